@@ -26,6 +26,7 @@
 #ifndef	COMMON_BUFFER_H
 #define	COMMON_BUFFER_H
 
+#include <stdlib.h> /* malloc(3), posix_memalign(3), etc.  */
 #include <string.h> /* memmove(3), memcpy(3), etc.  */
 
 #include <deque>
@@ -51,6 +52,13 @@ struct iovec;
 
 #define	BUFFER_SEGMENT_SIZE		(2048)
 
+/*
+ * Alignment of BufferSegment data that is to be used for direct (i.e.
+ * unbuffered) I/O, which is a multiple of the sector size of any
+ * device we expect to use that way.
+ */
+#define	BUFFER_SEGMENT_ALIGNMENT	(512)
+
 typedef	unsigned buffer_segment_size_t;
 
 /*
@@ -96,6 +104,24 @@ class BufferSegment {
 		data_ = (uint8_t *)malloc(BUFFER_SEGMENT_SIZE);
 	}
 
+	/*
+	 * Creates a new, empty BufferSegment with a single reference, and
+	 * with data aligned to the requested boundary.
+	 */
+	BufferSegment(size_t alignment)
+	: data_(NULL),
+	  offset_(0),
+	  length_(0),
+	  ref_(),
+	  data_free_(NULL),
+	  data_free_arg_(NULL)
+	{
+		void *data;
+		if (posix_memalign(&data, alignment, BUFFER_SEGMENT_SIZE) != 0)
+			HALT("/buffer/segment") << "Could not allocate aligned data.";
+		data_ = (uint8_t *)data;
+	}
+
 	/*
 	 * Creates a new BufferSegment with independent metadata and
 	 * external/shared data.
@@ -139,6 +165,16 @@ public:
 		return (new BufferSegment());
 	}
 
+	/*
+	 * Get an empty BufferSegment whose data is suitably aligned for
+	 * direct I/O.  Note that pullup() preserves the alignment of head(),
+	 * but data copied on write will not be aligned.
+	 */
+	static BufferSegment *create_aligned(void)
+	{
+		return (new BufferSegment((size_t)BUFFER_SEGMENT_ALIGNMENT));
+	}
+
 	/*
 	 * Get a BufferSegment with the requested data.
 	 */
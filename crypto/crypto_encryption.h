@@ -42,12 +42,14 @@ namespace CryptoEncryption {
 		CAST,
 		IDEA,
 		RC4,
+		ChaCha20,
 	};
 
 	enum Mode {
 		CBC,
 		CTR,
 		Stream,
+		GCM,
 	};
 	typedef	std::pair<Algorithm, Mode> Cipher;
 
@@ -73,9 +75,45 @@ namespace CryptoEncryption {
 
 		virtual bool initialize(Operation, const Buffer *, const Buffer *) = 0;
 
-		virtual bool cipher(Buffer *, const Buffer *) = 0;
+		/*
+		 * Ciphers all of the input, which is consumed, appending the
+		 * result to the output.  Where the input's data is not shared,
+		 * it is ciphered in place and moved to the output rather than
+		 * copied.
+		 */
+		virtual bool cipher(Buffer *, Buffer *) = 0;
 
 		virtual Action *submit(Buffer *, BufferEventCallback *) = 0;
+
+		/*
+		 * The length of the tag with which an AEAD cipher authenticates
+		 * each message; zero for other ciphers.
+		 */
+		virtual unsigned tag_size(void) const
+		{
+			return (0);
+		}
+
+		/*
+		 * For AEAD ciphers, ciphers one message, which is consumed.
+		 * The given number of bytes at its start are associated data,
+		 * which are authenticated and passed through in the clear.
+		 * Each message is ciphered with the next nonce.  Encrypting
+		 * appends the tag to the output; decrypting takes the tag from
+		 * the end of the input and fails if it does not match.
+		 */
+		virtual bool cipher_aead(Buffer *, Buffer *in, unsigned)
+		{
+			in->clear();
+			return (false);
+		}
+
+		virtual Action *submit_aead(Buffer *in, unsigned, BufferEventCallback *cb)
+		{
+			in->clear();
+			cb->param(Event::Error, Buffer());
+			return (cb->schedule());
+		}
 	};
 
 	class Method {
@@ -23,23 +23,30 @@
  * SUCH DAMAGE.
  */
 
+#include <string.h>
+
+#include <algorithm>
+
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 
 #include <common/factory.h>
 
 #include <crypto/crypto_encryption.h>
+#include <crypto/crypto_system.h>
 
 namespace {
 	class SessionEVP : public CryptoEncryption::Session {
 		LogHandle log_;
 		const EVP_CIPHER *cipher_;
 		EVP_CIPHER_CTX *ctx_;
+		CryptoThread *thread_;
 	public:
 		SessionEVP(const EVP_CIPHER *xcipher)
 		: log_("/crypto/encryption/session/openssl"),
 		  cipher_(xcipher),
-		  ctx_()
+		  ctx_(),
+		  thread_(NULL)
 		{
 			ctx_ = EVP_CIPHER_CTX_new();
 		}
@@ -51,6 +58,13 @@ namespace {
 
 		unsigned block_size(void) const
 		{
+			/*
+			 * OpenSSL gives CTR mode a block size of 1, but it
+			 * still works a block of the cipher at a time, and
+			 * protocols pad to that.
+			 */
+			if (EVP_CIPHER_mode(cipher_) == EVP_CIPH_CTR_MODE)
+				return (EVP_CIPHER_iv_length(cipher_));
 			return (EVP_CIPHER_block_size(cipher_));
 		}
 
@@ -102,38 +116,304 @@ namespace {
 			return (true);
 		}
 
-		bool cipher(Buffer *out, const Buffer *in)
+		bool cipher(Buffer *out, Buffer *in)
 		{
 			/*
-			 * We process a single, large, linear byte buffer here rather
-			 * than going a BufferSegment at a time, even though the byte
-			 * buffer is less efficient than some alternatives, because
-			 * there are padding and buffering implications if each
-			 * BufferSegment's length is not modular to the block size.
+			 * Each BufferSegment is ciphered in place, but their
+			 * lengths need not be modular to the block size, so a
+			 * block which spans segments is gathered into blockdata
+			 * and its output scattered back to where it came from.
+			 * The pieces of it are in segments already appended to
+			 * out, which no one else can yet see.
 			 */
-			uint8_t indata[in->length()];
-			in->copyout(indata, sizeof indata);
-
-			uint8_t outdata[sizeof indata];
-			int rv = EVP_Cipher(ctx_, outdata, indata, sizeof indata);
-			if (rv == 0)
+			size_t bsize = EVP_CIPHER_CTX_block_size(ctx_);
+			if (in->length() % bsize != 0) {
+				in->clear();
 				return (false);
-			out->append(outdata, sizeof outdata);
+			}
+
+			uint8_t blockdata[EVP_MAX_BLOCK_LENGTH];
+			struct { uint8_t *p; size_t len; } pieces[EVP_MAX_BLOCK_LENGTH];
+			size_t blocklen = 0;
+			unsigned npieces = 0;
+
+			while (!in->empty()) {
+				BufferSegment *seg;
+				in->moveout(&seg);
+				if (!seg->data_exclusive())
+					seg = seg->unshare();
+
+				uint8_t *p = seg->head();
+				size_t len = seg->length();
+
+				out->append(seg);
+				seg->unref();
+
+				if (blocklen != 0) {
+					size_t plen = std::min(bsize - blocklen, len);
+					memcpy(&blockdata[blocklen], p, plen);
+					pieces[npieces].p = p;
+					pieces[npieces].len = plen;
+					npieces++;
+					blocklen += plen;
+					p += plen;
+					len -= plen;
+
+					if (blocklen != bsize)
+						continue;
+
+					if (EVP_Cipher(ctx_, blockdata, blockdata, bsize) == 0) {
+						in->clear();
+						return (false);
+					}
+					uint8_t *q = blockdata;
+					unsigned i;
+					for (i = 0; i < npieces; i++) {
+						memcpy(pieces[i].p, q, pieces[i].len);
+						q += pieces[i].len;
+					}
+					npieces = 0;
+					blocklen = 0;
+				}
+
+				size_t whole = len - (len % bsize);
+				if (whole != 0 && EVP_Cipher(ctx_, p, p, whole) == 0) {
+					in->clear();
+					return (false);
+				}
+				p += whole;
+				len -= whole;
+
+				if (len != 0) {
+					memcpy(blockdata, p, len);
+					pieces[0].p = p;
+					pieces[0].len = len;
+					npieces = 1;
+					blocklen = len;
+				}
+			}
+			ASSERT_ZERO(log_, blocklen);
 			return (true);
 		}
 
+		/*
+		 * Each operation depends on the cipher state left by the last,
+		 * so all of them are done by the same thread.
+		 */
 		Action *submit(Buffer *in, BufferEventCallback *cb)
 		{
-			Buffer out;
-			if (!cipher(&out, in)) {
-				in->clear();
-				cb->param(Event::Error, Buffer());
-				return (cb->schedule());
+			if (thread_ == NULL)
+				thread_ = CryptoSystem::instance()->thread();
+			return (thread_->schedule(new CryptoOperation::Method<SessionEVP, Buffer>(in, cb, this, &SessionEVP::cipher)));
+		}
+	};
+
+	/*
+	 * AES-GCM.  The IV given to initialize is the nonce of the first
+	 * message, and its last 64 bits are a counter which is incremented
+	 * after each message, as RFC 5647 has it.
+	 */
+	class SessionGCM : public CryptoEncryption::Session {
+		class Operation : public CryptoOperation {
+			SessionGCM *session_;
+			unsigned aad_;
+		public:
+			Operation(Buffer *in, BufferEventCallback *cb, SessionGCM *session, unsigned aad)
+			: CryptoOperation(in, cb),
+			  session_(session),
+			  aad_(aad)
+			{ }
+
+			~Operation()
+			{ }
+
+		private:
+			bool run(Buffer *out, Buffer *in)
+			{
+				return (session_->cipher_aead(out, in, aad_));
+			}
+		};
+
+		LogHandle log_;
+		const EVP_CIPHER *cipher_;
+		EVP_CIPHER_CTX *ctx_;
+		bool encrypt_;
+		CryptoThread *thread_;
+	public:
+		SessionGCM(const EVP_CIPHER *xcipher)
+		: log_("/crypto/encryption/session/openssl"),
+		  cipher_(xcipher),
+		  ctx_(),
+		  encrypt_(false),
+		  thread_(NULL)
+		{
+			ctx_ = EVP_CIPHER_CTX_new();
+		}
+
+		~SessionGCM()
+		{
+			EVP_CIPHER_CTX_free(ctx_);
+		}
+
+		unsigned block_size(void) const
+		{
+			return (AES_BLOCK_SIZE);
+		}
+
+		unsigned key_size(void) const
+		{
+			return (EVP_CIPHER_key_length(cipher_));
+		}
+
+		unsigned iv_size(void) const
+		{
+			return (EVP_CIPHER_iv_length(cipher_));
+		}
+
+		unsigned tag_size(void) const
+		{
+			return (EVP_GCM_TLS_TAG_LEN);
+		}
+
+		Session *clone(void) const
+		{
+			return (new SessionGCM(cipher_));
+		}
+
+		bool initialize(CryptoEncryption::Operation operation, const Buffer *key, const Buffer *iv)
+		{
+			if (key->length() < (size_t)EVP_CIPHER_key_length(cipher_))
+				return (false);
+
+			if (iv->length() < (size_t)EVP_CIPHER_iv_length(cipher_))
+				return (false);
+
+			switch (operation) {
+			case CryptoEncryption::Encrypt:
+				encrypt_ = true;
+				break;
+			case CryptoEncryption::Decrypt:
+				encrypt_ = false;
+				break;
+			default:
+				return (false);
 			}
+
+			uint8_t keydata[EVP_CIPHER_key_length(cipher_)];
+			key->copyout(keydata, sizeof keydata);
+
+			uint8_t ivdata[EVP_CIPHER_iv_length(cipher_)];
+			iv->copyout(ivdata, sizeof ivdata);
+
+			if (EVP_CipherInit_ex(ctx_, cipher_, NULL, keydata, NULL, encrypt_ ? 1 : 0) == 0)
+				return (false);
+			if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_IV_FIXED, -1, ivdata) == 0)
+				return (false);
+
+			return (true);
+		}
+
+		bool cipher(Buffer *, Buffer *in)
+		{
+			ERROR(log_) << "GCM may only be used as an AEAD cipher.";
 			in->clear();
-			cb->param(Event::Done, out);
+			return (false);
+		}
+
+		Action *submit(Buffer *in, BufferEventCallback *cb)
+		{
+			ERROR(log_) << "GCM may only be used as an AEAD cipher.";
+			in->clear();
+			cb->param(Event::Error, Buffer());
 			return (cb->schedule());
 		}
+
+		/*
+		 * Like SessionEVP::cipher, each BufferSegment is ciphered in
+		 * place, but GCM works like a stream cipher and so segments
+		 * need not be modular to the block size.
+		 */
+		bool cipher_aead(Buffer *out, Buffer *in, unsigned aad)
+		{
+			uint8_t tag[EVP_GCM_TLS_TAG_LEN];
+			int outlen;
+
+			if (in->length() < aad + (encrypt_ ? 0 : sizeof tag)) {
+				in->clear();
+				return (false);
+			}
+
+			uint8_t lastiv[1];
+			if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_IV_GEN, 1, lastiv) == 0) {
+				in->clear();
+				return (false);
+			}
+
+			if (!encrypt_) {
+				in->copyout(tag, in->length() - sizeof tag, sizeof tag);
+				in->trim(sizeof tag);
+				if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, sizeof tag, tag) == 0) {
+					in->clear();
+					return (false);
+				}
+			}
+
+			if (aad != 0) {
+				Buffer ad;
+				in->moveout(&ad, aad);
+
+				Buffer::SegmentIterator iter = ad.segments();
+				while (!iter.end()) {
+					const BufferSegment *seg = *iter;
+					if (EVP_CipherUpdate(ctx_, NULL, &outlen, seg->data(), seg->length()) == 0) {
+						in->clear();
+						return (false);
+					}
+					iter.next();
+				}
+				out->append(ad);
+			}
+
+			while (!in->empty()) {
+				BufferSegment *seg;
+				in->moveout(&seg);
+				if (!seg->data_exclusive())
+					seg = seg->unshare();
+
+				if (EVP_CipherUpdate(ctx_, seg->head(), &outlen, seg->head(), seg->length()) == 0) {
+					seg->unref();
+					in->clear();
+					return (false);
+				}
+				ASSERT(log_, (size_t)outlen == seg->length());
+
+				out->append(seg);
+				seg->unref();
+			}
+
+			uint8_t final[EVP_MAX_BLOCK_LENGTH];
+			if (EVP_CipherFinal_ex(ctx_, final, &outlen) <= 0)
+				return (false);
+			ASSERT_ZERO(log_, outlen);
+
+			if (encrypt_) {
+				if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, sizeof tag, tag) == 0)
+					return (false);
+				out->append(tag, sizeof tag);
+			}
+			return (true);
+		}
+
+		/*
+		 * As with SessionEVP, each message depends on the nonce left
+		 * by the last, so all of them are done by the same thread.
+		 */
+		Action *submit_aead(Buffer *in, unsigned aad, BufferEventCallback *cb)
+		{
+			if (thread_ == NULL)
+				thread_ = CryptoSystem::instance()->thread();
+			return (thread_->schedule(new Operation(in, cb, this, aad)));
+		}
 	};
 
 #if OPENSSL_VERSION_NUMBER < 0x1010006fL
@@ -141,11 +421,13 @@ namespace {
 		LogHandle log_;
 		AES_KEY key_;
 		uint8_t iv_[AES_BLOCK_SIZE];
+		CryptoThread *thread_;
 	public:
 		SessionAES128CTR(void)
 		: log_("/crypto/encryption/session/openssl"),
 		  key_(),
-		  iv_()
+		  iv_(),
+		  thread_(NULL)
 		{ }
 
 		~SessionAES128CTR()
@@ -191,48 +473,37 @@ namespace {
 			return (true);
 		}
 
-		bool cipher(Buffer *out, const Buffer *in)
+		bool cipher(Buffer *out, Buffer *in)
 		{
 			ASSERT(log_, in->length() % AES_BLOCK_SIZE == 0);
 
 			/*
-			 * Temporaries for AES_ctr128_encrypt.
-			 *
-			 * Their values only need to persist if we aren't using block-sized
-			 * buffers, which we are.  We could just use AES_ctr128_inc and do
-			 * the crypt operation by hand here.
+			 * Temporaries for AES_ctr128_encrypt, which carry a block
+			 * of keystream from one BufferSegment to the next if
+			 * their lengths are not modular to the block size.
 			 */
 			uint8_t counterbuf[AES_BLOCK_SIZE]; /* Will be initialized if countern==0.  */
 			unsigned countern = 0;
 
-			/*
-			 * We process a single, large, linear byte buffer here rather
-			 * than going a BufferSegment at a time, even though the byte
-			 * buffer is less efficient than some alternatives, because
-			 * there are padding and buffering implications if each
-			 * BufferSegment's length is not modular to the block size.
-			 */
-			uint8_t indata[in->length()];
-			in->copyout(indata, sizeof indata);
+			while (!in->empty()) {
+				BufferSegment *seg;
+				in->moveout(&seg);
+				if (!seg->data_exclusive())
+					seg = seg->unshare();
 
-			uint8_t outdata[sizeof indata];
-			AES_ctr128_encrypt(indata, outdata, sizeof indata, &key_, iv_, counterbuf, &countern);
+				AES_ctr128_encrypt(seg->head(), seg->head(), seg->length(), &key_, iv_, counterbuf, &countern);
 
-			out->append(outdata, sizeof outdata);
+				out->append(seg);
+				seg->unref();
+			}
 			return (true);
 		}
 
 		Action *submit(Buffer *in, BufferEventCallback *cb)
 		{
-			Buffer out;
-			if (!cipher(&out, in)) {
-				in->clear();
-				cb->param(Event::Error, Buffer());
-				return (cb->schedule());
-			}
-			in->clear();
-			cb->param(Event::Done, out);
-			return (cb->schedule());
+			if (thread_ == NULL)
+				thread_ = CryptoSystem::instance()->thread();
+			return (thread_->schedule(new CryptoOperation::Method<SessionAES128CTR, Buffer>(in, cb, this, &SessionAES128CTR::cipher)));
 		}
 	};
 #endif
@@ -271,6 +542,13 @@ namespace {
 			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::IDEA, CryptoEncryption::CBC), evp_factory(EVP_idea_cbc()));
 #endif
 			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::RC4, CryptoEncryption::Stream), evp_factory(EVP_rc4()));
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA)
+			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::ChaCha20, CryptoEncryption::Stream), evp_factory(EVP_chacha20()));
+#endif
+
+			factory<SessionGCM> gcm_factory;
+			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::AES128, CryptoEncryption::GCM), gcm_factory(EVP_aes_128_gcm()));
+			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::AES256, CryptoEncryption::GCM), gcm_factory(EVP_aes_256_gcm()));
 
 			/* XXX Register.  */
 		}
@@ -45,21 +45,30 @@ namespace {
 
 		virtual bool hash(Buffer *out, const Buffer *in)
 		{
-			/*
-			 * We process a single, large, linear byte buffer here rather
-			 * than going a BufferSegment at a time, even though the byte
-			 * buffer is less efficient than some alternatives, because
-			 * there are padding and buffering implications if each
-			 * BufferSegment's length is not modular to the block size.
-			 */
-			uint8_t indata[in->length()];
-			in->copyout(indata, sizeof indata);
-
-			uint8_t macdata[EVP_MD_size(algorithm_)];
+			EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+			if (EVP_DigestInit_ex(ctx, algorithm_, NULL) == 0) {
+				EVP_MD_CTX_destroy(ctx);
+				return (false);
+			}
+
+			Buffer::SegmentIterator iter = in->segments();
+			while (!iter.end()) {
+				const BufferSegment *seg = *iter;
+				if (EVP_DigestUpdate(ctx, seg->data(), seg->length()) == 0) {
+					EVP_MD_CTX_destroy(ctx);
+					return (false);
+				}
+				iter.next();
+			}
+
+			uint8_t macdata[EVP_MAX_MD_SIZE];
 			unsigned maclen;
-			if (!EVP_Digest(indata, sizeof indata, macdata, &maclen, algorithm_, NULL))
+			if (EVP_DigestFinal_ex(ctx, macdata, &maclen) == 0) {
+				EVP_MD_CTX_destroy(ctx);
 				return (false);
-			ASSERT(log_, maclen == sizeof macdata);
+			}
+			EVP_MD_CTX_destroy(ctx);
+			ASSERT(log_, maclen == (unsigned)EVP_MD_size(algorithm_));
 			out->append(macdata, maclen);
 			return (true);
 		}
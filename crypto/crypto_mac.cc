@@ -72,6 +72,8 @@ operator<< (std::ostream& os, CryptoMAC::Algorithm algorithm)
 		return (os << "HMAC-SHA512");
 	case CryptoMAC::RIPEMD160:
 		return (os << "HMAC-RIPEMD160");
+	case CryptoMAC::Poly1305:
+		return (os << "Poly1305");
 	}
 	NOTREACHED("/crypto/encryption");
 }
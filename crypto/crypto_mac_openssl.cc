@@ -29,6 +29,7 @@
 #include <common/factory.h>
 
 #include <crypto/crypto_mac.h>
+#include <crypto/crypto_system.h>
 
 namespace {
 	class InstanceEVP : public CryptoMAC::Instance {
@@ -36,16 +37,24 @@ namespace {
 		const EVP_MD *algorithm_;
 		uint8_t key_[EVP_MAX_KEY_LENGTH];
 		size_t key_length_;
+		HMAC_CTX *ctx_;
+		CryptoThread *thread_;
 	public:
 		InstanceEVP(const EVP_MD *algorithm)
 		: log_("/crypto/mac/instance/openssl"),
 		  algorithm_(algorithm),
 		  key_(),
-		  key_length_(0)
-		{ }
+		  key_length_(0),
+		  ctx_(),
+		  thread_(NULL)
+		{
+			ctx_ = HMAC_CTX_new();
+		}
 
 		~InstanceEVP()
-		{ }
+		{
+			HMAC_CTX_free(ctx_);
+		}
 
 		unsigned size(void) const
 		{
@@ -66,43 +75,139 @@ namespace {
 			key->copyout(key_, key->length());
 			key_length_ = key->length();
 
+			if (HMAC_Init_ex(ctx_, key_, key_length_, algorithm_, NULL) == 0)
+				return (false);
+
 			return (true);
 		}
 
+		/*
+		 * The key is set up once, by initialize, and each MAC starts
+		 * again from it.  Each BufferSegment is fed to HMAC as it is.
+		 */
 		bool mac(Buffer *out, const Buffer *in)
 		{
-			/*
-			 * We process a single, large, linear byte buffer here rather
-			 * than going a BufferSegment at a time, even though the byte
-			 * buffer is less efficient than some alternatives, because
-			 * there are padding and buffering implications if each
-			 * BufferSegment's length is not modular to the block size.
-			 */
-			uint8_t indata[in->length()];
-			in->copyout(indata, sizeof indata);
-
-			uint8_t macdata[EVP_MD_size(algorithm_)];
+			if (HMAC_Init_ex(ctx_, NULL, 0, NULL, NULL) == 0)
+				return (false);
+
+			Buffer::SegmentIterator iter = in->segments();
+			while (!iter.end()) {
+				const BufferSegment *seg = *iter;
+				if (HMAC_Update(ctx_, seg->data(), seg->length()) == 0)
+					return (false);
+				iter.next();
+			}
+
+			uint8_t macdata[EVP_MAX_MD_SIZE];
 			unsigned maclen;
-			if (HMAC(algorithm_, key_, key_length_, indata, sizeof indata, macdata, &maclen) == NULL)
+			if (HMAC_Final(ctx_, macdata, &maclen) == 0)
 				return (false);
-			ASSERT(log_, maclen == sizeof macdata);
+			ASSERT(log_, maclen == (unsigned)EVP_MD_size(algorithm_));
 			out->append(macdata, maclen);
 			return (true);
 		}
 
 		Action *submit(Buffer *in, BufferEventCallback *cb)
 		{
-			Buffer out;
-			if (!mac(&out, in)) {
-				in->clear();
-				cb->param(Event::Error, Buffer());
-				return (cb->schedule());
+			if (thread_ == NULL)
+				thread_ = CryptoSystem::instance()->thread();
+			return (thread_->schedule(new CryptoOperation::Method<InstanceEVP>(in, cb, this, &InstanceEVP::mac)));
+		}
+	};
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_POLY1305)
+	/*
+	 * Poly1305 is a one-time authenticator: it must be given a new key
+	 * with initialize before each message.  An operation submitted to a
+	 * CryptoThread uses whatever key the instance has when it is done.
+	 */
+	class InstancePoly1305 : public CryptoMAC::Instance {
+		LogHandle log_;
+		EVP_PKEY *key_;
+		CryptoThread *thread_;
+	public:
+		InstancePoly1305(void)
+		: log_("/crypto/mac/instance/openssl"),
+		  key_(NULL),
+		  thread_(NULL)
+		{ }
+
+		~InstancePoly1305()
+		{
+			if (key_ != NULL) {
+				EVP_PKEY_free(key_);
+				key_ = NULL;
+			}
+		}
+
+		unsigned size(void) const
+		{
+			return (16);
+		}
+
+		Instance *clone(void) const
+		{
+			return (new InstancePoly1305());
+		}
+
+		bool initialize(const Buffer *key)
+		{
+			uint8_t keydata[32];
+
+			if (key == NULL || key->length() != sizeof keydata)
+				return (false);
+			key->copyout(keydata, sizeof keydata);
+
+			if (key_ != NULL)
+				EVP_PKEY_free(key_);
+			key_ = EVP_PKEY_new_raw_private_key(EVP_PKEY_POLY1305, NULL, keydata, sizeof keydata);
+			if (key_ == NULL)
+				return (false);
+
+			return (true);
+		}
+
+		bool mac(Buffer *out, const Buffer *in)
+		{
+			if (key_ == NULL)
+				return (false);
+
+			EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+			if (EVP_DigestSignInit(ctx, NULL, NULL, NULL, key_) <= 0) {
+				EVP_MD_CTX_free(ctx);
+				return (false);
+			}
+
+			Buffer::SegmentIterator iter = in->segments();
+			while (!iter.end()) {
+				const BufferSegment *seg = *iter;
+				if (EVP_DigestSignUpdate(ctx, seg->data(), seg->length()) <= 0) {
+					EVP_MD_CTX_free(ctx);
+					return (false);
+				}
+				iter.next();
+			}
+
+			uint8_t macdata[16];
+			size_t maclen = sizeof macdata;
+			if (EVP_DigestSignFinal(ctx, macdata, &maclen) <= 0) {
+				EVP_MD_CTX_free(ctx);
+				return (false);
 			}
-			in->clear();
-			cb->param(Event::Done, out);
-			return (cb->schedule());
+			EVP_MD_CTX_free(ctx);
+			ASSERT(log_, maclen == sizeof macdata);
+			out->append(macdata, maclen);
+			return (true);
+		}
+
+		Action *submit(Buffer *in, BufferEventCallback *cb)
+		{
+			if (thread_ == NULL)
+				thread_ = CryptoSystem::instance()->thread();
+			return (thread_->schedule(new CryptoOperation::Method<InstancePoly1305>(in, cb, this, &InstancePoly1305::mac)));
 		}
 	};
+#endif
 
 	class MethodOpenSSL : public CryptoMAC::Method {
 		LogHandle log_;
@@ -121,6 +226,10 @@ namespace {
 			algorithm_map_.enter(CryptoMAC::SHA256, evp_factory(EVP_sha256()));
 			algorithm_map_.enter(CryptoMAC::SHA512, evp_factory(EVP_sha512()));
 			algorithm_map_.enter(CryptoMAC::RIPEMD160, evp_factory(EVP_ripemd160()));
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_POLY1305)
+			factory<InstancePoly1305> poly1305_factory;
+			algorithm_map_.enter(CryptoMAC::Poly1305, poly1305_factory());
+#endif
 
 			/* XXX Register.  */
 		}
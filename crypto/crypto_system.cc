@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+
+#include <event/event_callback.h>
+#include <event/event_system.h>
+
+#include <crypto/crypto_system.h>
+
+#define	CRYPTO_SYSTEM_THREAD_MAX	(8)
+
+CryptoOperation::CryptoOperation(Buffer *in, BufferEventCallback *cb)
+: thread_(NULL),
+  state_(Queued),
+  in_(),
+  callback_(cb),
+  action_(NULL)
+{
+	in->moveout(&in_);
+}
+
+/*
+ * If the operation is being done, wait for it to finish, since whatever it
+ * is being done by may not be around for long once we return.
+ */
+void
+CryptoOperation::cancel(void)
+{
+	ASSERT_NON_NULL("/crypto/operation", thread_);
+	thread_->queue_mtx_.lock();
+	switch (state_) {
+	case Queued: {
+		std::deque<CryptoOperation *>::iterator it;
+
+		it = std::find(thread_->queue_.begin(), thread_->queue_.end(), this);
+		ASSERT("/crypto/operation", it != thread_->queue_.end());
+		thread_->queue_.erase(it);
+		break;
+	}
+	case Running:
+		while (state_ == Running)
+			thread_->queue_sleepq_.wait();
+		/* FALLTHROUGH */
+	case Done:
+		if (action_ != NULL) {
+			action_->cancel();
+			action_ = NULL;
+		}
+		break;
+	}
+	thread_->queue_mtx_.unlock();
+
+	delete this;
+}
+
+CryptoThread::CryptoThread(void)
+: WorkerThread("CryptoThread"),
+  log_("/crypto/thread"),
+  queue_mtx_("CryptoThread"),
+  queue_sleepq_("CryptoThread", &queue_mtx_),
+  queue_()
+{ }
+
+CryptoThread::~CryptoThread()
+{
+	ASSERT(log_, queue_.empty());
+}
+
+Action *
+CryptoThread::schedule(CryptoOperation *op)
+{
+	ASSERT_NULL(log_, op->thread_);
+	op->thread_ = this;
+
+	queue_mtx_.lock();
+	queue_.push_back(op);
+	queue_mtx_.unlock();
+
+	submit();
+
+	return (op);
+}
+
+void
+CryptoThread::work(void)
+{
+	for (;;) {
+		queue_mtx_.lock();
+		if (queue_.empty()) {
+			queue_mtx_.unlock();
+			return;
+		}
+		CryptoOperation *op = queue_.front();
+		queue_.pop_front();
+		op->state_ = CryptoOperation::Running;
+		queue_mtx_.unlock();
+
+		Buffer out;
+		bool ok = op->run(&out, &op->in_);
+		op->in_.clear();
+
+		queue_mtx_.lock();
+		op->state_ = CryptoOperation::Done;
+		if (ok)
+			op->callback_->param(Event::Done, out);
+		else
+			op->callback_->param(Event::Error, Buffer());
+		op->action_ = op->callback_->schedule();
+		queue_sleepq_.signal();
+		queue_mtx_.unlock();
+	}
+}
+
+CryptoSystem::CryptoSystem(void)
+: log_("/crypto/system"),
+  mtx_("CryptoSystem"),
+  threads_(),
+  next_(0)
+{ }
+
+CryptoThread *
+CryptoSystem::thread(void)
+{
+	ScopedLock _(&mtx_);
+	if (threads_.size() < CRYPTO_SYSTEM_THREAD_MAX) {
+		CryptoThread *td = new CryptoThread();
+		threads_.push_back(td);
+
+		td->start();
+
+		EventSystem::instance()->thread_wait(td);
+
+		return (td);
+	}
+
+	CryptoThread *td = threads_[next_];
+	next_ = (next_ + 1) % threads_.size();
+	return (td);
+}
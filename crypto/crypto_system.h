@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	CRYPTO_CRYPTO_SYSTEM_H
+#define	CRYPTO_CRYPTO_SYSTEM_H
+
+#include <deque>
+#include <vector>
+
+#include <common/thread/thread.h>
+
+#include <event/event_callback.h>
+
+class CryptoThread;
+
+/*
+ * An operation submitted to a CryptoThread, which is done there rather than
+ * by the caller, and whose result is passed to the callback given with it.
+ * This is the Action returned to the caller, and, like any other, must be
+ * cancelled once the callback has been called.
+ *
+ * The object doing the operation must outlive it.
+ */
+class CryptoOperation : public Action {
+	friend class CryptoThread;
+
+	enum State {
+		Queued,
+		Running,
+		Done,
+	};
+
+	CryptoThread *thread_;
+	State state_;
+	Buffer in_;
+	BufferEventCallback *callback_;
+	Action *action_;
+public:
+	template<class C, class I = const Buffer>
+	class Method;
+
+protected:
+	CryptoOperation(Buffer *, BufferEventCallback *);
+
+	virtual ~CryptoOperation()
+	{ }
+
+	virtual bool run(Buffer *, Buffer *) = 0;
+
+public:
+	void cancel(void);
+};
+
+/*
+ * An operation done by a method of C, which may consume its input, in which
+ * case I is Buffer, or only read it, in which case I is const Buffer.
+ */
+template<class C, class I>
+class CryptoOperation::Method : public CryptoOperation {
+	typedef bool (C::*const method_t)(Buffer *, I *);
+
+	C *const obj_;
+	method_t method_;
+public:
+	template<typename Tm>
+	Method(Buffer *in, BufferEventCallback *cb, C *obj, Tm method)
+	: CryptoOperation(in, cb),
+	  obj_(obj),
+	  method_(method)
+	{ }
+
+	~Method()
+	{ }
+
+private:
+	bool run(Buffer *out, Buffer *in)
+	{
+		return ((obj_->*method_)(out, in));
+	}
+};
+
+/*
+ * A thread which does the operations submitted to it one at a time, in the
+ * order in which they were submitted.  A session or instance whose operations
+ * depend on the state left by those before it must submit all of them to the
+ * same thread.
+ */
+class CryptoThread : public WorkerThread {
+	friend class CryptoOperation;
+
+	LogHandle log_;
+	Mutex queue_mtx_;
+	SleepQueue queue_sleepq_;
+	std::deque<CryptoOperation *> queue_;
+public:
+	CryptoThread(void);
+	~CryptoThread();
+
+	Action *schedule(CryptoOperation *);
+
+private:
+	void work(void);
+};
+
+/*
+ * The CryptoThreads, which are started as sessions and instances ask for
+ * them, up to CRYPTO_SYSTEM_THREAD_MAX, and then shared out in turn, so that
+ * the operations of different streams are spread over them.
+ */
+class CryptoSystem {
+	LogHandle log_;
+	Mutex mtx_;
+	std::vector<CryptoThread *> threads_;
+	unsigned next_;
+
+	CryptoSystem(void);
+
+	~CryptoSystem()
+	{ }
+
+public:
+	CryptoThread *thread(void);
+
+	static CryptoSystem *instance(void)
+	{
+		static CryptoSystem instance;
+
+		return (&instance);
+	}
+};
+
+#endif /* !CRYPTO_CRYPTO_SYSTEM_H */
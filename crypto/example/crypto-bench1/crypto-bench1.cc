@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <common/buffer.h>
+#include <common/timer/timer.h>
+
+#include <crypto/crypto_encryption.h>
+#include <crypto/crypto_mac.h>
+
+/*
+ * Ciphers and MACs packets of a given size with each cipher and MAC we
+ * have, the way SSH does, and reports the throughput of each.  Packets are
+ * made of BufferSegments of a given length, which need not be modular to
+ * the block size, and each cipher is checked by deciphering one of them.
+ */
+
+#define	BENCH_PACKET_SIZE	32768
+#define	BENCH_TOTAL_SIZE	(64 * 1024 * 1024)
+
+struct CipherTrial {
+	const char *name_;
+	CryptoEncryption::Algorithm algorithm_;
+	CryptoEncryption::Mode mode_;
+};
+
+static const CipherTrial ciphers[] = {
+	{ "aes128-cbc",	CryptoEncryption::AES128,	CryptoEncryption::CBC },
+	{ "aes256-cbc",	CryptoEncryption::AES256,	CryptoEncryption::CBC },
+	{ "aes128-ctr",	CryptoEncryption::AES128,	CryptoEncryption::CTR },
+	{ "aes256-ctr",	CryptoEncryption::AES256,	CryptoEncryption::CTR },
+	{ "3des-cbc",	CryptoEncryption::TripleDES,	CryptoEncryption::CBC },
+};
+
+struct MACTrial {
+	const char *name_;
+	CryptoMAC::Algorithm algorithm_;
+};
+
+static const MACTrial macs[] = {
+	{ "hmac-md5",		CryptoMAC::MD5 },
+	{ "hmac-sha1",		CryptoMAC::SHA1 },
+	{ "hmac-sha2-256",	CryptoMAC::SHA256 },
+	{ "hmac-sha2-512",	CryptoMAC::SHA512 },
+};
+
+static void packet(Buffer *, size_t, size_t);
+static double rate(size_t, const Timer&);
+static void bench_cipher(const CipherTrial&, size_t, size_t, size_t);
+static void bench_mac(const MACTrial&, size_t, size_t, size_t);
+static void usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	size_t packet_size, segment_size, total_size;
+	unsigned i;
+	int ch;
+
+	packet_size = BENCH_PACKET_SIZE;
+	segment_size = BUFFER_SEGMENT_SIZE;
+	total_size = BENCH_TOTAL_SIZE;
+
+	while ((ch = getopt(argc, argv, "?b:n:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			packet_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			total_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			segment_size = strtoul(optarg, NULL, 0);
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage();
+	if (packet_size == 0 || packet_size % 16 != 0 || total_size < packet_size)
+		usage();
+	if (segment_size == 0 || segment_size > BUFFER_SEGMENT_SIZE)
+		usage();
+
+	for (i = 0; i < sizeof ciphers / sizeof ciphers[0]; i++)
+		bench_cipher(ciphers[i], packet_size, segment_size, total_size);
+	for (i = 0; i < sizeof macs / sizeof macs[0]; i++)
+		bench_mac(macs[i], packet_size, segment_size, total_size);
+}
+
+/*
+ * Make a packet of the given size out of BufferSegments of the given length.
+ */
+static void
+packet(Buffer *buf, size_t packet_size, size_t segment_size)
+{
+	uint8_t data[BUFFER_SEGMENT_SIZE];
+	size_t i;
+
+	for (i = 0; i < sizeof data; i++)
+		data[i] = random();
+
+	while (packet_size != 0) {
+		size_t len = std::min(packet_size, segment_size);
+		BufferSegment *seg = BufferSegment::create(data, len);
+		buf->append(seg);
+		seg->unref();
+		packet_size -= len;
+	}
+}
+
+/*
+ * Megabytes per second, since the Timer counts microseconds.
+ */
+static double
+rate(size_t bytes, const Timer& timer)
+{
+	uintmax_t usec = timer.sample();
+	if (usec == 0)
+		usec = 1;
+	return ((double)bytes / usec);
+}
+
+static void
+bench_cipher(const CipherTrial& trial, size_t packet_size, size_t segment_size, size_t total_size)
+{
+	CryptoEncryption::Cipher cipher(trial.algorithm_, trial.mode_);
+	const CryptoEncryption::Method *method = CryptoEncryption::Method::method(cipher);
+	if (method == NULL) {
+		INFO("/crypto/example/bench1") << trial.name_ << ": not available.";
+		return;
+	}
+
+	CryptoEncryption::Session *encrypt = method->session(cipher);
+	CryptoEncryption::Session *decrypt = method->session(cipher);
+
+	Buffer key, iv;
+	key.append(std::string(encrypt->key_size(), 'k'));
+	iv.append(std::string(encrypt->iv_size(), 'i'));
+	if (!encrypt->initialize(CryptoEncryption::Encrypt, &key, &iv) ||
+	    !decrypt->initialize(CryptoEncryption::Decrypt, &key, &iv))
+		HALT("/crypto/example/bench1") << trial.name_ << ": could not initialize sessions.";
+
+	Buffer plaintext, ciphertext, check;
+	packet(&plaintext, packet_size, segment_size);
+	Buffer in(plaintext);
+	if (!encrypt->cipher(&ciphertext, &in) || !decrypt->cipher(&check, &ciphertext))
+		HALT("/crypto/example/bench1") << trial.name_ << ": could not cipher.";
+	if (!check.equal(&plaintext))
+		HALT("/crypto/example/bench1") << trial.name_ << ": data did not survive the round trip.";
+
+	std::vector<Buffer> packets(total_size / packet_size);
+	std::vector<Buffer>::iterator it;
+	for (it = packets.begin(); it != packets.end(); ++it)
+		packet(&*it, packet_size, segment_size);
+
+	Timer timer;
+	timer.start();
+	for (it = packets.begin(); it != packets.end(); ++it) {
+		Buffer out;
+		if (!encrypt->cipher(&out, &*it))
+			HALT("/crypto/example/bench1") << trial.name_ << ": could not cipher.";
+	}
+	timer.stop();
+
+	INFO("/crypto/example/bench1") << trial.name_ << ": " << rate(packets.size() * packet_size, timer) << " MB/s";
+
+	delete encrypt;
+	delete decrypt;
+}
+
+static void
+bench_mac(const MACTrial& trial, size_t packet_size, size_t segment_size, size_t total_size)
+{
+	CryptoMAC::Algorithm algorithm = trial.algorithm_;
+	const CryptoMAC::Method *method = CryptoMAC::Method::method(algorithm);
+	if (method == NULL) {
+		INFO("/crypto/example/bench1") << trial.name_ << ": not available.";
+		return;
+	}
+
+	CryptoMAC::Instance *instance = method->instance(algorithm);
+
+	Buffer key;
+	key.append(std::string(instance->size(), 'k'));
+	if (!instance->initialize(&key))
+		HALT("/crypto/example/bench1") << trial.name_ << ": could not initialize instance.";
+
+	std::vector<Buffer> packets(total_size / packet_size);
+	std::vector<Buffer>::iterator it;
+	for (it = packets.begin(); it != packets.end(); ++it)
+		packet(&*it, packet_size, segment_size);
+
+	Timer timer;
+	timer.start();
+	for (it = packets.begin(); it != packets.end(); ++it) {
+		Buffer out;
+		if (!instance->mac(&out, &*it))
+			HALT("/crypto/example/bench1") << trial.name_ << ": could not MAC.";
+	}
+	timer.stop();
+
+	INFO("/crypto/example/bench1") << trial.name_ << ": " << rate(packets.size() * packet_size, timer) << " MB/s";
+
+	delete instance;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: crypto-bench1 [-b packet-size] [-n total-size] [-s segment-size]\n");
+	exit(1);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	EVENT_FLUSH_TIMER_H
+#define	EVENT_FLUSH_TIMER_H
+
+#include <event/action.h>
+#include <event/event_callback.h>
+#include <event/event_system.h>
+
+/*
+ * The default interval, in milliseconds, of a FlushTimer.
+ */
+#define	FLUSH_TIMER_INTERVAL	2
+
+/*
+ * Decides when output which is written a little at a time is flushed.  It
+ * is flushed at once if we have not flushed within the last interval, so
+ * that a lone write goes out without delay.  Otherwise it is held until the
+ * interval is up, when the callback is called, or until the owner has
+ * enough built up to flush anyway, so that a run of small writes costs one
+ * flush rather than one each.
+ *
+ * An interval of zero has everything flushed at once.  The callback is
+ * called with the owner's lock held, and must call expire().
+ */
+class FlushTimer {
+	SimpleCallback *callback_;
+	unsigned interval_;
+	Action *action_;
+public:
+	FlushTimer(SimpleCallback *callback, unsigned interval = FLUSH_TIMER_INTERVAL)
+	: callback_(callback),
+	  interval_(interval),
+	  action_(NULL)
+	{ }
+
+	~FlushTimer()
+	{
+		cancel();
+	}
+
+	/*
+	 * Whether output should be held, because we have flushed within the
+	 * interval.
+	 */
+	bool hold(void) const
+	{
+		return (action_ != NULL);
+	}
+
+	/*
+	 * Note that we have flushed, and start the interval if it is not
+	 * already running.
+	 */
+	void flushed(void)
+	{
+		if (action_ != NULL || interval_ == 0)
+			return;
+		action_ = EventSystem::instance()->timeout(interval_, callback_);
+	}
+
+	void expire(void)
+	{
+		ASSERT_NON_NULL("/flush/timer", action_);
+		action_->cancel();
+		action_ = NULL;
+	}
+
+	void cancel(void)
+	{
+		if (action_ != NULL) {
+			action_->cancel();
+			action_ = NULL;
+		}
+	}
+
+	void set_interval(unsigned interval)
+	{
+		interval_ = interval;
+	}
+};
+
+#endif /* !EVENT_FLUSH_TIMER_H */
@@ -37,7 +37,7 @@
 #include <io/pipe/pipe_producer.h>
 #include <io/pipe/splice.h>
 
-HTTPServerHandler::HTTPServerHandler(Socket *client)
+HTTPServerHandler::HTTPServerHandler(Socket *client, unsigned max_requests, unsigned idle_timeout)
 : log_("/http/server/handler/" + client->getpeername()),
   mtx_("HTTPServerHandler"),
   client_(client),
@@ -51,7 +51,7 @@ HTTPServerHandler::HTTPServerHandler(Socket *client)
   request_action_(NULL)
 {
 	ScopedLock _(&mtx_);
-	pipe_ = new HTTPServerPipe(log_ + "/pipe");
+	pipe_ = new HTTPServerPipe(log_ + "/pipe", max_requests, idle_timeout);
 	request_action_ = pipe_->request(&request_complete_);
 
 	splice_ = new Splice(log_, client_, pipe_, client_);
@@ -88,12 +88,30 @@ HTTPServerHandler::request_complete(Event e, HTTPProtocol::Request req)
 	request_action_->cancel();
 	request_action_ = NULL;
 
-	if (e.type_ == Event::Error) {
+	switch (e.type_) {
+	case Event::Done:
+		break;
+	case Event::EOS:
+		DEBUG(log_) << "No more requests.";
+		return;
+	case Event::Error:
 		ERROR(log_) << "Error while waiting for request: " << e;
 		return;
+	default:
+		HALT(log_) << "Unexpected event: " << e;
 	}
-	ASSERT(log_, e.type_ == Event::Done);
 
+	request_dispatch(req);
+
+	/*
+	 * The connection may persist, so wait for the next request.
+	 */
+	request_action_ = pipe_->request(&request_complete_);
+}
+
+void
+HTTPServerHandler::request_dispatch(HTTPProtocol::Request req)
+{
 	ASSERT(log_, !req.start_line_.empty());
 	std::vector<Buffer> words = req.start_line_.split(' ', false);
 	ASSERT(log_, !words.empty());
@@ -153,7 +171,7 @@ HTTPServerHandler::splice_complete(Event e)
 	splice_ = NULL;
 
 	if (request_action_ != NULL) {
-		ERROR(log_) << "Splice exited before request was received.";
+		DEBUG(log_) << "Splice exited while waiting for a request.";
 		request_action_->cancel();
 		request_action_ = NULL;
 	}
@@ -52,13 +52,14 @@ private:
 	HTTPRequestEventCallback::Method<HTTPServerHandler> request_complete_;
 	Action *request_action_;
 public:
-	HTTPServerHandler(Socket *);
+	HTTPServerHandler(Socket *, unsigned = HTTP_SERVER_MAX_REQUESTS, unsigned = HTTP_SERVER_IDLE_TIMEOUT);
 protected:
 	virtual ~HTTPServerHandler();
 
 private:
 	void close_complete(void);
 	void request_complete(Event, HTTPProtocol::Request);
+	void request_dispatch(HTTPProtocol::Request);
 	void splice_complete(Event);
 
 	virtual void handle_request(const std::string&, const std::string&, HTTPProtocol::Request) = 0;
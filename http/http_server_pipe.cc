@@ -41,22 +41,37 @@
 
 #include <io/socket/simple_server.h>
 
-HTTPServerPipe::HTTPServerPipe(const LogHandle& log)
+HTTPServerPipe::HTTPServerPipe(const LogHandle& log, unsigned max_requests, unsigned idle_timeout)
 : PipeProducer(log, &mtx_),
   mtx_("HTTPServerPipe"),
   state_(GetStart),
   buffer_(),
+  eos_(false),
   request_(),
   last_header_(),
+  max_requests_(max_requests),
+  requests_(0),
+  keep_alive_(false),
   cancel_(&mtx_, this, &HTTPServerPipe::cancel),
   action_(NULL),
-  callback_(NULL)
-{ }
+  callback_(NULL),
+  idle_timeout_(idle_timeout),
+  idle_callback_(NULL, &mtx_, this, &HTTPServerPipe::idle_timeout),
+  idle_action_(NULL)
+{
+	ScopedLock _(&mtx_);
+	idle_start();
+}
 
 HTTPServerPipe::~HTTPServerPipe()
 {
 	ASSERT_NULL(log_, action_);
 	ASSERT_NULL(log_, callback_);
+
+	if (idle_action_ != NULL) {
+		idle_action_->cancel();
+		idle_action_ = NULL;
+	}
 }
 
 Action *
@@ -66,7 +81,7 @@ HTTPServerPipe::request(HTTPRequestEventCallback *cb)
 	ASSERT_NULL(log_, action_);
 	ASSERT_NULL(log_, callback_);
 
-	if (state_ == GotRequest || state_ == Error)
+	if (state_ == GotRequest || state_ == Closed || state_ == Error)
 		return (schedule_callback(cb));
 
 	callback_ = cb;
@@ -75,11 +90,22 @@ HTTPServerPipe::request(HTTPRequestEventCallback *cb)
 
 void
 HTTPServerPipe::send_response(HTTPProtocol::Status status, Buffer *body, Buffer *headers)
+{
+	ScopedLock _(&mtx_);
+	send_response_locked(status, body, headers);
+}
+
+void
+HTTPServerPipe::send_response_locked(HTTPProtocol::Status status, Buffer *body, Buffer *headers)
 {
 	ASSERT_LOCK_OWNED(log_, &mtx_);
-	if (state_ == GotRequest || state_ == Error) {
-		ASSERT(log_, buffer_.empty());
+	bool keep_alive;
+
+	if (state_ == SendResponse) {
+		keep_alive = keep_alive_;
 	} else {
+		keep_alive = false;
+		idle_cancel();
 		if (!buffer_.empty()) {
 			buffer_.clear();
 		} else {
@@ -128,8 +154,11 @@ HTTPServerPipe::send_response(HTTPProtocol::Status status, Buffer *body, Buffer
 	 * Fill response headers.
 	 */
 	response.append("Server: " + (std::string)log_ + "\r\n");
-	response.append("Transfer-encoding: identity\r\n");
-	response.append("Connection: close\r\n");
+	response << "Content-length: " << body->length() << "\r\n";
+	if (keep_alive)
+		response.append("Connection: keep-alive\r\n");
+	else
+		response.append("Connection: close\r\n");
 	if (headers != NULL)
 		headers->moveout(&response);
 	response.append("\r\n");
@@ -140,10 +169,52 @@ HTTPServerPipe::send_response(HTTPProtocol::Status status, Buffer *body, Buffer
 	body->moveout(&response);
 
 	/*
-	 * Output response and EOS.
+	 * Output response and EOS, unless the connection persists, in which
+	 * case go on to the next request.
 	 */
-	produce_eos(&response);
+	if (!keep_alive) {
+		if (state_ == SendResponse) {
+			/*
+			 * Pipelined requests which we will not get to are
+			 * dropped, and the client must send them again.
+			 */
+			buffer_.clear();
+			state_ = Closed;
+
+			ASSERT_NULL(log_, action_);
+			if (callback_ != NULL) {
+				action_ = schedule_callback(callback_);
+				callback_ = NULL;
+			}
+		}
+		produce_eos(&response);
+		ASSERT(log_, response.empty());
+		return;
+	}
+	produce(&response);
 	ASSERT(log_, response.empty());
+
+	state_ = GetStart;
+	request_ = HTTPProtocol::Request();
+	last_header_ = "";
+
+	if (!buffer_.empty()) {
+		parse();
+		if (state_ == GetStart || state_ == GetHeaders) {
+			if (eos_)
+				send_response_locked(HTTPProtocol::BadRequest, "Premature end of request.");
+			else
+				idle_start();
+		}
+		return;
+	}
+
+	if (eos_) {
+		close();
+		return;
+	}
+
+	idle_start();
 }
 
 void
@@ -152,7 +223,7 @@ HTTPServerPipe::send_response_locked(HTTPProtocol::Status status, const std::str
 	ASSERT_LOCK_OWNED(log_, &mtx_);
 	Buffer tmp(body);
 	Buffer header("Content-type: " + content_type + "\r\n");
-	send_response(status, &tmp, &header);
+	send_response_locked(status, &tmp, &header);
 	ASSERT(log_, tmp.empty());
 }
 
@@ -184,6 +255,10 @@ HTTPServerPipe::schedule_callback(HTTPRequestEventCallback *cb)
 	switch (state_) {
 	case GotRequest:
 		cb->param(Event::Done, request_);
+		state_ = SendResponse;
+		break;
+	case Closed:
+		cb->param(Event::EOS, HTTPProtocol::Request());
 		break;
 	case Error:
 		cb->param(Event::Error, HTTPProtocol::Request());
@@ -195,10 +270,135 @@ HTTPServerPipe::schedule_callback(HTTPRequestEventCallback *cb)
 	return (cb->schedule());
 }
 
+/*
+ * Close the connection without a response.
+ */
+void
+HTTPServerPipe::close(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	idle_cancel();
+
+	state_ = Closed;
+	produce_eos();
+
+	ASSERT_NULL(log_, action_);
+	if (callback_ != NULL) {
+		action_ = schedule_callback(callback_);
+		callback_ = NULL;
+	}
+}
+
+/*
+ * Wait for a whole request for at most idle_timeout_ milliseconds.
+ */
+void
+HTTPServerPipe::idle_start(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	ASSERT_NULL(log_, idle_action_);
+	idle_action_ = EventSystem::instance()->timeout(idle_timeout_, &idle_callback_);
+}
+
+void
+HTTPServerPipe::idle_cancel(void)
+{
+	if (idle_action_ != NULL) {
+		idle_action_->cancel();
+		idle_action_ = NULL;
+	}
+}
+
+void
+HTTPServerPipe::idle_timeout(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	idle_action_->cancel();
+	idle_action_ = NULL;
+
+	ASSERT(log_, state_ == GetStart || state_ == GetHeaders);
+	if (state_ == GetStart && buffer_.empty()) {
+		DEBUG(log_) << "Closing idle connection.";
+	} else {
+		DEBUG(log_) << "Closing connection with incomplete request.";
+		buffer_.clear();
+	}
+	close();
+}
+
+/*
+ * Whether the connection should persist after the response to the request
+ * we have.  A request with a body is never followed by another, since we
+ * do not read bodies and so could not find where the next request begins.
+ */
+bool
+HTTPServerPipe::persistent(void) const
+{
+	if (requests_ >= max_requests_)
+		return (false);
+
+	Buffer start_line(request_.start_line_);
+	std::vector<Buffer> words = start_line.split(' ', false);
+	if (words.size() != 3)
+		return (false);
+	bool keep_alive = words[2].equal("HTTP/1.1");
+
+	std::map<std::string, std::vector<Buffer> >::const_iterator it;
+	for (it = request_.headers_.begin(); it != request_.headers_.end(); ++it) {
+		Buffer name(it->first);
+		name = name.toupper();
+		if (name.equal("CONTENT-LENGTH") || name.equal("TRANSFER-ENCODING"))
+			return (false);
+		if (!name.equal("CONNECTION"))
+			continue;
+
+		std::vector<Buffer>::const_iterator vit;
+		for (vit = it->second.begin(); vit != it->second.end(); ++vit) {
+			std::vector<Buffer> options = vit->toupper().split(',', false);
+			std::vector<Buffer>::iterator oit;
+			for (oit = options.begin(); oit != options.end(); ++oit) {
+				std::string option;
+				oit->extract(option);
+
+				std::string::size_type first = option.find_first_not_of(' ');
+				if (first == std::string::npos)
+					continue;
+				option = option.substr(first, option.find_last_not_of(' ') + 1 - first);
+
+				if (option == "CLOSE")
+					return (false);
+				if (option == "KEEP-ALIVE")
+					keep_alive = true;
+			}
+		}
+	}
+
+	return (keep_alive);
+}
+
+/*
+ * We have received the full message.  Process any pending callback.
+ */
+void
+HTTPServerPipe::got_request(void)
+{
+	idle_cancel();
+
+	requests_++;
+	keep_alive_ = persistent();
+	state_ = GotRequest;
+
+	ASSERT_NULL(log_, action_);
+	if (callback_ != NULL) {
+		action_ = schedule_callback(callback_);
+		callback_ = NULL;
+	}
+}
+
 void
 HTTPServerPipe::consume(Buffer *in)
 {
-	if (state_ == GotRequest || state_ == Error) {
+	if (state_ == Closed || state_ == Error) {
 		ASSERT(log_, buffer_.empty());
 		if (in->empty()) {
 			DEBUG(log_) << "Got end-of-stream.";
@@ -209,28 +409,49 @@ HTTPServerPipe::consume(Buffer *in)
 		 * XXX
 		 * Really want a way to shut down input.
 		 */
-		if (state_ == GotRequest) {
-			ERROR(log_) << "Client sent unexpected additional data after request.";
-			state_ = Error;
-
-			/*
-			 * No need to schedule a callback for this state
-			 * change, the change to GotRequest already did.
-			 */
-		} else {
+		if (state_ == Closed)
+			ERROR(log_) << "Client sent unexpected additional data after last request.";
+		else
 			ERROR(log_) << "Client continuing to send gibberish.";
-		}
 		in->clear();
 		return;
 	}
 
+	/*
+	 * Input which follows a request is held until it has been responded
+	 * to, as is the end of the stream.
+	 */
+	if (state_ == GotRequest || state_ == SendResponse) {
+		if (in->empty())
+			eos_ = true;
+		else
+			in->moveout(&buffer_);
+		return;
+	}
+
+	/*
+	 * The idle timer keeps running until we have a whole request, so that
+	 * a client cannot hold the connection by sending it a little at a
+	 * time.
+	 */
 	if (in->empty()) {
+		idle_cancel();
+		if (state_ == GetStart && buffer_.empty() && requests_ != 0) {
+			DEBUG(log_) << "Client closed persistent connection.";
+			close();
+			return;
+		}
 		send_response_locked(HTTPProtocol::BadRequest, "Premature end of request.");
 		return;
 	}
 
 	in->moveout(&buffer_);
+	parse();
+}
 
+void
+HTTPServerPipe::parse(void)
+{
 	for (;;) {
 		ASSERT(log_, !buffer_.empty());
 
@@ -295,17 +516,7 @@ HTTPServerPipe::consume(Buffer *in)
 				return;
 			}
 
-			/*
-			 * We have received the full message.  Process any
-			 * pending callback.
-			 */
-			state_ = GotRequest;
-
-			ASSERT_NULL(log_, action_);
-			if (callback_ != NULL) {
-				action_ = schedule_callback(callback_);
-				callback_ = NULL;
-			}
+			got_request();
 			return;
 		}
 
@@ -313,26 +524,11 @@ HTTPServerPipe::consume(Buffer *in)
 		ASSERT(log_, !request_.start_line_.empty());
 
 		/*
-		 * Process end of headers!
+		 * Process end of headers!  Anything left over is the next
+		 * request, pipelined behind this one.
 		 */
 		if (line.empty()) {
-			if (!buffer_.empty()) {
-				ERROR(log_) << "Client sent garbage after message.";
-				send_response_locked(HTTPProtocol::BadRequest, "Garbage after message.");
-				return;
-			}
-
-			/*
-			 * We have received the full message.  Process any
-			 * pending callback.
-			 */
-			state_ = GotRequest;
-
-			ASSERT_NULL(log_, action_);
-			if (callback_ != NULL) {
-				action_ = schedule_callback(callback_);
-				callback_ = NULL;
-			}
+			got_request();
 			return;
 		}
 
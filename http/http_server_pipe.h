@@ -37,27 +37,54 @@
 
 typedef class TypedPairCallback<Event, HTTPProtocol::Request> HTTPRequestEventCallback;
 
+/*
+ * By default, a persistent connection is closed after HTTP_SERVER_MAX_REQUESTS
+ * requests, or once it has waited HTTP_SERVER_IDLE_TIMEOUT milliseconds for
+ * the next.
+ */
+#define	HTTP_SERVER_MAX_REQUESTS	100
+#define	HTTP_SERVER_IDLE_TIMEOUT	15000
+
+/*
+ * A connection persists from one request to the next when the client asks
+ * for it, or does not ask otherwise with HTTP/1.1, up to a limit on the
+ * number of requests.  Requests which are pipelined behind one being
+ * handled are kept and parsed once its response has been sent.  A
+ * connection which has not given us a whole request within the idle timeout
+ * of its connecting or of the last response is closed, whether it has sent
+ * nothing or only part of the request's headers.
+ */
 class HTTPServerPipe : public PipeProducer {
 	enum State {
 		GetStart,
 		GetHeaders,
 
 		GotRequest,
+		SendResponse,
+		Closed,
 		Error
 	};
 
 	Mutex mtx_;
 	State state_;
 	Buffer buffer_;
+	bool eos_;
 
 	HTTPProtocol::Request request_;
 	std::string last_header_;
+	unsigned max_requests_;
+	unsigned requests_;
+	bool keep_alive_;
 
 	Cancellation<HTTPServerPipe> cancel_;
 	Action *action_;
 	HTTPRequestEventCallback *callback_;
+
+	unsigned idle_timeout_;
+	SimpleCallback::Method<HTTPServerPipe> idle_callback_;
+	Action *idle_action_;
 public:
-	HTTPServerPipe(const LogHandle&);
+	HTTPServerPipe(const LogHandle&, unsigned = HTTP_SERVER_MAX_REQUESTS, unsigned = HTTP_SERVER_IDLE_TIMEOUT);
 	~HTTPServerPipe();
 
 	Action *request(HTTPRequestEventCallback *);
@@ -75,6 +102,15 @@ private:
 
 	Action *schedule_callback(HTTPRequestEventCallback *);
 
+	void close(void);
+	void idle_start(void);
+	void idle_cancel(void);
+	void idle_timeout(void);
+
+	bool persistent(void) const;
+	void got_request(void);
+	void parse(void);
+
 	void consume(Buffer *);
 };
 
@@ -35,11 +35,19 @@
  * We want to make it possible for the caller to request that the work be
  * done in a particular thread, and then here we can defer consume() to a
  * callback run in a specified CallbackScheduler.
+ *
+ * A consumer which cannot take more input for now may call input_hold()
+ * from consume(), in which case the input is not completed, and so the
+ * caller will not send more, until input_release() is called.
  */
 
 PipeProducer::PipeProducer(const LogHandle& log, Lock *lock)
 : log_(log),
   lock_(lock),
+  input_cancel_(lock_, this, &PipeProducer::input_cancel),
+  input_action_(NULL),
+  input_callback_(NULL),
+  input_held_(false),
   output_cancel_(lock_, this, &PipeProducer::output_cancel),
   output_buffer_(),
   output_action_(NULL),
@@ -51,6 +59,8 @@ PipeProducer::PipeProducer(const LogHandle& log, Lock *lock)
 
 PipeProducer::~PipeProducer()
 {
+	ASSERT_NULL(log_, input_action_);
+	ASSERT_NULL(log_, input_callback_);
 	ASSERT_NULL(log_, output_action_);
 	ASSERT_NULL(log_, output_callback_);
 }
@@ -59,11 +69,13 @@ Action *
 PipeProducer::input(Buffer *buf, EventCallback *cb)
 {
 	ScopedLock _(lock_);
+	ASSERT_NULL(log_, input_action_);
+	ASSERT_NULL(log_, input_callback_);
+
 	if (!error_) {
 		/*
 		 * XXX
-		 * Allow consume() to only consume part of buf, and to
-		 * delay further input.
+		 * Allow consume() to only consume part of buf.
 		 */
 		cork();
 		consume(buf);
@@ -75,6 +87,11 @@ PipeProducer::input(Buffer *buf, EventCallback *cb)
 		buf->clear();
 	}
 
+	if (!error_ && input_held_) {
+		input_callback_ = cb;
+		return (&input_cancel_);
+	}
+
 	if (error_)
 		cb->param(Event::Error);
 	else
@@ -100,6 +117,21 @@ PipeProducer::output(BufferEventCallback *cb)
 	return (&output_cancel_);
 }
 
+void
+PipeProducer::input_cancel(void)
+{
+	ASSERT_LOCK_OWNED(log_, lock_);
+	if (input_action_ != NULL) {
+		ASSERT_NULL(log_, input_callback_);
+
+		input_action_->cancel();
+		input_action_ = NULL;
+	}
+
+	if (input_callback_ != NULL)
+		input_callback_ = NULL;
+}
+
 void
 PipeProducer::output_cancel(void)
 {
@@ -208,6 +240,8 @@ PipeProducer::produce_error(void)
 	output_buffer_.clear();
 
 	output_produced();
+
+	input_release();
 }
 
 void
@@ -227,3 +261,34 @@ PipeProducer::uncork(void)
 
 	output_produced();
 }
+
+/*
+ * Do not complete the input being consumed, nor so take any more, until
+ * input_release() is called.
+ */
+void
+PipeProducer::input_hold(void)
+{
+	ASSERT_LOCK_OWNED(log_, lock_);
+	input_held_ = true;
+}
+
+void
+PipeProducer::input_release(void)
+{
+	ASSERT_LOCK_OWNED(log_, lock_);
+	if (!input_held_)
+		return;
+	input_held_ = false;
+
+	if (input_callback_ != NULL) {
+		ASSERT_NULL(log_, input_action_);
+
+		if (error_)
+			input_callback_->param(Event::Error);
+		else
+			input_callback_->param(Event::Done);
+		input_action_ = input_callback_->schedule();
+		input_callback_ = NULL;
+	}
+}
@@ -36,6 +36,10 @@ protected:
 
 private:
 	Lock *lock_;
+	Cancellation<PipeProducer> input_cancel_;
+	Action *input_action_;
+	EventCallback *input_callback_;
+	bool input_held_;
 	Cancellation<PipeProducer> output_cancel_;
 	Buffer output_buffer_;
 	Action *output_action_;
@@ -52,6 +56,7 @@ protected:
 	Action *output(BufferEventCallback *);
 
 private:
+	void input_cancel(void);
 	void output_cancel(void);
 	Action *output_do(BufferEventCallback *);
 	void output_produced(void);
@@ -64,6 +69,9 @@ public:
 	void cork(void);
 	void uncork(void);
 
+	void input_hold(void);
+	void input_release(void);
+
 protected:
 	virtual void consume(Buffer *) = 0;
 };
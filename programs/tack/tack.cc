@@ -55,6 +55,13 @@ enum FileAction {
 #define	TACK_FLAG_CODEC_TIMING_EACH	(0x00000008)
 #define	TACK_FLAG_CODEC_TIMING_SAMPLES	(0x00000010)
 
+/*
+ * The first pass turns data seen before into a stream of references some
+ * two hundred times shorter, so it is given to the second pass in batches
+ * long enough for that to find whole segments to reference.
+ */
+#define	TACK_PASS_LENGTH		(1024 * 1024)
+
 static void compress(const std::string&, int, int, XCodec *, unsigned, Timer *);
 static void decompress(const std::string&, int, int, XCodec *, unsigned, Timer *);
 static void hashes(int, int, unsigned, Timer *);
@@ -169,7 +176,9 @@ main(int argc, char *argv[])
 {
 	const char *fifo, *persist;
 	bool nullcache;
+	bool passes;
 	bool verbose;
+	XCodecChunking chunking;
 	FileAction action;
 	unsigned flags;
 	int ch;
@@ -179,9 +188,11 @@ main(int argc, char *argv[])
 	action = None;
 	flags = 0;
 	nullcache = false;
+	passes = false;
 	verbose = false;
+	chunking = XCodecChunkingExhaustive;
 
-	while ((ch = getopt(argc, argv, "?cdhp:svEF:NQST")) != -1) {
+	while ((ch = getopt(argc, argv, "?cdhp:svEF:NQRSTV")) != -1) {
 		switch (ch) {
 		case 'c':
 			action = Compress;
@@ -213,12 +224,18 @@ main(int argc, char *argv[])
 		case 'Q':
 			flags |= TACK_FLAG_QUIET_OUTPUT;
 			break;
+		case 'R':
+			passes = true;
+			break;
 		case 'S':
 			flags |= TACK_FLAG_CODEC_TIMING_SAMPLES;
 			break;
 		case 'T':
 			flags |= TACK_FLAG_CODEC_TIMING;
 			break;
+		case 'V':
+			chunking = XCodecChunkingVariable;
+			break;
 		case '?':
 		default:
 			usage();
@@ -237,8 +254,24 @@ main(int argc, char *argv[])
 			usage();
 		if (persist != NULL)
 			usage();
+		if (passes)
+			usage();
 	}
 
+	/*
+	 * Only the encoder cuts data into chunks; the decoder takes them
+	 * however they were cut.
+	 */
+	if (action != Compress && chunking != XCodecChunkingExhaustive)
+		usage();
+
+	/*
+	 * The second pass has only a memory cache, so it cannot go with
+	 * a cache which persists.
+	 */
+	if (passes && (fifo != NULL || persist != NULL))
+		usage();
+
 	if (fifo != NULL && (persist != NULL || nullcache))
 		usage();
 	if (persist != NULL && nullcache)
@@ -286,10 +319,24 @@ main(int argc, char *argv[])
 			HALT("/tack") << "Could not open persistent cache.";
 		cache = new TackPersistentCache(uuid, fd);
 	}
-	XCodec codec(cache);
+	XCodec codec(cache, XCODEC_WINDOW_COUNT, chunking);
+
+	XCodecCache *pass_cache = NULL;
+	if (passes) {
+		UUID pass_uuid;
+		pass_uuid.generate();
+
+		if (nullcache)
+			pass_cache = new TackNullCache(pass_uuid);
+		else
+			pass_cache = new XCodecMemoryCache(pass_uuid);
+		codec.set_pass_cache(pass_cache);
+	}
 
 	process_files(argc, argv, action, &codec, flags);
 
+	if (pass_cache != NULL)
+		delete pass_cache;
 	delete cache;
 
 	return (0);
@@ -298,19 +345,44 @@ main(int argc, char *argv[])
 static void
 compress(const std::string& name, int ifd, int ofd, XCodec *codec, unsigned flags, Timer *timer)
 {
-	XCodecEncoder encoder(codec->cache());
-	Buffer input, output;
-	uint64_t inbytes, outbytes;
+	XCodecEncoder encoder(codec->cache(), codec->window(), codec->chunking());
+	XCodecEncoder *pass_encoder;
+	Buffer input, pass, output;
+	uint64_t inbytes, outbytes, passbytes;
+
+	/*
+	 * We decode what we encode, so every extension may be used.
+	 */
+	encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
+	if (codec->pass_cache() != NULL) {
+		pass_encoder = new XCodecEncoder(codec->pass_cache());
+		pass_encoder->set_peer_capabilities(XCODEC_CAPABILITIES);
+	} else {
+		pass_encoder = NULL;
+	}
 
 	if ((flags & TACK_FLAG_BYTE_STATS) != 0)
-		inbytes = outbytes = 0;
+		inbytes = outbytes = passbytes = 0;
 
-	while (fill(ifd, &input)) {
+	for (;;) {
+		bool eof = !fill(ifd, &input);
+		if (eof && pass.empty())
+			break;
 		if ((flags & TACK_FLAG_BYTE_STATS) != 0)
 			inbytes += input.length();
 		if ((flags & TACK_FLAG_CODEC_TIMING) != 0)
 			timer->start();
-		encoder.encode(&output, &input);
+		if (pass_encoder != NULL) {
+			if (!input.empty())
+				encoder.encode(&pass, &input);
+			if (eof || pass.length() >= TACK_PASS_LENGTH) {
+				if ((flags & TACK_FLAG_BYTE_STATS) != 0)
+					passbytes += pass.length();
+				pass_encoder->encode(&output, &pass);
+			}
+		} else {
+			encoder.encode(&output, &input);
+		}
 		if ((flags & TACK_FLAG_CODEC_TIMING) != 0)
 			timer->stop();
 		if ((flags & TACK_FLAG_BYTE_STATS) != 0) {
@@ -318,22 +390,37 @@ compress(const std::string& name, int ifd, int ofd, XCodec *codec, unsigned flag
 			outbytes += output.length();
 		}
 		flush(ofd, &output);
+		if (eof)
+			break;
 	}
 	ASSERT("/compress", input.empty());
+	ASSERT("/compress", pass.empty());
 	ASSERT("/compress", output.empty());
 
-	if ((flags & TACK_FLAG_BYTE_STATS) != 0)
+	if ((flags & TACK_FLAG_BYTE_STATS) != 0) {
+		if (pass_encoder != NULL)
+			INFO("/codec_stats") << name << ": " << passbytes << " bytes after first pass.";
 		print_ratio(name, inbytes, outbytes);
+	}
+
+	if (pass_encoder != NULL)
+		delete pass_encoder;
 }
 
 static void
 decompress(const std::string& name, int ifd, int ofd, XCodec *codec, unsigned flags, Timer *timer)
 {
-	std::set<uint64_t> unknown_hashes;
+	std::set<XCodecReference> unknown_hashes;
 	XCodecDecoder decoder(codec->cache());
-	Buffer input, output;
+	XCodecDecoder *pass_decoder;
+	Buffer input, pass, output;
 	uint64_t inbytes, outbytes;
 
+	if (codec->pass_cache() != NULL)
+		pass_decoder = new XCodecDecoder(codec->pass_cache());
+	else
+		pass_decoder = NULL;
+
 	if ((flags & TACK_FLAG_BYTE_STATS) != 0)
 		inbytes = outbytes = 0;
 
@@ -342,7 +429,19 @@ decompress(const std::string& name, int ifd, int ofd, XCodec *codec, unsigned fl
 			inbytes += input.length();
 		if ((flags & TACK_FLAG_CODEC_TIMING) != 0)
 			timer->start();
-		if (!decoder.decode(&output, &input, unknown_hashes)) {
+		if (pass_decoder != NULL) {
+			if (!pass_decoder->decode(&pass, &input, unknown_hashes)) {
+				ERROR("/decompress") << "Second pass decode failed.";
+				delete pass_decoder;
+				return;
+			}
+			if (!pass.empty() &&
+			    !decoder.decode(&output, &pass, unknown_hashes)) {
+				ERROR("/decompress") << "Decode failed.";
+				delete pass_decoder;
+				return;
+			}
+		} else if (!decoder.decode(&output, &input, unknown_hashes)) {
 			ERROR("/decompress") << "Decode failed.";
 			return;
 		}
@@ -350,6 +449,8 @@ decompress(const std::string& name, int ifd, int ofd, XCodec *codec, unsigned fl
 			timer->stop();
 		if (!unknown_hashes.empty()) {
 			ERROR("/decompress") << "Cannot decode stream with unknown hashes.";
+			if (pass_decoder != NULL)
+				delete pass_decoder;
 			return;
 		}
 		if ((flags & TACK_FLAG_BYTE_STATS) != 0) {
@@ -359,8 +460,12 @@ decompress(const std::string& name, int ifd, int ofd, XCodec *codec, unsigned fl
 		flush(ofd, &output);
 	}
 	ASSERT("/decompress", input.empty());
+	ASSERT("/decompress", pass.empty());
 	ASSERT("/decompress", output.empty());
 
+	if (pass_decoder != NULL)
+		delete pass_decoder;
+
 	if ((flags & TACK_FLAG_BYTE_STATS) != 0)
 		print_ratio(name, outbytes, inbytes); /* Reverse order of compress().  */
 }
@@ -591,8 +696,8 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-"usage: tack [-p cache | -F fifo-cache | -N] [-svQ] [-T [-ES]] -c [file ...]\n"
-"       tack [-p cache | -F fifo-cache | -N] [-svQ] [-T [-ES]] -d [file ...]\n"
+"usage: tack [-p cache | -F fifo-cache | -N] [-svQRV] [-T [-ES]] -c [file ...]\n"
+"       tack [-p cache | -F fifo-cache | -N] [-svQR] [-T [-ES]] -d [file ...]\n"
 "       tack [-vQ] [-T [-ES]] -h [file ...]\n");
 	exit(1);
 }
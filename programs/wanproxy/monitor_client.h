@@ -30,12 +30,24 @@
 
 class Config;
 
+struct MonitorConfig {
+	Config *config_;
+	unsigned max_requests_;
+	unsigned idle_timeout_;
+
+	MonitorConfig(Config *config, unsigned max_requests, unsigned idle_timeout)
+	: config_(config),
+	  max_requests_(max_requests),
+	  idle_timeout_(idle_timeout)
+	{ }
+};
+
 class MonitorClient : public HTTPServerHandler {
 	Config *config_;
 public:
-	MonitorClient(Config *config, Socket *client)
-	: HTTPServerHandler(client),
-	  config_(config)
+	MonitorClient(const MonitorConfig& config, Socket *client)
+	: HTTPServerHandler(client, config.max_requests_, config.idle_timeout_),
+	  config_(config.config_)
 	{ }
 
 	~MonitorClient()
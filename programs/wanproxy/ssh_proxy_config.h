@@ -26,13 +26,16 @@
 #ifndef	PROGRAMS_WANPROXY_SSH_PROXY_CONFIG_H
 #define	PROGRAMS_WANPROXY_SSH_PROXY_CONFIG_H
 
+#include <ssh/ssh_moduli.h>
 #include <ssh/ssh_server_host_key.h>
 
 struct SSHProxyConfig {
 	SSH::ServerHostKey *server_host_key_;
+	SSH::Moduli *moduli_;
 
 	SSHProxyConfig(void)
-	: server_host_key_(NULL)
+	: server_host_key_(NULL),
+	  moduli_(NULL)
 	{ }
 
 	~SSHProxyConfig()
@@ -41,6 +44,10 @@ struct SSHProxyConfig {
 			delete server_host_key_;
 			server_host_key_ = NULL;
 		}
+		if (moduli_ != NULL) {
+			delete moduli_;
+			moduli_ = NULL;
+		}
 	}
 };
 
@@ -41,6 +41,14 @@
 
 #include "wanproxy_codec.h"
 
+/*
+ * Encoded data is a stream of bytes with no boundaries of its own, and is
+ * sent in packets of up to SSH_STREAM_PACKET_MAX bytes of payload, the most
+ * that every implementation must accept.  It is sent as the codec's
+ * FlushTimer says, or once a full packet has built up.
+ */
+#define	SSH_STREAM_PACKET_MAX		32768
+
 namespace {
 	static const uint8_t SSHStreamPacket = 0xff;
 }
@@ -70,7 +78,9 @@ SSHStream::SSHStream(const LogHandle& log, const SSHProxyConfig *ssh_config, SSH
   ready_action_(NULL),
   write_cancel_(&mtx_, this, &SSHStream::write_cancel),
   write_callback_(NULL),
-  write_action_(NULL)
+  write_action_(NULL),
+  flush_callback_(NULL, &mtx_, this, &SSHStream::flush_timeout),
+  flush_timer_(&flush_callback_, incoming_codec == NULL ? FLUSH_TIMER_INTERVAL : incoming_codec->flush_interval_)
 {
 	(void)outgoing_codec_;
 
@@ -78,6 +88,7 @@ SSHStream::SSHStream(const LogHandle& log, const SSHProxyConfig *ssh_config, SSH
 	if (session_.role_ == SSH::ServerRole) {
 		ASSERT_NON_NULL(log_, ssh_config_->server_host_key_);
 		session_.algorithm_negotiation_->add_algorithm(ssh_config_->server_host_key_);
+		session_.moduli_ = ssh_config_->moduli_;
 	}
 	session_.algorithm_negotiation_->add_algorithms();
 
@@ -89,6 +100,8 @@ SSHStream::SSHStream(const LogHandle& log, const SSHProxyConfig *ssh_config, SSH
 
 SSHStream::~SSHStream()
 {
+	flush_timer_.cancel();
+
 	if (pipe_ != NULL) {
 		delete pipe_;
 		pipe_ = NULL;
@@ -126,6 +139,14 @@ SSHStream::close(SimpleCallback *cb)
 	/* Let our parent be responsible for closing the socket.  */
 	socket_ = NULL;
 
+	/*
+	 * Send anything still being held for coalescing.
+	 */
+	flush_timer_.cancel();
+	if (ready_ && !input_buffer_.empty())
+		write_do();
+	flush_timer_.cancel();
+
 	ASSERT_NULL(log_, start_action_);
 	ASSERT_NULL(log_, start_callback_);
 
@@ -336,10 +357,22 @@ SSHStream::write_do(void)
 	 */
 	if (incoming_codec_ != NULL &&
 	    (incoming_codec_->codec_ != NULL || incoming_codec_->compressor_)) {
-		Buffer packet;
-		packet.append(SSHStreamPacket);
-		input_buffer_.moveout(&packet);
-		pipe_->send(&packet);
+		while (!input_buffer_.empty()) {
+			size_t length = input_buffer_.length();
+			if (length >= SSH_STREAM_PACKET_MAX - 1) {
+				length = SSH_STREAM_PACKET_MAX - 1;
+			} else if (flush_timer_.hold()) {
+				DEBUG(log_) << "Holding " << length << " bytes to coalesce.";
+				break;
+			}
+
+			Buffer packet;
+			packet.append(SSHStreamPacket);
+			input_buffer_.moveout(&packet, length);
+			pipe_->send(&packet);
+		}
+
+		flush_timer_.flushed();
 	} else {
 		uint32_t length;
 		while (input_buffer_.length() > sizeof length) {
@@ -358,3 +391,15 @@ SSHStream::write_do(void)
 		}
 	}
 }
+
+void
+SSHStream::flush_timeout(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	flush_timer_.expire();
+
+	if (input_buffer_.empty())
+		return;
+
+	write_do();
+}
@@ -27,6 +27,7 @@
 #define	PROGRAMS_WANPROXY_SSH_STREAM_H
 
 #include <event/cancellation.h>
+#include <event/flush_timer.h>
 
 #include <io/channel.h>
 
@@ -70,6 +71,9 @@ class SSHStream : public StreamChannel {
 	Cancellation<SSHStream> write_cancel_;
 	EventCallback *write_callback_;
 	Action *write_action_;
+
+	SimpleCallback::Method<SSHStream> flush_callback_;
+	FlushTimer flush_timer_;
 public:
 	SSHStream(const LogHandle&, const SSHProxyConfig *, SSH::Role, WANProxyCodec *, WANProxyCodec *);
 	~SSHStream();
@@ -93,6 +97,8 @@ private:
 
 	void write_cancel(void);
 	void write_do(void);
+
+	void flush_timeout(void);
 };
 
 #endif /* !PROGRAMS_WANPROXY_SSH_STREAM_H */
@@ -26,13 +26,27 @@
 #ifndef	PROGRAMS_WANPROXY_WANPROXY_CODEC_H
 #define	PROGRAMS_WANPROXY_WANPROXY_CODEC_H
 
+#include <event/flush_timer.h>
+
+#include <zlib/compressor.h>
+
+class Buffer;
 class XCodec;
 
 struct WANProxyCodec {
 	std::string name_;
 	XCodec *codec_;
 	bool compressor_;
+	CompressorType compressor_type_;
 	unsigned compressor_level_;
+	const Buffer *compressor_dictionary_;
+	CompressorStatistics compressor_statistics_;
+
+	/*
+	 * How long, in milliseconds, the compressor and SSH packets hold back
+	 * output written soon after the last they sent; see FlushTimer.
+	 */
+	unsigned flush_interval_;
 
 	bool track_statistics_;
 
@@ -45,7 +59,11 @@ struct WANProxyCodec {
 	: name_(""),
 	  codec_(NULL),
 	  compressor_(false),
+	  compressor_type_(CompressorZlib),
 	  compressor_level_(0),
+	  compressor_dictionary_(NULL),
+	  compressor_statistics_(),
+	  flush_interval_(FLUSH_TIMER_INTERVAL),
 	  track_statistics_(false),
 	  outgoing_to_codec_bytes_(NULL),
 	  codec_to_outgoing_bytes_(NULL),
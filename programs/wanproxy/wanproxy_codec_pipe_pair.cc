@@ -38,8 +38,7 @@
 #include <xcodec/xcodec_encoder.h>
 #include <xcodec/xcodec_pipe_pair.h>
 
-#include <zlib/deflate_pipe.h>
-#include <zlib/inflate_pipe.h>
+#include <zlib/compressor.h>
 
 #include "wanproxy_codec.h"
 #include "wanproxy_codec_pipe_pair.h"
@@ -95,8 +94,8 @@ WANProxyCodecPipePair::WANProxyCodecPipePair(WANProxyCodec *incoming, WANProxyCo
 		}
 
 		if (incoming->compressor_) {
-			Pipe *deflate_pipe = new DeflatePipe(incoming->compressor_level_);
-			Pipe *inflate_pipe = new InflatePipe();
+			Pipe *deflate_pipe = Compressor::compress_pipe(incoming->compressor_type_, incoming->compressor_level_, incoming->compressor_dictionary_, &incoming->compressor_statistics_, incoming->flush_interval_);
+			Pipe *inflate_pipe = Compressor::decompress_pipe(incoming->compressor_type_, incoming->compressor_dictionary_);
 
 			incoming_pipe_list.push_back(inflate_pipe);
 			outgoing_pipe_list.push_front(deflate_pipe);
@@ -146,8 +145,8 @@ WANProxyCodecPipePair::WANProxyCodecPipePair(WANProxyCodec *incoming, WANProxyCo
 		}
 
 		if (outgoing->compressor_) {
-			Pipe *deflate_pipe = new DeflatePipe(outgoing->compressor_level_);
-			Pipe *inflate_pipe = new InflatePipe();
+			Pipe *deflate_pipe = Compressor::compress_pipe(outgoing->compressor_type_, outgoing->compressor_level_, outgoing->compressor_dictionary_, &outgoing->compressor_statistics_, outgoing->flush_interval_);
+			Pipe *inflate_pipe = Compressor::decompress_pipe(outgoing->compressor_type_, outgoing->compressor_dictionary_);
 
 			incoming_pipe_list.push_back(deflate_pipe);
 			outgoing_pipe_list.push_front(inflate_pipe);
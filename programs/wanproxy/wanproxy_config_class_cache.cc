@@ -39,7 +39,13 @@ WANProxyConfigClassCache wanproxy_config_class_cache;
 bool
 WANProxyConfigClassCache::Instance::activate(const ConfigObject *)
 {
-	WANProxyConfigClassCache::Instance *primary, *secondary;
+	WANProxyConfigClassCache::Instance *buffer, *primary, *secondary;
+	std::vector<Buffer>::const_iterator pit;
+	std::vector<std::string> disk_paths;
+	std::vector<Buffer> paths;
+	XCodecMemoryCachePolicy policy;
+	XCodecMemoryCache *buffer_cache;
+	XCodecMemoryStore *buffer_store;
 	XCodecDisk *disk;
 	UUID uuid;
 
@@ -51,6 +57,32 @@ WANProxyConfigClassCache::Instance::activate(const ConfigObject *)
 		}
 	}
 
+	if (type_ != WANProxyConfigCacheDisk) {
+		if (direct_) {
+			ERROR("/wanproxy/config/cache") << "Direct I/O may only be used with disk caches.";
+			return (false);
+		}
+		if (buffer_size_ != 0) {
+			ERROR("/wanproxy/config/cache") << "Buffer size may only be specified for disk caches.";
+			return (false);
+		}
+		if (compression_) {
+			ERROR("/wanproxy/config/cache") << "Compression may only be used with disk caches.";
+			return (false);
+		}
+		if (buffer_ != NULL) {
+			ERROR("/wanproxy/config/cache") << "Buffer cache may only be specified for disk caches.";
+			return (false);
+		}
+	}
+
+	if (type_ != WANProxyConfigCacheMemory) {
+		if (policy_ != WANProxyConfigCachePolicyLRU) {
+			ERROR("/wanproxy/config/cache") << "Replacement policy may only be specified for memory caches.";
+			return (false);
+		}
+	}
+
 	switch (type_) {
 	case WANProxyConfigCacheMemory:
 		if (path_ != "") {
@@ -61,9 +93,23 @@ WANProxyConfigClassCache::Instance::activate(const ConfigObject *)
 			ERROR("/wanproxy/config/cache") << "Specified cache hierarchy for memory cache.";
 			return (false);
 		}
+		switch (policy_) {
+		case WANProxyConfigCachePolicyLRU:
+			policy = XCodecMemoryCachePolicyLRU;
+			break;
+		case WANProxyConfigCachePolicyTinyLFU:
+			policy = XCodecMemoryCachePolicyTinyLFU;
+			break;
+		case WANProxyConfigCachePolicyTinyLFUConsistent:
+			policy = XCodecMemoryCachePolicyTinyLFUConsistent;
+			break;
+		default:
+			ERROR("/wanproxy/config/cache") << "Invalid replacement policy.";
+			return (false);
+		}
 		if (uuid_ == "")
 			uuid.generate();
-		cache_ = new XCodecMemoryCache(uuid, size_);
+		cache_ = new XCodecMemoryCache(uuid, size_, policy);
 		break;
 	case WANProxyConfigCacheDisk:
 		if (uuid_ != "") {
@@ -76,12 +122,53 @@ WANProxyConfigClassCache::Instance::activate(const ConfigObject *)
 		}
 		if (size_ == 0)
 			INFO("/wanproxy/config/cache") << "No disk cache size specified; will attempt to detect from file size.";
-		disk = XCodecDisk::open(path_, size_);
+		/*
+		 * The buffer cache may be kept in a memory cache's store, so
+		 * that the two share one budget rather than having one each.
+		 */
+		buffer_store = NULL;
+		if (buffer_ != NULL) {
+			if (buffer_size_ != 0) {
+				ERROR("/wanproxy/config/cache") << "Cannot specify both a buffer size and a buffer cache.";
+				return (false);
+			}
+			buffer = dynamic_cast<WANProxyConfigClassCache::Instance *>(buffer_->instance_);
+			if (buffer == NULL) {
+				ERROR("/wanproxy/config/cache") << "Buffer cache not properly specified for disk cache.";
+				return (false);
+			}
+			if (buffer->cache_ == NULL) {
+				ERROR("/wanproxy/config/cache") << "Cache must be activated prior to use as a buffer cache.";
+				return (false);
+			}
+			buffer_cache = dynamic_cast<XCodecMemoryCache *>(buffer->cache_);
+			if (buffer_cache == NULL) {
+				ERROR("/wanproxy/config/cache") << "Buffer cache must be a memory cache.";
+				return (false);
+			}
+			buffer_store = buffer_cache->store();
+			if (!buffer_store->limited() || !buffer_store->shared()) {
+				ERROR("/wanproxy/config/cache") << "Buffer cache must be a memory cache with a size and a shared replacement policy.";
+				return (false);
+			}
+		}
+		/*
+		 * A disk cache may be striped across several files or
+		 * devices, given as a comma-separated list of paths.
+		 */
+		paths = Buffer(path_).split(',', false);
+		for (pit = paths.begin(); pit != paths.end(); ++pit) {
+			std::string path;
+			pit->extract(path);
+			disk_paths.push_back(path);
+		}
+		disk = XCodecDisk::open(disk_paths, size_, direct_, buffer_size_, compression_, buffer_store);
 		if (disk == NULL) {
 			ERROR("/wanproxy/config/cache") << "Could not open disk cache.";
 			return (false);
 		}
 		cache_ = disk->local();
+		disk_ = disk;
 		break;
 	case WANProxyConfigCachePair:
 		if (uuid_ != "") {
@@ -26,11 +26,14 @@
 #ifndef	PROGRAMS_WANPROXY_WANPROXY_CONFIG_CLASS_CACHE_H
 #define	PROGRAMS_WANPROXY_WANPROXY_CONFIG_CLASS_CACHE_H
 
+#include <config/config_type_boolean.h>
 #include <config/config_type_size.h>
 #include <config/config_type_pointer.h>
 #include <config/config_type_string.h>
 
 #include "wanproxy_config_type_cache.h"
+#include "wanproxy_config_type_cache_policy.h"
+#include "wanproxy_config_type_disk_statistics.h"
 
 class XCodecCache;
 
@@ -41,18 +44,31 @@ public:
 		WANProxyConfigCache type_;
 		std::string uuid_;
 		intmax_t size_;
+		WANProxyConfigCachePolicy policy_;
 		std::string path_;
+		bool direct_;
+		intmax_t buffer_size_;
+		bool compression_;
+		ConfigObject *buffer_;
 		ConfigObject *primary_;
 		ConfigObject *secondary_;
 
+		XCodecDisk *disk_;
+
 		Instance(void)
 		: cache_(),
 		  type_(WANProxyConfigCacheMemory),
 		  uuid_(""),
 		  size_(0),
+		  policy_(WANProxyConfigCachePolicyLRU),
 		  path_(""),
+		  direct_(false),
+		  buffer_size_(0),
+		  compression_(false),
+		  buffer_(NULL),
 		  primary_(NULL),
-		  secondary_(NULL)
+		  secondary_(NULL),
+		  disk_(NULL)
 		{ }
 
 		bool activate(const ConfigObject *);
@@ -64,9 +80,16 @@ public:
 		add_member("type", &wanproxy_config_type_cache, &Instance::type_);
 		add_member("uuid", &config_type_string, &Instance::uuid_);
 		add_member("size", &config_type_size, &Instance::size_);
+		add_member("policy", &wanproxy_config_type_cache_policy, &Instance::policy_);
 		add_member("path", &config_type_string, &Instance::path_);
+		add_member("direct", &config_type_boolean, &Instance::direct_);
+		add_member("buffer_size", &config_type_size, &Instance::buffer_size_);
+		add_member("compression", &config_type_boolean, &Instance::compression_);
+		add_member("buffer", &config_type_pointer, &Instance::buffer_);
 		add_member("primary", &config_type_pointer, &Instance::primary_);
 		add_member("secondary", &config_type_pointer, &Instance::secondary_);
+
+		add_member("statistics", &wanproxy_config_type_disk_statistics, &Instance::disk_);
 	}
 
 	~WANProxyConfigClassCache()
@@ -30,12 +30,17 @@
 
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_encoder.h>
+#include <xcodec/xcodec_eviction_log.h>
 
 #include "wanproxy_config_class_cache.h"
 #include "wanproxy_config_class_codec.h"
 
 WANProxyConfigClassCodec wanproxy_config_class_codec;
 
+static XCodecCache *codec_cache(ConfigObject *);
+static Buffer *codec_dictionary(const std::string&);
+
 bool
 WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co)
 {
@@ -43,40 +48,115 @@ WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co)
 
 	switch (codec_type_) {
 	case WANProxyConfigCodecXCodec: {
-		XCodecCache *xcache;
-		if (cache_ != NULL) {
-			WANProxyConfigClassCache::Instance *cache =
-				dynamic_cast<WANProxyConfigClassCache::Instance *>(cache_->instance_);
-			if (cache == NULL) {
-				ERROR("/wanproxy/config/codec") << "Codec cache not properly specified.";
+		unsigned window = XCODEC_WINDOW_COUNT;
+		if (window_ != -1) {
+			if (window_ < XCODEC_WINDOW_COUNT ||
+			    window_ > XCODEC_WIDE_WINDOW_COUNT ||
+			    (window_ & (window_ - 1)) != 0) {
+				ERROR("/wanproxy/config/codec") << "Codec window must be a power of two in range " << XCODEC_WINDOW_COUNT << ".." << XCODEC_WIDE_WINDOW_COUNT << " (inclusive.)";
 				return (false);
 			}
-			if (cache->cache_ == NULL) {
-				ERROR("/wanproxy/config/codec") << "Cache must be activated prior to use in configuration.";
+			window = window_;
+		}
+
+		if (encoder_threads_ < 0 || encoder_threads_ > 64) {
+			ERROR("/wanproxy/config/codec") << "Encoder threads must be in range 0..64 (inclusive.)";
+			return (false);
+		}
+
+		if (coalesce_ != -1 && (coalesce_ < 0 || coalesce_ > 1000)) {
+			ERROR("/wanproxy/config/codec") << "Coalescing window must be in range 0..1000 milliseconds (inclusive.)";
+			return (false);
+		}
+
+		if (credit_frames_ < 0 || credit_frames_ > 65536) {
+			ERROR("/wanproxy/config/codec") << "Frame credit must be in range 0..65536 (inclusive.)";
+			return (false);
+		}
+
+		if (credit_bytes_ < 0) {
+			ERROR("/wanproxy/config/codec") << "Byte credit must not be negative.";
+			return (false);
+		}
+
+		XCodecChunking chunking;
+		switch (chunking_) {
+		case WANProxyConfigChunkingExhaustive:
+			chunking = XCodecChunkingExhaustive;
+			break;
+		case WANProxyConfigChunkingContentDefined:
+			chunking = XCodecChunkingContentDefined;
+			break;
+		case WANProxyConfigChunkingVariable:
+			chunking = XCodecChunkingVariable;
+			break;
+		default:
+			ERROR("/wanproxy/config/codec") << "Invalid chunking.";
+			return (false);
+		}
+
+		if (passes_ != -1 && passes_ != 1 && passes_ != 2) {
+			ERROR("/wanproxy/config/codec") << "Codec passes must be 1 or 2.";
+			return (false);
+		}
+
+		if (pass_cache_ != NULL && passes_ != 2) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure a second pass cache without two passes.";
+			return (false);
+		}
+
+		/*
+		 * The <HELLO> of an older peer has no room for anything but
+		 * our UUID.
+		 */
+		if (legacy_ && (window != XCODEC_WINDOW_COUNT || passes_ == 2)) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure a window or a second pass for a legacy codec.";
+			return (false);
+		}
+
+		/*
+		 * Nor does an older peer accept data it has not asked for.
+		 */
+		if (legacy_ && push_) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure pushing for a legacy codec.";
+			return (false);
+		}
+
+		/*
+		 * Nor does it know chunks from segments.
+		 */
+		if (legacy_ && chunking == XCodecChunkingVariable) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure variable chunking for a legacy codec.";
+			return (false);
+		}
+
+		XCodecCache *xcache = codec_cache(cache_);
+		if (xcache == NULL)
+			return (false);
+
+		XCodecCache *pcache = NULL;
+		if (passes_ == 2) {
+			pcache = codec_cache(pass_cache_);
+			if (pcache == NULL)
+				return (false);
+			if (pcache == xcache) {
+				ERROR("/wanproxy/config/codec") << "Second pass must have a cache of its own.";
 				return (false);
 			}
-			xcache = cache->cache_;
-		} else {
-			/*
-			 * No cache configured, fall back to old
-			 * behaviour of generating an unlimited
-			 * memory cache.
-			 */
-			UUID uuid;
-
-			uuid.generate();
-			xcache = new XCodecMemoryCache(uuid);
-		}
-
-		const UUID& uuid = xcache->get_uuid();
-		XCodecCache *oxcache = XCodecCache::lookup(uuid);
- 		if (oxcache != NULL) {
-			if (oxcache != xcache)
-				INFO("/wanproxy/config/codec") << "Codec instance cache has a different UUID to shared cache associated with same UUID.";
-		} else {
-			XCodecCache::enter(uuid, xcache);
-		}
-		codec_.codec_ = new XCodec(xcache);
+		}
+
+		codec_.codec_ = new XCodec(xcache, window, chunking);
+		codec_.codec_->set_legacy(legacy_);
+		if (pcache != NULL)
+			codec_.codec_->set_pass_cache(pcache);
+
+		if (encoder_threads_ != 0)
+			codec_.codec_->set_encoder_pool(new XCodecEncoderPool(encoder_threads_));
+		if (coalesce_ != -1)
+			codec_.codec_->set_coalesce(coalesce_);
+		codec_.codec_->set_credit(credit_frames_, credit_bytes_);
+		if (push_)
+			codec_.codec_->set_eviction_log(new XCodecEvictionLog());
 		break;
 	}
 	case WANProxyConfigCodecNone:
@@ -84,6 +164,38 @@ WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co)
 			ERROR("/wanproxy/config/codec") << "Cannot configure a cache with a codec other than XCodec.";
 			return (false);
 		}
+		if (window_ != -1) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure a window with a codec other than XCodec.";
+			return (false);
+		}
+		if (chunking_ != WANProxyConfigChunkingExhaustive) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure chunking with a codec other than XCodec.";
+			return (false);
+		}
+		if (encoder_threads_ != 0) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure encoder threads with a codec other than XCodec.";
+			return (false);
+		}
+		if (coalesce_ != -1) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure coalescing with a codec other than XCodec.";
+			return (false);
+		}
+		if (passes_ != -1 || pass_cache_ != NULL) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure passes with a codec other than XCodec.";
+			return (false);
+		}
+		if (credit_frames_ != 0 || credit_bytes_ != 0) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure credit with a codec other than XCodec.";
+			return (false);
+		}
+		if (legacy_) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure legacy mode with a codec other than XCodec.";
+			return (false);
+		}
+		if (push_) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure pushing with a codec other than XCodec.";
+			return (false);
+		}
 		codec_.codec_ = NULL;
 		break;
 	default:
@@ -91,31 +203,148 @@ WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co)
 		return (false);
 	}
 
-	switch (compressor_) {
-	case WANProxyConfigCompressorZlib:
-		if (compressor_level_ < 0 || compressor_level_ > 9) {
-			ERROR("/wanproxy/config/codec") << "Compressor level must be in range 0..9 (inclusive.)";
-			return (false);
-		}
-
-		codec_.compressor_ = true;
-		codec_.compressor_level_ = compressor_level_;
-		break;
-	case WANProxyConfigCompressorNone:
+	if (compressor_ == WANProxyConfigCompressorNone) {
 		if (compressor_level_ != -1) {
 			ERROR("/wanproxy/config/codec") << "Compressor level set but no compressor.";
 			return (false);
 		}
+		if (compressor_dictionary_ != "") {
+			ERROR("/wanproxy/config/codec") << "Compressor dictionary set but no compressor.";
+			return (false);
+		}
 
 		codec_.compressor_ = false;
 		codec_.compressor_level_ = 0;
-		break;
-	default:
-		ERROR("/wanproxy/config/codec") << "Invalid compressor type.";
-		return (false);
+	} else {
+		CompressorType compressor_type;
+		switch (compressor_) {
+		case WANProxyConfigCompressorZlib:
+			compressor_type = CompressorZlib;
+			break;
+		case WANProxyConfigCompressorLZ4:
+			compressor_type = CompressorLZ4;
+			break;
+		case WANProxyConfigCompressorZstd:
+			compressor_type = CompressorZstd;
+			break;
+		default:
+			ERROR("/wanproxy/config/codec") << "Invalid compressor type.";
+			return (false);
+		}
+
+		if (!Compressor::available(compressor_type)) {
+			ERROR("/wanproxy/config/codec") << "Compressor " << Compressor::name(compressor_type) << " was not built in.";
+			return (false);
+		}
+
+		if (compressor_level_ < Compressor::level_min(compressor_type) ||
+		    compressor_level_ > Compressor::level_max(compressor_type)) {
+			ERROR("/wanproxy/config/codec") << "Compressor level must be in range " << Compressor::level_min(compressor_type) << ".." << Compressor::level_max(compressor_type) << " (inclusive.)";
+			return (false);
+		}
+
+		if (compressor_dictionary_ != "") {
+			if (!Compressor::dictionary(compressor_type)) {
+				ERROR("/wanproxy/config/codec") << "Cannot configure a dictionary for compressor " << Compressor::name(compressor_type) << ".";
+				return (false);
+			}
+
+			Buffer *dictionary = codec_dictionary(compressor_dictionary_);
+			if (dictionary == NULL)
+				return (false);
+			codec_.compressor_dictionary_ = dictionary;
+		}
+
+		codec_.compressor_ = true;
+		codec_.compressor_type_ = compressor_type;
+		codec_.compressor_level_ = compressor_level_;
+	}
+
+	if (flush_interval_ != -1) {
+		if (codec_.codec_ == NULL && !codec_.compressor_) {
+			ERROR("/wanproxy/config/codec") << "Cannot configure a flush interval without a codec or compressor.";
+			return (false);
+		}
+		if (flush_interval_ < 0 || flush_interval_ > 1000) {
+			ERROR("/wanproxy/config/codec") << "Flush interval must be in range 0..1000 milliseconds (inclusive.)";
+			return (false);
+		}
+		codec_.flush_interval_ = flush_interval_;
 	}
 
 	codec_.track_statistics_ = track_statistics_;
 
 	return (true);
 }
+
+/*
+ * Find the cache named by a codec's configuration, or if none is named, fall
+ * back to the old behaviour of generating an unlimited memory cache, and make
+ * it the cache for its UUID.
+ */
+static XCodecCache *
+codec_cache(ConfigObject *co)
+{
+	XCodecCache *xcache;
+	if (co != NULL) {
+		WANProxyConfigClassCache::Instance *cache =
+			dynamic_cast<WANProxyConfigClassCache::Instance *>(co->instance_);
+		if (cache == NULL) {
+			ERROR("/wanproxy/config/codec") << "Codec cache not properly specified.";
+			return (NULL);
+		}
+		if (cache->cache_ == NULL) {
+			ERROR("/wanproxy/config/codec") << "Cache must be activated prior to use in configuration.";
+			return (NULL);
+		}
+		xcache = cache->cache_;
+	} else {
+		UUID uuid;
+
+		uuid.generate();
+		xcache = new XCodecMemoryCache(uuid);
+	}
+
+	const UUID& uuid = xcache->get_uuid();
+	XCodecCache *oxcache = XCodecCache::lookup(uuid);
+	if (oxcache != NULL) {
+		if (oxcache != xcache)
+			INFO("/wanproxy/config/codec") << "Codec instance cache has a different UUID to shared cache associated with same UUID.";
+	} else {
+		XCodecCache::enter(uuid, xcache);
+	}
+	return (xcache);
+}
+
+/*
+ * Read a compressor dictionary, which is shared by every pipe using the codec
+ * and must be the same at both ends of a connection.
+ */
+static Buffer *
+codec_dictionary(const std::string& path)
+{
+	FILE *file = fopen(path.c_str(), "r");
+	if (file == NULL) {
+		ERROR("/wanproxy/config/codec") << "Could not open compressor dictionary: " << path;
+		return (NULL);
+	}
+
+	Buffer *dictionary = new Buffer();
+	for (;;) {
+		uint8_t data[65536];
+		size_t len = fread(data, 1, sizeof data, file);
+		if (len == 0)
+			break;
+		dictionary->append(data, len);
+	}
+
+	if (ferror(file) || dictionary->empty()) {
+		ERROR("/wanproxy/config/codec") << "Could not read compressor dictionary: " << path;
+		fclose(file);
+		delete dictionary;
+		return (NULL);
+	}
+	fclose(file);
+
+	return (dictionary);
+}
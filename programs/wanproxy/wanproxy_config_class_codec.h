@@ -30,9 +30,12 @@
 #include <config/config_type_pointer.h>
 #include <config/config_type_int.h>
 #include <config/config_type_size.h>
+#include <config/config_type_string.h>
 
 #include "wanproxy_codec.h"
+#include "wanproxy_config_type_chunking.h"
 #include "wanproxy_config_type_codec.h"
+#include "wanproxy_config_type_codec_statistics.h"
 #include "wanproxy_config_type_compressor.h"
 
 class WANProxyConfigClassCodec : public ConfigClass {
@@ -42,8 +45,20 @@ public:
 		WANProxyConfigCodec codec_type_;
 		WANProxyConfigCompressor compressor_;
 		intmax_t compressor_level_;
+		std::string compressor_dictionary_;
 
 		ConfigObject *cache_;
+		intmax_t window_;
+		intmax_t passes_;
+		ConfigObject *pass_cache_;
+		WANProxyConfigChunking chunking_;
+		intmax_t encoder_threads_;
+		intmax_t coalesce_;
+		intmax_t flush_interval_;
+		intmax_t credit_frames_;
+		intmax_t credit_bytes_;
+		bool legacy_;
+		bool push_;
 
 		bool track_statistics_;
 
@@ -57,7 +72,19 @@ public:
 		  codec_type_(WANProxyConfigCodecNone),
 		  compressor_(WANProxyConfigCompressorNone),
 		  compressor_level_(-1),
+		  compressor_dictionary_(""),
 		  cache_(NULL),
+		  window_(-1),
+		  passes_(-1),
+		  pass_cache_(NULL),
+		  chunking_(WANProxyConfigChunkingExhaustive),
+		  encoder_threads_(0),
+		  coalesce_(-1),
+		  flush_interval_(-1),
+		  credit_frames_(0),
+		  credit_bytes_(0),
+		  legacy_(false),
+		  push_(false),
 		  track_statistics_(false),
 		  outgoing_to_codec_bytes_(0),
 		  codec_to_outgoing_bytes_(0),
@@ -79,8 +106,20 @@ public:
 		add_member("codec", &wanproxy_config_type_codec, &Instance::codec_type_);
 		add_member("compressor", &wanproxy_config_type_compressor, &Instance::compressor_);
 		add_member("compressor_level", &config_type_int, &Instance::compressor_level_);
+		add_member("compressor_dictionary", &config_type_string, &Instance::compressor_dictionary_);
 
 		add_member("cache", &config_type_pointer, &Instance::cache_);
+		add_member("window", &config_type_int, &Instance::window_);
+		add_member("passes", &config_type_int, &Instance::passes_);
+		add_member("pass_cache", &config_type_pointer, &Instance::pass_cache_);
+		add_member("chunking", &wanproxy_config_type_chunking, &Instance::chunking_);
+		add_member("encoder_threads", &config_type_int, &Instance::encoder_threads_);
+		add_member("coalesce", &config_type_int, &Instance::coalesce_);
+		add_member("flush_interval", &config_type_int, &Instance::flush_interval_);
+		add_member("credit_frames", &config_type_int, &Instance::credit_frames_);
+		add_member("credit_bytes", &config_type_size, &Instance::credit_bytes_);
+		add_member("legacy", &config_type_boolean, &Instance::legacy_);
+		add_member("push", &config_type_boolean, &Instance::push_);
 
 		add_member("track_statistics", &config_type_boolean, &Instance::track_statistics_);
 
@@ -88,6 +127,8 @@ public:
 		add_member("codec_to_outgoing_bytes", &config_type_size, &Instance::codec_to_outgoing_bytes_);
 		add_member("incoming_to_codec_bytes", &config_type_size, &Instance::incoming_to_codec_bytes_);
 		add_member("codec_to_incoming_bytes", &config_type_size, &Instance::codec_to_incoming_bytes_);
+
+		add_member("statistics", &wanproxy_config_type_codec_statistics, &Instance::codec_);
 	}
 
 	~WANProxyConfigClassCodec()
@@ -53,8 +53,27 @@ WANProxyConfigClassMonitor::Instance::activate(const ConfigObject *co)
 
 	if (interface->host_ == "" || interface->port_ == "")
 		return (false);
+
+	unsigned max_requests = HTTP_SERVER_MAX_REQUESTS;
+	if (max_requests_ != -1) {
+		if (max_requests_ < 1 || max_requests_ > 65536) {
+			ERROR("/wanproxy/config/monitor") << "Requests per connection must be in range 1..65536 (inclusive.)";
+			return (false);
+		}
+		max_requests = max_requests_;
+	}
+
+	unsigned idle_timeout = HTTP_SERVER_IDLE_TIMEOUT;
+	if (idle_timeout_ != -1) {
+		if (idle_timeout_ < 1 || idle_timeout_ > 3600000) {
+			ERROR("/wanproxy/config/monitor") << "Idle timeout must be in range 1..3600000 milliseconds (inclusive.)";
+			return (false);
+		}
+		idle_timeout = idle_timeout_;
+	}
+
 	std::string interface_address = '[' + interface->host_ + ']' + ':' + interface->port_;
-	new HTTPServer<TCPServer, MonitorClient, Config *>(co->config_, SocketImplOS, interface->family_, interface_address);
+	new HTTPServer<TCPServer, MonitorClient, MonitorConfig>(MonitorConfig(co->config_, max_requests, idle_timeout), SocketImplOS, interface->family_, interface_address);
 
 	return (true);
 }
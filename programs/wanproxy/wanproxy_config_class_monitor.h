@@ -26,6 +26,7 @@
 #ifndef	PROGRAMS_WANPROXY_WANPROXY_CONFIG_CLASS_MONITOR_H
 #define	PROGRAMS_WANPROXY_WANPROXY_CONFIG_CLASS_MONITOR_H
 
+#include <config/config_type_int.h>
 #include <config/config_type_pointer.h>
 
 class MonitorListener;
@@ -33,9 +34,13 @@ class MonitorListener;
 class WANProxyConfigClassMonitor : public ConfigClass {
 	struct Instance : public ConfigClassInstance {
 		ConfigObject *interface_;
+		intmax_t max_requests_;
+		intmax_t idle_timeout_;
 
 		Instance(void)
-		: interface_(NULL)
+		: interface_(NULL),
+		  max_requests_(-1),
+		  idle_timeout_(-1)
 		{ }
 
 		bool activate(const ConfigObject *);
@@ -45,6 +50,8 @@ public:
 	: ConfigClass("monitor", new ConstructorFactory<ConfigClassInstance, Instance>)
 	{
 		add_member("interface", &config_type_pointer, &Instance::interface_);
+		add_member("max_requests", &config_type_int, &Instance::max_requests_);
+		add_member("idle_timeout", &config_type_int, &Instance::idle_timeout_);
 	}
 
 	/* XXX So wrong.  */
@@ -33,6 +33,7 @@
 
 #include <io/socket/socket_types.h>
 
+#include <ssh/ssh_moduli.h>
 #include <ssh/ssh_session.h>
 
 #include "proxy_listener.h"
@@ -105,6 +106,21 @@ WANProxyConfigClassProxy::Instance::activate(const ConfigObject *co)
 			return (false);
 		ssh_config = new SSHProxyConfig;
 		ssh_config->server_host_key_ = server_host_key;
+
+		/*
+		 * Without a moduli file, the built-in groups are used.
+		 */
+		if (moduli_ != "") {
+			SSH::Moduli *moduli = new SSH::Moduli();
+			if (!moduli->load(moduli_)) {
+				delete moduli;
+				delete ssh_config;
+				return (false);
+			}
+			ssh_config->moduli_ = moduli;
+		}
+	} else if (moduli_ != "") {
+		return (false);
 	}
 
 	std::string interface_address = '[' + interface->host_ + ']' + ':' + interface->port_;
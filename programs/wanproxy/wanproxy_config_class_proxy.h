@@ -41,6 +41,7 @@ class WANProxyConfigClassProxy : public ConfigClass {
 		ConfigObject *peer_;
 		ConfigObject *peer_codec_;
 		std::string server_host_key_;
+		std::string moduli_;
 
 		Instance(void)
 		: type_(WANProxyConfigProxyTypeTCPTCP),
@@ -48,7 +49,8 @@ class WANProxyConfigClassProxy : public ConfigClass {
 		  interface_codec_(NULL),
 		  peer_(NULL),
 		  peer_codec_(NULL),
-		  server_host_key_("")
+		  server_host_key_(""),
+		  moduli_("")
 		{ }
 
 		bool activate(const ConfigObject *);
@@ -63,6 +65,7 @@ public:
 		add_member("peer", &config_type_pointer, &Instance::peer_);
 		add_member("peer_codec", &config_type_pointer, &Instance::peer_codec_);
 		add_member("server_host_key", &config_type_string, &Instance::server_host_key_);
+		add_member("moduli", &config_type_string, &Instance::moduli_);
 	}
 
 	/* XXX So wrong.  */
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sstream>
+
+#include <common/buffer.h>
+
+#include <config/config_exporter.h>
+
+#include <xcodec/xcodec.h>
+
+#include "wanproxy_codec.h"
+#include "wanproxy_config_type_codec_statistics.h"
+
+WANProxyConfigTypeCodecStatistics wanproxy_config_type_codec_statistics;
+
+void
+WANProxyConfigTypeCodecStatistics::marshall(ConfigExporter *exp, const WANProxyCodec *codec) const
+{
+	if (codec->codec_ == NULL && !codec->compressor_) {
+		exp->value(this, "None");
+		return;
+	}
+
+	std::ostringstream os;
+
+	if (codec->codec_ != NULL) {
+		XCodec::Statistics stats = codec->codec_->statistics();
+		std::vector<XCodec::PipeStatistics>::const_iterator it;
+		unsigned interactive = 0, bulk = 0;
+
+		for (it = stats.pipes_.begin(); it != stats.pipes_.end(); ++it) {
+			if (it->bulk_)
+				bulk++;
+			else
+				interactive++;
+		}
+
+		os << interactive << " interactive connections (" << stats.interactive_frames_ << " frames), ";
+		os << bulk << " bulk connections (" << stats.bulk_frames_ << " frames)";
+		for (it = stats.pipes_.begin(); it != stats.pipes_.end(); ++it) {
+			os << "; connection " << it->id_ << ": ";
+			os << (it->bulk_ ? "bulk" : "interactive") << " (" << it->frames_ << " frames)";
+		}
+		if (codec->compressor_)
+			os << "; ";
+	}
+
+	if (codec->compressor_) {
+		const CompressorStatistics *stats = &codec->compressor_statistics_;
+
+		os << stats->compressed_bytes_ << " bytes compressed, ";
+		os << stats->bypassed_bytes_ << " bytes sent uncompressed";
+	}
+
+	exp->value(this, os.str());
+}
+
+bool
+WANProxyConfigTypeCodecStatistics::set(ConfigObject *, const std::string&, WANProxyCodec *)
+{
+	ERROR("/wanproxy/config/type/codec/statistics") << "Codec statistics may not be set.";
+	return (false);
+}
@@ -30,7 +30,9 @@
 
 enum WANProxyConfigCompressor {
 	WANProxyConfigCompressorNone,
-	WANProxyConfigCompressorZlib
+	WANProxyConfigCompressorZlib,
+	WANProxyConfigCompressorLZ4,
+	WANProxyConfigCompressorZstd
 };
 
 typedef ConfigTypeEnum<WANProxyConfigCompressor> WANProxyConfigTypeCompressor;
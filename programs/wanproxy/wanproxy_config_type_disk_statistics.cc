@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sstream>
+
+#include <common/buffer.h>
+
+#include <config/config_exporter.h>
+
+#include <xcodec/xcodec.h>
+#include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_cache_disk.h>
+
+#include "wanproxy_config_type_disk_statistics.h"
+
+WANProxyConfigTypeDiskStatistics wanproxy_config_type_disk_statistics;
+
+void
+WANProxyConfigTypeDiskStatistics::marshall(ConfigExporter *exp, XCodecDisk *const *diskp) const
+{
+	XCodecDisk *disk = *diskp;
+	if (disk == NULL) {
+		exp->value(this, "None");
+		return;
+	}
+
+	std::vector<XCodecDisk::Statistics> stats = disk->statistics();
+	std::vector<XCodecDisk::Statistics>::const_iterator it;
+	std::ostringstream os;
+
+	for (it = stats.begin(); it != stats.end(); ++it) {
+		if (it != stats.begin())
+			os << "; ";
+		os << it->path_ << (it->direct_ ? " (direct)" : "") << ": ";
+		os << it->reads_ << " reads (" << it->read_errors_ << " errors), ";
+		os << it->writes_ << " writes (" << it->write_errors_ << " errors), ";
+		os << it->writes_pending_ << " writes pending, ";
+		os << it->stored_segments_ << " segments stored in " << it->stored_bytes_ << " bytes";
+	}
+
+	exp->value(this, os.str());
+}
+
+bool
+WANProxyConfigTypeDiskStatistics::set(ConfigObject *, const std::string&, XCodecDisk **)
+{
+	ERROR("/wanproxy/config/type/disk/statistics") << "Disk statistics may not be set.";
+	return (false);
+}
@@ -163,10 +163,7 @@ private:
 		}
 		close(fd);
 
-		Buffer headers;
-		headers << "Content-length: " << data.length() << "\r\n";
-
-		pipe_->send_response(HTTPProtocol::OK, &data, &headers);
+		pipe_->send_response(HTTPProtocol::OK, &data, NULL);
 	}
 
 	void handle_directory(const std::string& uri_base, const std::string& directory)
@@ -219,7 +216,6 @@ private:
 		closedir(dir);
 
 		Buffer headers;
-		headers << "Content-length: " << data.length() << "\r\n";
 		headers << "Content-type: text/html\r\n";
 
 		pipe_->send_response(HTTPProtocol::OK, &data, &headers);
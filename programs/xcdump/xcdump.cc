@@ -39,6 +39,8 @@
 #include <common/limits.h>
 
 #include <xcodec/xcodec.h>
+#include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_chunk.h>
 #include <xcodec/xcodec_hash.h>
 
 static int dump_verbosity;
@@ -148,16 +150,22 @@ dump(int ifd, int ofd)
 				input.skip(sizeof XCODEC_MAGIC + sizeof op);
 				continue;
 			case XCODEC_OP_EXTRACT:
-				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + XCODEC_SEGMENT_LENGTH)
+			case XCODEC_OP_EXTRACT_GENERATION:
+				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + (op == XCODEC_OP_EXTRACT_GENERATION ? sizeof (uint8_t) : 0) + XCODEC_SEGMENT_LENGTH)
 					break;
 				else {
-					input.skip(sizeof XCODEC_MAGIC + sizeof op);
+					uint8_t generation = 0;
+					if (op == XCODEC_OP_EXTRACT_GENERATION) {
+						input.moveout(&generation, sizeof XCODEC_MAGIC + sizeof op, sizeof generation);
+					} else {
+						input.skip(sizeof XCODEC_MAGIC + sizeof op);
+					}
 
 					BufferSegment *seg;
 					input.copyout(&seg, XCODEC_SEGMENT_LENGTH);
 					input.skip(XCODEC_SEGMENT_LENGTH);
 
-					uint64_t hash = XCodecHash::hash(seg->data());
+					uint64_t hash = XCODEC_NAME(XCodecHash::hash(seg->data()), generation);
 
 					bprintf(&output, "<hash-declare");
 					if (dump_verbosity > 0) {
@@ -187,6 +195,74 @@ dump(int ifd, int ofd)
 					bprintf(&output, "/>\n");
 				}
 				continue;
+			case XCODEC_OP_REF_PEER:
+				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint64_t))
+					break;
+				else {
+					uint64_t behash;
+					input.moveout(&behash, sizeof XCODEC_MAGIC + sizeof op);
+					uint64_t hash = BigEndian::decode(behash);
+
+					bprintf(&output, "<peer-hash-reference");
+					if (dump_verbosity > 0)
+						bprintf(&output, " hash=\"0x%016jx\"", (uintmax_t)hash);
+					bprintf(&output, "/>\n");
+				}
+				continue;
+			case XCODEC_OP_EXTRACT_CHUNK:
+				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t) + sizeof (uint16_t))
+					break;
+				else {
+					uint8_t generation;
+					uint16_t belength;
+					input.copyout(&generation, sizeof XCODEC_MAGIC + sizeof op, sizeof generation);
+					input.extract(&belength, sizeof XCODEC_MAGIC + sizeof op + sizeof generation);
+					size_t length = BigEndian::decode(belength);
+					if (length < XCODEC_CHUNK_MIN || length > XCODEC_CHUNK_MAX) {
+						ERROR("/dump") << "Invalid chunk length " << length << ".";
+						return;
+					}
+
+					size_t header = sizeof XCODEC_MAGIC + sizeof op + sizeof generation + sizeof belength;
+					if (input.length() < header + length)
+						break;
+
+					uint8_t data[XCODEC_CHUNK_MAX];
+					input.copyout(data, header, length);
+					input.skip(header + length);
+
+					bprintf(&output, "<chunk-declare");
+					if (dump_verbosity > 0) {
+						XCodecChunk chunk;
+						chunk.make(data, length);
+						uint64_t hash = XCODEC_NAME(chunk.hash(), generation);
+
+						bprintf(&output, " hash=\"0x%016jx\" length=\"%u\"", (uintmax_t)hash, (unsigned)length);
+						if (dump_verbosity > 1) {
+							bprintf(&output, " data=\"");
+							bhexdump(&output, data, length);
+							bprintf(&output, "\"");
+						}
+					}
+					bprintf(&output, "/>\n");
+				}
+				continue;
+			case XCODEC_OP_REF_CHUNK:
+				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint64_t) + sizeof (uint16_t))
+					break;
+				else {
+					uint64_t behash;
+					uint16_t belength;
+					input.moveout(&behash, sizeof XCODEC_MAGIC + sizeof op);
+					input.moveout(&belength);
+					uint64_t hash = BigEndian::decode(behash);
+
+					bprintf(&output, "<chunk-reference");
+					if (dump_verbosity > 0)
+						bprintf(&output, " hash=\"0x%016jx\" length=\"%u\"", (uintmax_t)hash, (unsigned)BigEndian::decode(belength));
+					bprintf(&output, "/>\n");
+				}
+				continue;
 			case XCODEC_OP_BACKREF:
 				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t))
 					break;
@@ -200,6 +276,50 @@ dump(int ifd, int ofd)
 					bprintf(&output, "/>\n");
 				}
 				continue;
+			case XCODEC_OP_BACKREF16:
+				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t))
+					break;
+				else {
+					uint16_t beidx;
+					input.moveout(&beidx, sizeof XCODEC_MAGIC + sizeof op);
+					uint16_t idx = BigEndian::decode(beidx);
+
+					bprintf(&output, "<back-reference");
+					if (dump_verbosity > 0)
+						bprintf(&output, " offset=\"%u\"", (unsigned)idx);
+					bprintf(&output, "/>\n");
+				}
+				continue;
+			case XCODEC_OP_RUN:
+				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t) + sizeof (uint16_t))
+					break;
+				else {
+					uint8_t ch;
+					uint16_t berun;
+					input.skip(sizeof XCODEC_MAGIC + sizeof op);
+					input.moveout(&ch, sizeof ch);
+					input.moveout(&berun);
+
+					bprintf(&output, "<run");
+					if (dump_verbosity > 0)
+						bprintf(&output, " byte=\"0x%02x\" length=\"%u\"", (unsigned)ch, (unsigned)BigEndian::decode(berun));
+					bprintf(&output, "/>\n");
+				}
+				continue;
+			case XCODEC_OP_REPEAT:
+				if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t) + sizeof (uint16_t))
+					break;
+				else {
+					uint16_t bedistance, berepeat;
+					input.moveout(&bedistance, sizeof XCODEC_MAGIC + sizeof op);
+					input.moveout(&berepeat);
+
+					bprintf(&output, "<repeat");
+					if (dump_verbosity > 0)
+						bprintf(&output, " distance=\"%u\" length=\"%u\"", (unsigned)BigEndian::decode(bedistance), (unsigned)BigEndian::decode(berepeat));
+					bprintf(&output, "/>\n");
+				}
+				continue;
 			default:
 				ERROR("/dump") << "Unsupported XCodec opcode " << (unsigned)op << ".";
 				return;
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2013 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <common/buffer.h>
+#include <common/thread/mutex.h>
+#include <common/timer/timer.h>
+
+#include <event/event_callback.h>
+#include <event/event_main.h>
+#include <event/event_system.h>
+
+#include <io/pipe/pipe.h>
+#include <io/pipe/pipe_producer.h>
+#include <io/pipe/pipe_splice.h>
+
+#include <ssh/ssh_algorithm_negotiation.h>
+#include <ssh/ssh_compression.h>
+#include <ssh/ssh_encryption.h>
+#include <ssh/ssh_key_exchange.h>
+#include <ssh/ssh_mac.h>
+#include <ssh/ssh_server_host_key.h>
+#include <ssh/ssh_session.h>
+#include <ssh/ssh_transport_pipe.h>
+
+/*
+ * Performs SSH handshakes between a client and a server connected by
+ * PipeSplices, one at a time, with each key exchange method we have, and
+ * reports the handshakes per second of each.  A handshake is done when both
+ * sides have finished key exchange, and so includes signing and verifying
+ * the exchange hash with the server's host key.
+ */
+
+#define	BENCH_HANDSHAKES	100
+
+static const char *key_exchanges[] = {
+	"curve25519-sha256",
+	"diffie-hellman-group-exchange-sha256",
+	"diffie-hellman-group-exchange-sha1",
+};
+
+class Handshake {
+	LogHandle log_;
+	Mutex mtx_;
+	SSH::Session client_session_;
+	SSH::Session server_session_;
+	SSH::TransportPipe *client_pipe_;
+	SSH::TransportPipe *server_pipe_;
+	PipeSplice *client_splice_;
+	PipeSplice *server_splice_;
+	BufferEventCallback::Method<Handshake> receive_complete_;
+	Action *client_receive_action_;
+	Action *server_receive_action_;
+	EventCallback::Method<Handshake> splice_complete_;
+	Action *client_splice_action_;
+	Action *server_splice_action_;
+	SimpleCallback::Method<Handshake> client_ready_complete_;
+	Action *client_ready_action_;
+	SimpleCallback::Method<Handshake> server_ready_complete_;
+	Action *server_ready_action_;
+	unsigned ready_;
+	SimpleCallback *callback_;
+	Action *callback_action_;
+public:
+	Handshake(const std::string& key_exchange, SSH::ServerHostKey *server_host_key, SimpleCallback *cb)
+	: log_("/ssh/example/kex/bench1/handshake"),
+	  mtx_("Handshake"),
+	  client_session_(SSH::ClientRole),
+	  server_session_(SSH::ServerRole),
+	  client_pipe_(NULL),
+	  server_pipe_(NULL),
+	  client_splice_(NULL),
+	  server_splice_(NULL),
+	  receive_complete_(NULL, &mtx_, this, &Handshake::receive_complete),
+	  client_receive_action_(NULL),
+	  server_receive_action_(NULL),
+	  splice_complete_(NULL, &mtx_, this, &Handshake::splice_complete),
+	  client_splice_action_(NULL),
+	  server_splice_action_(NULL),
+	  client_ready_complete_(NULL, &mtx_, this, &Handshake::client_ready_complete),
+	  client_ready_action_(NULL),
+	  server_ready_complete_(NULL, &mtx_, this, &Handshake::server_ready_complete),
+	  server_ready_action_(NULL),
+	  ready_(0),
+	  callback_(cb),
+	  callback_action_(NULL)
+	{
+		/*
+		 * The client offers only the method being measured.
+		 */
+		client_session_.algorithm_negotiation_ = new SSH::AlgorithmNegotiation(&client_session_);
+		client_session_.algorithm_negotiation_->add_algorithm(SSH::KeyExchange::algorithm(&client_session_, key_exchange));
+		SSH::ServerHostKey::add_client_algorithms(&client_session_);
+		SSH::Encryption::add_algorithms(&client_session_);
+		SSH::MAC::add_algorithms(&client_session_);
+		client_session_.algorithm_negotiation_->add_algorithm(SSH::Compression::none());
+
+		server_session_.algorithm_negotiation_ = new SSH::AlgorithmNegotiation(&server_session_);
+		server_session_.algorithm_negotiation_->add_algorithm(server_host_key);
+		server_session_.algorithm_negotiation_->add_algorithms();
+
+		client_pipe_ = new SSH::TransportPipe(&client_session_);
+		server_pipe_ = new SSH::TransportPipe(&server_session_);
+
+		client_splice_ = new PipeSplice(client_pipe_, server_pipe_);
+		server_splice_ = new PipeSplice(server_pipe_, client_pipe_);
+
+		ScopedLock _(&mtx_);
+		client_receive_action_ = client_pipe_->receive(&receive_complete_);
+		server_receive_action_ = server_pipe_->receive(&receive_complete_);
+		client_ready_action_ = client_pipe_->ready(&client_ready_complete_);
+		server_ready_action_ = server_pipe_->ready(&server_ready_complete_);
+		client_splice_action_ = client_splice_->start(&splice_complete_);
+		server_splice_action_ = server_splice_->start(&splice_complete_);
+	}
+
+	~Handshake()
+	{
+		ScopedLock _(&mtx_);
+		ASSERT_NULL(log_, client_ready_action_);
+		ASSERT_NULL(log_, server_ready_action_);
+		if (callback_action_ != NULL) {
+			callback_action_->cancel();
+			callback_action_ = NULL;
+		}
+
+		client_receive_action_->cancel();
+		client_receive_action_ = NULL;
+		server_receive_action_->cancel();
+		server_receive_action_ = NULL;
+
+		client_splice_action_->cancel();
+		client_splice_action_ = NULL;
+		server_splice_action_->cancel();
+		server_splice_action_ = NULL;
+
+		delete client_splice_;
+		client_splice_ = NULL;
+		delete server_splice_;
+		server_splice_ = NULL;
+
+		delete client_pipe_;
+		client_pipe_ = NULL;
+		delete server_pipe_;
+		server_pipe_ = NULL;
+
+		delete client_session_.algorithm_negotiation_;
+		client_session_.algorithm_negotiation_ = NULL;
+		delete server_session_.algorithm_negotiation_;
+		server_session_.algorithm_negotiation_ = NULL;
+	}
+
+private:
+	/*
+	 * Nothing but key exchange is expected.
+	 */
+	void receive_complete(Event e, Buffer)
+	{
+		HALT(log_) << "Unexpected packet: " << e;
+	}
+
+	void splice_complete(Event e)
+	{
+		HALT(log_) << "Handshake failed: " << e;
+	}
+
+	void client_ready_complete(void)
+	{
+		client_ready_action_->cancel();
+		client_ready_action_ = NULL;
+
+		ready();
+	}
+
+	void server_ready_complete(void)
+	{
+		server_ready_action_->cancel();
+		server_ready_action_ = NULL;
+
+		ready();
+	}
+
+	void ready(void)
+	{
+		if (++ready_ != 2)
+			return;
+		callback_action_ = callback_->schedule();
+	}
+};
+
+class KeyExchangeBench {
+	LogHandle log_;
+	Mutex mtx_;
+	SSH::ServerHostKey *server_host_key_;
+	unsigned handshakes_;
+	unsigned method_;
+	unsigned count_;
+	Handshake *handshake_;
+	SimpleCallback::Method<KeyExchangeBench> handshake_complete_;
+	Timer timer_;
+public:
+	KeyExchangeBench(SSH::ServerHostKey *server_host_key, unsigned handshakes)
+	: log_("/ssh/example/kex/bench1"),
+	  mtx_("KeyExchangeBench"),
+	  server_host_key_(server_host_key),
+	  handshakes_(handshakes),
+	  method_(0),
+	  count_(0),
+	  handshake_(NULL),
+	  handshake_complete_(NULL, &mtx_, this, &KeyExchangeBench::handshake_complete),
+	  timer_()
+	{
+		ScopedLock _(&mtx_);
+		start();
+	}
+
+	~KeyExchangeBench()
+	{
+		ASSERT_NULL(log_, handshake_);
+	}
+
+private:
+	void start(void)
+	{
+		for (;;) {
+			if (method_ == sizeof key_exchanges / sizeof key_exchanges[0]) {
+				EventSystem::instance()->stop();
+				return;
+			}
+			if (count_ == 0) {
+				SSH::KeyExchange *key_exchange = SSH::KeyExchange::algorithm(NULL, key_exchanges[method_]);
+				if (key_exchange == NULL) {
+					INFO(log_) << key_exchanges[method_] << ": not available.";
+					method_++;
+					continue;
+				}
+				delete key_exchange;
+
+				timer_.reset();
+				timer_.start();
+			}
+			break;
+		}
+
+		handshake_ = new Handshake(key_exchanges[method_], server_host_key_, &handshake_complete_);
+	}
+
+	void handshake_complete(void)
+	{
+		delete handshake_;
+		handshake_ = NULL;
+
+		if (++count_ != handshakes_) {
+			start();
+			return;
+		}
+		timer_.stop();
+
+		uintmax_t usec = timer_.sample();
+		if (usec == 0)
+			usec = 1;
+		INFO(log_) << key_exchanges[method_] << ": " << (count_ * 1000000.0 / usec) << " handshakes/s";
+
+		method_++;
+		count_ = 0;
+		start();
+	}
+};
+
+static void usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	std::string keyfile("ssh-server1.pem");
+	unsigned handshakes;
+	int ch;
+
+	handshakes = BENCH_HANDSHAKES;
+
+	while ((ch = getopt(argc, argv, "?k:n:")) != -1) {
+		switch (ch) {
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'n':
+			handshakes = strtoul(optarg, NULL, 0);
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0 || handshakes == 0)
+		usage();
+
+	SSH::ServerHostKey *server_host_key = SSH::ServerHostKey::server(SSH::ServerRole, keyfile);
+	if (server_host_key == NULL)
+		HALT("/ssh/example/kex/bench1") << "Could not open server host key: " << keyfile;
+
+	KeyExchangeBench *bench = new KeyExchangeBench(server_host_key, handshakes);
+
+	event_main();
+
+	delete bench;
+	delete server_host_key;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: ssh-kex-bench1 [-k server-host-key] [-n handshakes]\n");
+	exit(1);
+}
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2013 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <common/buffer.h>
+#include <common/thread/mutex.h>
+#include <common/timer/timer.h>
+
+#include <event/event_callback.h>
+#include <event/event_main.h>
+#include <event/event_system.h>
+
+#include <io/pipe/pipe.h>
+#include <io/pipe/pipe_producer.h>
+#include <io/pipe/pipe_splice.h>
+
+#include <ssh/ssh_algorithm_negotiation.h>
+#include <ssh/ssh_encryption.h>
+#include <ssh/ssh_mac.h>
+#include <ssh/ssh_server_host_key.h>
+#include <ssh/ssh_session.h>
+#include <ssh/ssh_transport_pipe.h>
+
+
+/*
+ * Sends packets from an SSH client to a server connected by PipeSplices,
+ * after they have finished key exchange with whatever algorithms they
+ * choose by default, and reports the packets and bytes per second of each
+ * workload.  Interactive packets carry a few bytes each, and so show what
+ * each packet costs; bulk packets carry as much as every implementation
+ * must accept, and so show what each byte costs.  Packets are sent in
+ * batches of about BENCH_BATCH_BYTES, and each batch must all be received
+ * before the next is sent.
+ */
+
+#define	BENCH_BATCH_BYTES	(1024 * 1024)
+
+/*
+ * A message number from the range for local extensions.
+ */
+#define	BENCH_MESSAGE		(0xff)
+
+struct Workload {
+	const char *name_;
+	size_t payload_;
+	unsigned packets_;
+};
+
+static const Workload workloads[] = {
+	{ "interactive",	64,	200000 },
+	{ "bulk",		32768,	4000 },
+};
+
+class PacketBench {
+	LogHandle log_;
+	Mutex mtx_;
+	SSH::Session client_session_;
+	SSH::Session server_session_;
+	SSH::TransportPipe *client_pipe_;
+	SSH::TransportPipe *server_pipe_;
+	PipeSplice *client_splice_;
+	PipeSplice *server_splice_;
+	BufferEventCallback::Method<PacketBench> client_receive_complete_;
+	Action *client_receive_action_;
+	BufferEventCallback::Method<PacketBench> server_receive_complete_;
+	Action *server_receive_action_;
+	EventCallback::Method<PacketBench> splice_complete_;
+	Action *client_splice_action_;
+	Action *server_splice_action_;
+	SimpleCallback::Method<PacketBench> client_ready_complete_;
+	Action *client_ready_action_;
+	SimpleCallback::Method<PacketBench> server_ready_complete_;
+	Action *server_ready_action_;
+	unsigned ready_;
+	unsigned workload_;
+	unsigned sent_;
+	unsigned received_;
+	uintmax_t bytes_;
+	Timer timer_;
+public:
+	PacketBench(SSH::ServerHostKey *server_host_key)
+	: log_("/ssh/example/packet/bench1"),
+	  mtx_("PacketBench"),
+	  client_session_(SSH::ClientRole),
+	  server_session_(SSH::ServerRole),
+	  client_pipe_(NULL),
+	  server_pipe_(NULL),
+	  client_splice_(NULL),
+	  server_splice_(NULL),
+	  client_receive_complete_(NULL, &mtx_, this, &PacketBench::client_receive_complete),
+	  client_receive_action_(NULL),
+	  server_receive_complete_(NULL, &mtx_, this, &PacketBench::server_receive_complete),
+	  server_receive_action_(NULL),
+	  splice_complete_(NULL, &mtx_, this, &PacketBench::splice_complete),
+	  client_splice_action_(NULL),
+	  server_splice_action_(NULL),
+	  client_ready_complete_(NULL, &mtx_, this, &PacketBench::client_ready_complete),
+	  client_ready_action_(NULL),
+	  server_ready_complete_(NULL, &mtx_, this, &PacketBench::server_ready_complete),
+	  server_ready_action_(NULL),
+	  ready_(0),
+	  workload_(0),
+	  sent_(0),
+	  received_(0),
+	  bytes_(0),
+	  timer_()
+	{
+		client_session_.algorithm_negotiation_ = new SSH::AlgorithmNegotiation(&client_session_);
+		client_session_.algorithm_negotiation_->add_algorithms();
+
+		server_session_.algorithm_negotiation_ = new SSH::AlgorithmNegotiation(&server_session_);
+		server_session_.algorithm_negotiation_->add_algorithm(server_host_key);
+		server_session_.algorithm_negotiation_->add_algorithms();
+
+		client_pipe_ = new SSH::TransportPipe(&client_session_);
+		server_pipe_ = new SSH::TransportPipe(&server_session_);
+
+		client_splice_ = new PipeSplice(client_pipe_, server_pipe_);
+		server_splice_ = new PipeSplice(server_pipe_, client_pipe_);
+
+		ScopedLock _(&mtx_);
+		client_receive_action_ = client_pipe_->receive(&client_receive_complete_);
+		server_receive_action_ = server_pipe_->receive(&server_receive_complete_);
+		client_ready_action_ = client_pipe_->ready(&client_ready_complete_);
+		server_ready_action_ = server_pipe_->ready(&server_ready_complete_);
+		client_splice_action_ = client_splice_->start(&splice_complete_);
+		server_splice_action_ = server_splice_->start(&splice_complete_);
+	}
+
+	~PacketBench()
+	{
+		ScopedLock _(&mtx_);
+		ASSERT_NULL(log_, client_ready_action_);
+		ASSERT_NULL(log_, server_ready_action_);
+
+		client_receive_action_->cancel();
+		client_receive_action_ = NULL;
+		if (server_receive_action_ != NULL) {
+			server_receive_action_->cancel();
+			server_receive_action_ = NULL;
+		}
+
+		client_splice_action_->cancel();
+		client_splice_action_ = NULL;
+		server_splice_action_->cancel();
+		server_splice_action_ = NULL;
+
+		delete client_splice_;
+		client_splice_ = NULL;
+		delete server_splice_;
+		server_splice_ = NULL;
+
+		delete client_pipe_;
+		client_pipe_ = NULL;
+		delete server_pipe_;
+		server_pipe_ = NULL;
+
+		delete client_session_.algorithm_negotiation_;
+		client_session_.algorithm_negotiation_ = NULL;
+		delete server_session_.algorithm_negotiation_;
+		server_session_.algorithm_negotiation_ = NULL;
+	}
+
+private:
+	/*
+	 * Nothing is sent to the client once key exchange is done.
+	 */
+	void client_receive_complete(Event e, Buffer)
+	{
+		HALT(log_) << "Unexpected packet: " << e;
+	}
+
+	void server_receive_complete(Event e, Buffer packet)
+	{
+		server_receive_action_->cancel();
+		server_receive_action_ = NULL;
+
+		if (e.type_ != Event::Done)
+			HALT(log_) << "Unexpected event: " << e;
+		if (packet.peek() != BENCH_MESSAGE)
+			HALT(log_) << "Unexpected message: " << (unsigned)packet.peek();
+
+		received_++;
+		bytes_ += packet.length();
+
+		server_receive_action_ = server_pipe_->receive(&server_receive_complete_);
+
+		if (received_ != sent_)
+			return;
+
+		if (sent_ != workloads[workload_].packets_) {
+			send();
+			return;
+		}
+		timer_.stop();
+
+		uintmax_t usec = timer_.sample();
+		if (usec == 0)
+			usec = 1;
+		INFO(log_) << workloads[workload_].name_ << ": " <<
+			(received_ * 1000000.0 / usec) << " packets/s, " <<
+			(bytes_ / (double)usec) << " MB/s";
+
+		workload_++;
+		start();
+	}
+
+	void splice_complete(Event e)
+	{
+		HALT(log_) << "Splice failed: " << e;
+	}
+
+	void client_ready_complete(void)
+	{
+		client_ready_action_->cancel();
+		client_ready_action_ = NULL;
+
+		ready();
+	}
+
+	void server_ready_complete(void)
+	{
+		server_ready_action_->cancel();
+		server_ready_action_ = NULL;
+
+		ready();
+	}
+
+	void ready(void)
+	{
+		if (++ready_ != 2)
+			return;
+
+		/*
+		 * Neither side sends NEWKEYS yet, but once both are ready
+		 * nothing is in flight, so both may switch to the new keys.
+		 */
+		client_session_.activate_chosen();
+		server_session_.activate_chosen();
+
+		const SSH::Encryption *encryption = client_session_.active_algorithms_.local_to_remote_->encryption_;
+		const SSH::MAC *mac = client_session_.active_algorithms_.local_to_remote_->mac_;
+		if (encryption == NULL)
+			INFO(log_) << "Sending without encryption.";
+		else if (encryption->tag_size() != 0)
+			INFO(log_) << "Sending with " << encryption->name() << ".";
+		else
+			INFO(log_) << "Sending with " << encryption->name() << " and " <<
+				(mac == NULL ? "none" : mac->name()) << ".";
+
+		start();
+	}
+
+	void start(void)
+	{
+		if (workload_ == sizeof workloads / sizeof workloads[0]) {
+			EventSystem::instance()->stop();
+			return;
+		}
+
+		sent_ = 0;
+		received_ = 0;
+		bytes_ = 0;
+
+		timer_.reset();
+		timer_.start();
+
+		send();
+	}
+
+	void send(void)
+	{
+		const Workload *w = &workloads[workload_];
+		Buffer payload;
+
+		payload.append((uint8_t)BENCH_MESSAGE);
+		while (payload.length() != w->payload_) {
+			static uint8_t zero[BUFFER_SEGMENT_SIZE];
+			size_t len = std::min(sizeof zero, w->payload_ - payload.length());
+			payload.append(zero, len);
+		}
+
+		unsigned batch = BENCH_BATCH_BYTES / w->payload_;
+		if (batch == 0)
+			batch = 1;
+		while (batch-- != 0 && sent_ != w->packets_) {
+			Buffer packet(payload);
+			client_pipe_->send(&packet);
+			sent_++;
+		}
+	}
+};
+
+static void usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	std::string keyfile("ssh-server1.pem");
+	int ch;
+
+	while ((ch = getopt(argc, argv, "?k:")) != -1) {
+		switch (ch) {
+		case 'k':
+			keyfile = optarg;
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage();
+
+	SSH::ServerHostKey *server_host_key = SSH::ServerHostKey::server(SSH::ServerRole, keyfile);
+	if (server_host_key == NULL)
+		HALT("/ssh/example/packet/bench1") << "Could not open server host key: " << keyfile;
+
+	PacketBench *bench = new PacketBench(server_host_key);
+
+	event_main();
+
+	delete bench;
+	delete server_host_key;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: ssh-packet-bench1 [-k server-host-key]\n");
+	exit(1);
+}
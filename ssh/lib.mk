@@ -9,4 +9,7 @@ SRCS+=	ssh_compression.cc
 SRCS+=	ssh_encryption.cc
 SRCS+=	ssh_key_exchange.cc
 SRCS+=	ssh_mac.cc
+SRCS+=	ssh_moduli.cc
 SRCS+=	ssh_server_host_key.cc
+
+LDADD+=	-lz
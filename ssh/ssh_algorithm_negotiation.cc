@@ -123,7 +123,7 @@ SSH::AlgorithmNegotiation::add_algorithms(void)
 		SSH::ServerHostKey::add_client_algorithms(session_);
 	SSH::Encryption::add_algorithms(session_);
 	SSH::MAC::add_algorithms(session_);
-	add_algorithm(SSH::Compression::none());
+	SSH::Compression::add_algorithms(session_);
 	/* XXX Add languages?  */
 }
 
@@ -23,15 +23,20 @@
  * SUCH DAMAGE.
  */
 
+#include <zlib.h>
+
+#include <common/buffer.h>
+
+#include <ssh/ssh_algorithm_negotiation.h>
 #include <ssh/ssh_compression.h>
+#include <ssh/ssh_protocol.h>
+#include <ssh/ssh_session.h>
 
 namespace {
 	class NoneCompression : public SSH::Compression {
-		LogHandle log_;
 	public:
 		NoneCompression(void)
-		: SSH::Compression("none"),
-		  log_("/ssh/compression/none")
+		: SSH::Compression("none")
 		{ }
 
 		~NoneCompression()
@@ -42,14 +47,218 @@ namespace {
 			return (new NoneCompression(*this));
 		}
 
-		bool input(Buffer *)
+		bool compress(Buffer *)
+		{
+			return (true);
+		}
+
+		bool decompress(Buffer *)
+		{
+			return (true);
+		}
+	};
+
+	/*
+	 * Payloads are deflated into one stream per direction, each flushed
+	 * to a byte boundary so that it may be inflated on its own, as in
+	 * RFC 4253 and OpenSSH.  Output goes straight into BufferSegments, as
+	 * in DeflatePipe and InflatePipe.
+	 */
+	class ZlibCompression : public SSH::Compression {
+		LogHandle log_;
+		z_stream stream_;
+		enum { Idle, Deflating, Inflating } state_;
+		BufferSegment *outseg_;
+	public:
+		ZlibCompression(const std::string& xname, bool xdelayed)
+		: SSH::Compression(xname, xdelayed),
+		  log_("/ssh/compression/" + xname),
+		  stream_(),
+		  state_(Idle),
+		  outseg_(NULL)
+		{
+			stream_.zalloc = Z_NULL;
+			stream_.zfree = Z_NULL;
+			stream_.opaque = Z_NULL;
+		}
+
+		~ZlibCompression()
+		{
+			if (outseg_ != NULL) {
+				outseg_->unref();
+				outseg_ = NULL;
+			}
+
+			switch (state_) {
+			case Idle:
+				break;
+			case Deflating:
+				deflateEnd(&stream_);
+				break;
+			case Inflating:
+				inflateEnd(&stream_);
+				break;
+			}
+		}
+
+		Compression *clone(void) const
+		{
+			return (new ZlibCompression(name(), delayed()));
+		}
+
+		bool compress(Buffer *payload)
+		{
+			Buffer out;
+
+			if (state_ == Idle) {
+				if (deflateInit(&stream_, Z_DEFAULT_COMPRESSION) != Z_OK) {
+					ERROR(log_) << "Could not initialize deflate stream.";
+					return (false);
+				}
+				state_ = Deflating;
+			}
+			ASSERT(log_, state_ == Deflating);
+
+			while (!payload->empty()) {
+				Buffer::SegmentIterator iter = payload->segments();
+				const BufferSegment *seg = *iter;
+				bool last = seg->length() == payload->length();
+
+				stream_.avail_in = seg->length();
+				stream_.next_in = (Bytef *)(uintptr_t)seg->data();
+
+				if (!deflate_run(last ? Z_PARTIAL_FLUSH : Z_NO_FLUSH, &out))
+					return (false);
+
+				payload->skip(seg->length());
+			}
+			out.moveout(payload);
+
+			return (true);
+		}
+
+		bool decompress(Buffer *payload)
 		{
-			ERROR(log_) << "Not yet implemented.";
-			return (false);
+			Buffer out;
+
+			if (state_ == Idle) {
+				stream_.avail_in = 0;
+				stream_.next_in = Z_NULL;
+				if (inflateInit(&stream_) != Z_OK) {
+					ERROR(log_) << "Could not initialize inflate stream.";
+					return (false);
+				}
+				state_ = Inflating;
+			}
+			ASSERT(log_, state_ == Inflating);
+
+			while (!payload->empty()) {
+				Buffer::SegmentIterator iter = payload->segments();
+				const BufferSegment *seg = *iter;
+
+				stream_.avail_in = seg->length();
+				stream_.next_in = (Bytef *)(uintptr_t)seg->data();
+
+				if (!inflate_run(&out))
+					return (false);
+
+				payload->skip(seg->length());
+			}
+			out.moveout(payload);
+
+			return (true);
+		}
+
+	private:
+		void output_prepare(void)
+		{
+			if (outseg_ == NULL)
+				outseg_ = BufferSegment::create();
+			stream_.next_out = outseg_->head();
+			stream_.avail_out = BUFFER_SEGMENT_SIZE;
+		}
+
+		void output_collect(Buffer *out)
+		{
+			size_t outlen = BUFFER_SEGMENT_SIZE - stream_.avail_out;
+			if (outlen == 0)
+				return;
+
+			outseg_->set_length(outlen);
+			out->append(outseg_);
+			outseg_->unref();
+			outseg_ = NULL;
+		}
+
+		bool deflate_run(int flush, Buffer *out)
+		{
+			for (;;) {
+				output_prepare();
+				int error = deflate(&stream_, flush);
+				output_collect(out);
+				if (error == Z_STREAM_ERROR) {
+					ERROR(log_) << "deflate(): " << zError(error);
+					return (false);
+				}
+				if (stream_.avail_out != 0) {
+					ASSERT(log_, stream_.avail_in == 0);
+					return (true);
+				}
+			}
+		}
+
+		/*
+		 * A payload may inflate to no more than SSH_PACKET_MAX bytes,
+		 * so that a small packet cannot make us hold an unbounded
+		 * amount of data.
+		 */
+		bool inflate_run(Buffer *out)
+		{
+			for (;;) {
+				output_prepare();
+				int error = inflate(&stream_, Z_SYNC_FLUSH);
+				output_collect(out);
+				if (out->length() > SSH_PACKET_MAX) {
+					ERROR(log_) << "Payload inflates to more than " << SSH_PACKET_MAX << " bytes.";
+					return (false);
+				}
+				switch (error) {
+				case Z_OK:
+				case Z_BUF_ERROR:
+					if (stream_.avail_out == 0)
+						break;
+					if (stream_.avail_in != 0) {
+						ERROR(log_) << "inflate() left input unconsumed.";
+						return (false);
+					}
+					return (true);
+				default:
+					/*
+					 * The stream is never ended, so even
+					 * Z_STREAM_END is an error.
+					 */
+					ERROR(log_) << "inflate(): " << zError(error);
+					return (false);
+				}
+			}
 		}
 	};
 }
 
+void
+SSH::Compression::add_algorithms(Session *session)
+{
+	session->algorithm_negotiation_->add_algorithm(new ZlibCompression("zlib@openssh.com", true));
+	session->algorithm_negotiation_->add_algorithm(zlib());
+	session->algorithm_negotiation_->add_algorithm(none());
+}
+
+SSH::Compression *
+SSH::Compression::zlib(void)
+{
+	return (new ZlibCompression("zlib", false));
+}
+
 SSH::Compression *
 SSH::Compression::none(void)
 {
@@ -29,11 +29,15 @@
 class Buffer;
 
 namespace SSH {
+	struct Session;
+
 	class Compression {
 		std::string name_;
+		bool delayed_;
 	protected:
-		Compression(const std::string& xname)
-		: name_(xname)
+		Compression(const std::string& xname, bool xdelayed = false)
+		: name_(xname),
+		  delayed_(xdelayed)
 		{ }
 
 	public:
@@ -45,11 +49,28 @@ namespace SSH {
 			return (name_);
 		}
 
+		/*
+		 * A delayed compression leaves payloads as they are until user
+		 * authentication has succeeded.
+		 */
+		bool delayed(void) const
+		{
+			return (delayed_);
+		}
+
 		virtual Compression *clone(void) const = 0;
 
-		virtual bool input(Buffer *) = 0;
+		/*
+		 * Compresses a payload to be sent, or decompresses one received,
+		 * in place.  Each instance is used in only one direction, and
+		 * the stream runs on from one payload to the next.
+		 */
+		virtual bool compress(Buffer *) = 0;
+		virtual bool decompress(Buffer *) = 0;
 
+		static void add_algorithms(Session *);
 		static Compression *none(void);
+		static Compression *zlib(void);
 	};
 }
 
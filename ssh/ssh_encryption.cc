@@ -24,9 +24,14 @@
  */
 
 #include <common/buffer.h>
+#include <common/endian.h>
+
+#include <crypto/crypto_mac.h>
+#include <crypto/crypto_system.h>
 
 #include <ssh/ssh_algorithm_negotiation.h>
 #include <ssh/ssh_encryption.h>
+#include <ssh/ssh_protocol.h>
 #include <ssh/ssh_session.h>
 
 namespace {
@@ -36,7 +41,14 @@ namespace {
 		CryptoEncryption::Mode crypto_mode_;
 	};
 
+	/*
+	 * The AEAD ciphers come first, as they cost the least per byte, and
+	 * so are chosen whenever the peer has them.
+	 */
 	static const struct ssh_encryption_algorithm ssh_encryption_algorithms[] = {
+		{ "aes128-gcm@openssh.com",	CryptoEncryption::AES128,	CryptoEncryption::GCM	},
+		{ "aes256-gcm@openssh.com",	CryptoEncryption::AES256,	CryptoEncryption::GCM	},
+		{ "chacha20-poly1305@openssh.com", CryptoEncryption::ChaCha20,	CryptoEncryption::Stream},
 		{ "aes128-ctr",		CryptoEncryption::AES128,	CryptoEncryption::CTR	},
 		{ "aes128-cbc",		CryptoEncryption::AES128,	CryptoEncryption::CBC	},
 		{ "aes192-ctr",		CryptoEncryption::AES192,	CryptoEncryption::CTR	},
@@ -53,6 +65,8 @@ namespace {
 		{ NULL,			CryptoEncryption::AES128,	CryptoEncryption::CBC	}
 	};
 
+	static uint8_t zero_block[64];
+
 	class CryptoSSHEncryption : public SSH::Encryption {
 		LogHandle log_;
 		CryptoEncryption::Session *session_;
@@ -85,7 +99,261 @@ namespace {
 			in->clear();
 			return (true);
 		}
+
+		Action *submit(Buffer *in, BufferEventCallback *cb)
+		{
+			return (session_->submit(in, cb));
+		}
+	};
+	/*
+	 * An AEAD cipher from the crypto layer, such as AES-GCM, used as in
+	 * RFC 5647 and by OpenSSH: the packet length is associated data.
+	 */
+	class CryptoSSHAEADEncryption : public SSH::Encryption {
+		LogHandle log_;
+		CryptoEncryption::Session *session_;
+	public:
+		CryptoSSHAEADEncryption(const std::string& xname, CryptoEncryption::Session *session)
+		: SSH::Encryption(xname, session->block_size(), session->key_size(), session->iv_size(), session->tag_size()),
+		  log_("/ssh/encryption/crypto/" + xname),
+		  session_(session)
+		{ }
+
+		~CryptoSSHAEADEncryption()
+		{ }
+
+		Encryption *clone(void) const
+		{
+			return (new CryptoSSHAEADEncryption(name_, session_->clone()));
+		}
+
+		bool initialize(CryptoEncryption::Operation operation, const Buffer *key, const Buffer *iv)
+		{
+			return (session_->initialize(operation, key, iv));
+		}
+
+		bool cipher(Buffer *, Buffer *in)
+		{
+			in->clear();
+			return (false);
+		}
+
+		Action *submit(Buffer *in, BufferEventCallback *cb)
+		{
+			return (SSH::Encryption::seal(0, in, cb));
+		}
+
+		bool packet_length(uint32_t, const Buffer *in, uint32_t *lenp)
+		{
+			if (in->length() < sizeof *lenp)
+				return (false);
+			BigEndian::extract(lenp, in);
+			return (true);
+		}
+
+		Action *open(uint32_t, Buffer *in, BufferEventCallback *cb)
+		{
+			return (session_->submit_aead(in, sizeof (uint32_t), cb));
+		}
+
+		Action *seal(uint32_t, Buffer *in, BufferEventCallback *cb)
+		{
+			return (session_->submit_aead(in, sizeof (uint32_t), cb));
+		}
+	};
+
+	/*
+	 * chacha20-poly1305@openssh.com, as described in OpenSSH's
+	 * PROTOCOL.chacha20poly1305.  The key is two ChaCha20 keys: the
+	 * second ciphers the packet length and the first the rest of the
+	 * packet, each with the sequence number as nonce.  The first 32
+	 * bytes of the main keystream key Poly1305, which authenticates the
+	 * whole ciphered packet, and the packet is ciphered with the rest of
+	 * the keystream from its second 64-byte block on.
+	 */
+	class ChaCha20Poly1305SSHEncryption : public SSH::Encryption {
+		LogHandle log_;
+		CryptoEncryption::Session *header_;
+		CryptoEncryption::Session *main_;
+		CryptoMAC::Instance *poly1305_;
+		Buffer header_key_;
+		Buffer main_key_;
+		CryptoThread *thread_;
+	public:
+		ChaCha20Poly1305SSHEncryption(const std::string& xname, CryptoEncryption::Session *header, CryptoEncryption::Session *main, CryptoMAC::Instance *poly1305)
+		: SSH::Encryption(xname, 8, 64, 0, 16),
+		  log_("/ssh/encryption/chacha20-poly1305"),
+		  header_(header),
+		  main_(main),
+		  poly1305_(poly1305),
+		  header_key_(),
+		  main_key_(),
+		  thread_(NULL)
+		{ }
+
+		~ChaCha20Poly1305SSHEncryption()
+		{
+			delete header_;
+			delete main_;
+			delete poly1305_;
+		}
+
+		Encryption *clone(void) const
+		{
+			return (new ChaCha20Poly1305SSHEncryption(name_, header_->clone(), main_->clone(), poly1305_->clone()));
+		}
+
+		bool initialize(CryptoEncryption::Operation, const Buffer *key, const Buffer *)
+		{
+			if (key->length() != key_size_)
+				return (false);
+			Buffer keys(*key);
+			main_key_.clear();
+			header_key_.clear();
+			keys.moveout(&main_key_, 32);
+			keys.moveout(&header_key_);
+			return (true);
+		}
+
+		bool cipher(Buffer *, Buffer *in)
+		{
+			in->clear();
+			return (false);
+		}
+
+		Action *submit(Buffer *in, BufferEventCallback *cb)
+		{
+			return (SSH::Encryption::seal(0, in, cb));
+		}
+
+		bool packet_length(uint32_t seq, const Buffer *in, uint32_t *lenp)
+		{
+			if (in->length() < sizeof *lenp)
+				return (false);
+
+			Buffer length, ciphertext(*in, sizeof *lenp);
+			if (!start(header_, &header_key_, seq) || !header_->cipher(&length, &ciphertext))
+				return (false);
+			BigEndian::extract(lenp, &length);
+			return (true);
+		}
+
+		/*
+		 * The sequence number is passed to the CryptoThread ahead of
+		 * the packet, as it is for a MAC.
+		 */
+		Action *open(uint32_t seq, Buffer *in, BufferEventCallback *cb)
+		{
+			Buffer packet;
+			SSH::UInt32::encode(&packet, seq);
+			in->moveout(&packet);
+
+			if (thread_ == NULL)
+				thread_ = CryptoSystem::instance()->thread();
+			return (thread_->schedule(new CryptoOperation::Method<ChaCha20Poly1305SSHEncryption, Buffer>(&packet, cb, this, &ChaCha20Poly1305SSHEncryption::open_packet)));
+		}
+
+		Action *seal(uint32_t seq, Buffer *in, BufferEventCallback *cb)
+		{
+			Buffer packet;
+			SSH::UInt32::encode(&packet, seq);
+			in->moveout(&packet);
+
+			if (thread_ == NULL)
+				thread_ = CryptoSystem::instance()->thread();
+			return (thread_->schedule(new CryptoOperation::Method<ChaCha20Poly1305SSHEncryption, Buffer>(&packet, cb, this, &ChaCha20Poly1305SSHEncryption::seal_packet)));
+		}
+
+	private:
+		bool open_packet(Buffer *out, Buffer *in)
+		{
+			uint32_t seq;
+			if (!SSH::UInt32::decode(&seq, in)) {
+				in->clear();
+				return (false);
+			}
+
+			if (in->length() < sizeof (uint32_t) + tag_size_) {
+				in->clear();
+				return (false);
+			}
+
+			uint8_t tagdata[tag_size_];
+			in->copyout(tagdata, in->length() - tag_size_, tag_size_);
+			in->trim(tag_size_);
+
+			Buffer tag(tagdata, tag_size_), expected;
+			if (!authenticator(seq) || !poly1305_->mac(&expected, in) ||
+			    !expected.equal(&tag)) {
+				in->clear();
+				return (false);
+			}
+
+			Buffer length;
+			in->moveout(&length, sizeof (uint32_t));
+			if (!start(header_, &header_key_, seq) || !header_->cipher(out, &length)) {
+				in->clear();
+				return (false);
+			}
+			return (main_->cipher(out, in));
+		}
+
+		bool seal_packet(Buffer *out, Buffer *in)
+		{
+			uint32_t seq;
+			if (!SSH::UInt32::decode(&seq, in) || in->length() < sizeof seq) {
+				in->clear();
+				return (false);
+			}
+
+			Buffer packet, length;
+			in->moveout(&length, sizeof seq);
+			if (!start(header_, &header_key_, seq) || !header_->cipher(&packet, &length) ||
+			    !authenticator(seq) || !main_->cipher(&packet, in)) {
+				in->clear();
+				return (false);
+			}
+
+			Buffer tag;
+			if (!poly1305_->mac(&tag, &packet))
+				return (false);
+			out->append(packet);
+			out->append(tag);
+			return (true);
+		}
+
+		/*
+		 * Start a ChaCha20 keystream at block zero with the sequence
+		 * number as nonce.  OpenSSL takes a 32-bit little-endian block
+		 * counter and a 96-bit nonce, which, for the first 2^32 blocks,
+		 * is the same as the original 64-bit counter and 64-bit nonce.
+		 */
+		bool start(CryptoEncryption::Session *session, const Buffer *key, uint32_t seq)
+		{
+			Buffer iv;
+			iv.append(zero_block, 12);
+			SSH::UInt32::encode(&iv, seq);
+			return (session->initialize(CryptoEncryption::Encrypt, key, &iv));
+		}
+
+		/*
+		 * Key Poly1305 with the first 32 bytes of the main keystream,
+		 * leaving the keystream at its second block.
+		 */
+		bool authenticator(uint32_t seq)
+		{
+			if (!start(main_, &main_key_, seq))
+				return (false);
+
+			Buffer zero(zero_block, sizeof zero_block);
+			Buffer block;
+			if (!main_->cipher(&block, &zero))
+				return (false);
+			block.trim(32);
+			return (poly1305_->initialize(&block));
+		}
 	};
+
 }
 
 void
@@ -121,6 +389,17 @@ SSH::Encryption::cipher(CryptoEncryption::Cipher cipher)
 			ERROR("/ssh/encryption") << "Could not get session for cipher: " << cipher;
 			return (NULL);
 		}
+		if (cipher.first == CryptoEncryption::ChaCha20) {
+			const CryptoMAC::Method *mac_method = CryptoMAC::Method::method(CryptoMAC::Poly1305);
+			if (mac_method == NULL) {
+				DEBUG("/ssh/encryption") << "Could not get method for Poly1305.";
+				delete session;
+				return (NULL);
+			}
+			return (new ChaCha20Poly1305SSHEncryption(alg->rfc4250_name_, session, session->clone(), mac_method->instance(CryptoMAC::Poly1305)));
+		}
+		if (session->tag_size() != 0)
+			return (new CryptoSSHAEADEncryption(alg->rfc4250_name_, session));
 		return (new CryptoSSHEncryption(alg->rfc4250_name_, session));
 	}
 	DEBUG("/ssh/encryption") << "No SSH encryption support is available for cipher: " << cipher;
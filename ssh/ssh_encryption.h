@@ -37,12 +37,14 @@ namespace SSH {
 		const unsigned block_size_;
 		const unsigned key_size_;
 		const unsigned iv_size_;
+		const unsigned tag_size_;
 
-		Encryption(const std::string& xname, unsigned xblock_size, unsigned xkey_size, unsigned xiv_size)
+		Encryption(const std::string& xname, unsigned xblock_size, unsigned xkey_size, unsigned xiv_size, unsigned xtag_size = 0)
 		: name_(xname),
 		  block_size_(xblock_size),
 		  key_size_(xkey_size),
-		  iv_size_(xiv_size)
+		  iv_size_(xiv_size),
+		  tag_size_(xtag_size)
 		{ }
 
 	public:
@@ -64,6 +66,16 @@ namespace SSH {
 			return (iv_size_);
 		}
 
+		/*
+		 * An AEAD cipher authenticates each packet itself, with a tag
+		 * of this length in place of the MAC, which is not used.  For
+		 * other ciphers, zero.
+		 */
+		unsigned tag_size(void) const
+		{
+			return (tag_size_);
+		}
+
 		std::string name(void) const
 		{
 			return (name_);
@@ -73,6 +85,39 @@ namespace SSH {
 
 		virtual bool initialize(CryptoEncryption::Operation, const Buffer *, const Buffer *) = 0;
 		virtual bool cipher(Buffer *, Buffer *) = 0;
+		virtual Action *submit(Buffer *, BufferEventCallback *) = 0;
+
+		/*
+		 * AEAD ciphers work a whole packet at a time, given its
+		 * sequence number.  The packet length is left out of the main
+		 * cipher, so that the length may be had from the first four
+		 * bytes of a packet before the rest of it is in hand.
+		 * Padding is to the block size, not counting the length.
+		 *
+		 * open deciphers a packet and its tag, which are consumed,
+		 * and passes the packet to the callback, or fails if the tag
+		 * does not match; seal ciphers a packet, which is consumed,
+		 * and passes it and its tag to the callback.  Both are done
+		 * by a CryptoThread.
+		 */
+		virtual bool packet_length(uint32_t, const Buffer *, uint32_t *)
+		{
+			return (false);
+		}
+
+		virtual Action *open(uint32_t, Buffer *in, BufferEventCallback *cb)
+		{
+			in->clear();
+			cb->param(Event::Error, Buffer());
+			return (cb->schedule());
+		}
+
+		virtual Action *seal(uint32_t, Buffer *in, BufferEventCallback *cb)
+		{
+			in->clear();
+			cb->param(Event::Error, Buffer());
+			return (cb->schedule());
+		}
 
 		static void add_algorithms(Session *);
 		static Encryption *cipher(CryptoEncryption::Cipher);
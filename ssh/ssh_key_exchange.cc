@@ -25,6 +25,7 @@
 
 #include <openssl/bn.h>
 #include <openssl/dh.h>
+#include <openssl/evp.h>
 
 #include <common/buffer.h>
 #include <common/thread/mutex.h>
@@ -35,37 +36,62 @@
 
 #include <ssh/ssh_algorithm_negotiation.h>
 #include <ssh/ssh_key_exchange.h>
+#include <ssh/ssh_moduli.h>
 #include <ssh/ssh_protocol.h>
 #include <ssh/ssh_server_host_key.h>
 #include <ssh/ssh_session.h>
 #include <ssh/ssh_transport_pipe.h>
 
-#define	DH_GROUP_MIN	1024
+#define	DH_GROUP_MIN	2048
 #define	DH_GROUP_MAX	8192
 
-#define	USE_TEST_GROUP
+#define	CURVE25519_SIZE	32
 
 namespace {
-#ifdef USE_TEST_GROUP
-	static uint8_t test_prime_and_generator[] = {
-		0x00, 0x00, 0x00, 0x81, 0x00, 0xe3, 0x1d, 0xfe, 0x85, 0x59, 0x9b, 0xcb, 0x5c, 0x2b, 0xbe, 0xcf,
-		0x20, 0x1f, 0x5f, 0x49, 0xf1, 0xea, 0x31, 0x07, 0x7d, 0xa9, 0x26, 0xcb, 0x31, 0x03, 0x9d, 0x82,
-		0x33, 0x2f, 0xed, 0x67, 0xa3, 0xa9, 0xb1, 0xc9, 0xe6, 0x34, 0x6c, 0xd7, 0xb5, 0x1a, 0x0a, 0x94,
-		0x11, 0xa7, 0xd9, 0x26, 0xff, 0x0e, 0x8d, 0x72, 0xc1, 0x7b, 0x53, 0x9a, 0x13, 0x78, 0x7e, 0x16,
-		0x38, 0x74, 0x7c, 0xb2, 0xdc, 0x60, 0x2c, 0x8c, 0xe8, 0x31, 0xf8, 0xd9, 0x7b, 0xac, 0xa6, 0x71,
-		0xee, 0x61, 0x0c, 0x1a, 0xa4, 0x2f, 0x47, 0x2f, 0xe2, 0x22, 0xbd, 0x01, 0xe5, 0x25, 0xb6, 0x95,
-		0xda, 0x3f, 0xf7, 0x03, 0xf4, 0x0e, 0xd6, 0x8c, 0xbb, 0x69, 0x1d, 0xcb, 0xd1, 0xe2, 0x60, 0xdb,
-		0xf5, 0x0b, 0x85, 0x98, 0xe6, 0x17, 0xbe, 0x29, 0x4e, 0xa7, 0x90, 0x11, 0xac, 0xbc, 0xa5, 0x3e,
-		0x05, 0xfe, 0xe9, 0x56, 0x93, 0x00, 0x00, 0x00, 0x01, 0x02
-	};
-#endif
-
 	static const uint8_t
 		DiffieHellmanGroupExchangeRequest = 34,
 		DiffieHellmanGroupExchangeGroup = 31,
 		DiffieHellmanGroupExchangeInitialize = 32,
 		DiffieHellmanGroupExchangeReply = 33;
 
+	static const uint8_t
+		EllipticCurveDiffieHellmanInitialize = 30,
+		EllipticCurveDiffieHellmanReply = 31;
+
+	/*
+	 * Computes the exchange hash from the key exchange data particular to
+	 * the method and the shared secret k, and keeps them in the session.
+	 */
+	static bool
+	exchange_hash(SSH::Session *session, CryptoHash::Algorithm hash_algorithm, const Buffer& key_exchange, const BIGNUM *k)
+	{
+		SSH::ServerHostKey *key;
+		Buffer server_public_key;
+		Buffer exchange_hash;
+		Buffer data;
+
+		key = session->chosen_algorithms_.server_host_key_;
+		key->encode_public_key(&server_public_key);
+
+		SSH::String::encode(&data, session->client_version_);
+		SSH::String::encode(&data, session->server_version_);
+		SSH::String::encode(&data, session->client_kexinit_);
+		SSH::String::encode(&data, session->server_kexinit_);
+		SSH::String::encode(&data, server_public_key);
+		data.append(key_exchange);
+		SSH::MPInt::encode(&data, k);
+
+		if (!CryptoHash::hash(hash_algorithm, &exchange_hash, &data))
+			return (false);
+
+		session->exchange_hash_ = exchange_hash;
+		SSH::MPInt::encode(&session->shared_secret_, k);
+		if (session->session_id_.empty())
+			session->session_id_ = exchange_hash;
+
+		return (true);
+	}
+
 	/*
 	 * XXX
 	 * Like a non-trivial amount of other code, this has been
@@ -117,7 +143,7 @@ namespace {
 		{
 			SSH::ServerHostKey *key;
 			uint32_t max, min, n;
-			const BIGNUM *pr, *gr;
+			const SSH::Moduli *moduli;
 			const BIGNUM *er, *fr;
 			BIGNUM *p, *g;
 			BIGNUM *e, *f;
@@ -154,6 +180,18 @@ namespace {
 				else if (n > max)
 					n = max;
 
+				moduli = session_->moduli_;
+				if (moduli == NULL)
+					moduli = SSH::Moduli::defaults();
+				if (!moduli->choose(&group, min, n, max)) {
+					ERROR(log_) << "No group of between " << min << " and " << max << " bits.";
+					return (false);
+				}
+				key_exchange_.append(group);
+
+				packet.append(DiffieHellmanGroupExchangeGroup);
+				packet.append(group);
+
 				/*
 				 * XXX
 				 * Do we want to reuse dh_?
@@ -162,46 +200,25 @@ namespace {
 					DH_free(dh_);
 					dh_ = NULL;
 				}
-#ifdef USE_TEST_GROUP
-				group.append(test_prime_and_generator, sizeof test_prime_and_generator);
 				dh_ = DH_new();
-				SSH::MPInt::decode(&p, &group);
-				SSH::MPInt::decode(&g, &group);
-#if OPENSSL_VERSION_NUMBER < 0x1010006fL
-				dh_->p = p;
-				dh_->g = g;
-#else
-				DH_set0_pqg(dh_, p, NULL, g);
-#endif
-				ASSERT(log_, group.empty());
-#else
-				DEBUG(log_) << "Doing DH_generate_parameters for " << n << " bits.";
-				ASSERT_NULL(log_, dh_);
-				dh_ = DH_generate_parameters(n, 2, NULL, NULL);
 				if (dh_ == NULL) {
-					ERROR(log_) << "DH_generate_parameters failed.";
+					ERROR(log_) << "DH_new failed.";
 					return (false);
 				}
-#endif
-
-#ifdef USE_TEST_GROUP
-				pr = p;
-				gr = g;
-#else
+				if (!SSH::MPInt::decode(&p, &group))
+					return (false);
+				if (!SSH::MPInt::decode(&g, &group)) {
+					BN_free(p);
+					return (false);
+				}
+				ASSERT(log_, group.empty());
 #if OPENSSL_VERSION_NUMBER < 0x1010006fL
-				pr = dh_->p;
-				gr = dh_->p;
+				dh_->p = p;
+				dh_->g = g;
 #else
-				DH_get0_pqg(dh_, &pr, NULL, &gr);
-#endif
+				DH_set0_pqg(dh_, p, NULL, g);
 #endif
 
-				SSH::MPInt::encode(&group, pr);
-				SSH::MPInt::encode(&group, gr);
-				key_exchange_.append(group);
-
-				packet.append(DiffieHellmanGroupExchangeGroup);
-				packet.append(group);
 				pipe->send(&packet);
 				return (true);
 			case DiffieHellmanGroupExchangeGroup:
@@ -228,6 +245,12 @@ namespace {
 					BN_free(p);
 					return (false);
 				}
+				if (BN_num_bits(p) < DH_GROUP_MIN || BN_num_bits(p) > DH_GROUP_MAX) {
+					ERROR(log_) << "Received group of " << BN_num_bits(p) << " bits.";
+					BN_free(p);
+					BN_free(g);
+					return (false);
+				}
 
 #if OPENSSL_VERSION_NUMBER < 0x1010006fL
 				dh_->p = p;
@@ -292,7 +315,7 @@ namespace {
 
 				packet.append(DiffieHellmanGroupExchangeReply);
 				SSH::String::encode(&packet, server_public_key);
-				SSH::MPInt::encode(&packet, f);
+				SSH::MPInt::encode(&packet, fr);
 				SSH::String::encode(&packet, &signature);
 				pipe->send(&packet);
 
@@ -376,11 +399,6 @@ namespace {
 	private:
 		bool exchange_finish(BIGNUM *remote_pubkey)
 		{
-			SSH::ServerHostKey *key;
-			Buffer server_public_key;
-			Buffer exchange_hash;
-			Buffer data;
-
 			ASSERT_NON_NULL(log_, dh_);
 
 			uint8_t secret[DH_size(dh_)];
@@ -391,33 +409,257 @@ namespace {
 			if (k_ == NULL)
 				return (false);
 
-			key = session_->chosen_algorithms_.server_host_key_;
-			key->encode_public_key(&server_public_key);
+			return (exchange_hash(session_, hash_algorithm, key_exchange_, k_));
+		}
+	};
 
-			SSH::String::encode(&data, session_->client_version_);
-			SSH::String::encode(&data, session_->server_version_);
-			SSH::String::encode(&data, session_->client_kexinit_);
-			SSH::String::encode(&data, session_->server_kexinit_);
-			SSH::String::encode(&data, server_public_key);
-			data.append(key_exchange_);
-			SSH::MPInt::encode(&data, k_);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_EC)
+	/*
+	 * Elliptic-curve Diffie-Hellman over Curve25519 as in RFC 8731, which
+	 * needs no group chosen and is much cheaper than group exchange.
+	 */
+	class Curve25519 : public SSH::KeyExchange {
+		LogHandle log_;
+		SSH::Session *session_;
+		EVP_PKEY *key_;
+		Buffer key_exchange_;
+	public:
+		Curve25519(SSH::Session *session, const std::string& key_exchange_name)
+		: SSH::KeyExchange(key_exchange_name),
+		  log_("/ssh/key_exchange/" + key_exchange_name),
+		  session_(session),
+		  key_(NULL),
+		  key_exchange_()
+		{ }
+
+		~Curve25519()
+		{
+			if (key_ != NULL) {
+				EVP_PKEY_free(key_);
+				key_ = NULL;
+			}
+		}
+
+		KeyExchange *clone(void) const
+		{
+			return (new Curve25519(session_, name_));
+		}
 
-			if (!CryptoHash::hash(hash_algorithm, &exchange_hash, &data))
+		bool hash(Buffer *out, const Buffer *in) const
+		{
+			return (CryptoHash::hash(CryptoHash::SHA256, out, in));
+		}
+
+		bool input(SSH::TransportPipe *pipe, Buffer *in)
+		{
+			SSH::ServerHostKey *key;
+			Buffer server_public_key;
+			Buffer signature;
+			Buffer packet;
+			Buffer local;
+			Buffer remote;
+
+			switch (in->peek()) {
+			case EllipticCurveDiffieHellmanInitialize:
+				if (session_->role_ != SSH::ServerRole) {
+					ERROR(log_) << "Received key exchange initialization as client.";
+					return (false);
+				}
+				in->skip(1);
+				if (!SSH::String::decode(&remote, in))
+					return (false);
+				if (!generate(&local))
+					return (false);
+
+				key_exchange_.clear();
+				SSH::String::encode(&key_exchange_, remote);
+				SSH::String::encode(&key_exchange_, local);
+				if (!exchange_finish(&remote)) {
+					ERROR(log_) << "Server key exchange finish failed.";
+					return (false);
+				}
+
+				key = session_->chosen_algorithms_.server_host_key_;
+				if (!key->sign(&signature, &session_->exchange_hash_))
+					return (false);
+				key->encode_public_key(&server_public_key);
+
+				packet.append(EllipticCurveDiffieHellmanReply);
+				SSH::String::encode(&packet, server_public_key);
+				SSH::String::encode(&packet, local);
+				SSH::String::encode(&packet, &signature);
+				pipe->send(&packet);
+
+				pipe->key_exchange_complete();
+				return (true);
+			case EllipticCurveDiffieHellmanReply:
+				if (session_->role_ != SSH::ClientRole) {
+					ERROR(log_) << "Received key exchange reply as server.";
+					return (false);
+				}
+				if (key_ == NULL) {
+					ERROR(log_) << "Received premature key exchange reply.";
+					return (false);
+				}
+				in->skip(1);
+				if (!SSH::String::decode(&server_public_key, in))
+					return (false);
+				if (!SSH::String::decode(&remote, in))
+					return (false);
+				if (!SSH::String::decode(&signature, in))
+					return (false);
+
+				key = session_->chosen_algorithms_.server_host_key_;
+				if (!key->decode_public_key(&server_public_key)) {
+					ERROR(log_) << "Could not decode server public key:" << std::endl << server_public_key.hexdump();
+					return (false);
+				}
+
+				SSH::String::encode(&key_exchange_, remote);
+				if (!exchange_finish(&remote)) {
+					ERROR(log_) << "Client key exchange finish failed.";
+					return (false);
+				}
+
+				if (!key->verify(&signature, &session_->exchange_hash_)) {
+					ERROR(log_) << "Failed to verify exchange hash.";
+					return (false);
+				}
+
+				pipe->key_exchange_complete();
+				return (true);
+			default:
+				ERROR(log_) << "Not yet implemented.";
 				return (false);
+			}
+		}
 
-			session_->exchange_hash_ = exchange_hash;
-			SSH::MPInt::encode(&session_->shared_secret_, k_);
-			if (session_->session_id_.empty())
-				session_->session_id_ = exchange_hash;
+		bool init(Buffer *out)
+		{
+			ASSERT(log_, out->empty());
+			ASSERT(log_, session_->role_ == SSH::ClientRole);
+
+			Buffer local;
+			if (!generate(&local))
+				return (false);
+
+			key_exchange_.clear();
+			SSH::String::encode(&key_exchange_, local);
+
+			out->append(EllipticCurveDiffieHellmanInitialize);
+			SSH::String::encode(out, local);
+
+			return (true);
+		}
+
+	private:
+		/*
+		 * Generates a new private key and appends its public key.
+		 */
+		bool generate(Buffer *out)
+		{
+			EVP_PKEY_CTX *ctx;
+
+			if (key_ != NULL) {
+				EVP_PKEY_free(key_);
+				key_ = NULL;
+			}
+
+			ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+			if (ctx == NULL)
+				return (false);
+			if (EVP_PKEY_keygen_init(ctx) <= 0 ||
+			    EVP_PKEY_keygen(ctx, &key_) <= 0) {
+				ERROR(log_) << "Could not generate key.";
+				EVP_PKEY_CTX_free(ctx);
+				return (false);
+			}
+			EVP_PKEY_CTX_free(ctx);
+
+			uint8_t public_key[CURVE25519_SIZE];
+			size_t public_keylen = sizeof public_key;
+			if (EVP_PKEY_get_raw_public_key(key_, public_key, &public_keylen) <= 0 ||
+			    public_keylen != sizeof public_key)
+				return (false);
+			out->append(public_key, public_keylen);
 
 			return (true);
 		}
+
+		bool exchange_finish(const Buffer *remote)
+		{
+			EVP_PKEY_CTX *ctx;
+			EVP_PKEY *peer;
+			BIGNUM *k;
+			bool ok;
+
+			ASSERT_NON_NULL(log_, key_);
+
+			uint8_t remote_public_key[CURVE25519_SIZE];
+			if (remote->length() != sizeof remote_public_key) {
+				ERROR(log_) << "Public key of peer has wrong length.";
+				return (false);
+			}
+			remote->copyout(remote_public_key, sizeof remote_public_key);
+
+			peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, remote_public_key, sizeof remote_public_key);
+			if (peer == NULL)
+				return (false);
+			ctx = EVP_PKEY_CTX_new(key_, NULL);
+			if (ctx == NULL) {
+				EVP_PKEY_free(peer);
+				return (false);
+			}
+
+			/*
+			 * OpenSSL refuses to derive the all-zero secret which
+			 * small-order points from the peer would give.
+			 */
+			uint8_t secret[CURVE25519_SIZE];
+			size_t secretlen = sizeof secret;
+			ok = EVP_PKEY_derive_init(ctx) > 0 &&
+			     EVP_PKEY_derive_set_peer(ctx, peer) > 0 &&
+			     EVP_PKEY_derive(ctx, secret, &secretlen) > 0;
+			EVP_PKEY_CTX_free(ctx);
+			EVP_PKEY_free(peer);
+			if (!ok) {
+				ERROR(log_) << "Could not derive shared secret.";
+				return (false);
+			}
+
+			k = BN_bin2bn(secret, secretlen, NULL);
+			if (k == NULL)
+				return (false);
+			ok = exchange_hash(session_, CryptoHash::SHA256, key_exchange_, k);
+			BN_clear_free(k);
+
+			return (ok);
+		}
 	};
+#endif
 }
 
 void
 SSH::KeyExchange::add_algorithms(SSH::Session *session)
 {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_EC)
+	session->algorithm_negotiation_->add_algorithm(new Curve25519(session, "curve25519-sha256"));
+	session->algorithm_negotiation_->add_algorithm(new Curve25519(session, "curve25519-sha256@libssh.org"));
+#endif
 	session->algorithm_negotiation_->add_algorithm(new DiffieHellmanGroupExchange<CryptoHash::SHA256>(session, "diffie-hellman-group-exchange-sha256"));
 	session->algorithm_negotiation_->add_algorithm(new DiffieHellmanGroupExchange<CryptoHash::SHA1>(session, "diffie-hellman-group-exchange-sha1"));
 }
+
+SSH::KeyExchange *
+SSH::KeyExchange::algorithm(SSH::Session *session, const std::string& name)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_EC)
+	if (name == "curve25519-sha256" || name == "curve25519-sha256@libssh.org")
+		return (new Curve25519(session, name));
+#endif
+	if (name == "diffie-hellman-group-exchange-sha256")
+		return (new DiffieHellmanGroupExchange<CryptoHash::SHA256>(session, name));
+	if (name == "diffie-hellman-group-exchange-sha1")
+		return (new DiffieHellmanGroupExchange<CryptoHash::SHA1>(session, name));
+	return (NULL);
+}
@@ -58,6 +58,7 @@ namespace SSH {
 		virtual bool init(Buffer *) = 0;
 
 		static void add_algorithms(Session *);
+		static KeyExchange *algorithm(Session *, const std::string&);
 	};
 }
 
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2013 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include <openssl/bn.h>
+
+#include <common/buffer.h>
+
+#include <ssh/ssh_moduli.h>
+#include <ssh/ssh_protocol.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define	BN_get_rfc3526_prime_2048	get_rfc3526_prime_2048
+#define	BN_get_rfc3526_prime_3072	get_rfc3526_prime_3072
+#define	BN_get_rfc3526_prime_4096	get_rfc3526_prime_4096
+#define	BN_get_rfc3526_prime_6144	get_rfc3526_prime_6144
+#define	BN_get_rfc3526_prime_8192	get_rfc3526_prime_8192
+#endif
+
+/*
+ * Fields of a moduli(5) entry.
+ */
+#define	MODULI_TYPE_SAFE	(2)
+#define	MODULI_TESTS_COMPOSITE	(0x01)
+
+namespace {
+	static BIGNUM *(*const rfc3526_primes[])(BIGNUM *) = {
+		BN_get_rfc3526_prime_2048,
+		BN_get_rfc3526_prime_3072,
+		BN_get_rfc3526_prime_4096,
+		BN_get_rfc3526_prime_6144,
+		BN_get_rfc3526_prime_8192,
+	};
+}
+
+SSH::Moduli::Moduli(void)
+: log_("/ssh/moduli"),
+  group_map_()
+{
+	BIGNUM *g = BN_new();
+	if (g == NULL || !BN_set_word(g, 2))
+		HALT(log_) << "Could not create generator.";
+
+	unsigned i;
+	for (i = 0; i < sizeof rfc3526_primes / sizeof rfc3526_primes[0]; i++) {
+		BIGNUM *p = rfc3526_primes[i](NULL);
+		if (p == NULL)
+			HALT(log_) << "Could not create RFC 3526 prime.";
+		enter(p, g);
+		BN_free(p);
+	}
+	BN_free(g);
+}
+
+SSH::Moduli::~Moduli()
+{ }
+
+bool
+SSH::Moduli::load(const std::string& path)
+{
+	std::ifstream in;
+	group_map_t groups;
+
+	in.open(path.c_str());
+	if (!in.good()) {
+		ERROR(log_) << "Could not open moduli file: " << path;
+		return (false);
+	}
+
+	group_map_.swap(groups);
+	while (in.good()) {
+		std::string line;
+		std::getline(in, line);
+
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream is(line);
+		std::string timestamp, modulus;
+		unsigned type, tests, trials, size, generator;
+
+		is >> timestamp >> type >> tests >> trials >> size >> std::hex >> generator >> modulus;
+		if (is.fail()) {
+			ERROR(log_) << "Malformed moduli entry: " << line;
+			continue;
+		}
+
+		/*
+		 * Only safe primes which have passed a primality test are
+		 * of any use.
+		 */
+		if (type != MODULI_TYPE_SAFE || tests == 0 ||
+		    (tests & MODULI_TESTS_COMPOSITE) != 0 || trials == 0)
+			continue;
+
+		BIGNUM *p = NULL;
+		if (BN_hex2bn(&p, modulus.c_str()) == 0) {
+			ERROR(log_) << "Malformed modulus in moduli entry: " << line;
+			continue;
+		}
+		if ((unsigned)BN_num_bits(p) != size + 1) {
+			ERROR(log_) << "Modulus is not of its stated size in moduli entry: " << line;
+			BN_free(p);
+			continue;
+		}
+
+		BIGNUM *g = BN_new();
+		if (g == NULL || !BN_set_word(g, generator)) {
+			BN_free(p);
+			if (g != NULL)
+				BN_free(g);
+			continue;
+		}
+
+		enter(p, g);
+		BN_free(p);
+		BN_free(g);
+	}
+
+	if (group_map_.empty()) {
+		ERROR(log_) << "No usable groups in moduli file: " << path;
+		group_map_.swap(groups);
+		return (false);
+	}
+
+	INFO(log_) << "Loaded " << group_map_.size() << " groups from " << path;
+
+	return (true);
+}
+
+bool
+SSH::Moduli::choose(Buffer *out, unsigned min, unsigned n, unsigned max) const
+{
+	group_map_t::const_iterator it;
+	unsigned bits;
+
+	/*
+	 * The smallest groups at least as large as wanted, else the largest
+	 * allowed.
+	 */
+	it = group_map_.lower_bound(n);
+	if (it != group_map_.end() && it->first <= max) {
+		bits = it->first;
+	} else {
+		it = group_map_.upper_bound(max);
+		if (it == group_map_.begin())
+			return (false);
+		--it;
+		bits = it->first;
+	}
+	if (bits < min)
+		return (false);
+
+	std::pair<group_map_t::const_iterator, group_map_t::const_iterator> range =
+		group_map_.equal_range(bits);
+	size_t count = std::distance(range.first, range.second);
+	it = range.first;
+	std::advance(it, random() % count);
+
+	out->append(it->second);
+
+	return (true);
+}
+
+const SSH::Moduli *
+SSH::Moduli::defaults(void)
+{
+	static Moduli moduli;
+
+	return (&moduli);
+}
+
+void
+SSH::Moduli::enter(const BIGNUM *p, const BIGNUM *g)
+{
+	Buffer group;
+
+	SSH::MPInt::encode(&group, p);
+	SSH::MPInt::encode(&group, g);
+	group_map_.insert(group_map_t::value_type(BN_num_bits(p), group));
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2013 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	SSH_SSH_MODULI_H
+#define	SSH_SSH_MODULI_H
+
+#include <map>
+
+/* XXX OpenSSL dependency.  */
+typedef struct bignum_st BIGNUM;
+
+namespace SSH {
+	/*
+	 * The groups a server offers for Diffie-Hellman group exchange, so
+	 * that none need be generated while a client waits.  They may be read
+	 * from a file in the format of OpenSSH's moduli(5); otherwise the
+	 * MODP groups of RFC 3526 are used.
+	 */
+	class Moduli {
+		typedef std::multimap<unsigned, Buffer> group_map_t;
+
+		LogHandle log_;
+		group_map_t group_map_;	/* Prime and generator as mpints, by size in bits.  */
+	public:
+		Moduli(void);
+		~Moduli();
+
+		/*
+		 * Replaces our groups with the safe primes in the named file.
+		 */
+		bool load(const std::string&);
+
+		/*
+		 * Appends the prime and generator of a group of at least min
+		 * and at most max bits, as close to the wanted size as we have.
+		 * Groups of the same size are chosen among at random.
+		 */
+		bool choose(Buffer *, unsigned, unsigned, unsigned) const;
+
+		static const Moduli *defaults(void);
+
+	private:
+		void enter(const BIGNUM *, const BIGNUM *);
+	};
+}
+
+#endif /* !SSH_SSH_MODULI_H */
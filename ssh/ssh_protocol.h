@@ -31,6 +31,12 @@
 /* XXX OpenSSL dependency.  */
 typedef struct bignum_st BIGNUM;
 
+/*
+ * The largest packet we will accept, and the largest a payload may inflate
+ * to, as in OpenSSH.
+ */
+#define	SSH_PACKET_MAX	(256 * 1024)
+
 namespace SSH {
 	namespace Message {
 		static const uint8_t
@@ -25,11 +25,26 @@
 
 #include <common/buffer.h>
 
+#include <ssh/ssh_compression.h>
 #include <ssh/ssh_encryption.h>
 #include <ssh/ssh_key_exchange.h>
 #include <ssh/ssh_mac.h>
 #include <ssh/ssh_session.h>
 
+namespace {
+	void keep_compression(SSH::UnidirectionalAlgorithms *chosen, const SSH::UnidirectionalAlgorithms *active)
+	{
+		if (chosen->compression_ == NULL || active->compression_ == NULL)
+			return;
+		if (chosen->compression_ == active->compression_)
+			return;
+		if (chosen->compression_->name() != active->compression_->name())
+			return;
+		delete chosen->compression_;
+		chosen->compression_ = active->compression_;
+	}
+}
+
 void
 SSH::Session::activate_chosen(void)
 {
@@ -43,6 +58,13 @@ SSH::Session::activate_chosen(void)
 	 * Need to free instances in active_algorithms_.
 	 */
 
+	/*
+	 * A compression stream carries on across key exchanges, so keep the
+	 * one we have if it was chosen again.
+	 */
+	keep_compression(&chosen_algorithms_.client_to_server_, &active_algorithms_.client_to_server_);
+	keep_compression(&chosen_algorithms_.server_to_client_, &active_algorithms_.server_to_client_);
+
 	active_algorithms_ = chosen_algorithms_;
 
 	if (active_algorithms_.client_to_server_.encryption_ != NULL) {
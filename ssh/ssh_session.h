@@ -33,6 +33,7 @@ namespace SSH {
 	class KeyExchange;
 	class Language;
 	class MAC;
+	class Moduli;
 	class ServerHostKey;
 
 	enum Role {
@@ -82,6 +83,7 @@ namespace SSH {
 		AlgorithmNegotiation *algorithm_negotiation_;
 		Algorithms chosen_algorithms_;
 		Algorithms active_algorithms_;
+		const Moduli *moduli_;	/* Groups for group exchange, if not the defaults.  */
 		Buffer client_version_;	/* Client's version string.  */
 		Buffer server_version_;	/* Server's version string.  */
 		Buffer client_kexinit_;	/* Client's first key exchange packet.  */
@@ -89,6 +91,7 @@ namespace SSH {
 		Buffer shared_secret_;	/* Shared secret from key exchange.  */
 		Buffer session_id_;	/* First exchange hash.  */
 		Buffer exchange_hash_;	/* Most recent exchange hash.  */
+		bool authenticated_;	/* User authentication has succeeded.  */
 	private:
 		Buffer client_to_server_iv_;	/* Initial client-to-server IV.  */
 		Buffer server_to_client_iv_;	/* Initial server-to-client IV.  */
@@ -105,6 +108,7 @@ namespace SSH {
 		  algorithm_negotiation_(NULL),
 		  chosen_algorithms_(role),
 		  active_algorithms_(role),
+		  moduli_(NULL),
 		  client_version_(),
 		  server_version_(),
 		  client_kexinit_(),
@@ -112,6 +116,7 @@ namespace SSH {
 		  shared_secret_(),
 		  session_id_(),
 		  exchange_hash_(),
+		  authenticated_(false),
 		  client_to_server_iv_(),
 		  server_to_client_iv_(),
 		  client_to_server_key_(),
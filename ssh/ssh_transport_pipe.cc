@@ -53,9 +53,16 @@ SSH::TransportPipe::TransportPipe(Session *session)
   state_(GetIdentificationString),
   input_buffer_(),
   first_block_(),
+  open_complete_(NULL, &mtx_, this, &TransportPipe::open_complete),
+  open_action_(NULL),
+  open_packet_(),
   receive_cancel_(&mtx_, this, &TransportPipe::receive_cancel),
   receive_callback_(NULL),
   receive_action_(NULL),
+  send_queue_(),
+  send_complete_(NULL, &mtx_, this, &TransportPipe::send_complete),
+  send_action_(NULL),
+  send_eos_(false),
   ready_(false),
   ready_cancel_(&mtx_, this, &TransportPipe::ready_cancel),
   ready_callback_(NULL),
@@ -76,6 +83,20 @@ SSH::TransportPipe::~TransportPipe()
 
 	ASSERT_NULL(log_, ready_callback_);
 	ASSERT_NULL(log_, ready_action_);
+
+	ScopedLock _(&mtx_);
+	if (open_action_ != NULL) {
+		open_action_->cancel();
+		open_action_ = NULL;
+	}
+	if (send_action_ != NULL) {
+		send_action_->cancel();
+		send_action_ = NULL;
+	}
+	while (!send_queue_.empty()) {
+		delete send_queue_.front();
+		send_queue_.pop_front();
+	}
 }
 
 Action *
@@ -112,31 +133,71 @@ SSH::TransportPipe::receive(BufferEventCallback *cb)
  * padding and zero padding.  Quick and dirty.  Perhaps revisit later,
  * although it makes send() asynchronous unless we add a blocking
  * RNG interface.
+ *
+ * The MAC and encryption are done by CryptoThreads, and the packet is
+ * produced once they are done and every packet before it has been.
  */
 void
 SSH::TransportPipe::send(Buffer *payload)
 {
+	Compression *compression_algorithm;
 	Encryption *encryption_algorithm;
 	MAC *mac_algorithm;
+	OutgoingPacket *op;
 	Buffer packet;
 	uint8_t padding_len;
 	uint32_t packet_len;
 	unsigned block_size;
-	Buffer mac;
+	bool aead;
+	uint8_t msg;
 
 	ASSERT(log_, state_ == GetPacket);
+
+	/*
+	 * A delayed compression starts with the first packet after the server
+	 * says that user authentication has succeeded.
+	 */
+	msg = payload->empty() ? 0 : payload->peek();
+	compression_algorithm = session_->active_algorithms_.local_to_remote_->compression_;
+	if (compression_algorithm != NULL &&
+	    (!compression_algorithm->delayed() || session_->authenticated_)) {
+		if (!compression_algorithm->compress(payload)) {
+			ERROR(log_) << "Could not compress packet.";
+			op = new OutgoingPacket(this);
+			op->error_ = true;
+			send_queue_.push_back(op);
+			if (send_queue_.size() == 1 && send_action_ == NULL)
+				send_action_ = send_complete_.schedule();
+			return;
+		}
+	}
+	if (session_->role_ == ServerRole &&
+	    msg == SSH::Message::UserAuthenticationSuccessMessage)
+		session_->authenticated_ = true;
+
 	encryption_algorithm = session_->active_algorithms_.local_to_remote_->encryption_;
 	if (encryption_algorithm != NULL) {
 		block_size = encryption_algorithm->block_size();
 		if (block_size < 8)
 			block_size = 8;
+		aead = encryption_algorithm->tag_size() != 0;
 	} else {
 		block_size = 8;
+		aead = false;
 	}
-	mac_algorithm = session_->active_algorithms_.local_to_remote_->mac_;
+	if (!aead)
+		mac_algorithm = session_->active_algorithms_.local_to_remote_->mac_;
+	else
+		mac_algorithm = NULL;
 
+	/*
+	 * AEAD ciphers pad the packet without its length to the block size.
+	 */
 	packet_len = sizeof padding_len + payload->length();
-	padding_len = 4 + (block_size - ((sizeof packet_len + packet_len + 4) % block_size));
+	if (!aead)
+		padding_len = 4 + (block_size - ((sizeof packet_len + packet_len + 4) % block_size));
+	else
+		padding_len = 4 + (block_size - ((packet_len + 4) % block_size));
 	packet_len += padding_len;
 
 	BigEndian::append(&packet, packet_len);
@@ -144,34 +205,33 @@ SSH::TransportPipe::send(Buffer *payload)
 	payload->moveout(&packet);
 	packet.append(zero_padding, padding_len);
 
+	op = new OutgoingPacket(this);
+	send_queue_.push_back(op);
+
 	if (mac_algorithm != NULL) {
 		Buffer mac_input;
 
 		SSH::UInt32::encode(&mac_input, session_->local_sequence_number_);
 		mac_input.append(&packet);
 
-		if (!mac_algorithm->mac(&mac, &mac_input)) {
-			ERROR(log_) << "Could not compute outgoing MAC.";
-			produce_error();
-			return;
-		}
+		op->mac_action_ = mac_algorithm->submit(&mac_input, &op->mac_complete_);
 	}
 
-	if (encryption_algorithm != NULL) {
-		Buffer ciphertext;
-		if (!encryption_algorithm->cipher(&ciphertext, &packet)) {
-			ERROR(log_) << "Could not encrypt outgoing packet.";
-			produce_error();
-			return;
-		}
-		packet = ciphertext;
-	}
-	if (!mac.empty())
-		packet.append(mac);
+	if (aead)
+		op->encryption_action_ = encryption_algorithm->seal(session_->local_sequence_number_, &packet, &op->encryption_complete_);
+	else if (encryption_algorithm != NULL)
+		op->encryption_action_ = encryption_algorithm->submit(&packet, &op->encryption_complete_);
+	else
+		packet.moveout(&op->packet_);
 
 	session_->local_sequence_number_++;
 
-	produce(&packet);
+	/*
+	 * We may not hold the lock needed to produce, so a packet which
+	 * needs no more work is produced by a callback instead.
+	 */
+	if (op->done() && send_queue_.size() == 1 && send_action_ == NULL)
+		send_action_ = send_complete_.schedule();
 }
 
 Action *
@@ -211,6 +271,10 @@ SSH::TransportPipe::consume(Buffer *in)
 	if (in->empty()) {
 		if (!input_buffer_.empty())
 			DEBUG(log_) << "Received EOS with data outstanding.";
+		if (!send_queue_.empty()) {
+			send_eos_ = true;
+			return;
+		}
 		produce_eos();
 		return;
 	}
@@ -286,37 +350,66 @@ SSH::TransportPipe::receive_do(void)
 	if (state_ != GetPacket)
 		return;
 
-	while (!input_buffer_.empty()) {
+	while (!input_buffer_.empty() || !open_packet_.empty()) {
+		Compression *compression_algorithm;
 		Encryption *encryption_algorithm;
 		MAC *mac_algorithm;
 		Buffer packet;
 		Buffer mac;
 		unsigned block_size;
+		unsigned tag_size;
 		unsigned mac_size;
 		uint32_t packet_len;
 		uint8_t padding_len;
 		uint8_t msg;
 
+		if (open_action_ != NULL) {
+			DEBUG(log_) << "Waiting for packet to be opened.";
+			return;
+		}
+
 		encryption_algorithm = session_->active_algorithms_.remote_to_local_->encryption_;
 		if (encryption_algorithm != NULL) {
 			block_size = encryption_algorithm->block_size();
 			if (block_size < 8)
 				block_size = 8;
+			tag_size = encryption_algorithm->tag_size();
 		} else {
 			block_size = 8;
+			tag_size = 0;
 		}
-		mac_algorithm = session_->active_algorithms_.remote_to_local_->mac_;
+		if (tag_size == 0)
+			mac_algorithm = session_->active_algorithms_.remote_to_local_->mac_;
+		else
+			mac_algorithm = NULL;
 		if (mac_algorithm != NULL)
 			mac_size = mac_algorithm->size();
 		else
 			mac_size = 0;
 
-		if (input_buffer_.length() <= block_size) {
+		if (tag_size != 0 && !open_packet_.empty()) {
+			BigEndian::extract(&packet_len, &open_packet_);
+		} else if (tag_size != 0) {
+			if (input_buffer_.length() < sizeof packet_len) {
+				DEBUG(log_) << "Waiting for length of packet.";
+				return;
+			}
+
+			if (!encryption_algorithm->packet_length(session_->remote_sequence_number_, &input_buffer_, &packet_len)) {
+				ERROR(log_) << "Could not get length of packet.";
+				produce_error();
+				return;
+			}
+
+			if (packet_len % block_size != 0) {
+				ERROR(log_) << "Packet length is not a multiple of the block size.";
+				produce_error();
+				return;
+			}
+		} else if (input_buffer_.length() <= block_size) {
 			DEBUG(log_) << "Waiting for first block of packet.";
 			return;
-		}
-
-		if (encryption_algorithm != NULL) {
+		} else if (encryption_algorithm != NULL) {
 			if (first_block_.empty()) {
 				Buffer block;
 				input_buffer_.moveout(&block, block_size);
@@ -337,7 +430,28 @@ SSH::TransportPipe::receive_do(void)
 			return;
 		}
 
-		if (encryption_algorithm != NULL) {
+		if (packet_len > SSH_PACKET_MAX) {
+			ERROR(log_) << "Packet too long: " << packet_len;
+			produce_error();
+			return;
+		}
+
+		if (tag_size != 0) {
+			if (open_packet_.empty()) {
+				if (input_buffer_.length() < sizeof packet_len + packet_len + tag_size) {
+					DEBUG(log_) << "Need " << sizeof packet_len + packet_len + tag_size << " bytes to open packet; have " << input_buffer_.length() << ".";
+					return;
+				}
+
+				Buffer ciphertext;
+				input_buffer_.moveout(&ciphertext, sizeof packet_len + packet_len + tag_size);
+				open_action_ = encryption_algorithm->open(session_->remote_sequence_number_, &ciphertext, &open_complete_);
+				return;
+			}
+
+			open_packet_.moveout(&packet);
+			ASSERT(log_, packet.length() == sizeof packet_len + packet_len);
+		} else if (encryption_algorithm != NULL) {
 			ASSERT(log_, !first_block_.empty());
 
 			if (block_size + input_buffer_.length() < sizeof packet_len + packet_len + mac_size) {
@@ -400,6 +514,16 @@ SSH::TransportPipe::receive_do(void)
 			packet.trim(padding_len);
 		}
 
+		compression_algorithm = session_->active_algorithms_.remote_to_local_->compression_;
+		if (compression_algorithm != NULL &&
+		    (!compression_algorithm->delayed() || session_->authenticated_)) {
+			if (!compression_algorithm->decompress(&packet)) {
+				ERROR(log_) << "Could not decompress packet.";
+				produce_error();
+				return;
+			}
+		}
+
 		if (packet.empty()) {
 			ERROR(log_) << "Need to handle empty packet.";
 			produce_error();
@@ -430,6 +554,9 @@ SSH::TransportPipe::receive_do(void)
 		 *     an error.
 		 */
 		msg = packet.peek();
+		if (session_->role_ == ClientRole &&
+		    msg == SSH::Message::UserAuthenticationSuccessMessage)
+			session_->authenticated_ = true;
 		if (msg >= SSH::Message::TransportRangeBegin &&
 		    msg <= SSH::Message::TransportRangeEnd) {
 			DEBUG(log_) << "Using default handler for transport message.";
@@ -484,6 +611,118 @@ SSH::TransportPipe::receive_do(void)
 	}
 }
 
+void
+SSH::TransportPipe::open_complete(Event e, Buffer buf)
+{
+	open_action_->cancel();
+	open_action_ = NULL;
+
+	if (e.type_ != Event::Done) {
+		ERROR(log_) << "Could not decrypt or authenticate packet.";
+		produce_error();
+		return;
+	}
+
+	ASSERT(log_, !buf.empty());
+	open_packet_ = buf;
+
+	if (receive_callback_ != NULL)
+		receive_do();
+}
+
+void
+SSH::TransportPipe::send_complete(void)
+{
+	send_action_->cancel();
+	send_action_ = NULL;
+
+	send_flush();
+}
+
+void
+SSH::TransportPipe::send_flush(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	while (!send_queue_.empty()) {
+		OutgoingPacket *op = send_queue_.front();
+		if (!op->done())
+			return;
+		send_queue_.pop_front();
+
+		if (op->error_) {
+			delete op;
+
+			ERROR(log_) << "Could not encrypt outgoing packet or compute its MAC.";
+			produce_error();
+			return;
+		}
+
+		Buffer packet;
+		op->packet_.moveout(&packet);
+		op->mac_.moveout(&packet);
+		delete op;
+
+		produce(&packet);
+	}
+
+	if (send_eos_) {
+		send_eos_ = false;
+		produce_eos();
+	}
+}
+
+SSH::TransportPipe::OutgoingPacket::OutgoingPacket(TransportPipe *pipe)
+: pipe_(pipe),
+  packet_(),
+  mac_(),
+  error_(false),
+  encryption_complete_(NULL, &pipe->mtx_, this, &OutgoingPacket::encryption_complete),
+  encryption_action_(NULL),
+  mac_complete_(NULL, &pipe->mtx_, this, &OutgoingPacket::mac_complete),
+  mac_action_(NULL)
+{ }
+
+SSH::TransportPipe::OutgoingPacket::~OutgoingPacket()
+{
+	if (encryption_action_ != NULL) {
+		encryption_action_->cancel();
+		encryption_action_ = NULL;
+	}
+
+	if (mac_action_ != NULL) {
+		mac_action_->cancel();
+		mac_action_ = NULL;
+	}
+}
+
+void
+SSH::TransportPipe::OutgoingPacket::encryption_complete(Event e, Buffer buf)
+{
+	encryption_action_->cancel();
+	encryption_action_ = NULL;
+
+	if (e.type_ == Event::Done)
+		packet_ = buf;
+	else
+		error_ = true;
+
+	pipe_->send_flush();
+}
+
+void
+SSH::TransportPipe::OutgoingPacket::mac_complete(Event e, Buffer buf)
+{
+	mac_action_->cancel();
+	mac_action_ = NULL;
+
+	if (e.type_ == Event::Done)
+		mac_ = buf;
+	else
+		error_ = true;
+
+	pipe_->send_flush();
+}
+
 void
 SSH::TransportPipe::ready_cancel(void)
 {
@@ -26,7 +26,10 @@
 #ifndef	SSH_SSH_TRANSPORT_PIPE_H
 #define	SSH_SSH_TRANSPORT_PIPE_H
 
+#include <deque>
+
 #include <event/cancellation.h>
+#include <event/event_callback.h>
 
 #include <io/pipe/pipe.h>
 #include <io/pipe/pipe_producer.h>
@@ -47,6 +50,36 @@ namespace SSH {
 			GetPacket
 		};
 
+		/*
+		 * A packet whose MAC is being computed, or which is being
+		 * encrypted, by a CryptoThread.  Packets are queued in the
+		 * order of their sequence numbers, and each is produced once
+		 * it and all of those before it are done.
+		 */
+		struct OutgoingPacket {
+			TransportPipe *pipe_;
+			Buffer packet_;
+			Buffer mac_;
+			bool error_;
+
+			BufferEventCallback::Method<OutgoingPacket> encryption_complete_;
+			Action *encryption_action_;
+
+			BufferEventCallback::Method<OutgoingPacket> mac_complete_;
+			Action *mac_action_;
+
+			OutgoingPacket(TransportPipe *);
+			~OutgoingPacket();
+
+			bool done(void) const
+			{
+				return (encryption_action_ == NULL && mac_action_ == NULL);
+			}
+
+			void encryption_complete(Event, Buffer);
+			void mac_complete(Event, Buffer);
+		};
+
 		Mutex mtx_;
 
 		Session *session_;
@@ -55,10 +88,24 @@ namespace SSH {
 		Buffer input_buffer_;
 		Buffer first_block_;
 
+		/*
+		 * With an AEAD cipher, a whole packet is opened by a
+		 * CryptoThread.  Only one is opened at a time, as a packet
+		 * may change the keys with which those after it are opened.
+		 */
+		BufferEventCallback::Method<TransportPipe> open_complete_;
+		Action *open_action_;
+		Buffer open_packet_;
+
 		Cancellation<TransportPipe> receive_cancel_;
 		BufferEventCallback *receive_callback_;
 		Action *receive_action_;
 
+		std::deque<OutgoingPacket *> send_queue_;
+		SimpleCallback::Method<TransportPipe> send_complete_;
+		Action *send_action_;
+		bool send_eos_;
+
 		bool ready_;
 		Cancellation<TransportPipe> ready_cancel_;
 		SimpleCallback *ready_callback_;
@@ -80,6 +127,11 @@ namespace SSH {
 		void receive_cancel(void);
 		void receive_do(void);
 
+		void open_complete(Event, Buffer);
+
+		void send_complete(void);
+		void send_flush(void);
+
 		void ready_cancel(void);
 	};
 }
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <vector>
+
+#include <common/buffer.h>
+#include <common/test.h>
+
+#include <ssh/ssh_compression.h>
+#include <ssh/ssh_protocol.h>
+
+static uint8_t zeroes[SSH_PACKET_MAX + 1];
+
+static void
+payload_fill(Buffer *buf, size_t len, uint32_t *xp)
+{
+	while (len-- != 0) {
+		*xp = *xp * 1103515245 + 12345;
+		/*
+		 * Keep to a few values so that the payloads compress.
+		 */
+		buf->append((uint8_t)((*xp >> 16) & 0x0f));
+	}
+}
+
+int
+main(void)
+{
+	{
+		TestGroup g("/test/ssh/compression1/round_trip", "SSH Compression #1 / Round trip");
+
+		SSH::Compression *deflater = SSH::Compression::zlib();
+		SSH::Compression *inflater = deflater->clone();
+
+		uint32_t x = 1;
+		unsigned i;
+		for (i = 0; i < 2000; i++) {
+			size_t len;
+			if (i % 100 == 0)
+				len = 0;
+			else if (i % 10 == 0)
+				len = 3 * BUFFER_SEGMENT_SIZE + (i % BUFFER_SEGMENT_SIZE);
+			else
+				len = i;
+
+			Buffer original;
+			payload_fill(&original, len, &x);
+
+			Buffer payload(original);
+			{
+				Test _(g, "Compress.", deflater->compress(&payload));
+			}
+			{
+				Test _(g, "Decompress.", inflater->decompress(&payload));
+			}
+			{
+				Test _(g, "Expected payload.", payload.equal(&original));
+			}
+		}
+
+		delete deflater;
+		delete inflater;
+	}
+
+	{
+		TestGroup g("/test/ssh/compression1/inflate_limit", "SSH Compression #1 / Inflate limit");
+
+		SSH::Compression *deflater = SSH::Compression::zlib();
+		SSH::Compression *inflater = deflater->clone();
+
+		Buffer payload;
+		payload.append(zeroes, SSH_PACKET_MAX);
+		{
+			Test _(g, "Compress largest payload.", deflater->compress(&payload));
+		}
+		{
+			Test _(g, "Decompress largest payload.", inflater->decompress(&payload));
+		}
+		{
+			Test _(g, "Expected length.", payload.length() == SSH_PACKET_MAX);
+		}
+
+		payload.clear();
+		payload.append(zeroes, sizeof zeroes);
+		{
+			Test _(g, "Compress oversized payload.", deflater->compress(&payload));
+		}
+		{
+			Test _(g, "Compressed to a small packet.", payload.length() < SSH_PACKET_MAX / 64);
+		}
+		{
+			Test _(g, "Refuse to decompress oversized payload.", !inflater->decompress(&payload));
+		}
+
+		delete deflater;
+		delete inflater;
+	}
+}
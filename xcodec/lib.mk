@@ -5,4 +5,7 @@ SRCS+=	xcodec_cache_disk.cc
 SRCS+=	xcodec_decoder.cc
 SRCS+=	xcodec_encoder.cc
 
+# Used to compress disk cache contents.
+LDADD+=	-lz
+
 SRCS_io_pipe+=xcodec_pipe_pair.cc
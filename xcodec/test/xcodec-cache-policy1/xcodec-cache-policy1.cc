@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <common/buffer.h>
+#include <common/test.h>
+#include <common/time/time.h>
+#include <common/uuid/uuid.h>
+
+#include <xcodec/xcodec.h>
+#include <xcodec/xcodec_cache.h>
+
+/*
+ * Replays a trace of small transfers drawn repeatedly from a set of hot
+ * segments, interleaved with a large transfer of segments that are never
+ * seen again, against a memory cache that can hold all of the hot segments
+ * but not the hot segments and the large transfer together.
+ */
+
+#define	CACHE_SEGMENTS		(1024)
+#define	HOT_SEGMENTS		(768)
+#define	TRANSFER_SEGMENTS	(64)
+#define	SCAN_SEGMENTS		(512)
+#define	ROUNDS			(200)
+
+struct Replay {
+	uint64_t lookups_;
+	uint64_t hits_;
+	uint64_t hot_lookups_;
+	uint64_t hot_hits_;
+	uint64_t mismatches_;
+	double seconds_;
+
+	Replay(void)
+	: lookups_(0),
+	  hits_(0),
+	  hot_lookups_(0),
+	  hot_hits_(0),
+	  mismatches_(0),
+	  seconds_(0.0)
+	{ }
+};
+
+static BufferSegment *
+segment(uint64_t id)
+{
+	uint8_t data[XCODEC_SEGMENT_LENGTH];
+	memset(data, 0, sizeof data);
+	memcpy(data, &id, sizeof id);
+
+	BufferSegment *seg = BufferSegment::create();
+	seg->append(data, sizeof data);
+	return (seg);
+}
+
+/*
+ * An encoder's cache sees a lookup for every segment and enters those it
+ * misses; the peer's decoder cache only enters what it is sent and looks
+ * up what is referenced.
+ *
+ * If shared, the decoder cache is connected to the store of the peer's own
+ * local cache, which is kept busy with a stream of segments of its own, as
+ * it would be by the peer's encoder.
+ */
+static Replay
+replay(XCodecMemoryCachePolicy policy, bool shared)
+{
+	Replay r;
+	UUID uuid;
+	uuid.generate();
+
+	XCodecMemoryCache *encoder = new XCodecMemoryCache(uuid, CACHE_SEGMENTS * XCODEC_SEGMENT_LENGTH, policy);
+	XCodecMemoryCache *local = NULL;
+	XCodecCache *decoder;
+	if (shared) {
+		UUID local_uuid;
+		local_uuid.generate();
+
+		local = new XCodecMemoryCache(local_uuid, CACHE_SEGMENTS * XCODEC_SEGMENT_LENGTH, policy);
+		decoder = local->connect(uuid);
+	} else {
+		decoder = new XCodecMemoryCache(uuid, CACHE_SEGMENTS * XCODEC_SEGMENT_LENGTH, policy);
+	}
+	uint64_t next_local = 0;
+
+	std::vector<BufferSegment *> hot;
+	unsigned i;
+	for (i = 0; i < HOT_SEGMENTS; i++)
+		hot.push_back(segment(i));
+
+	uint64_t next_cold = HOT_SEGMENTS;
+	uint32_t seed = 1;
+
+	NanoTime start = NanoTime::current_time();
+	unsigned round;
+	for (round = 0; round < ROUNDS; round++) {
+		std::vector<std::pair<uint64_t, BufferSegment *> > trace;
+
+		for (i = 0; i < TRANSFER_SEGMENTS; i++) {
+			seed = seed * 1103515245 + 12345;
+			uint64_t id = (seed >> 8) % HOT_SEGMENTS;
+			hot[id]->ref();
+			trace.push_back(std::make_pair(id, hot[id]));
+		}
+		if (round % 4 == 3) {
+			for (i = 0; i < SCAN_SEGMENTS; i++) {
+				uint64_t id = next_cold++;
+				trace.push_back(std::make_pair(id, segment(id)));
+			}
+		}
+
+		std::vector<std::pair<uint64_t, BufferSegment *> >::iterator it;
+		for (it = trace.begin(); it != trace.end(); ++it) {
+			uint64_t hash = it->first * 0x9e3779b97f4a7c15ull;
+			BufferSegment *seg = it->second;
+
+			r.lookups_++;
+			if (it->first < HOT_SEGMENTS)
+				r.hot_lookups_++;
+
+			BufferSegment *oseg = encoder->lookup(hash);
+			if (oseg != NULL) {
+				r.hits_++;
+				if (it->first < HOT_SEGMENTS)
+					r.hot_hits_++;
+				oseg->unref();
+
+				oseg = decoder->lookup(hash);
+				if (oseg == NULL) {
+					r.mismatches_++;
+					decoder->enter(hash, seg);
+				} else {
+					oseg->unref();
+				}
+			} else {
+				encoder->enter(hash, seg);
+				if (decoder->lookup(hash) == NULL)
+					decoder->enter(hash, seg);
+				else
+					r.mismatches_++;
+			}
+			seg->unref();
+
+			if (local != NULL) {
+				uint64_t id = next_local++;
+				seg = segment(~id);
+				local->enter(id * 0xc2b2ae3d27d4eb4full, seg);
+				seg->unref();
+			}
+		}
+	}
+	NanoTime end = NanoTime::current_time();
+
+	r.seconds_ = (double)end.seconds_ - (double)start.seconds_;
+	r.seconds_ += ((double)end.nanoseconds_ - (double)start.nanoseconds_) / 1e9;
+
+	for (i = 0; i < HOT_SEGMENTS; i++)
+		hot[i]->unref();
+
+	delete decoder;
+	if (local != NULL)
+		delete local;
+	delete encoder;
+
+	return (r);
+}
+
+static void
+report(const char *name, const Replay& r)
+{
+	INFO("/test/xcodec/cache/policy/1") << name << ": " <<
+		(100 * r.hits_ / r.lookups_) << "% hits (" <<
+		(100 * r.hot_hits_ / r.hot_lookups_) << "% of hot segments), " <<
+		(uint64_t)(r.lookups_ / (r.seconds_ > 0 ? r.seconds_ : 1e-9)) << " lookups/s, " <<
+		r.mismatches_ << " encoder/decoder mismatches.";
+}
+
+int
+main(void)
+{
+	TestGroup g("/test/xcodec/cache/policy/1", "XCodecMemoryCache replacement policies #1");
+
+	Replay lru = replay(XCodecMemoryCachePolicyLRU, false);
+	Replay tinylfu = replay(XCodecMemoryCachePolicyTinyLFU, false);
+	Replay consistent = replay(XCodecMemoryCachePolicyTinyLFUConsistent, false);
+	Replay shared = replay(XCodecMemoryCachePolicyTinyLFUConsistent, true);
+
+	report("LRU", lru);
+	report("TinyLFU", tinylfu);
+	report("TinyLFU-Consistent", consistent);
+	report("TinyLFU-Consistent (shared store)", shared);
+
+	{
+		Test _(g, "TinyLFU hits more often than LRU.", tinylfu.hits_ > lru.hits_);
+	}
+
+	{
+		Test _(g, "TinyLFU-Consistent hits more often than LRU.", consistent.hits_ > lru.hits_);
+	}
+
+	{
+		Test _(g, "TinyLFU-Consistent keeps encoder and decoder in step.", consistent.mismatches_ == 0);
+	}
+
+	{
+		Test _(g, "TinyLFU-Consistent keeps encoder and decoder in step in a shared store.", shared.mismatches_ == 0);
+	}
+
+	return (0);
+}
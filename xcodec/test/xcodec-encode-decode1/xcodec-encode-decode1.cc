@@ -31,6 +31,7 @@
 #include <xcodec/xcodec_cache.h>
 #include <xcodec/xcodec_decoder.h>
 #include <xcodec/xcodec_encoder.h>
+#include <xcodec/xcodec_eviction_log.h>
 
 int
 main(void)
@@ -58,6 +59,7 @@ main(void)
 
 			XCodecCache *cache = new XCodecMemoryCache(uuid);
 			XCodecEncoder encoder(cache);
+			encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
 
 			Buffer out;
 			encoder.encode(&out, &in);
@@ -77,7 +79,7 @@ main(void)
 			out.moveout(&in);
 
 			XCodecDecoder decoder(cache);
-			std::set<uint64_t> unknown_hashes;
+			std::set<XCodecReference> unknown_hashes;
 
 			bool ok = decoder.decode(&out, &in, unknown_hashes);
 			{
@@ -104,5 +106,438 @@ main(void)
 		}
 	}
 
+	{
+		TestGroup g("/test/xcodec/encode-decode/1/capabilities", "XCodecEncoder::set_peer_capabilities");
+
+		/*
+		 * Zeros and text with words repeated in it, which would be
+		 * sent as <RUN>s and <REPEAT>s if the peer offers them.
+		 */
+		Buffer in;
+		unsigned i;
+		for (i = 0; i < 4 * XCODEC_SEGMENT_LENGTH + 100; i++)
+			in.append((uint8_t)0);
+		for (i = 0; i < 64; i++)
+			in.append("the quick brown fox jumps over the lazy dog ");
+
+		unsigned c;
+		for (c = 0; c < 2; c++) {
+			uint32_t capabilities = c == 0 ? 0 : XCODEC_CAPABILITIES;
+			Buffer original(in);
+
+			UUID uuid;
+			uuid.generate();
+			XCodecCache *cache = new XCodecMemoryCache(uuid);
+			XCodecEncoder encoder(cache);
+			encoder.set_peer_capabilities(capabilities);
+
+			Buffer tmp(in), out;
+			encoder.encode(&out, &tmp);
+
+			std::vector<uint8_t> data(out.length());
+			out.copyout(&data[0], data.size());
+
+			bool extended = false;
+			for (i = 0; i + 1 < data.size(); i++) {
+				if (data[i] != XCODEC_MAGIC)
+					continue;
+				if (data[i + 1] == XCODEC_OP_RUN ||
+				    data[i + 1] == XCODEC_OP_REPEAT)
+					extended = true;
+				i++;
+			}
+
+			if (capabilities == 0) {
+				Test _(g, "No <RUN> or <REPEAT> for a peer which does not offer them.", !extended);
+			} else {
+				Test _(g, "<RUN> and <REPEAT> for a peer which offers them.", extended);
+			}
+
+			XCodecDecoder decoder(cache);
+			decoder.set_legacy((capabilities & XCODEC_CAPABILITY_GENERATION) == 0);
+			std::set<XCodecReference> unknown_hashes;
+			Buffer decoded;
+
+			bool ok = decoder.decode(&decoded, &out, unknown_hashes);
+			{
+				Test _(g, "Decoder success.", ok);
+			}
+
+			{
+				Test _(g, "Expected data.", decoded.equal(&original));
+			}
+
+			delete cache;
+		}
+	}
+
+	{
+		TestGroup g("/test/xcodec/encode-decode/1/reorder", "XCodecDecoder::set_reorder");
+
+		/*
+		 * Data which the peer learns from one stream and which is
+		 * referenced again, among new data, in another, which is
+		 * decoded by a peer which has not seen the first.
+		 */
+		Buffer known;
+		uint32_t x = 1;
+		unsigned i;
+		for (i = 0; i < 8 * XCODEC_SEGMENT_LENGTH; i++) {
+			x = x * 1103515245 + 12345;
+			known.append((uint8_t)(x >> 16));
+		}
+
+		Buffer in;
+		for (i = 0; i < XCODEC_SEGMENT_LENGTH + 100; i++) {
+			x = x * 1103515245 + 12345;
+			in.append((uint8_t)(x >> 16));
+		}
+		in.append(known);
+		for (i = 0; i < 16; i++)
+			in.append("the quick brown fox jumps over the lazy dog ");
+		in.append(known);
+		for (i = 0; i < XCODEC_SEGMENT_LENGTH; i++)
+			in.append((uint8_t)0);
+
+		UUID uuid1;
+		uuid1.generate();
+		XCodecCache *cache1 = new XCodecMemoryCache(uuid1);
+		{
+			XCodecEncoder encoder(cache1);
+			encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
+			Buffer tmp(known), out;
+			encoder.encode(&out, &tmp);
+		}
+
+		XCodecEncoder encoder(cache1);
+		encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
+		Buffer tmp(in), encoded;
+		encoder.encode(&encoded, &tmp);
+
+		unsigned r;
+		for (r = 0; r < 2; r++) {
+			UUID uuid2;
+			uuid2.generate();
+			XCodecCache *cache2 = new XCodecMemoryCache(uuid2);
+
+			XCodecDecoder decoder(cache2);
+			decoder.set_reorder(r != 0);
+			std::set<XCodecReference> unknown_hashes;
+			Buffer input(encoded), decoded;
+
+			bool ok = decoder.decode(&decoded, &input, unknown_hashes);
+			{
+				Test _(g, "Decoder success.", ok);
+			}
+
+			{
+				Test _(g, "Unknown hashes.", !unknown_hashes.empty());
+			}
+
+			if (r == 0) {
+				Test _(g, "Input left without reorder.", !input.empty());
+			} else {
+				Test _(g, "Input consumed with reorder.", input.empty() && decoder.holding() && decoder.held() != 0);
+			}
+
+			{
+				Test _(g, "Output only up to the first unknown hash.", decoded.length() < XCODEC_SEGMENT_LENGTH * 2);
+			}
+
+			/*
+			 * Learn everything asked for, and decode again.
+			 */
+			std::set<XCodecReference>::const_iterator it;
+			for (it = unknown_hashes.begin(); it != unknown_hashes.end(); ++it) {
+				BufferSegment *seg = cache1->lookup(it->name_);
+				ASSERT("/test/xcodec/encode-decode/1/reorder", seg != NULL);
+				cache2->enter(it->name_, seg);
+				seg->unref();
+			}
+			unknown_hashes.clear();
+
+			ok = decoder.decode(&decoded, &input, unknown_hashes);
+			{
+				Test _(g, "Decoder success after learning.", ok);
+			}
+
+			{
+				Test _(g, "No unknown hashes after learning.", unknown_hashes.empty());
+			}
+
+			{
+				Test _(g, "Nothing held after learning.", input.empty() && !decoder.holding() && decoder.held() == 0);
+			}
+
+			{
+				Test _(g, "Expected data.", decoded.equal(&in));
+			}
+
+			delete cache2;
+		}
+
+		delete cache1;
+	}
+
+	{
+		TestGroup g("/test/xcodec/encode-decode/1/eviction", "XCodecEncoder::set_eviction_log");
+
+		/*
+		 * Data left in the window of one encoder is logged when it is
+		 * done, and so is found in the log when another references it.
+		 */
+		Buffer known;
+		uint32_t x = 1;
+		unsigned i;
+		for (i = 0; i < 8 * XCODEC_SEGMENT_LENGTH; i++) {
+			x = x * 1103515245 + 12345;
+			known.append((uint8_t)(x >> 16));
+		}
+
+		UUID uuid;
+		uuid.generate();
+		XCodecCache *cache = new XCodecMemoryCache(uuid);
+		XCodecEvictionLog log;
+		{
+			XCodecEncoder encoder(cache);
+			encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
+			encoder.set_eviction_log(&log);
+			Buffer tmp(known), out;
+			encoder.encode(&out, &tmp);
+		}
+
+		XCodecEncoder encoder(cache);
+		encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
+		std::map<XCodecReference, BufferSegment *> refmap;
+		Buffer tmp(known), out;
+		encoder.encode(&out, &tmp, &refmap);
+
+		{
+			Test _(g, "References made.", !refmap.empty());
+		}
+
+		unsigned logged = 0, again = 0;
+		std::map<XCodecReference, BufferSegment *>::iterator it;
+		for (it = refmap.begin(); it != refmap.end(); ++it) {
+			if (log.take(it->first.name_))
+				logged++;
+			if (log.take(it->first.name_))
+				again++;
+			it->second->unref();
+		}
+
+		{
+			Test _(g, "Every reference logged.", logged == refmap.size());
+		}
+
+		{
+			Test _(g, "Each taken only once.", again == 0);
+		}
+
+		delete cache;
+	}
+
+	{
+		TestGroup g("/test/xcodec/encode-decode/1/chunks", "XCodecEncoder::encode with XCodecChunkingVariable");
+
+		/*
+		 * Data which is repeated with a byte inserted in the middle,
+		 * which moves everything after it off any segment boundary.
+		 */
+		Buffer in;
+		uint32_t x = 1;
+		unsigned i;
+		for (i = 0; i < 64 * 1024; i++) {
+			x = x * 1103515245 + 12345;
+			in.append((uint8_t)(x >> 16));
+		}
+		Buffer first(in, 16 * 1024);
+		Buffer rest(in);
+		rest.skip(16 * 1024);
+		in.append(first);
+		in.append((uint8_t)0x5a);
+		in.append(rest);
+
+		UUID uuid1;
+		uuid1.generate();
+		XCodecCache *cache1 = new XCodecMemoryCache(uuid1);
+
+		UUID uuid2;
+		uuid2.generate();
+		XCodecCache *cache2 = new XCodecMemoryCache(uuid2);
+
+		{
+			XCodecEncoder encoder(cache1, XCODEC_WINDOW_COUNT, XCodecChunkingVariable);
+			encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
+			Buffer tmp(in), encoded;
+			encoder.encode(&encoded, &tmp);
+
+			{
+				Test _(g, "Empty input buffer after encode.", tmp.empty());
+			}
+
+			{
+				Test _(g, "Repeat found despite the insertion.", encoded.length() < in.length() - 48 * 1024);
+			}
+
+			XCodecDecoder decoder(cache2);
+			std::set<XCodecReference> unknown_hashes;
+			Buffer decoded;
+
+			bool ok = decoder.decode(&decoded, &encoded, unknown_hashes);
+			{
+				Test _(g, "Decoder success.", ok);
+			}
+
+			{
+				Test _(g, "No unknown hashes.", unknown_hashes.empty());
+			}
+
+			{
+				Test _(g, "Expected data.", decoded.equal(&in));
+			}
+		}
+
+		/*
+		 * A decoder which has seen none of it must learn the index of
+		 * each chunk and then its pieces.
+		 */
+		XCodecEncoder encoder(cache1, XCODEC_WINDOW_COUNT, XCodecChunkingVariable);
+		encoder.set_peer_capabilities(XCODEC_CAPABILITIES);
+		Buffer tmp(in), encoded;
+		encoder.encode(&encoded, &tmp);
+
+		UUID uuid3;
+		uuid3.generate();
+		XCodecCache *cache3 = new XCodecMemoryCache(uuid3);
+
+		XCodecDecoder decoder(cache3);
+		decoder.set_reorder(true);
+		std::set<XCodecReference> unknown_hashes;
+		Buffer decoded;
+
+		bool ok = decoder.decode(&decoded, &encoded, unknown_hashes);
+		{
+			Test _(g, "Decoder success.", ok);
+		}
+
+		{
+			Test _(g, "Unknown hashes.", !unknown_hashes.empty() && decoder.holding());
+		}
+
+		unsigned rounds;
+		for (rounds = 0; !unknown_hashes.empty() && rounds < 3; rounds++) {
+			std::set<XCodecReference>::const_iterator it;
+			for (it = unknown_hashes.begin(); it != unknown_hashes.end(); ++it) {
+				BufferSegment *seg = cache1->lookup(it->name_);
+				ASSERT("/test/xcodec/encode-decode/1/chunks", seg != NULL);
+				cache3->enter(it->name_, seg);
+				seg->unref();
+			}
+			unknown_hashes.clear();
+
+			ok = decoder.decode(&decoded, &encoded, unknown_hashes);
+			if (!ok)
+				break;
+		}
+
+		{
+			Test _(g, "Decoder success after learning.", ok);
+		}
+
+		{
+			Test _(g, "Index and then pieces learned.", rounds == 2);
+		}
+
+		{
+			Test _(g, "Nothing held after learning.", encoded.empty() && !decoder.holding());
+		}
+
+		{
+			Test _(g, "Expected data.", decoded.equal(&in));
+		}
+
+		delete cache3;
+		delete cache2;
+		delete cache1;
+	}
+
+#ifdef THREADS
+	{
+		TestGroup g("/test/xcodec/encode-decode/1/pool", "XCodecEncoder::encode with XCodecEncoderPool");
+
+		XCodecEncoderPool pool(3);
+
+		/*
+		 * Data with some repeats, some of them moved by a few bytes.
+		 */
+		Buffer in;
+		uint32_t x = 1;
+		unsigned i;
+		for (i = 0; i < 64 * 1024; i++) {
+			x = x * 1103515245 + 12345;
+			in.append((uint8_t)(x >> 16));
+		}
+		for (i = 0; i < 4; i++) {
+			Buffer tmp(in, 32 * 1024 + i);
+			in.append((uint8_t)i);
+			in.append(tmp);
+		}
+
+		unsigned c;
+		for (c = 0; c < 2; c++) {
+			XCodecChunking chunking = c == 0 ? XCodecChunkingExhaustive : XCodecChunkingContentDefined;
+			Buffer original(in);
+
+			UUID uuid1;
+			uuid1.generate();
+			XCodecCache *cache1 = new XCodecMemoryCache(uuid1);
+			XCodecEncoder encoder1(cache1, XCODEC_WINDOW_COUNT, chunking);
+			encoder1.set_peer_capabilities(XCODEC_CAPABILITIES);
+
+			UUID uuid2;
+			uuid2.generate();
+			XCodecCache *cache2 = new XCodecMemoryCache(uuid2);
+			XCodecEncoder encoder2(cache2, XCODEC_WINDOW_COUNT, chunking);
+			encoder2.set_peer_capabilities(XCODEC_CAPABILITIES);
+			encoder2.set_pool(&pool);
+
+			Buffer in1(in), out1;
+			encoder1.encode(&out1, &in1);
+
+			Buffer in2(in), out2;
+			encoder2.encode(&out2, &in2);
+
+			{
+				Test _(g, "Empty input buffer after encode.", in2.empty());
+			}
+
+			{
+				Test _(g, "Reduction in size.", out2.length() < original.length());
+			}
+
+			{
+				Test _(g, "Same encoding as without pool.", out1.equal(&out2));
+			}
+
+			XCodecDecoder decoder(cache2);
+			std::set<XCodecReference> unknown_hashes;
+			Buffer decoded;
+
+			bool ok = decoder.decode(&decoded, &out2, unknown_hashes);
+			{
+				Test _(g, "Decoder success.", ok);
+			}
+
+			{
+				Test _(g, "Expected data.", decoded.equal(&original));
+			}
+
+			delete cache1;
+			delete cache2;
+		}
+	}
+#endif
+
 	return (0);
 }
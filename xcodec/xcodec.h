@@ -26,6 +26,9 @@
 #ifndef	XCODEC_XCODEC_H
 #define	XCODEC_XCODEC_H
 
+#include <map>
+#include <vector>
+
 #define	XCODEC_MAGIC		((uint8_t)0xf1)	/* Magic!  */
 
 /*
@@ -56,6 +59,21 @@
  */
 #define	XCODEC_OP_EXTRACT	((uint8_t)0x01)
 
+/*
+ * Usage:
+ * 	<MAGIC> <OP_EXTRACT_GENERATION> generation[uint8_t] data[uint8_t x XCODEC_SEGMENT_LENGTH]
+ *
+ * Effects:
+ * 	As <OP_EXTRACT>, but the data is named by its hash with the generation
+ * 	`generation' rather than with generation zero.  Earlier generations of
+ * 	the same hash will not be used by the sender again.  Only sent to
+ * 	peers which offer XCODEC_CAPABILITY_GENERATION.
+ *
+ * Side-effects:
+ * 	The data is put into the backref FIFO.
+ */
+#define	XCODEC_OP_EXTRACT_GENERATION	((uint8_t)0x08)
+
 /*
  * Usage:
  * 	<MAGIC> <OP_REF> hash[uint64_t]
@@ -84,17 +102,294 @@
  */
 #define	XCODEC_OP_BACKREF	((uint8_t)0x03)
 
+/*
+ * Usage:
+ * 	<MAGIC> <OP_BACKREF16> index[uint16_t]
+ *
+ * Effects:
+ * 	As <OP_BACKREF>, but with an index into a backref FIFO of up to
+ * 	XCODEC_WIDE_WINDOW_COUNT entries.  Only sent to peers whose <HELLO>
+ * 	says they keep a window that large.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define	XCODEC_OP_BACKREF16	((uint8_t)0x04)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REF_PEER> hash[uint64_t]
+ *
+ * Effects:
+ * 	As <OP_REF>, but the hash `hash' is in the namespace of the receiver,
+ * 	rather than that of the sender, i.e. it names data which the sender
+ * 	got from the receiver.
+ *
+ * 	If the receiver no longer knows the `hash', an OP_ASK will be sent in
+ * 	response, as with <OP_REF>.  Only sent to peers which offer
+ * 	XCODEC_CAPABILITY_REF_PEER.
+ *
+ * Side-effects:
+ * 	The data is put into the backref FIFO.
+ */
+#define	XCODEC_OP_REF_PEER	((uint8_t)0x07)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_RUN> byte[uint8_t] length[uint16_t]
+ *
+ * Effects:
+ * 	The byte `byte' is inserted into the output stream `length' times.
+ * 	Only sent to peers which offer XCODEC_CAPABILITY_RUN.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define	XCODEC_OP_RUN		((uint8_t)0x05)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REPEAT> distance[uint16_t] length[uint16_t]
+ *
+ * Effects:
+ * 	The `length' bytes starting `distance' bytes back in the output stream
+ * 	are inserted into the output stream again.  If `length' is greater
+ * 	than `distance', the bytes being inserted are themselves repeated.
+ *
+ * 	The `distance' may be at most XCODEC_HISTORY_LENGTH.  Only sent to
+ * 	peers which offer XCODEC_CAPABILITY_RUN.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define	XCODEC_OP_REPEAT	((uint8_t)0x06)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_EXTRACT_CHUNK> generation[uint8_t] length[uint16_t] data[uint8_t x length]
+ *
+ * Effects:
+ * 	The `data' is a chunk of between XCODEC_CHUNK_MIN and XCODEC_CHUNK_MAX
+ * 	bytes, which is kept as segments (see XCodecChunk) and named by the
+ * 	hash of its index segment with the generation `generation'.  The name
+ * 	is associated with the chunk if possible and the data is inserted into
+ * 	the output stream.  Only sent to peers which offer
+ * 	XCODEC_CAPABILITY_CHUNK.
+ *
+ * Side-effects:
+ * 	None; chunks are not put into the backref FIFO.
+ */
+#define	XCODEC_OP_EXTRACT_CHUNK	((uint8_t)0x09)
+
+/*
+ * Usage:
+ * 	<MAGIC> <OP_REF_CHUNK> name[uint64_t] length[uint16_t]
+ *
+ * Effects:
+ * 	The chunk of `length' bytes with the name `name' is looked up and
+ * 	inserted into the output stream if possible.
+ *
+ * 	If the index segment named by `name', or any of the segments it
+ * 	names, is not known, an OP_ASK will be sent for it in response, as
+ * 	with <OP_REF>.  If the index is for a chunk of another length, error
+ * 	will be indicated from the decoder.
+ *
+ * Side-effects:
+ * 	None.
+ */
+#define	XCODEC_OP_REF_CHUNK	((uint8_t)0x0a)
+
+/*
+ * Extensions to the stream which each side offers in its <HELLO>.  One is
+ * only used if both sides offer it; until the peer's <HELLO> arrives, none
+ * are.
+ */
+#define	XCODEC_CAPABILITY_RUN		(0x00000001)	/* <OP_RUN> and <OP_REPEAT> */
+#define	XCODEC_CAPABILITY_REF_PEER	(0x00000002)	/* <OP_REF_PEER> */
+#define	XCODEC_CAPABILITY_GENERATION	(0x00000004)	/* Names with generations. */
+#define	XCODEC_CAPABILITY_PUSH		(0x00000008)	/* <LEARN> without <ASK>. */
+#define	XCODEC_CAPABILITY_CHUNK		(0x00000010)	/* Variable-size chunks. */
+
+#define	XCODEC_CAPABILITIES						\
+	(XCODEC_CAPABILITY_RUN | XCODEC_CAPABILITY_REF_PEER |		\
+	 XCODEC_CAPABILITY_GENERATION | XCODEC_CAPABILITY_PUSH |	\
+	 XCODEC_CAPABILITY_CHUNK)
+
+/*
+ * The backref FIFO holds the most recent XCODEC_WINDOW_COUNT segments to be
+ * declared or referenced, and so an <OP_BACKREF> index is the position of a
+ * segment in the stream of such segments, modulo XCODEC_WINDOW_COUNT.  A
+ * wider window may be used with peers which agree to it, in which case
+ * <OP_BACKREF16> indices are positions modulo XCODEC_WIDE_WINDOW_COUNT.
+ */
+#define	XCODEC_WINDOW_MAX		(0xff)
+#define	XCODEC_WINDOW_COUNT		(XCODEC_WINDOW_MAX + 1)
+#define	XCODEC_WIDE_WINDOW_MAX		(0xffff)
+#define	XCODEC_WIDE_WINDOW_COUNT	(XCODEC_WIDE_WINDOW_MAX + 1)
+
 #define	XCODEC_SEGMENT_LENGTH	(2048)
 
+/*
+ * Variable-size chunks are between XCODEC_CHUNK_MIN and XCODEC_CHUNK_MAX
+ * bytes long, and are cut so that they are XCODEC_CHUNK_AVERAGE bytes long
+ * more often than not.
+ */
+#define	XCODEC_CHUNK_MIN	(512)
+#define	XCODEC_CHUNK_AVERAGE	(XCODEC_SEGMENT_LENGTH)
+#define	XCODEC_CHUNK_MAX	(8192)
+
+/*
+ * Data is named by a 56-bit hash with an 8-bit generation number above it.
+ * The hash in <OP_REF> and <OP_REF_PEER> is such a name.
+ *
+ * Each time the data with a given name is evicted from a cache, the next
+ * data to be declared with the same hash gets the next generation, so a
+ * name is not reused for other data while a peer may still know the old.
+ *
+ * Such names are only put on the wire when both sides offer
+ * XCODEC_CAPABILITY_GENERATION.  Otherwise data is named as it was before
+ * names had generations, by the whole 64-bit legacy hash from which the
+ * 56-bit hash is folded, and a peer finds out that a name has been reused
+ * from <OP_EXTRACT>.  A peer whose <HELLO> has only its UUID offers nothing,
+ * and so is sent names in that form and none of the extensions to the
+ * stream.
+ *
+ * An encoder does not know which form to use until the peer's <HELLO>
+ * arrives, and until then it sends data it would reference with <OP_EXTRACT>
+ * instead.
+ */
+#define	XCODEC_NAME_HASH_BITS		(56)
+#define	XCODEC_NAME_HASH_MASK		(((uint64_t)1 << XCODEC_NAME_HASH_BITS) - 1)
+#define	XCODEC_NAME(hash, generation)					\
+	((uint64_t)(hash) | ((uint64_t)(generation) << XCODEC_NAME_HASH_BITS))
+#define	XCODEC_NAME_HASH(name)		((name) & XCODEC_NAME_HASH_MASK)
+#define	XCODEC_NAME_GENERATION(name)	((uint8_t)((name) >> XCODEC_NAME_HASH_BITS))
+
+/*
+ * Each side names data independently, so the same name may mean different
+ * data to each.  An <OP_REF> names data in the namespace of the encoder, and
+ * an <OP_REF_PEER> in that of the decoder, and anything which keeps names
+ * from both keeps them apart.
+ */
+enum XCodecNamespace {
+	XCodecNamespaceEncoder,
+	XCodecNamespaceDecoder,
+};
+
+struct XCodecReference {
+	XCodecNamespace namespace_;
+	uint64_t name_;
+
+	XCodecReference(XCodecNamespace ns, uint64_t name)
+	: namespace_(ns),
+	  name_(name)
+	{ }
+
+	bool operator< (const XCodecReference& ref) const
+	{
+		if (namespace_ != ref.namespace_)
+			return (namespace_ < ref.namespace_);
+		return (name_ < ref.name_);
+	}
+};
+
+/*
+ * How much of the output stream each side keeps for <OP_REPEAT>.
+ */
+#define	XCODEC_HISTORY_LENGTH	(XCODEC_SEGMENT_LENGTH)
+
+/*
+ * How the encoder chooses which segments to look up and declare.
+ *
+ * Exhaustive encoding considers the segment at every offset.  Content-defined
+ * encoding considers only segments which end at anchors chosen by the data
+ * itself, so that the same data is cut into the same segments wherever it
+ * occurs, with far fewer lookups.  Either way, segments are always
+ * XCODEC_SEGMENT_LENGTH bytes, and the decoder need not know which is used.
+ *
+ * Variable encoding cuts all of the data into chunks of variable size at
+ * such anchors, FastCDC-style, and looks each chunk up once.  It is only used
+ * with peers which offer XCODEC_CAPABILITY_CHUNK; with others, and until the
+ * peer's <HELLO> arrives, the encoder falls back to content-defined encoding.
+ */
+enum XCodecChunking {
+	XCodecChunkingExhaustive,
+	XCodecChunkingContentDefined,
+	XCodecChunkingVariable,
+};
+
 class XCodecCache;
+class XCodecEncoderPool;
+class XCodecEvictionLog;
 
 class XCodec {
+public:
+	/*
+	 * Whether one of the pipes using this codec is framing data as an
+	 * interactive or a bulk flow, and the frames it has sent.  Each pipe
+	 * is numbered in the order it was attached.
+	 */
+	struct PipeStatistics {
+		uintmax_t id_;
+		bool bulk_;
+		uintmax_t frames_;
+
+		PipeStatistics(void)
+		: id_(0),
+		  bulk_(false),
+		  frames_(0)
+		{ }
+	};
+
+	/*
+	 * The pipes now using this codec, and the frames sent by all of the
+	 * pipes which have used it as interactive and as bulk flows.
+	 */
+	struct Statistics {
+		std::vector<PipeStatistics> pipes_;
+		uintmax_t interactive_frames_;
+		uintmax_t bulk_frames_;
+
+		Statistics(void)
+		: pipes_(),
+		  interactive_frames_(0),
+		  bulk_frames_(0)
+		{ }
+	};
+
+private:
 	LogHandle log_;
 	XCodecCache *cache_;
+	XCodecCache *pass_cache_;
+	unsigned window_;
+	XCodecChunking chunking_;
+	bool legacy_;
+	XCodecEvictionLog *eviction_log_;
+	XCodecEncoderPool *encoder_pool_;
+	unsigned coalesce_;
+	unsigned credit_frames_;
+	size_t credit_bytes_;
+	uintmax_t pipe_next_id_;
+	std::map<uintmax_t, const PipeStatistics *> pipes_;
+	uintmax_t interactive_frames_;
+	uintmax_t bulk_frames_;
 public:
-	XCodec(XCodecCache *database)
+	XCodec(XCodecCache *database, unsigned window = XCODEC_WINDOW_COUNT, XCodecChunking chunking = XCodecChunkingExhaustive)
 	: log_("/xcodec"),
-	  cache_(database)
+	  cache_(database),
+	  pass_cache_(NULL),
+	  window_(window),
+	  chunking_(chunking),
+	  legacy_(false),
+	  eviction_log_(NULL),
+	  encoder_pool_(NULL),
+	  coalesce_(0),
+	  credit_frames_(0),
+	  credit_bytes_(0),
+	  pipe_next_id_(0),
+	  pipes_(),
+	  interactive_frames_(0),
+	  bulk_frames_(0)
 	{ }
 
 	~XCodec()
@@ -104,6 +399,160 @@ public:
 	{
 		return (cache_);
 	}
+
+	/*
+	 * The cache used by a second pass over the stream we encode, if we
+	 * are to encode it twice.  The second pass has its own names, cache
+	 * and window, so that runs of references which recur in the encoded
+	 * stream can themselves be sent as references.
+	 */
+	XCodecCache *pass_cache(void) const
+	{
+		return (pass_cache_);
+	}
+
+	void set_pass_cache(XCodecCache *cache)
+	{
+		pass_cache_ = cache;
+	}
+
+	/*
+	 * The number of entries in the backref FIFO we keep, and so the
+	 * largest window we will offer to a peer.
+	 */
+	unsigned window(void) const
+	{
+		return (window_);
+	}
+
+	XCodecChunking chunking(void) const
+	{
+		return (chunking_);
+	}
+
+	/*
+	 * Whether we send a <HELLO> with only our UUID, as older peers do and
+	 * expect, in which case we offer no extensions, keep a window of
+	 * XCODEC_WINDOW_COUNT entries and encode in one pass.
+	 */
+	bool legacy(void) const
+	{
+		return (legacy_);
+	}
+
+	void set_legacy(bool legacy)
+	{
+		legacy_ = legacy;
+	}
+
+	/*
+	 * The XCODEC_CAPABILITY_* bits which we offer.
+	 */
+	uint32_t capabilities(void) const
+	{
+		if (legacy_)
+			return (0);
+		return (XCODEC_CAPABILITIES);
+	}
+
+	/*
+	 * Where our encoders note data which falls out of their windows, if
+	 * data is to be pushed to peers which have lost it.
+	 */
+	XCodecEvictionLog *eviction_log(void) const
+	{
+		return (eviction_log_);
+	}
+
+	void set_eviction_log(XCodecEvictionLog *log)
+	{
+		eviction_log_ = log;
+	}
+
+	/*
+	 * Threads to be used by all of our encoders, if any.
+	 */
+	XCodecEncoderPool *encoder_pool(void) const
+	{
+		return (encoder_pool_);
+	}
+
+	void set_encoder_pool(XCodecEncoderPool *pool)
+	{
+		encoder_pool_ = pool;
+	}
+
+	/*
+	 * How many milliseconds bulk flows may hold data back to send it
+	 * in larger frames; zero if they should not.
+	 */
+	unsigned coalesce(void) const
+	{
+		return (coalesce_);
+	}
+
+	void set_coalesce(unsigned ms)
+	{
+		coalesce_ = ms;
+	}
+
+	/*
+	 * How many frames, and how many bytes of frames, an encoder may
+	 * send before the peer's <ADVANCE> says it has finished with them;
+	 * zero if there is no limit.
+	 */
+	unsigned credit_frames(void) const
+	{
+		return (credit_frames_);
+	}
+
+	size_t credit_bytes(void) const
+	{
+		return (credit_bytes_);
+	}
+
+	void set_credit(unsigned frames, size_t bytes)
+	{
+		credit_frames_ = frames;
+		credit_bytes_ = bytes;
+	}
+
+	/*
+	 * A pipe keeps its own statistics up to date while it is attached, and
+	 * counts each frame it sends here too.
+	 */
+	void pipe_attach(PipeStatistics *stats)
+	{
+		stats->id_ = ++pipe_next_id_;
+		pipes_[stats->id_] = stats;
+	}
+
+	void pipe_detach(const PipeStatistics *stats)
+	{
+		pipes_.erase(stats->id_);
+	}
+
+	void pipe_frame(PipeStatistics *stats)
+	{
+		stats->frames_++;
+		if (stats->bulk_)
+			bulk_frames_++;
+		else
+			interactive_frames_++;
+	}
+
+	Statistics statistics(void) const
+	{
+		Statistics stats;
+		std::map<uintmax_t, const PipeStatistics *>::const_iterator it;
+
+		for (it = pipes_.begin(); it != pipes_.end(); ++it)
+			stats.pipes_.push_back(*it->second);
+		stats.interactive_frames_ = interactive_frames_;
+		stats.bulk_frames_ = bulk_frames_;
+
+		return (stats);
+	}
 };
 
 #endif /* !XCODEC_XCODEC_H */
@@ -23,9 +23,219 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+
 #include <common/buffer.h>
 
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
 
 std::map<UUID, XCodecCache *> XCodecCache::cache_map;
+
+/*
+ * Find the stored copy of a segment, or store it, evicting entries from
+ * the largest caches as needed to make room.  Returns with a reference
+ * held on behalf of the caller.
+ */
+XCodecMemoryStore::Segment *
+XCodecMemoryStore::enter(const uint64_t& hash, BufferSegment *seg)
+{
+	segment_map_t::iterator smit = segment_map_.find(hash);
+	if (smit != segment_map_.end()) {
+		std::vector<Segment *>& segments = smit->second;
+		std::vector<Segment *>::iterator it;
+
+		for (it = segments.begin(); it != segments.end(); ++it) {
+			Segment *segment = *it;
+			if (!segment->seg_->equal(seg))
+				continue;
+			segment->refs_++;
+			return (segment);
+		}
+	}
+
+	while (limit_ != 0 && shared() && segments_ >= limit_) {
+		ASSERT(log_, !cache_usage_.empty());
+		cache_usage_t::reverse_iterator cit = cache_usage_.rbegin();
+		ASSERT(log_, cit->first != 0);
+		cit->second->evict();
+	}
+
+	Segment *segment = new Segment(seg);
+	segment->refs_++;
+	segment_map_[hash].push_back(segment);
+	segments_++;
+	return (segment);
+}
+
+void
+XCodecMemoryStore::release(const uint64_t& hash, Segment *segment)
+{
+	ASSERT(log_, segment->refs_ != 0);
+	if (--segment->refs_ != 0)
+		return;
+
+	segment_map_t::iterator it = segment_map_.find(hash);
+	ASSERT(log_, it != segment_map_.end());
+	std::vector<Segment *>& segments = it->second;
+	std::vector<Segment *>::iterator sit = std::find(segments.begin(), segments.end(), segment);
+	ASSERT(log_, sit != segments.end());
+	segments.erase(sit);
+	if (segments.empty())
+		segment_map_.erase(it);
+
+	delete segment;
+	segments_--;
+}
+
+void
+XCodecMemoryStore::usage(XCodecMemoryStoreClient *client, size_t oentries, size_t nentries)
+{
+	cache_usage_t::iterator it = cache_usage_.find(cache_usage_t::value_type(oentries, client));
+	ASSERT(log_, it != cache_usage_.end());
+	cache_usage_.erase(it);
+	cache_usage_.insert(cache_usage_t::value_type(nentries, client));
+}
+
+XCodecMemoryCache::~XCodecMemoryCache()
+{
+	while (!segment_hash_map_.empty())
+		remove(segment_hash_map_.begin());
+	store_->detach(this);
+	if (store_owner_) {
+		/*
+		 * Caches connected through us must not outlive us.
+		 */
+		ASSERT(log_, store_->cache_usage_.empty());
+		delete store_;
+	}
+	store_ = NULL;
+
+	if (sketch_ != NULL) {
+		delete sketch_;
+		sketch_ = NULL;
+	}
+}
+
+/*
+ * While there is room in the store, entries leaving the window go into the
+ * main cache without having to compete for a place there.
+ */
+void
+XCodecMemoryCache::admit(void)
+{
+	size_t window_limit = std::max(segment_hash_map_.size() / 100, (size_t)1);
+
+	while (window_lru_.active() > window_limit) {
+		uint64_t hash = window_lru_.evict();
+
+		segment_hash_map_t::iterator it = segment_hash_map_.find(hash);
+		ASSERT(log_, it != segment_hash_map_.end());
+		it->second.counter_ = probation_lru_.enter(hash);
+		it->second.region_ = Probation;
+	}
+}
+
+void
+XCodecMemoryCache::use(const uint64_t& hash, CacheEntry& entry)
+{
+	if (sketch_ == NULL) {
+		entry.counter_ = window_lru_.use(hash, entry.counter_);
+		return;
+	}
+
+	/*
+	 * Nothing but declarations may affect a consistent cache.
+	 */
+	if (store_->policy_ == XCodecMemoryCachePolicyTinyLFUConsistent)
+		return;
+
+	sketch_->increment(hash);
+
+	if (entry.region_ != Probation) {
+		entry.counter_ = lru(entry.region_).use(hash, entry.counter_);
+		return;
+	}
+
+	/*
+	 * A second use promotes an entry to the protected segment, which
+	 * may push the oldest protected entry back into probation.
+	 */
+	probation_lru_.remove(hash, entry.counter_);
+	entry.counter_ = protected_lru_.enter(hash);
+	entry.region_ = Protected;
+
+	size_t protected_limit = (probation_lru_.active() + protected_lru_.active()) * 4 / 5;
+	if (protected_lru_.active() <= protected_limit)
+		return;
+
+	uint64_t ohash = protected_lru_.evict();
+	segment_hash_map_t::iterator oit = segment_hash_map_.find(ohash);
+	ASSERT(log_, oit != segment_hash_map_.end());
+	oit->second.counter_ = probation_lru_.enter(ohash);
+	oit->second.region_ = Probation;
+}
+
+void
+XCodecMemoryCache::evict(void)
+{
+	segment_hash_map_t::iterator it;
+
+	if (sketch_ == NULL) {
+		/*
+		 * Remove the oldest hash.
+		 */
+		it = segment_hash_map_.find(window_lru_.oldest());
+		ASSERT(log_, it != segment_hash_map_.end());
+		retire(it->first.tag_);
+		remove(it);
+		return;
+	}
+
+	XCodecLRU<uint64_t>& main_lru = probation_lru_.active() != 0 ? probation_lru_ : protected_lru_;
+	size_t window_limit = std::max(segment_hash_map_.size() / 100, (size_t)1);
+
+	if (window_lru_.active() != 0 &&
+	    (window_lru_.active() >= window_limit || main_lru.active() == 0)) {
+		/*
+		 * The oldest entry in the window must displace the main
+		 * cache's victim to stay, which it may only do if it has been
+		 * seen more often.
+		 */
+		uint64_t candidate = window_lru_.oldest();
+		if (main_lru.active() != 0) {
+			uint64_t victim = main_lru.oldest();
+			if (sketch_->frequency(candidate) > sketch_->frequency(victim)) {
+				it = segment_hash_map_.find(victim);
+				ASSERT(log_, it != segment_hash_map_.end());
+				retire(victim);
+				remove(it);
+
+				it = segment_hash_map_.find(candidate);
+				ASSERT(log_, it != segment_hash_map_.end());
+				window_lru_.remove(candidate, it->second.counter_);
+				it->second.counter_ = probation_lru_.enter(candidate);
+				it->second.region_ = Probation;
+				return;
+			}
+		}
+		it = segment_hash_map_.find(candidate);
+	} else {
+		it = segment_hash_map_.find(main_lru.oldest());
+	}
+	ASSERT(log_, it != segment_hash_map_.end());
+	retire(it->first.tag_);
+	remove(it);
+}
+
+void
+XCodecMemoryCache::remove(segment_hash_map_t::iterator it)
+{
+	uint64_t hash = it->first.tag_;
+
+	if (store_->limited())
+		lru(it->second.region_).remove(hash, it->second.counter_);
+	store_->release(hash, it->second.segment_);
+	segment_hash_map_.erase(it);
+	store_->usage(this, segment_hash_map_.size() + 1, segment_hash_map_.size());
+}
@@ -28,10 +28,13 @@
 
 #include <ext/hash_map>
 #include <map>
+#include <set>
+#include <vector>
 
 #include <common/uuid/uuid.h>
 
 #include <xcodec/xcodec_lru.h>
+#include <xcodec/xcodec_sketch.h>
 
 /*
  * XXX
@@ -68,12 +71,23 @@ namespace __gnu_cxx {
 	};
 }
 
+/*
+ * The most hashes whose generations we remember; beyond that we forget them
+ * all and start over, and a peer may see names reused as it would without
+ * generations at all.
+ */
+#define	XCODEC_CACHE_GENERATIONS_MAX	(1024 * 1024)
+
 class XCodecCache {
+	typedef __gnu_cxx::hash_map<Tag64, uint8_t> generation_map_t;
+
 protected:
 	UUID uuid_;
+	generation_map_t generations_;
 
 	XCodecCache(const UUID& uuid)
-	: uuid_(uuid)
+	: uuid_(uuid),
+	  generations_()
 	{ }
 
 public:
@@ -88,6 +102,66 @@ public:
 	{ }
 	virtual bool out_of_band(void) const = 0;
 
+	/*
+	 * Find data without counting it as a use, for a caller which may not
+	 * go on to use it, and which calls use() if it does.  Caches which do
+	 * not keep track of use need not tell the difference.
+	 */
+	virtual BufferSegment *peek(const uint64_t& hash)
+	{
+		return (lookup(hash));
+	}
+
+	virtual void use(const uint64_t& hash)
+	{
+		BufferSegment *seg = lookup(hash);
+		if (seg != NULL)
+			seg->unref();
+	}
+
+	/*
+	 * The name by which data with the given hash is to be declared.
+	 * Only hashes whose generation is not zero are kept track of.
+	 */
+	virtual uint64_t name(const uint64_t& hash) const
+	{
+		generation_map_t::const_iterator it = generations_.find(hash);
+		if (it == generations_.end())
+			return (hash);
+		return (XCODEC_NAME(hash, it->second));
+	}
+
+	/*
+	 * Make the given name the one by which its hash is to be declared.
+	 */
+	virtual void rename(const uint64_t& name)
+	{
+		uint64_t hash = XCODEC_NAME_HASH(name);
+		uint8_t generation = XCODEC_NAME_GENERATION(name);
+
+		if (generation == 0) {
+			generations_.erase(hash);
+			return;
+		}
+		if (generations_.size() >= XCODEC_CACHE_GENERATIONS_MAX &&
+		    generations_.find(hash) == generations_.end())
+			generations_.clear();
+		generations_[hash] = generation;
+	}
+
+	/*
+	 * Data with the given name has been evicted, so if it is the name by
+	 * which its hash is now declared, move on to the next generation.
+	 */
+	void retire(const uint64_t& name)
+	{
+		uint64_t hash = XCODEC_NAME_HASH(name);
+
+		if (this->name(hash) != name)
+			return;
+		rename(XCODEC_NAME(hash, (uint8_t)(XCODEC_NAME_GENERATION(name) + 1)));
+	}
+
 	UUID get_uuid(void) const
 	{
 		return (uuid_);
@@ -234,94 +308,266 @@ public:
 		primary_->touch(hash, seg);
 		secondary_->touch(hash, seg);
 	}
+
+	/*
+	 * A use found by peek() is counted by lookup(), which also brings
+	 * data found only in the secondary into the primary.
+	 */
+	BufferSegment *peek(const uint64_t& hash)
+	{
+		BufferSegment *seg = primary_->peek(hash);
+		if (seg != NULL)
+			return (seg);
+		return (secondary_->peek(hash));
+	}
+
+	/*
+	 * Data only leaves the pair once it leaves the most persistent level,
+	 * so that level keeps track of generations for both.
+	 */
+	uint64_t name(const uint64_t& hash) const
+	{
+		return (secondary_->name(hash));
+	}
+
+	void rename(const uint64_t& name)
+	{
+		secondary_->rename(name);
+	}
 };
 
+class XCodecMemoryCache;
+
 /*
- * XXX
- * Would be easy enough to rename this something like BackendMemoryCache
- * and have the front-end handle sharing the backend on connect(), with
- * just a little additional key space.
+ * How a memory cache with a limited store chooses what to keep.
+ *
+ * With the TinyLFU policies, new entries go into a small LRU window and
+ * from there into a segmented LRU (probation and protected) for the rest of
+ * the cache.  When the store is full, the oldest entry in the window is
+ * only admitted to the main cache if it has been seen more often recently
+ * than the entry it would displace, so that a single large transfer cannot
+ * flush segments which are used over and over by smaller ones.
+ *
+ * The consistent variant only counts declarations, and lookups do not
+ * affect it at all, so that an encoder's cache and the peer decoder's
+ * cache for it make the same decisions from the same stream.  For the same
+ * reason, each of its caches is limited to the configured size on its own,
+ * rather than competing for room with the other caches in its store.
  */
-class XCodecMemoryCache : public XCodecCache {
-	struct CacheEntry {
+enum XCodecMemoryCachePolicy {
+	XCodecMemoryCachePolicyLRU,
+	XCodecMemoryCachePolicyTinyLFU,
+	XCodecMemoryCachePolicyTinyLFUConsistent,
+};
+
+/*
+ * Anything which keeps entries in a memory store, and from which the store
+ * may have one evicted to make room.
+ */
+class XCodecMemoryStoreClient {
+protected:
+	XCodecMemoryStoreClient(void)
+	{ }
+
+public:
+	virtual ~XCodecMemoryStoreClient()
+	{ }
+
+	virtual void evict(void) = 0;
+};
+
+/*
+ * The backing store shared by a memory cache and by all of the per-peer
+ * memory caches connected through it.
+ *
+ * A segment is stored once, however many caches refer to it by whatever
+ * hash, and the configured size limits the store as a whole rather than
+ * each cache.  When the store is full, an entry is evicted from whichever
+ * cache holds the most entries, so that each peer gets a fair share of the
+ * store.  Caches using the consistent policy are not evicted from on behalf
+ * of the store; each evicts from itself when it reaches the limit.
+ *
+ * A disk cache's buffer cache may also be kept in the store, and then it
+ * competes for room with the memory caches in the same way.
+ */
+class XCodecMemoryStore {
+	friend class XCodecDisk;
+	friend class XCodecMemoryCache;
+
+	struct Segment {
 		BufferSegment *seg_;
-		uint64_t counter_;
+		unsigned refs_;
 
-		CacheEntry(BufferSegment *seg)
+		Segment(BufferSegment *seg)
 		: seg_(seg),
-		  counter_(0)
-		{
-			seg_->ref();
-		}
-
-		CacheEntry(const CacheEntry& src)
-		: seg_(src.seg_),
-		  counter_(src.counter_)
+		  refs_(0)
 		{
 			seg_->ref();
 		}
 
-		~CacheEntry()
+		~Segment()
 		{
+			ASSERT("/xcodec/cache/memory/store", refs_ == 0);
 			seg_->unref();
 			seg_ = NULL;
 		}
 	};
 
+	typedef __gnu_cxx::hash_map<Tag64, std::vector<Segment *> > segment_map_t;
+	typedef std::set<std::pair<size_t, XCodecMemoryStoreClient *> > cache_usage_t;
+
+	LogHandle log_;
+	segment_map_t segment_map_;
+	size_t segments_;
+	size_t limit_;
+	XCodecMemoryCachePolicy policy_;
+	cache_usage_t cache_usage_;
+
+	XCodecMemoryStore(size_t limit, XCodecMemoryCachePolicy policy)
+	: log_("/xcodec/cache/memory/store"),
+	  segment_map_(),
+	  segments_(0),
+	  limit_(limit),
+	  policy_(policy),
+	  cache_usage_()
+	{ }
+
+	~XCodecMemoryStore()
+	{
+		ASSERT(log_, segments_ == 0);
+		ASSERT(log_, cache_usage_.empty());
+	}
+
+public:
+	bool limited(void) const
+	{
+		return (limit_ != 0);
+	}
+
+	bool shared(void) const
+	{
+		return (policy_ != XCodecMemoryCachePolicyTinyLFUConsistent);
+	}
+
+private:
+	Segment *enter(const uint64_t&, BufferSegment *);
+	void release(const uint64_t&, Segment *);
+
+	void attach(XCodecMemoryStoreClient *client)
+	{
+		cache_usage_.insert(cache_usage_t::value_type(0, client));
+	}
+
+	void detach(XCodecMemoryStoreClient *client)
+	{
+		cache_usage_.erase(cache_usage_t::value_type(0, client));
+	}
+
+	void usage(XCodecMemoryStoreClient *, size_t, size_t);
+};
+
+/*
+ * A memory cache is an index from hashes to segments in a store, with its
+ * own replacement policy, and may be the front-end for a single peer.
+ *
+ * With the LRU policy, every entry lives in the window.
+ */
+class XCodecMemoryCache : public XCodecCache, public XCodecMemoryStoreClient {
+	enum Region {
+		Window,
+		Probation,
+		Protected,
+	};
+
+	struct CacheEntry {
+		XCodecMemoryStore::Segment *segment_;
+		uint64_t counter_;
+		Region region_;
+
+		CacheEntry(XCodecMemoryStore::Segment *segment)
+		: segment_(segment),
+		  counter_(0),
+		  region_(Window)
+		{ }
+	};
+
 	typedef __gnu_cxx::hash_map<Tag64, CacheEntry> segment_hash_map_t;
 
 	LogHandle log_;
+	XCodecMemoryStore *store_;
+	bool store_owner_;
 	segment_hash_map_t segment_hash_map_;
-	XCodecLRU<uint64_t> segment_lru_;
-	size_t memory_cache_limit_;
+	XCodecSketch *sketch_;
+	XCodecLRU<uint64_t> window_lru_;
+	XCodecLRU<uint64_t> probation_lru_;
+	XCodecLRU<uint64_t> protected_lru_;
+
+	XCodecMemoryCache(const UUID& uuid, XCodecMemoryStore *store)
+	: XCodecCache(uuid),
+	  log_("/xcodec/cache/memory"),
+	  store_(store),
+	  store_owner_(false),
+	  segment_hash_map_(),
+	  sketch_(NULL),
+	  window_lru_(),
+	  probation_lru_(),
+	  protected_lru_()
+	{
+		store_->attach(this);
+		if (store_->limited() && store_->policy_ != XCodecMemoryCachePolicyLRU)
+			sketch_ = new XCodecSketch(store_->limit_);
+	}
 public:
-	XCodecMemoryCache(const UUID& uuid, size_t memory_cache_limit_bytes = 0)
+	XCodecMemoryCache(const UUID& uuid, size_t memory_cache_limit_bytes = 0, XCodecMemoryCachePolicy policy = XCodecMemoryCachePolicyLRU)
 	: XCodecCache(uuid),
 	  log_("/xcodec/cache/memory"),
+	  store_(NULL),
+	  store_owner_(true),
 	  segment_hash_map_(),
-	  segment_lru_(),
-	  memory_cache_limit_(memory_cache_limit_bytes / XCODEC_SEGMENT_LENGTH)
+	  sketch_(NULL),
+	  window_lru_(),
+	  probation_lru_(),
+	  protected_lru_()
 	{
+		size_t memory_cache_limit = memory_cache_limit_bytes / XCODEC_SEGMENT_LENGTH;
 		if (memory_cache_limit_bytes != 0 &&
 		    memory_cache_limit_bytes < XCODEC_SEGMENT_LENGTH)
-			memory_cache_limit_ = 1;
+			memory_cache_limit = 1;
+		store_ = new XCodecMemoryStore(memory_cache_limit, policy);
+		store_->attach(this);
+		if (store_->limited() && policy != XCodecMemoryCachePolicyLRU)
+			sketch_ = new XCodecSketch(memory_cache_limit);
 	}
 
-	~XCodecMemoryCache()
-	{ }
+	~XCodecMemoryCache();
 
 	/*
-	 * Just assume that we can spin up another memory cache of the same size
-	 * for any connecting UUID.
+	 * Any connecting UUID gets its own index into the same store.
 	 */
 	XCodecCache *connect(const UUID& uuid)
 	{
-		XCodecMemoryCache *cache = new XCodecMemoryCache(uuid, memory_cache_limit_ * XCODEC_SEGMENT_LENGTH);
+		XCodecMemoryCache *cache = new XCodecMemoryCache(uuid, store_);
 		return (cache);
 	}
 
 	void enter(const uint64_t& hash, BufferSegment *seg)
 	{
-		if (memory_cache_limit_ != 0 &&
-		    segment_lru_.active() == memory_cache_limit_) {
-			/*
-			 * Find the oldest hash.
-			 */
-			uint64_t ohash = segment_lru_.evict();
-
-			/*
-			 * Remove the oldest hash.
-			 */
-			segment_hash_map_t::iterator oit = segment_hash_map_.find(ohash);
-			ASSERT(log_, oit != segment_hash_map_.end());
-			segment_hash_map_.erase(oit);
-		}
 		ASSERT(log_, seg->length() == XCODEC_SEGMENT_LENGTH);
 		ASSERT(log_, segment_hash_map_.find(hash) == segment_hash_map_.end());
-		CacheEntry entry(seg);
-		if (memory_cache_limit_ != 0)
-			entry.counter_ = segment_lru_.enter(hash);
+		if (store_->limited() && !store_->shared()) {
+			while (segment_hash_map_.size() >= store_->limit_)
+				evict();
+		}
+		CacheEntry entry(store_->enter(hash, seg));
+		if (store_->limited())
+			entry.counter_ = window_lru_.enter(hash);
 		segment_hash_map_.insert(segment_hash_map_t::value_type(hash, entry));
+		store_->usage(this, segment_hash_map_.size() - 1, segment_hash_map_.size());
+
+		if (sketch_ != NULL) {
+			sketch_->increment(hash);
+			admit();
+		}
 	}
 
 	virtual void replace(const uint64_t& hash, BufferSegment *seg)
@@ -330,17 +576,14 @@ public:
 		it = segment_hash_map_.find(hash);
 		ASSERT(log_, it != segment_hash_map_.end());
 
-		CacheEntry entry(seg);
-		if (memory_cache_limit_ != 0)
-			entry.counter_ = segment_lru_.use(hash, it->second.counter_);
-		it->second = entry;
+		remove(it);
+		enter(hash, seg);
 	}
 
 	bool out_of_band(void) const
 	{
 		/*
-		 * Memory caches are not exchanged out-of-band; references
-		 * must be extracted in-stream.
+		 * Memory caches are exchanged in-band.
 		 */
 		return (false);
 	}
@@ -357,11 +600,61 @@ public:
 		 * If we have a limit and if we aren't also the last hash to
 		 * be used, update our position in the LRU.
 		 */
-		if (memory_cache_limit_ != 0)
-			entry.counter_ = segment_lru_.use(hash, entry.counter_);
-		entry.seg_->ref();
-		return (entry.seg_);
+		if (store_->limited())
+			use(hash, entry);
+		BufferSegment *seg = entry.segment_->seg_;
+		seg->ref();
+		return (seg);
 	}
+
+	BufferSegment *peek(const uint64_t& hash)
+	{
+		segment_hash_map_t::iterator it;
+		it = segment_hash_map_.find(hash);
+		if (it == segment_hash_map_.end())
+			return (NULL);
+
+		BufferSegment *seg = it->second.segment_->seg_;
+		seg->ref();
+		return (seg);
+	}
+
+	void use(const uint64_t& hash)
+	{
+		if (!store_->limited())
+			return;
+
+		segment_hash_map_t::iterator it;
+		it = segment_hash_map_.find(hash);
+		if (it == segment_hash_map_.end())
+			return;
+		use(hash, it->second);
+	}
+
+	XCodecMemoryStore *store(void) const
+	{
+		return (store_);
+	}
+
+private:
+	XCodecLRU<uint64_t>& lru(Region region)
+	{
+		switch (region) {
+		case Window:
+			return (window_lru_);
+		case Probation:
+			return (probation_lru_);
+		case Protected:
+			return (protected_lru_);
+		default:
+			NOTREACHED(log_);
+		}
+	}
+
+	void admit(void);
+	void use(const uint64_t&, CacheEntry&);
+	void evict(void);
+	void remove(segment_hash_map_t::iterator);
 };
 
 #endif /* !XCODEC_XCODEC_CACHE_H */
@@ -24,11 +24,19 @@
  */
 
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include <deque>
+#include <map>
 
 #include <common/buffer.h>
+#ifdef THREADS
+#include <common/thread/thread.h>
+#endif
 
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
@@ -78,9 +86,9 @@
  *                      head and tail, and knowing which are the oldest (most likely to
  *                      have been overwritten) and newest (most likely to not be in sync)
  *                      so that we can check those thoroughly, which we do not want to
- *                      have to do for the whole disk.
+ *                      have to do for the whole disk.  The format version is above it.
  * uint16_t entry_0_xuid; -- The XUID associated with the corresponding data block.
- * uint64_t entry_0_hash; -- The XCodecHash of the corresponding data block.
+ * uint64_t entry_0_hash; -- The name (XCodecHash and generation) of the corresponding data block.
  *  ...
  * [entries sufficient to fill the block.]
  */
@@ -100,156 +108,316 @@
  */
 #define	XCDFS_CHECK_BOUNDARY	(80)
 
+/*
+ * With compression, each index spans several blocks, so as to have room for
+ * more entries than the data that follows it could hold uncompressed, and
+ * each entry also gives the byte offset of its segment within the extent
+ * of data blocks following the index:
+ * uint64_t counter; -- As above, but with XCDFS_COUNTER_COMPRESSED set.
+ * uint16_t entry_0_xuid;
+ * uint64_t entry_0_hash;
+ * uint32_t entry_0_offset;
+ *  ...
+ *
+ * Each segment in an extent is stored as:
+ * uint16_t header; -- The length of the data which follows, with
+ *                     XCDFS_RECORD_DEFLATE set if it is compressed.
+ * uint8_t data[length];
+ *
+ * The extent is sized so that it fills at about the same time as the index
+ * when segments compress to a quarter of their size.  If they compress less
+ * well, the extent fills first; if better, the index does.
+ *
+ * Because the first index block is at the same place in either layout, its
+ * counter tells us how a disk was laid out before we read anything else.
+ */
+#define	XCDFS_COMPRESSED_INDEX_BLOCKS	(4)
+#define	XCDFS_COMPRESSED_ENTRIES_PER_INDEX_BLOCK	((XCDFS_COMPRESSED_INDEX_BLOCKS * XCDFS_BLOCK_SIZE - sizeof (uint64_t)) / (sizeof (uint16_t) + sizeof (uint64_t) + sizeof (uint32_t)))
+#define	XCDFS_COMPRESSED_EXTENT_BLOCKS	(XCDFS_COMPRESSED_ENTRIES_PER_INDEX_BLOCK / 4)
+
+#define	XCDFS_COUNTER_COMPRESSED	((uint64_t)1 << 63)
+
+/*
+ * Below XCDFS_COUNTER_COMPRESSED, each counter also carries the version of
+ * the format its index block was written in.  Version 0 index blocks hold
+ * bare 64-bit hashes rather than names with a generation (see XCODEC_NAME),
+ * so they are taken to be free, and such a disk is written over from the
+ * start.
+ */
+#define	XCDFS_VERSION			(1)
+#define	XCDFS_COUNTER_VERSION_SHIFT	(56)
+#define	XCDFS_COUNTER_VERSION(counter)					\
+	(((counter) & ~XCDFS_COUNTER_COMPRESSED) >> XCDFS_COUNTER_VERSION_SHIFT)
+#define	XCDFS_COUNTER_MASK		(((uint64_t)1 << XCDFS_COUNTER_VERSION_SHIFT) - 1)
+
+#define	XCDFS_RECORD_DEFLATE		(0x8000)
+#define	XCDFS_RECORD_LENGTH_MASK	(0x0fff)
+
+/*
+ * Lookups from a compressed disk must decompress their segment, so we keep
+ * a buffer cache of decompressed segments even if one is not configured.
+ */
+#define	XCDFS_COMPRESSED_BUFFER_SIZE	(4 * 1024 * 1024)
+
+/*
+ * Data block addresses, as stored in the front-end indices and used to key
+ * the buffer cache, carry the index of the member holding the block in
+ * their upper bits.  The lower bits are a block number or, with compression,
+ * the byte offset of the segment's record.
+ */
+#define	XCDFS_MEMBER_SHIFT	(48)
+#define	XCDFS_MEMBER_MAX	(1u << (64 - XCDFS_MEMBER_SHIFT))
+#define	XCDFS_MEMBER_BLOCK_MASK	(((uint64_t)1 << XCDFS_MEMBER_SHIFT) - 1)
+
+/*
+ * The number of writes which may be queued to a member's I/O thread before
+ * we wait for it to catch up.  This bounds the memory held by segments in
+ * flight to the disk.
+ */
+#define	XCDFS_IO_QUEUE_LIMIT	(1024)
+
 namespace {
 	static uint8_t zero_uuid[UUID_SIZE];
 }
 
-XCodecDisk::XCodecDisk(int fd, uint64_t disk_size)
-: log_("/xcodec/disk"),
+#ifdef THREADS
+/*
+ * Writes to a member are queued to its own thread, so that callers do not
+ * wait on the device and so that each device is kept busy independently.
+ * Reads are done synchronously by the caller, after first checking for a
+ * queued write to the same block, whose data is then the most recent.
+ */
+class XCodecDiskIOThread : public WorkerThread {
+	typedef std::pair<uint64_t, BufferSegment *> write_t;
+
+	LogHandle log_;
+	int fd_;
+	SleepQueue drained_;
+	std::deque<write_t> queue_;
+	std::map<uint64_t, BufferSegment *> queued_blocks_;
+	uint64_t writes_;
+	uint64_t write_errors_;
+public:
+	XCodecDiskIOThread(const std::string& path, int fd)
+	: WorkerThread("XCodecDiskIOThread"),
+	  log_("/xcodec/disk/io/" + path),
+	  fd_(fd),
+	  drained_("XCodecDiskIOThread", &mtx_),
+	  queue_(),
+	  queued_blocks_(),
+	  writes_(0),
+	  write_errors_(0)
+	{ }
+
+	~XCodecDiskIOThread()
+	{
+		ASSERT(log_, queue_.empty());
+	}
+
+	/*
+	 * Takes a reference to the segment for the duration of the write.
+	 */
+	void write(uint64_t blockno, BufferSegment *seg)
+	{
+		mtx_.lock();
+		while (queue_.size() >= XCDFS_IO_QUEUE_LIMIT)
+			drained_.wait();
+		seg->ref();
+		queue_.push_back(write_t(blockno, seg));
+		queued_blocks_[blockno] = seg;
+		mtx_.unlock();
+
+		submit();
+	}
+
+	BufferSegment *queued(uint64_t blockno)
+	{
+		ScopedLock _(&mtx_);
+		std::map<uint64_t, BufferSegment *>::const_iterator it;
+		it = queued_blocks_.find(blockno);
+		if (it == queued_blocks_.end())
+			return (NULL);
+		BufferSegment *seg = it->second;
+		seg->ref();
+		return (seg);
+	}
+
+	void statistics(XCodecDisk::Statistics *stats)
+	{
+		ScopedLock _(&mtx_);
+		stats->writes_ += writes_;
+		stats->write_errors_ += write_errors_;
+		stats->writes_pending_ = queue_.size();
+	}
+
+private:
+	void work(void)
+	{
+		mtx_.lock();
+		while (!queue_.empty()) {
+			write_t w = queue_.front();
+			mtx_.unlock();
+
+			ssize_t amt = ::pwrite(fd_, w.second->data(), XCDFS_BLOCK_SIZE, w.first * XCDFS_BLOCK_SIZE);
+
+			mtx_.lock();
+			queue_.pop_front();
+			std::map<uint64_t, BufferSegment *>::iterator it;
+			it = queued_blocks_.find(w.first);
+			if (it != queued_blocks_.end() && it->second == w.second)
+				queued_blocks_.erase(it);
+			if (amt == XCDFS_BLOCK_SIZE) {
+				writes_++;
+			} else {
+				ERROR(log_) << "Failed to write block #" << w.first << "; expect inconsistency.";
+				write_errors_++;
+			}
+			w.second->unref();
+			drained_.signal();
+		}
+		mtx_.unlock();
+	}
+
+	/*
+	 * Once asked to stop, we are not given any more work, so write out
+	 * anything which is still queued before we go.
+	 */
+	void final(void)
+	{
+		work();
+	}
+};
+#endif
+
+XCodecDisk::Member::Member(unsigned index, const std::string& path, int fd, bool direct, bool compression, uint64_t disk_size)
+: index_(index),
   fd_(fd),
   disk_blocks_(disk_size / XCDFS_BLOCK_SIZE),
-  index_blocks_((disk_blocks_ - XCDFS_REGISTRY_BLOCKS) / (1 + XCDFS_ENTRIES_PER_INDEX_BLOCK)),
-  xuid_cache_map_(),
-  uuid_xuid_map_(),
+  index_blocks_(0),
   current_index_block_(0),
   index_block_(),
   index_block_next_(0),
-  index_block_counter_(0)
+  index_block_counter_(0),
+  extent_(),
+  extent_next_(0),
+  extent_flushed_(0),
+  io_(NULL),
+  stats_(path, direct)
 {
-	uint64_t o;
-
-	ASSERT(log_, XCDFS_BLOCK_SIZE == XCODEC_SEGMENT_LENGTH);
-
-	DEBUG(log_) << "Opened disk with " << index_blocks_ << " index blocks.  Block size is " << XCDFS_BLOCK_SIZE << ".";
-	DEBUG(log_) << "Disk maps " << (index_blocks_ * XCDFS_ENTRIES_PER_INDEX_BLOCK) << " data blocks.";
-	DEBUG(log_) << "Using " << XCDFS_REGISTRY_BLOCKS << " registry blocks to map " << XCDFS_XUID_COUNT << " namespaces.";
-	DEBUG(log_) << "Volume size " << disk_size << ".";
-	DEBUG(log_) << "Actual size of store and metadata " << ((XCDFS_REGISTRY_BLOCKS + index_blocks_ + (XCDFS_ENTRIES_PER_INDEX_BLOCK * index_blocks_)) * XCDFS_BLOCK_SIZE) << ".";
-	DEBUG(log_) << "Wasted space " << disk_size - ((XCDFS_REGISTRY_BLOCKS + index_blocks_ + (XCDFS_ENTRIES_PER_INDEX_BLOCK * index_blocks_)) * XCDFS_BLOCK_SIZE) << ".";
-
-	if (index_blocks_ == 0) {
-		ERROR(log_) << "Disk too small; reduce XCDFS_BLOCK_SIZE.";
+	if (disk_blocks_ <= XCDFS_REGISTRY_BLOCKS)
 		return;
+	if (compression)
+		index_blocks_ = (disk_blocks_ - XCDFS_REGISTRY_BLOCKS) / (XCDFS_COMPRESSED_INDEX_BLOCKS + XCDFS_COMPRESSED_EXTENT_BLOCKS);
+	else
+		index_blocks_ = (disk_blocks_ - XCDFS_REGISTRY_BLOCKS) / (1 + XCDFS_ENTRIES_PER_INDEX_BLOCK);
+}
+
+XCodecDisk::Member::~Member()
+{
+#ifdef THREADS
+	if (io_ != NULL) {
+		io_->stop();
+		io_->join();
+		delete io_;
+		io_ = NULL;
+	}
+#endif
+	if (fd_ != -1) {
+		::close(fd_);
+		fd_ = -1;
 	}
+}
 
-	if (!registry_load())
-		HALT(log_) << "Could not load registry and cannot recover.";
+XCodecDisk::XCodecDisk(const std::vector<Member *>& members, bool direct, bool compression, uint64_t buffer_size, XCodecMemoryStore *buffer_store)
+: log_("/xcodec/disk"),
+  members_(members),
+  direct_(direct),
+  compression_(compression),
+  xuid_cache_map_(),
+  uuid_xuid_map_(),
+  buffer_cache_(),
+  buffer_cache_lru_(),
+  buffer_size_(buffer_size),
+  buffer_cache_limit_(buffer_size / XCDFS_BLOCK_SIZE),
+  buffer_store_(buffer_store)
+{
+	std::vector<Member *>::iterator mit;
 
-	std::map<uint64_t, uint64_t> counter_index_map;
-	for (o = 0; o < index_blocks_; o++) {
-		uint64_t counter;
-		if (!index_read_counter(o, &counter))
-			HALT(log_) << "Could not read counter for index block #" << o << ".";
-		if (counter == 0) {
-			DEBUG(log_) << "Free index block found at index block #" << o << ".";
-			counter_index_map[0] = o;
-			break;
+	ASSERT(log_, XCDFS_BLOCK_SIZE == XCODEC_SEGMENT_LENGTH);
+	ASSERT(log_, !members_.empty());
+	ASSERT(log_, members_.size() <= XCDFS_MEMBER_MAX);
+
+	for (mit = members_.begin(); mit != members_.end(); ++mit) {
+		Member *m = *mit;
+
+		DEBUG(log_) << "Member #" << m->index_ << " is " << m->stats_.path_ << ".";
+		if (compression_) {
+			DEBUG(log_) << "Opened compressed disk with " << m->index_blocks_ << " extents.  Block size is " << XCDFS_BLOCK_SIZE << ".";
+			DEBUG(log_) << "Disk maps up to " << (m->index_blocks_ * XCDFS_COMPRESSED_ENTRIES_PER_INDEX_BLOCK) << " segments in " << (m->index_blocks_ * XCDFS_COMPRESSED_EXTENT_BLOCKS) << " data blocks.";
+			DEBUG(log_) << "Volume size " << (m->disk_blocks_ * XCDFS_BLOCK_SIZE) << ".";
+			DEBUG(log_) << "Actual size of store and metadata " << ((XCDFS_REGISTRY_BLOCKS + (XCDFS_COMPRESSED_INDEX_BLOCKS + XCDFS_COMPRESSED_EXTENT_BLOCKS) * m->index_blocks_) * XCDFS_BLOCK_SIZE) << ".";
+			continue;
 		}
-		if (counter > index_block_counter_)
-			index_block_counter_ = counter + 1;
-		counter_index_map[counter] = o;
+		DEBUG(log_) << "Opened disk with " << m->index_blocks_ << " index blocks.  Block size is " << XCDFS_BLOCK_SIZE << ".";
+		DEBUG(log_) << "Disk maps " << (m->index_blocks_ * XCDFS_ENTRIES_PER_INDEX_BLOCK) << " data blocks.";
+		DEBUG(log_) << "Volume size " << (m->disk_blocks_ * XCDFS_BLOCK_SIZE) << ".";
+		DEBUG(log_) << "Actual size of store and metadata " << ((XCDFS_REGISTRY_BLOCKS + m->index_blocks_ + (XCDFS_ENTRIES_PER_INDEX_BLOCK * m->index_blocks_)) * XCDFS_BLOCK_SIZE) << ".";
+		DEBUG(log_) << "Wasted space " << ((m->disk_blocks_ - (XCDFS_REGISTRY_BLOCKS + m->index_blocks_ + (XCDFS_ENTRIES_PER_INDEX_BLOCK * m->index_blocks_))) * XCDFS_BLOCK_SIZE) << ".";
 	}
-
-	std::map<uint64_t, uint64_t>::iterator it;
-	if ((it = counter_index_map.begin()) != counter_index_map.end()) {
-		if (it->first == 0) {
-			DEBUG(log_) << "Write head is at first free index block; index block #" << it->second << ".";
-		} else {
-			DEBUG(log_) << "Lowest counter found in index block #" << it->second << ".  This will be the write head.";
-		}
-		current_index_block_ = it->second;
-
-		/*
-		 * We do not want to load entries from the index we are
-		 * about to erase.  There is no code to invalidate them
-		 * once we begin writing.
-		 */
-		counter_index_map.erase(it);
+	DEBUG(log_) << "Using " << XCDFS_REGISTRY_BLOCKS << " registry blocks to map " << XCDFS_XUID_COUNT << " namespaces.";
+	if (buffer_store_ != NULL) {
+		ASSERT(log_, buffer_cache_limit_ == 0);
+		buffer_store_->attach(this);
+		DEBUG(log_) << "Buffer cache is kept in a memory store.";
 	} else {
-		DEBUG(log_) << "This appears to be an empty disk; writing from start.";
+		if (compression_ && buffer_cache_limit_ == 0)
+			buffer_cache_limit_ = XCDFS_COMPRESSED_BUFFER_SIZE / XCDFS_BLOCK_SIZE;
+		DEBUG(log_) << "Buffer cache holds " << buffer_cache_limit_ << " data blocks.";
 	}
 
-	/*
-	 * XXX
-	 * We should detect ordering corruption also, unless we want to
-	 * overwrite things in counter order and assign counters to free
-	 * indices, and thereby be able to do something more like LRU
-	 * replacement rather than FIFO.  This would actually be a small
-	 * step, given our use of counters to detect FIFO head and tail
-	 * already.
-	 *
-	 * We would just have a map (or other sorted queue) of counter
-	 * to block, and assign the next counter to a block on use and
-	 * on touch.  There is still the problem of getting rid of stale
-	 * segments around hot ones, but that's easier; we could track
-	 * the number of times a block gets its counter bumped and cap
-	 * that in proportion to the size of the disk cache, forcing its
-	 * entries to be rewritten on use or touch once the block itself
-	 * has spoiled.  This would require no additional on-disk
-	 * metadata, a number of more disk writes (which we could also
-	 * cap proportionally), and only a little more in-memory
-	 * overhead, since we can always let blocks warm back up once
-	 * we have to restart.
-	 *
-	 * Even easier, though breaking with some of the current design
-	 * decisions, would be to have the index pages include XUID,
-	 * hash, and counter for each data block, and just LRU the data
-	 * blocks themselves, rather than the index blocks.  This has a
-	 * cost in terms of inserts to the index, but with the current
-	 * consistency model, would not actually need to be much worse,
-	 * especially if we mmap(2) the index blocks and let the kernel
-	 * do the work there.
-	 */
-	unsigned leading = XCDFS_CHECK_BOUNDARY;
-	while ((it = counter_index_map.begin()) != counter_index_map.end()) {
-		/*
-		 * We want to check the first N and last N index pages.
-		 * These are the ones most likely to have not yet been
-		 * synced, or to have been overwritten, and we need to
-		 * discard any inconsistencies they may hold.
-		 *
-		 * By loading in counter order, we also ensure that we
-		 * will use the newest version of each hash, and will
-		 * evict a hash if it has been reused, but the reused
-		 * one has been corrupted.
-		 */
-		bool need_check;
-		if (leading != 0) {
-			need_check = true;
-			leading--;
-		} else if (counter_index_map.size() <= XCDFS_CHECK_BOUNDARY) {
-			need_check = true;
-		} else {
-			need_check = false;
-		}
+	if (members_[0]->stats_.direct_ && buffer_cache_limit_ == 0 && buffer_store_ == NULL)
+		INFO(log_) << "Using direct I/O without a buffer cache; every lookup will go to disk.";
 
-		if (!index_load_entries(it->second, need_check))
-			HALT(log_) << "Could not load index block #" << o << ".";
-		counter_index_map.erase(it);
+	if (!registry_load())
+		HALT(log_) << "Could not load registry and cannot recover.";
+
+	for (mit = members_.begin(); mit != members_.end(); ++mit) {
+		if (!index_load(*mit))
+			HALT(log_) << "Could not load index for member #" << (*mit)->index_ << ".";
 	}
 
 	if (!registry_collect())
 		HALT(log_) << "Could not collect unused entries from registry.";
 
-	if (index_block_counter_ == 0)
-		index_block_counter_ = 1;
-	index_block_.append(&index_block_counter_);
+	for (mit = members_.begin(); mit != members_.end(); ++mit) {
+		Member *m = *mit;
+
+		if (m->index_block_counter_ == 0)
+			m->index_block_counter_ = 1;
+		index_begin(m);
+
+#ifdef THREADS
+		m->io_ = new XCodecDiskIOThread(m->stats_.path_, m->fd_);
+		m->io_->start();
+#endif
+	}
 }
 
 /*
  * XXX
  * Want support for device block size being a multiple or divisor of the logical block size.
+ *
+ * All I/O goes through aligned BufferSegments so that it is suitable for
+ * use with O_DIRECT.
  */
 bool
-XCodecDisk::block_read(Buffer *buf, uint64_t blockno)
+XCodecDisk::block_read(Member *m, Buffer *buf, uint64_t blockno)
 {
-	ASSERT(log_, blockno < disk_blocks_);
-	uint8_t block[XCDFS_BLOCK_SIZE];
-	ssize_t amt = ::pread(fd_, block, XCDFS_BLOCK_SIZE, blockno * XCDFS_BLOCK_SIZE);
-	if (amt == -1)
+	BufferSegment *seg;
+	if (!block_read(m, &seg, blockno))
 		return (false);
-	ASSERT_EQUAL(log_, amt, XCDFS_BLOCK_SIZE);
-	buf->append(block, sizeof block);
+	buf->append(seg);
+	seg->unref();
 	return (true);
 }
 
@@ -259,63 +427,426 @@ XCodecDisk::block_read(Buffer *buf, uint64_t blockno)
  * than the whole XCDFS block.
  */
 bool
-XCodecDisk::block_write(Buffer *buf, uint64_t blockno)
+XCodecDisk::block_write(Member *m, Buffer *buf, uint64_t blockno)
 {
 	ASSERT(log_, buf->length() == XCDFS_BLOCK_SIZE);
-	ASSERT(log_, blockno < disk_blocks_);
-	uint8_t block[XCDFS_BLOCK_SIZE];
-	buf->copyout(block, sizeof block);
-	ssize_t amt = ::pwrite(fd_, block, XCDFS_BLOCK_SIZE, blockno * XCDFS_BLOCK_SIZE);
-	if (amt == -1)
+	BufferSegment *seg = BufferSegment::create_aligned();
+	buf->copyout(seg->head(), XCDFS_BLOCK_SIZE);
+	seg->set_length(XCDFS_BLOCK_SIZE);
+	bool ok = block_write(m, seg, blockno);
+	seg->unref();
+	if (!ok)
 		return (false);
 	buf->clear();
-	ASSERT_EQUAL(log_, amt, XCDFS_BLOCK_SIZE);
 	return (true);
 }
 
 bool
-XCodecDisk::block_read(BufferSegment **segp, uint64_t blockno)
+XCodecDisk::block_read(Member *m, BufferSegment **segp, uint64_t blockno)
 {
-	ASSERT(log_, blockno < disk_blocks_);
-	BufferSegment *seg = BufferSegment::create();
-	ssize_t amt = ::pread(fd_, seg->head(), XCDFS_BLOCK_SIZE, blockno * XCDFS_BLOCK_SIZE);
+	ASSERT(log_, blockno < m->disk_blocks_);
+#ifdef THREADS
+	if (m->io_ != NULL) {
+		BufferSegment *pseg = m->io_->queued(blockno);
+		if (pseg != NULL) {
+			*segp = pseg;
+			return (true);
+		}
+	}
+#endif
+	BufferSegment *seg = BufferSegment::create_aligned();
+	ssize_t amt = ::pread(m->fd_, seg->head(), XCDFS_BLOCK_SIZE, blockno * XCDFS_BLOCK_SIZE);
 	if (amt == -1) {
+		m->stats_.read_errors_++;
 		seg->unref();
 		return (false);
 	}
 	ASSERT_EQUAL(log_, amt, XCDFS_BLOCK_SIZE);
+	m->stats_.reads_++;
 	seg->set_length(XCDFS_BLOCK_SIZE);
 	*segp = seg;
 	return (true);
 }
 
 bool
-XCodecDisk::block_write(const BufferSegment *seg, uint64_t blockno)
+XCodecDisk::block_write(Member *m, const BufferSegment *seg, uint64_t blockno)
 {
 	ASSERT(log_, seg->length() == XCDFS_BLOCK_SIZE);
-	ASSERT(log_, blockno < disk_blocks_);
-	ssize_t amt = ::pwrite(fd_, seg->data(), XCDFS_BLOCK_SIZE, blockno * XCDFS_BLOCK_SIZE);
-	if (amt == -1)
+	ASSERT(log_, blockno < m->disk_blocks_);
+
+	/*
+	 * Segments which come from the network are not aligned, and must
+	 * be bounced through an aligned segment for direct I/O.
+	 */
+	BufferSegment *bounce = NULL;
+	if (m->stats_.direct_ && ((uintptr_t)seg->data() % BUFFER_SEGMENT_ALIGNMENT) != 0) {
+		bounce = BufferSegment::create_aligned();
+		seg->copyout(bounce->head(), 0, XCDFS_BLOCK_SIZE);
+		bounce->set_length(XCDFS_BLOCK_SIZE);
+		seg = bounce;
+	}
+
+#ifdef THREADS
+	if (m->io_ != NULL) {
+		/*
+		 * The I/O thread only reads the data, and the segment is
+		 * copied before any write to it while the I/O thread holds
+		 * its reference.
+		 */
+		m->io_->write(blockno, const_cast<BufferSegment *>(seg));
+		if (bounce != NULL)
+			bounce->unref();
+		return (true);
+	}
+#endif
+
+	ssize_t amt = ::pwrite(m->fd_, seg->data(), XCDFS_BLOCK_SIZE, blockno * XCDFS_BLOCK_SIZE);
+	if (bounce != NULL)
+		bounce->unref();
+	if (amt == -1) {
+		m->stats_.write_errors_++;
 		return (false);
+	}
 	ASSERT_EQUAL(log_, amt, XCDFS_BLOCK_SIZE);
+	m->stats_.writes_++;
+	return (true);
+}
+
+bool
+XCodecDisk::data_read(BufferSegment **segp, uint64_t offset)
+{
+	uint64_t member = offset >> XCDFS_MEMBER_SHIFT;
+	ASSERT(log_, member < members_.size());
+	if (compression_)
+		return (extent_read(members_[member], segp, offset & XCDFS_MEMBER_BLOCK_MASK));
+	return (block_read(members_[member], segp, offset & XCDFS_MEMBER_BLOCK_MASK));
+}
+
+/*
+ * Writes a segment to the next free space on a member, returning its address.
+ */
+bool
+XCodecDisk::data_write(Member *m, BufferSegment *seg, uint64_t *offsetp)
+{
+	if (!compression_) {
+		uint64_t offset = data_block_address(m, m->current_index_block_, m->index_block_next_);
+		if (!block_write(m, seg, offset & XCDFS_MEMBER_BLOCK_MASK))
+			return (false);
+		m->stats_.stored_segments_++;
+		m->stats_.stored_bytes_ += XCDFS_BLOCK_SIZE;
+		*offsetp = offset;
+		return (true);
+	}
+
+	uint8_t data[XCDFS_BLOCK_SIZE];
+	uint8_t cdata[XCDFS_BLOCK_SIZE];
+	uLongf clen = sizeof cdata;
+	uint16_t header;
+
+	seg->copyout(data, 0, sizeof data);
+
+	/*
+	 * Segments which do not compress are stored as they are.
+	 */
+	int error = ::compress2(cdata, &clen, data, sizeof data, Z_BEST_SPEED);
+	if (error == Z_OK && clen < sizeof data)
+		header = XCDFS_RECORD_DEFLATE | clen;
+	else
+		header = sizeof data;
+
+	size_t length = sizeof header + (header & XCDFS_RECORD_LENGTH_MASK);
+	if (m->extent_next_ + length > XCDFS_COMPRESSED_EXTENT_BLOCKS * XCDFS_BLOCK_SIZE)
+		index_advance(m);
+
+	*offsetp = extent_address(m, m->current_index_block_, m->extent_next_);
+
+	m->extent_.append(&header);
+	if ((header & XCDFS_RECORD_DEFLATE) != 0)
+		m->extent_.append(cdata, header & XCDFS_RECORD_LENGTH_MASK);
+	else
+		m->extent_.append(data, sizeof data);
+	m->extent_next_ += length;
+
+	m->stats_.stored_segments_++;
+	m->stats_.stored_bytes_ += length;
+
+	return (extent_flush(m, false));
+}
+
+/*
+ * Returns the address of a byte within the extent following an index block.
+ */
+uint64_t
+XCodecDisk::extent_address(const Member *m, uint64_t index_block, uint64_t offset) const
+{
+	ASSERT(log_, offset < XCDFS_COMPRESSED_EXTENT_BLOCKS * XCDFS_BLOCK_SIZE);
+	uint64_t address = extent_block(m, index_block) * XCDFS_BLOCK_SIZE + offset;
+	ASSERT(log_, address <= XCDFS_MEMBER_BLOCK_MASK);
+	return (((uint64_t)m->index_ << XCDFS_MEMBER_SHIFT) | address);
+}
+
+uint64_t
+XCodecDisk::extent_block(const Member *m, uint64_t index_block) const
+{
+	ASSERT(log_, index_block < m->index_blocks_);
+	return (XCDFS_REGISTRY_BLOCKS + (m->index_blocks_ * XCDFS_COMPRESSED_INDEX_BLOCKS) + (index_block * XCDFS_COMPRESSED_EXTENT_BLOCKS));
+}
+
+/*
+ * Reads a block of an extent, which, if it is part of the tail of the extent
+ * currently being filled, may be only partly written and only in memory.
+ */
+bool
+XCodecDisk::extent_block_read(Member *m, Buffer *buf, uint64_t blockno)
+{
+	uint64_t first = extent_block(m, m->current_index_block_) + (m->extent_flushed_ / XCDFS_BLOCK_SIZE);
+	uint64_t last = extent_block(m, m->current_index_block_) + XCDFS_COMPRESSED_EXTENT_BLOCKS;
+
+	if (blockno < first || blockno >= last)
+		return (block_read(m, buf, blockno));
+
+	size_t offset = (blockno - first) * XCDFS_BLOCK_SIZE;
+	if (offset >= m->extent_.length())
+		return (false);
+	size_t length = std::min(m->extent_.length() - offset, (size_t)XCDFS_BLOCK_SIZE);
+
+	uint8_t data[XCDFS_BLOCK_SIZE];
+	m->extent_.copyout(data, offset, length);
+	buf->append(data, length);
 	return (true);
 }
 
+/*
+ * Writes out whatever whole blocks are at the tail of the current extent,
+ * or with pad, all of the tail, padded to a whole block.
+ */
+bool
+XCodecDisk::extent_flush(Member *m, bool pad)
+{
+	while (m->extent_.length() >= XCDFS_BLOCK_SIZE || (pad && !m->extent_.empty())) {
+		uint64_t blockno = extent_block(m, m->current_index_block_) + (m->extent_flushed_ / XCDFS_BLOCK_SIZE);
+		Buffer block;
+
+		if (m->extent_.length() >= XCDFS_BLOCK_SIZE) {
+			m->extent_.moveout(&block, XCDFS_BLOCK_SIZE);
+		} else {
+			uint8_t zero[XCDFS_BLOCK_SIZE];
+			memset(zero, 0, sizeof zero);
+
+			m->extent_.moveout(&block);
+			block.append(zero, XCDFS_BLOCK_SIZE - block.length());
+		}
+		m->extent_flushed_ += XCDFS_BLOCK_SIZE;
+
+		if (!block_write(m, &block, blockno)) {
+			ERROR(log_) << "Could not write extent block.";
+			return (false);
+		}
+	}
+	return (true);
+}
+
+bool
+XCodecDisk::extent_read(Member *m, BufferSegment **segp, uint64_t address)
+{
+	uint64_t blockno = address / XCDFS_BLOCK_SIZE;
+	size_t skip = address % XCDFS_BLOCK_SIZE;
+	size_t length = 0;
+	uint16_t header = 0;
+	Buffer raw;
+
+	while (length == 0 || raw.length() < length) {
+		if (!extent_block_read(m, &raw, blockno++))
+			return (false);
+		if (length == 0 && raw.length() >= skip + sizeof header) {
+			raw.extract(&header, skip);
+			if ((header & XCDFS_RECORD_LENGTH_MASK) == 0 ||
+			    (header & XCDFS_RECORD_LENGTH_MASK) > XCDFS_BLOCK_SIZE) {
+				ERROR(log_) << "Invalid record header in extent.";
+				return (false);
+			}
+			length = skip + sizeof header + (header & XCDFS_RECORD_LENGTH_MASK);
+		}
+	}
+
+	uint8_t cdata[XCDFS_BLOCK_SIZE];
+	uLongf clen = header & XCDFS_RECORD_LENGTH_MASK;
+	raw.copyout(cdata, skip + sizeof header, clen);
+
+	BufferSegment *seg = BufferSegment::create();
+	if ((header & XCDFS_RECORD_DEFLATE) == 0) {
+		if (clen != XCDFS_BLOCK_SIZE) {
+			ERROR(log_) << "Uncompressed record in extent is truncated.";
+			seg->unref();
+			return (false);
+		}
+		memcpy(seg->head(), cdata, XCDFS_BLOCK_SIZE);
+	} else {
+		uLongf dlen = XCDFS_BLOCK_SIZE;
+		int error = ::uncompress(seg->head(), &dlen, cdata, clen);
+		if (error != Z_OK || dlen != XCDFS_BLOCK_SIZE) {
+			ERROR(log_) << "Could not decompress record in extent.";
+			seg->unref();
+			return (false);
+		}
+	}
+	seg->set_length(XCDFS_BLOCK_SIZE);
+	*segp = seg;
+	return (true);
+}
+
+/*
+ * In a memory store, the store evicts from us, as from any of its caches,
+ * when it needs room.
+ */
+void
+XCodecDisk::buffer_cache_enter(uint64_t offset, uint64_t name, BufferSegment *seg)
+{
+	if (buffer_cache_limit_ == 0 && buffer_store_ == NULL)
+		return;
+
+	buffer_cache_remove(offset);
+
+	if (buffer_store_ == NULL) {
+		if (buffer_cache_lru_.active() == buffer_cache_limit_)
+			evict();
+
+		BufferCacheEntry entry(seg, name, NULL);
+		entry.counter_ = buffer_cache_lru_.enter(offset);
+		buffer_cache_.insert(buffer_cache_t::value_type(offset, entry));
+		return;
+	}
+
+	XCodecMemoryStore::Segment *segment = buffer_store_->enter(name, seg);
+	BufferCacheEntry entry(segment->seg_, name, segment);
+	entry.counter_ = buffer_cache_lru_.enter(offset);
+	buffer_cache_.insert(buffer_cache_t::value_type(offset, entry));
+	buffer_store_->usage(this, buffer_cache_.size() - 1, buffer_cache_.size());
+}
+
+BufferSegment *
+XCodecDisk::buffer_cache_lookup(uint64_t offset, bool use)
+{
+	buffer_cache_t::iterator it = buffer_cache_.find(offset);
+	if (it == buffer_cache_.end())
+		return (NULL);
+
+	BufferCacheEntry& entry = it->second;
+	if (use)
+		entry.counter_ = buffer_cache_lru_.use(offset, entry.counter_);
+	entry.seg_->ref();
+	return (entry.seg_);
+}
+
+void
+XCodecDisk::buffer_cache_remove(uint64_t offset)
+{
+	buffer_cache_t::iterator it = buffer_cache_.find(offset);
+	if (it == buffer_cache_.end())
+		return;
+	buffer_cache_lru_.remove(offset, it->second.counter_);
+	if (buffer_store_ == NULL) {
+		buffer_cache_.erase(it);
+		return;
+	}
+	buffer_store_->release(it->second.name_, it->second.segment_);
+	buffer_cache_.erase(it);
+	buffer_store_->usage(this, buffer_cache_.size() + 1, buffer_cache_.size());
+}
+
+/*
+ * Remove the least-recently-used block from the buffer cache.
+ */
+void
+XCodecDisk::evict(void)
+{
+	ASSERT(log_, buffer_cache_lru_.active() != 0);
+	buffer_cache_remove(buffer_cache_lru_.oldest());
+}
+
 uint64_t
-XCodecDisk::data_block_address(uint64_t index_block, unsigned entry) const
+XCodecDisk::data_block_address(const Member *m, uint64_t index_block, unsigned entry) const
 {
-	ASSERT(log_, index_block < index_blocks_);
+	ASSERT(log_, index_block < m->index_blocks_);
 	ASSERT(log_, entry < XCDFS_ENTRIES_PER_INDEX_BLOCK);
-	return (XCDFS_REGISTRY_BLOCKS + index_blocks_ + (index_block * XCDFS_ENTRIES_PER_INDEX_BLOCK) + entry);
+	uint64_t blockno = XCDFS_REGISTRY_BLOCKS + m->index_blocks_ + (index_block * XCDFS_ENTRIES_PER_INDEX_BLOCK) + entry;
+	ASSERT(log_, blockno <= XCDFS_MEMBER_BLOCK_MASK);
+	return (((uint64_t)m->index_ << XCDFS_MEMBER_SHIFT) | blockno);
 }
 
 uint64_t
-XCodecDisk::index_block_address(uint64_t index_block) const
+XCodecDisk::index_block_address(const Member *m, uint64_t index_block) const
 {
-	ASSERT(log_, index_block < index_blocks_);
+	ASSERT(log_, index_block < m->index_blocks_);
+	if (compression_)
+		return (XCDFS_REGISTRY_BLOCKS + (index_block * XCDFS_COMPRESSED_INDEX_BLOCKS));
 	return (XCDFS_REGISTRY_BLOCKS + index_block);
 }
 
+/*
+ * Writes out the current index block and any extent that goes with it, and
+ * moves the write head on to the next, forgetting what is there now.
+ */
+void
+XCodecDisk::index_advance(Member *m)
+{
+	DEBUG(log_) << "Filled index block; writing to disk.";
+	/*
+	 * Filled index block, write it out.
+	 *
+	 * NB: We optimize for the common insert case at the cost of a
+	 *     little consistency and to minimize the number of writes
+	 *     we have to do in total.
+	 */
+	if (compression_ && !extent_flush(m, true))
+		ERROR(log_) << "Failed to write extent; expect inconsistency.";
+	if (!index_write(m)) {
+		ERROR(log_) << "Failed to write index block update; expect inconsistency.";
+		m->index_block_.clear();
+	}
+	ASSERT(log_, m->index_block_.empty());
+
+	if (++m->current_index_block_ == m->index_blocks_)
+		m->current_index_block_ = 0;
+	m->index_block_next_ = 0;
+	m->extent_.clear();
+	m->extent_next_ = 0;
+	m->extent_flushed_ = 0;
+
+	/*
+	 * We are going to be rewriting the entries associated
+	 * with the new index block; purge them from memory.
+	 */
+	if (!index_invalidate_entries(m, m->current_index_block_))
+		ERROR(log_) << "Could not invalidate new index block; expect inconsistency.";
+
+	/* A counter of 0 always indicates unused.  */
+	if ((++m->index_block_counter_ & XCDFS_COUNTER_MASK) == 0)
+		m->index_block_counter_ = 1;
+	index_begin(m);
+}
+
+void
+XCodecDisk::index_begin(Member *m)
+{
+	ASSERT(log_, m->index_block_.empty());
+	ASSERT(log_, (m->index_block_counter_ & ~XCDFS_COUNTER_MASK) == 0);
+
+	uint64_t counter = m->index_block_counter_;
+	counter |= (uint64_t)XCDFS_VERSION << XCDFS_COUNTER_VERSION_SHIFT;
+	if (compression_)
+		counter |= XCDFS_COUNTER_COMPRESSED;
+	m->index_block_.append(&counter);
+}
+
+unsigned
+XCodecDisk::index_entries(void) const
+{
+	if (compression_)
+		return (XCDFS_COMPRESSED_ENTRIES_PER_INDEX_BLOCK);
+	return (XCDFS_ENTRIES_PER_INDEX_BLOCK);
+}
+
 /*
  * Note that we do not invalidate on-disk, because we have no need to.
  *
@@ -325,90 +856,177 @@ XCodecDisk::index_block_address(uint64_t index_block) const
  * simple matter to check the last N indices and invalidate them.
  */
 bool
-XCodecDisk::index_invalidate_entries(uint64_t index_block)
+XCodecDisk::index_invalidate_entries(Member *m, uint64_t index_block)
 {
-	Buffer idx;
+	std::vector<IndexEntry> entries;
+	std::vector<IndexEntry>::const_iterator it;
+	uint64_t counter;
 
 	/*
 	 * Read in the index block and invalidate all entries
 	 * that are currently active and primary.
 	 */
-	if (!block_read(&idx, index_block_address(index_block))) {
+	if (!index_read(m, index_block, &counter, &entries)) {
 		ERROR(log_) << "Could not read index to be invalidated.";
 		return (false);
 	}
 
-	uint64_t counter;
-	idx.moveout(&counter);
-
 	if (counter == 0) {
 		DEBUG(log_) << "Skipping invalidate for free index.";
 		return (true);
 	}
 
-	unsigned i;
-	for (i = 0; i < XCDFS_ENTRIES_PER_INDEX_BLOCK; i++) {
-		uint16_t xuid;
-		idx.moveout(&xuid);
-
-		uint64_t hash;
-		idx.moveout(&hash);
-
-		if (hash == 0)
-			continue;
+	for (it = entries.begin(); it != entries.end(); ++it) {
+		buffer_cache_remove(it->offset_);
 
 		std::map<uint16_t, XCodecDiskCache *>::const_iterator xcit;
-		xcit = xuid_cache_map_.find(xuid);
+		xcit = xuid_cache_map_.find(it->xuid_);
 		if (xcit == xuid_cache_map_.end())
 			continue;
 		XCodecDiskCache *cache = xcit->second;
 		ASSERT_NON_NULL(log_, cache);
 
-		XCodecDiskCache::hash_cache_t::iterator hcit;
-		hcit = cache->hash_cache_.find(hash);
-		if (hcit == cache->hash_cache_.end()) {
-			DEBUG(log_) << "Skipping invalidate for absent hash.";
-			continue;
+		XCodecDiskCache::hash_cache_t::iterator hcit;
+		hcit = cache->hash_cache_.find(it->hash_);
+		if (hcit == cache->hash_cache_.end()) {
+			DEBUG(log_) << "Skipping invalidate for absent hash.";
+			continue;
+		}
+		const uint64_t& offset = hcit->second;
+		if (offset != it->offset_) {
+			DEBUG(log_) << "Skipping invalidate for old, inactive hash.";
+			continue;
+		}
+		cache->retire(it->hash_);
+		cache->hash_cache_.erase(hcit);
+	}
+
+	return (true);
+}
+
+bool
+XCodecDisk::index_load(Member *m)
+{
+	uint64_t o;
+
+	std::map<uint64_t, uint64_t> counter_index_map;
+	for (o = 0; o < m->index_blocks_; o++) {
+		uint64_t counter;
+		if (!index_read_counter(m, o, &counter))
+			HALT(log_) << "Could not read counter for index block #" << o << ".";
+		if (counter == 0) {
+			DEBUG(log_) << "Free index block found at index block #" << o << ".";
+			counter_index_map[0] = o;
+			break;
+		}
+		if (counter > m->index_block_counter_)
+			m->index_block_counter_ = counter + 1;
+		counter_index_map[counter] = o;
+	}
+
+	std::map<uint64_t, uint64_t>::iterator it;
+	if ((it = counter_index_map.begin()) != counter_index_map.end()) {
+		if (it->first == 0) {
+			DEBUG(log_) << "Write head is at first free index block; index block #" << it->second << ".";
+		} else {
+			DEBUG(log_) << "Lowest counter found in index block #" << it->second << ".  This will be the write head.";
+		}
+		m->current_index_block_ = it->second;
+
+		/*
+		 * We do not want to load entries from the index we are
+		 * about to erase.  There is no code to invalidate them
+		 * once we begin writing.
+		 */
+		counter_index_map.erase(it);
+	} else {
+		DEBUG(log_) << "This appears to be an empty disk; writing from start.";
+	}
+
+	/*
+	 * XXX
+	 * We should detect ordering corruption also, unless we want to
+	 * overwrite things in counter order and assign counters to free
+	 * indices, and thereby be able to do something more like LRU
+	 * replacement rather than FIFO.  This would actually be a small
+	 * step, given our use of counters to detect FIFO head and tail
+	 * already.
+	 *
+	 * We would just have a map (or other sorted queue) of counter
+	 * to block, and assign the next counter to a block on use and
+	 * on touch.  There is still the problem of getting rid of stale
+	 * segments around hot ones, but that's easier; we could track
+	 * the number of times a block gets its counter bumped and cap
+	 * that in proportion to the size of the disk cache, forcing its
+	 * entries to be rewritten on use or touch once the block itself
+	 * has spoiled.  This would require no additional on-disk
+	 * metadata, a number of more disk writes (which we could also
+	 * cap proportionally), and only a little more in-memory
+	 * overhead, since we can always let blocks warm back up once
+	 * we have to restart.
+	 *
+	 * Even easier, though breaking with some of the current design
+	 * decisions, would be to have the index pages include XUID,
+	 * hash, and counter for each data block, and just LRU the data
+	 * blocks themselves, rather than the index blocks.  This has a
+	 * cost in terms of inserts to the index, but with the current
+	 * consistency model, would not actually need to be much worse,
+	 * especially if we mmap(2) the index blocks and let the kernel
+	 * do the work there.
+	 */
+	unsigned leading = XCDFS_CHECK_BOUNDARY;
+	while ((it = counter_index_map.begin()) != counter_index_map.end()) {
+		/*
+		 * We want to check the first N and last N index pages.
+		 * These are the ones most likely to have not yet been
+		 * synced, or to have been overwritten, and we need to
+		 * discard any inconsistencies they may hold.
+		 *
+		 * By loading in counter order, we also ensure that we
+		 * will use the newest version of each hash, and will
+		 * evict a hash if it has been reused, but the reused
+		 * one has been corrupted.
+		 */
+		bool need_check;
+		if (leading != 0) {
+			need_check = true;
+			leading--;
+		} else if (counter_index_map.size() <= XCDFS_CHECK_BOUNDARY) {
+			need_check = true;
+		} else {
+			need_check = false;
 		}
-		const uint64_t& offset = hcit->second;
-		if (offset != data_block_address(index_block, i)) {
-			DEBUG(log_) << "Skipping invalidate for old, inactive hash.";
-			continue;
+
+		if (!index_load_entries(m, it->second, need_check)) {
+			ERROR(log_) << "Could not load index block #" << it->second << ".";
+			return (false);
 		}
-		cache->hash_cache_.erase(hcit);
+		counter_index_map.erase(it);
 	}
 
 	return (true);
 }
 
 bool
-XCodecDisk::index_load_entries(uint64_t index_block, bool check)
+XCodecDisk::index_load_entries(Member *m, uint64_t index_block, bool check)
 {
-	Buffer idx;
+	std::vector<IndexEntry> entries;
+	std::vector<IndexEntry>::const_iterator it;
+	uint64_t counter;
 
-	if (!block_read(&idx, index_block_address(index_block))) {
+	if (!index_read(m, index_block, &counter, &entries)) {
 		ERROR(log_) << "Could not read index to be loaded.";
 		return (false);
 	}
 
-	uint64_t counter;
-	idx.moveout(&counter);
-
 	if (counter == 0) {
 		ERROR(log_) << "Block became free during index load.";
 		return (false);
 	}
 
-	unsigned i;
-	for (i = 0; i < XCDFS_ENTRIES_PER_INDEX_BLOCK; i++) {
-		uint16_t xuid;
-		idx.moveout(&xuid);
-
-		uint64_t hash;
-		idx.moveout(&hash);
-
-		if (hash == 0)
-			continue;
+	for (it = entries.begin(); it != entries.end(); ++it) {
+		const uint16_t& xuid = it->xuid_;
+		const uint64_t& hash = it->hash_;
 
 		std::map<uint16_t, XCodecDiskCache *>::const_iterator xcit;
 		xcit = xuid_cache_map_.find(xuid);
@@ -442,18 +1060,18 @@ XCodecDisk::index_load_entries(uint64_t index_block, bool check)
 			cache->hash_cache_.erase(hcit);
 		}
 
-		const uint64_t& offset = data_block_address(index_block, i);
+		const uint64_t& offset = it->offset_;
 
 		if (check) {
 			BufferSegment *seg;
-			if (!block_read(&seg, offset)) {
+			if (!data_read(&seg, offset)) {
 				ERROR(log_) << "Could not read data entry for check.";
 				return (false);
 			}
 
 			uint64_t ohash = XCodecHash::hash(seg->data());
 			seg->unref();
-			if (ohash != hash) {
+			if (ohash != XCODEC_NAME_HASH(hash)) {
 				INFO(log_) << "Removing invalid cache entry during check.";
 
 				/*
@@ -462,13 +1080,13 @@ XCodecDisk::index_load_entries(uint64_t index_block, bool check)
 				 * are where we (assume) there has been the most recent
 				 * activity that we have no desire to keep.
 				 */
-				if (current_index_block_ > index_block) {
-					if (!index_invalidate_entries(index_block)) {
+				if (m->current_index_block_ > index_block) {
+					if (!index_invalidate_entries(m, index_block)) {
 						ERROR(log_) << "Could not remove invalid index entries from block with errors.  Expect inconsistency.";
 						return (false);
 					}
 					DEBUG(log_) << "Resetting current index to rewrite index block with errors.";
-					current_index_block_ = index_block;
+					m->current_index_block_ = index_block;
 					return (true);
 				}
 				continue;
@@ -481,12 +1099,60 @@ XCodecDisk::index_load_entries(uint64_t index_block, bool check)
 	return (true);
 }
 
+/*
+ * Reads the counter and the valid entries of an index block.
+ */
+bool
+XCodecDisk::index_read(Member *m, uint64_t index_block, uint64_t *counterp, std::vector<IndexEntry> *entries)
+{
+	uint64_t blockno = index_block_address(m, index_block);
+	Buffer idx;
+	unsigned i;
+
+	for (i = 0; i < (compression_ ? XCDFS_COMPRESSED_INDEX_BLOCKS : 1); i++) {
+		if (!block_read(m, &idx, blockno + i))
+			return (false);
+	}
+
+	ASSERT_NON_NULL(log_, counterp);
+	idx.moveout(counterp);
+	if (XCDFS_COUNTER_VERSION(*counterp) != XCDFS_VERSION)
+		*counterp = 0;
+	*counterp &= XCDFS_COUNTER_MASK;
+
+	if (*counterp == 0)
+		return (true);
+
+	for (i = 0; i < index_entries(); i++) {
+		IndexEntry entry;
+		idx.moveout(&entry.xuid_);
+		idx.moveout(&entry.hash_);
+
+		if (!compression_) {
+			entry.offset_ = data_block_address(m, index_block, i);
+		} else {
+			uint32_t offset;
+			idx.moveout(&offset);
+
+			if (offset >= XCDFS_COMPRESSED_EXTENT_BLOCKS * XCDFS_BLOCK_SIZE)
+				continue;
+			entry.offset_ = extent_address(m, index_block, offset);
+		}
+
+		if (entry.hash_ == 0)
+			continue;
+		entries->push_back(entry);
+	}
+
+	return (true);
+}
+
 bool
-XCodecDisk::index_read_counter(uint64_t index_block, uint64_t *counterp)
+XCodecDisk::index_read_counter(Member *m, uint64_t index_block, uint64_t *counterp)
 {
 	Buffer idx;
 
-	if (!block_read(&idx, index_block_address(index_block))) {
+	if (!block_read(m, &idx, index_block_address(m, index_block))) {
 		ERROR(log_) << "Could not read index to be loaded.";
 		return (false);
 	}
@@ -494,6 +1160,56 @@ XCodecDisk::index_read_counter(uint64_t index_block, uint64_t *counterp)
 	ASSERT_NON_NULL(log_, counterp);
 	idx.moveout(counterp);
 
+	/*
+	 * An index block in an older format is as good as free.  Since the
+	 * first is where we would start writing anyway, one there means we
+	 * will be writing the whole disk over, whatever its layout.
+	 */
+	if (*counterp != 0 && XCDFS_COUNTER_VERSION(*counterp) != XCDFS_VERSION) {
+		if (index_block == 0)
+			INFO(log_) << "Disk was written in an older format; it will be written over.";
+		*counterp = 0;
+		return (true);
+	}
+
+	/*
+	 * The two layouts put their first index block in the same place, so
+	 * the flag there tells us whether the disk was written the way we
+	 * are about to read it.
+	 */
+	if (*counterp != 0 && ((*counterp & XCDFS_COUNTER_COMPRESSED) != 0) != compression_) {
+		ERROR(log_) << "Disk was written " << (compression_ ? "without" : "with") << " compression; it must be used the same way or recreated.";
+		return (false);
+	}
+	*counterp &= XCDFS_COUNTER_MASK;
+
+	return (true);
+}
+
+/*
+ * Writes out the index block being filled, padded to its full size.
+ */
+bool
+XCodecDisk::index_write(Member *m)
+{
+	uint64_t blockno = index_block_address(m, m->current_index_block_);
+	size_t size = (compression_ ? XCDFS_COMPRESSED_INDEX_BLOCKS : 1) * XCDFS_BLOCK_SIZE;
+
+	ASSERT(log_, m->index_block_.length() <= size);
+	if (m->index_block_.length() != size) {
+		uint8_t zero[XCDFS_BLOCK_SIZE];
+		memset(zero, 0, sizeof zero);
+
+		while (m->index_block_.length() != size)
+			m->index_block_.append(zero, std::min(size - m->index_block_.length(), sizeof zero));
+	}
+
+	while (!m->index_block_.empty()) {
+		Buffer block;
+		m->index_block_.moveout(&block, XCDFS_BLOCK_SIZE);
+		if (!block_write(m, &block, blockno++))
+			return (false);
+	}
 	return (true);
 }
 
@@ -535,24 +1251,88 @@ XCodecDisk::registry_collect(void)
 	return (true);
 }
 
+/*
+ * Every member carries a copy of the registry, so that the XUIDs in its
+ * index blocks can be interpreted.  The copies must agree; a member with
+ * an empty registry (i.e. a new member) is given a copy of the others.
+ */
 bool
 XCodecDisk::registry_load(void)
 {
+	std::vector<Member *>::iterator mit;
+	Member *source;
+	Buffer registry;
 	unsigned i, r;
 
-	for (r = 0; r < XCDFS_REGISTRY_BLOCKS; r++) {
-		Buffer reg;
+	source = NULL;
+	for (mit = members_.begin(); mit != members_.end(); ++mit) {
+		Member *m = *mit;
+		Buffer mregistry;
+
+		for (r = 0; r < XCDFS_REGISTRY_BLOCKS; r++) {
+			if (!block_read(m, &mregistry, r)) {
+				ERROR(log_) << "Could not read registry block for loading.";
+				return (false);
+			}
+		}
+
+		Buffer entries(mregistry);
+		while (!entries.empty()) {
+			if (!entries.prefix(zero_uuid, sizeof zero_uuid))
+				break;
+			entries.skip(UUID_SIZE);
+		}
+		if (entries.empty())
+			continue;
+
+		if (source == NULL) {
+			source = m;
+			registry = mregistry;
+			continue;
+		}
 
-		if (!block_read(&reg, r)) {
-			ERROR(log_) << "Could not read registry block for loading.";
+		if (!registry.equal(&mregistry)) {
+			ERROR(log_) << "Registry on member #" << m->index_ << " (" << m->stats_.path_ << ") does not match that on member #" << source->index_ << " (" << source->stats_.path_ << ").";
 			return (false);
 		}
+	}
+
+	if (source != NULL) {
+		for (mit = members_.begin(); mit != members_.end(); ++mit) {
+			Member *m = *mit;
+			Buffer mregistry;
+
+			for (r = 0; r < XCDFS_REGISTRY_BLOCKS; r++) {
+				if (!block_read(m, &mregistry, r)) {
+					ERROR(log_) << "Could not read registry block for loading.";
+					return (false);
+				}
+			}
+			if (registry.equal(&mregistry))
+				continue;
+
+			INFO(log_) << "Copying registry to new member #" << m->index_ << " (" << m->stats_.path_ << ").";
+			Buffer copy(registry);
+			for (r = 0; r < XCDFS_REGISTRY_BLOCKS; r++) {
+				Buffer reg;
+				copy.moveout(&reg, XCDFS_BLOCK_SIZE);
+				if (!block_write(m, &reg, r)) {
+					ERROR(log_) << "Could not write registry block to new member.";
+					return (false);
+				}
+			}
+		}
+	}
 
+	for (r = 0; r < XCDFS_REGISTRY_BLOCKS; r++) {
 		for (i = 0; i < XCDFS_REGISTRY_BLOCK_ENTRIES; i++) {
 			uint16_t xuid = r * XCDFS_REGISTRY_BLOCK_ENTRIES + i;
 
+			if (registry.empty())
+				break;
+
 			Buffer uuidbuf;
-			reg.moveout(&uuidbuf, UUID_SIZE);
+			registry.moveout(&uuidbuf, UUID_SIZE);
 			if (uuidbuf.equal(zero_uuid, sizeof zero_uuid))
 				continue;
 
@@ -601,37 +1381,46 @@ XCodecDisk::registry_load(void)
 	return (true);
 }
 
+/*
+ * Updates the registry on every member, so that they stay in agreement.
+ */
 bool
 XCodecDisk::registry_write(uint16_t xuid, const Buffer *uuidbuf)
 {
-	Buffer reg;
+	std::vector<Member *>::iterator mit;
+	uint64_t blockno;
 
 	ASSERT(log_, xuid < XCDFS_XUID_COUNT);
+	blockno = xuid / XCDFS_REGISTRY_BLOCK_ENTRIES;
 
-	/*
-	 * Read registry so we can update it.
-	 */
-	if (!block_read(&reg, xuid / XCDFS_REGISTRY_BLOCK_ENTRIES)) {
-		ERROR(log_) << "Could not read registry block for update.";
-		return (false);
-	}
+	for (mit = members_.begin(); mit != members_.end(); ++mit) {
+		Member *m = *mit;
+		Buffer reg;
+
+		/*
+		 * Read registry so we can update it.
+		 */
+		if (!block_read(m, &reg, blockno)) {
+			ERROR(log_) << "Could not read registry block for update.";
+			return (false);
+		}
 
-	uint8_t block[XCDFS_BLOCK_SIZE];
-	ASSERT(log_, reg.length() == sizeof block);
-	reg.moveout(block, sizeof block);
+		uint8_t block[XCDFS_BLOCK_SIZE];
+		ASSERT(log_, reg.length() == sizeof block);
+		reg.moveout(block, sizeof block);
 
-	uuidbuf->copyout(&block[(xuid % XCDFS_REGISTRY_BLOCK_ENTRIES) * UUID_SIZE], UUID_SIZE);
+		uuidbuf->copyout(&block[(xuid % XCDFS_REGISTRY_BLOCK_ENTRIES) * UUID_SIZE], UUID_SIZE);
 
-	reg.append(block, sizeof block);
+		reg.append(block, sizeof block);
 
-	if (!block_write(&reg, 0)) {
-		ERROR(log_) << "Failed to write registry update.";
-		return (false);
+		if (!block_write(m, &reg, blockno)) {
+			ERROR(log_) << "Failed to write registry update.";
+			return (false);
+		}
 	}
 
 	return (true);
 }
-
 XCodecDiskCache *
 XCodecDisk::local(void)
 {
@@ -691,57 +1480,46 @@ XCodecDisk::connect(const UUID& uuid)
 }
 
 void
-XCodecDisk::enter(XCodecDiskCache *cache, uint64_t hash, const BufferSegment *seg)
+XCodecDisk::enter(XCodecDiskCache *cache, uint64_t hash, BufferSegment *seg)
 {
 	ASSERT(log_, cache->hash_cache_.find(hash) == cache->hash_cache_.end());
 
-	index_block_.append(&cache->xuid_);
-	index_block_.append(&hash);
+	/*
+	 * Fold the hash before choosing a member, since its low bits
+	 * alone follow the data too closely to spread segments evenly.
+	 */
+	Member *m = members_[(hash ^ (hash >> 29) ^ (hash >> 47)) % members_.size()];
 
-	uint64_t offset = data_block_address(current_index_block_, index_block_next_);
-	if (!block_write(seg, offset)) {
+	uint64_t offset;
+	if (!data_write(m, seg, &offset)) {
 		ERROR(log_) << "Could not write data segment.";
 		return;
 	}
 
-	cache->hash_cache_[hash] = offset;
-
-	if (++index_block_next_ == XCDFS_ENTRIES_PER_INDEX_BLOCK) {
-		DEBUG(log_) << "Filled index block; writing to disk.";
-		/*
-		 * Filled index block, write it out.
-		 *
-		 * NB: We optimize for the common insert case at the cost of a
-		 *     little consistency and to minimize the number of writes
-		 *     we have to do in total.
-		 */
-		ASSERT(log_, index_block_.length() == XCDFS_BLOCK_SIZE);
-		if (!block_write(&index_block_, index_block_address(current_index_block_))) {
-			ERROR(log_) << "Failed to write index block update; expect inconsistency.";
-			index_block_.clear();
-		}
-		ASSERT(log_, index_block_.empty());
-
-		if (++current_index_block_ == index_blocks_)
-			current_index_block_ = 0;
-		index_block_next_ = 0;
+	/*
+	 * Writing a compressed segment may have moved on to the next index
+	 * block, so the entry is only added now.
+	 */
+	m->index_block_.append(&cache->xuid_);
+	m->index_block_.append(&hash);
+	if (compression_) {
+		uint32_t extent_offset = (offset & XCDFS_MEMBER_BLOCK_MASK) - (extent_block(m, m->current_index_block_) * XCDFS_BLOCK_SIZE);
+		m->index_block_.append(&extent_offset);
+	}
 
-		/*
-		 * We are going to be rewriting the entries associated
-		 * with the new index block; purge them from memory.
-		 */
-		if (!index_invalidate_entries(current_index_block_))
-			ERROR(log_) << "Could not invalidate new index block; expect inconsistency.";
+	cache->hash_cache_[hash] = offset;
+	buffer_cache_enter(offset, hash, seg);
 
-		/* A counter of 0 always indicates unused.  */
-		if (++index_block_counter_ == 0)
-			index_block_counter_ = 1;
-		index_block_.append(&index_block_counter_);
-	}
+	if (++m->index_block_next_ == index_entries())
+		index_advance(m);
 }
 
+/*
+ * A lookup which is not a use leaves the buffer cache's LRU alone, but what
+ * it has to read from disk is still kept there, so as not to read it twice.
+ */
 BufferSegment *
-XCodecDisk::lookup(XCodecDiskCache *cache, uint64_t hash)
+XCodecDisk::lookup(XCodecDiskCache *cache, uint64_t hash, bool use)
 {
 	XCodecDiskCache::hash_cache_t::iterator it;
 	it = cache->hash_cache_.find(hash);
@@ -751,22 +1529,26 @@ XCodecDisk::lookup(XCodecDiskCache *cache, uint64_t hash)
 	const uint64_t& offset = it->second;
 	ASSERT_NON_ZERO(log_, offset);
 
-	BufferSegment *seg;
-	if (!block_read(&seg, offset)) {
-		seg->unref();
+	BufferSegment *seg = buffer_cache_lookup(offset, use);
+	if (seg != NULL)
+		return (seg);
+
+	if (!data_read(&seg, offset)) {
 		ERROR(log_) << "Could not read segment from disk; removing index entry.";
 		cache->hash_cache_.erase(it);
 		return (NULL);
 	}
 
 	uint64_t ohash = XCodecHash::hash(seg->data());
-	if (ohash != hash) {
+	if (ohash != XCODEC_NAME_HASH(hash)) {
 		seg->unref();
 		ERROR(log_) << "Hash mismatch on disk; removing index entry.";
 		cache->hash_cache_.erase(it);
 		return (NULL);
 	}
 
+	buffer_cache_enter(offset, hash, seg);
+
 	return (seg);
 }
 
@@ -780,6 +1562,7 @@ XCodecDisk::remove(XCodecDiskCache *cache, uint64_t hash)
 		return;
 	}
 
+	buffer_cache_remove(hcit->second);
 	cache->hash_cache_.erase(hcit);
 }
 
@@ -811,7 +1594,7 @@ XCodecDisk::remove(XCodecDiskCache *cache, uint64_t hash)
  *     just something used by the on-disk cache, in other places.
  */
 void
-XCodecDisk::touch(XCodecDiskCache *cache, uint64_t hash, const BufferSegment *seg)
+XCodecDisk::touch(XCodecDiskCache *cache, uint64_t hash, BufferSegment *seg)
 {
 	/* Do nothing if this is already in the cache.  */
 	if (cache->hash_cache_.find(hash) != cache->hash_cache_.end())
@@ -822,53 +1605,186 @@ XCodecDisk::touch(XCodecDiskCache *cache, uint64_t hash, const BufferSegment *se
 	enter(cache, hash, seg);
 }
 
+std::vector<XCodecDisk::Statistics>
+XCodecDisk::statistics(void) const
+{
+	std::vector<Statistics> stats;
+	std::vector<Member *>::const_iterator mit;
+
+	for (mit = members_.begin(); mit != members_.end(); ++mit) {
+		const Member *m = *mit;
+		Statistics mstats(m->stats_);
+#ifdef THREADS
+		if (m->io_ != NULL)
+			m->io_->statistics(&mstats);
+#endif
+		stats.push_back(mstats);
+	}
+
+	return (stats);
+}
+
+XCodecDisk *
+XCodecDisk::open(const std::string& path, uint64_t size, bool direct, uint64_t buffer_size, bool compression, XCodecMemoryStore *buffer_store)
+{
+	std::vector<std::string> paths;
+	paths.push_back(path);
+	return (open(paths, size, direct, buffer_size, compression, buffer_store));
+}
+
+/*
+ * Each member is opened with the same size, which may be 0 to use the
+ * existing size of each file or device.
+ */
 XCodecDisk *
-XCodecDisk::open(const std::string& path, uint64_t size)
+XCodecDisk::open(const std::vector<std::string>& paths, uint64_t size, bool direct, uint64_t buffer_size, bool compression, XCodecMemoryStore *buffer_store)
 {
 	static std::map<std::string, XCodecDisk *> disk_map;
-	struct stat st;
-	int fd;
-	int rv;
+	std::vector<std::string>::const_iterator pit;
+	std::vector<Member *> members;
+	std::string key;
 
-	std::map<std::string, XCodecDisk *>::const_iterator it;
-	it = disk_map.find(path);
-	if (it != disk_map.end()) {
-		INFO("/xcodec/disk") << "Multiple distinct opens of disk; disk will be shared.";
-		return (it->second);
+	if (paths.empty()) {
+		ERROR("/xcodec/disk") << "No paths specified for disk.";
+		return (NULL);
 	}
 
-	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0700);
-	if (fd == -1) {
-		ERROR("/xcodec/disk") << "Could not open disk: " << path;
+	if (paths.size() > XCDFS_MEMBER_MAX) {
+		ERROR("/xcodec/disk") << "Too many members specified for disk.";
 		return (NULL);
 	}
 
-	rv = fstat(fd, &st);
-	if (rv == -1) {
-		ERROR("/xcodec/disk") << "Could not stat disk.";
-		close(fd);
-		return (NULL);
+	for (pit = paths.begin(); pit != paths.end(); ++pit) {
+		if (pit != paths.begin())
+			key += ",";
+		key += *pit;
 	}
 
-	if (size != 0 && S_ISREG(st.st_mode)) {
-		rv = ftruncate(fd, size);
-		if (rv == -1) {
-			ERROR("/xcodec/disk") << "Could not truncate/extend disk.";
-			close(fd);
+	std::map<std::string, XCodecDisk *>::const_iterator it;
+	it = disk_map.find(key);
+	if (it != disk_map.end()) {
+		/*
+		 * The settings are those of the first open; a later one
+		 * which asks for something else must not silently get
+		 * them, and the on-disk format does not allow for two.
+		 */
+		XCodecDisk *disk = it->second;
+		if (disk->direct_ != direct) {
+			ERROR("/xcodec/disk") << "Disk is already open " << (disk->direct_ ? "with" : "without") << " direct I/O; it must be opened the same way by each cache.";
+			return (NULL);
+		}
+		if (disk->compression_ != compression) {
+			ERROR("/xcodec/disk") << "Disk is already open " << (disk->compression_ ? "with" : "without") << " compression; it must be opened the same way by each cache.";
+			return (NULL);
+		}
+		if (disk->buffer_size_ != buffer_size) {
+			ERROR("/xcodec/disk") << "Disk is already open with a buffer size of " << disk->buffer_size_ << "; it must be opened the same way by each cache.";
+			return (NULL);
+		}
+		if (disk->buffer_store_ != buffer_store) {
+			ERROR("/xcodec/disk") << "Disk is already open " << (disk->buffer_store_ != NULL ? "with" : "without") << " its buffer cache in " << (buffer_store != NULL && disk->buffer_store_ != NULL ? "another" : "a") << " memory cache; it must be opened the same way by each cache.";
 			return (NULL);
 		}
+		INFO("/xcodec/disk") << "Multiple distinct opens of disk; disk will be shared.";
+		return (disk);
 	}
 
-	if (size == 0) {
-		size = st.st_size;
-		if (size == 0) {
-			ERROR("/xcodec/disk") << "Could not determine disk size.";
+	for (pit = paths.begin(); pit != paths.end(); ++pit) {
+		const std::string& path = *pit;
+		bool mdirect = direct;
+		uint64_t msize = size;
+		struct stat st;
+		int flags;
+		int fd;
+		int rv;
+
+		flags = O_RDWR | O_CREAT;
+		if (mdirect) {
+#if defined(O_DIRECT)
+			flags |= O_DIRECT;
+#else
+			INFO("/xcodec/disk") << "Direct I/O is not supported on this system; using buffered I/O.";
+			mdirect = false;
+#endif
+		}
+
+		fd = ::open(path.c_str(), flags, 0700);
+#if defined(O_DIRECT)
+		if (fd == -1 && mdirect && errno == EINVAL) {
+			INFO("/xcodec/disk") << "Direct I/O is not supported by the filesystem; using buffered I/O.";
+			mdirect = false;
+			fd = ::open(path.c_str(), flags & ~O_DIRECT, 0700);
+		}
+#endif
+		if (fd == -1) {
+			ERROR("/xcodec/disk") << "Could not open disk: " << path;
+			break;
+		}
+
+		rv = fstat(fd, &st);
+		if (rv == -1) {
+			ERROR("/xcodec/disk") << "Could not stat disk.";
 			close(fd);
-			return (NULL);
+			break;
+		}
+
+		if (msize != 0 && S_ISREG(st.st_mode)) {
+			rv = ftruncate(fd, msize);
+			if (rv == -1) {
+				ERROR("/xcodec/disk") << "Could not truncate/extend disk.";
+				close(fd);
+				break;
+			}
+		}
+
+		if (msize == 0) {
+			msize = st.st_size;
+			if (msize == 0) {
+				ERROR("/xcodec/disk") << "Could not determine disk size.";
+				close(fd);
+				break;
+			}
+		}
+
+#if defined(O_DIRECT)
+		/*
+		 * Devices with a sector size larger than our block size cannot do
+		 * direct I/O for us; find that out now rather than on first use.
+		 */
+		if (mdirect) {
+			BufferSegment *seg = BufferSegment::create_aligned();
+			ssize_t amt = ::pread(fd, seg->head(), XCDFS_BLOCK_SIZE, 0);
+			seg->unref();
+			if (amt == -1 && errno == EINVAL) {
+				INFO("/xcodec/disk") << "Device does not support direct I/O with a block size of " << XCDFS_BLOCK_SIZE << "; using buffered I/O.";
+				mdirect = false;
+				rv = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+				if (rv == -1) {
+					ERROR("/xcodec/disk") << "Could not disable direct I/O.";
+					close(fd);
+					break;
+				}
+			}
+		}
+#endif
+
+		Member *m = new Member(members.size(), path, fd, mdirect, compression, msize);
+		members.push_back(m);
+
+		if (m->index_blocks_ == 0) {
+			ERROR("/xcodec/disk") << "Disk too small; reduce XCDFS_BLOCK_SIZE.";
+			break;
 		}
 	}
 
-	XCodecDisk *disk = new XCodecDisk(fd, size);
-	disk_map[path] = disk;
+	if (members.size() != paths.size() || members.back()->index_blocks_ == 0) {
+		std::vector<Member *>::iterator mit;
+		for (mit = members.begin(); mit != members.end(); ++mit)
+			delete *mit;
+		return (NULL);
+	}
+
+	XCodecDisk *disk = new XCodecDisk(members, direct, compression, buffer_size, buffer_store);
+	disk_map[key] = disk;
 	return (disk);
 }
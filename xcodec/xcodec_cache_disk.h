@@ -27,47 +27,195 @@
 #define	XCODEC_XCODEC_CACHE_DISK_H
 
 class XCodecDiskCache;
+class XCodecDiskIOThread;
 
 /*
  * This handles the actual on-disk data, shared by
  * many front-ends, which store their own indices.
+ *
+ * The data may be striped across several member
+ * files or devices.  Each member is laid out like a
+ * whole disk, with its own copy of the registry and
+ * its own index and data blocks, and each segment is
+ * stored on the member selected by its hash.
+ *
+ * With compression, each index block is followed by
+ * an extent into which compressed segments are packed
+ * end to end, and the index records where in that
+ * extent each segment begins.
+ *
+ * The buffer cache may be kept in a memory store
+ * rather than having a budget of its own, and is then
+ * a client of that store like its memory caches.
  */
-class XCodecDisk {
-	LogHandle log_;
+class XCodecDisk : public XCodecMemoryStoreClient {
+public:
+	struct Statistics {
+		std::string path_;
+		bool direct_;
+		uint64_t reads_;
+		uint64_t read_errors_;
+		uint64_t writes_;
+		uint64_t write_errors_;
+		uint64_t writes_pending_;
+		uint64_t stored_segments_;
+		uint64_t stored_bytes_;
+
+		Statistics(const std::string& path, bool direct)
+		: path_(path),
+		  direct_(direct),
+		  reads_(0),
+		  read_errors_(0),
+		  writes_(0),
+		  write_errors_(0),
+		  writes_pending_(0),
+		  stored_segments_(0),
+		  stored_bytes_(0)
+		{ }
+	};
+
+private:
+	/*
+	 * The buffer cache holds recently-used data blocks, keyed by their
+	 * address on disk, so that with direct I/O we neither go to disk
+	 * for hot blocks nor keep a second copy in the kernel's cache.
+	 *
+	 * In a memory store, each block is stored under the name of the
+	 * segment it holds, so that a segment which is also in one of the
+	 * store's memory caches is kept and counted only once.
+	 */
+	struct BufferCacheEntry {
+		BufferSegment *seg_;
+		uint64_t name_;
+		XCodecMemoryStore::Segment *segment_;
+		uint64_t counter_;
+
+		BufferCacheEntry(BufferSegment *seg, uint64_t name, XCodecMemoryStore::Segment *segment)
+		: seg_(seg),
+		  name_(name),
+		  segment_(segment),
+		  counter_(0)
+		{
+			seg_->ref();
+		}
+
+		BufferCacheEntry(const BufferCacheEntry& src)
+		: seg_(src.seg_),
+		  name_(src.name_),
+		  segment_(src.segment_),
+		  counter_(src.counter_)
+		{
+			seg_->ref();
+		}
+
+		~BufferCacheEntry()
+		{
+			seg_->unref();
+			seg_ = NULL;
+		}
+	};
+
+	typedef __gnu_cxx::hash_map<Tag64, BufferCacheEntry> buffer_cache_t;
+
+	struct IndexEntry {
+		uint16_t xuid_;
+		uint64_t hash_;
+		uint64_t offset_;
+	};
+
+	/*
+	 * Each member has its own write head, and, if we have threads, its
+	 * own I/O thread to which writes are queued, so that writes to one
+	 * device do not hold up I/O to any other.
+	 *
+	 * With compression, the tail of the extent being filled, which does
+	 * not yet make up a whole block, is kept in memory until it does.
+	 */
+	struct Member {
+		unsigned index_;
+		int fd_;
+
+		uint64_t disk_blocks_;
+		uint64_t index_blocks_;
 
-	int fd_;
+		uint64_t current_index_block_;
+		Buffer index_block_;
+		size_t index_block_next_;
+		uint64_t index_block_counter_;
 
-	uint64_t disk_blocks_;
-	uint64_t index_blocks_;
+		Buffer extent_;
+		uint64_t extent_next_;
+		uint64_t extent_flushed_;
+
+		XCodecDiskIOThread *io_;
+		Statistics stats_;
+
+		Member(unsigned, const std::string&, int, bool, bool, uint64_t);
+		~Member();
+	};
+
+	LogHandle log_;
+
+	std::vector<Member *> members_;
+	bool direct_;
+	bool compression_;
 
 	std::map<uint16_t, XCodecDiskCache *> xuid_cache_map_;
 	std::map<UUID, uint16_t> uuid_xuid_map_;
 
-	uint64_t current_index_block_;
-	Buffer index_block_;
-	size_t index_block_next_;
-	uint64_t index_block_counter_;
+	buffer_cache_t buffer_cache_;
+	XCodecLRU<uint64_t> buffer_cache_lru_;
+	uint64_t buffer_size_;
+	size_t buffer_cache_limit_;
+	XCodecMemoryStore *buffer_store_;
 
-	XCodecDisk(int, uint64_t);
+	XCodecDisk(const std::vector<Member *>&, bool, bool, uint64_t, XCodecMemoryStore *);
 
 	~XCodecDisk()
 	{
-		ASSERT(log_, fd_ == -1);
+		ASSERT(log_, members_.empty());
 		ASSERT(log_, xuid_cache_map_.empty());
+		while (!buffer_cache_.empty())
+			buffer_cache_remove(buffer_cache_.begin()->first.tag_);
+		if (buffer_store_ != NULL) {
+			buffer_store_->detach(this);
+			buffer_store_ = NULL;
+		}
 	}
 
-	bool block_read(Buffer *, uint64_t);
-	bool block_write(Buffer *, uint64_t);
+	void buffer_cache_enter(uint64_t, uint64_t, BufferSegment *);
+	BufferSegment *buffer_cache_lookup(uint64_t, bool);
+	void buffer_cache_remove(uint64_t);
+
+	void evict(void);
+
+	bool block_read(Member *, Buffer *, uint64_t);
+	bool block_write(Member *, Buffer *, uint64_t);
 
-	bool block_read(BufferSegment **, uint64_t);
-	bool block_write(const BufferSegment *, uint64_t);
+	bool block_read(Member *, BufferSegment **, uint64_t);
+	bool block_write(Member *, const BufferSegment *, uint64_t);
 
-	uint64_t data_block_address(uint64_t, unsigned) const;
+	bool data_read(BufferSegment **, uint64_t);
+	bool data_write(Member *, BufferSegment *, uint64_t *);
 
-	uint64_t index_block_address(uint64_t) const;
-	bool index_invalidate_entries(uint64_t);
-	bool index_load_entries(uint64_t, bool);
-	bool index_read_counter(uint64_t, uint64_t *);
+	uint64_t data_block_address(const Member *, uint64_t, unsigned) const;
+
+	uint64_t extent_address(const Member *, uint64_t, uint64_t) const;
+	uint64_t extent_block(const Member *, uint64_t) const;
+	bool extent_block_read(Member *, Buffer *, uint64_t);
+	bool extent_flush(Member *, bool);
+	bool extent_read(Member *, BufferSegment **, uint64_t);
+
+	uint64_t index_block_address(const Member *, uint64_t) const;
+	void index_advance(Member *);
+	void index_begin(Member *);
+	unsigned index_entries(void) const;
+	bool index_invalidate_entries(Member *, uint64_t);
+	bool index_load(Member *);
+	bool index_load_entries(Member *, uint64_t, bool);
+	bool index_read(Member *, uint64_t, uint64_t *, std::vector<IndexEntry> *);
+	bool index_read_counter(Member *, uint64_t, uint64_t *);
+	bool index_write(Member *);
 
 	bool registry_collect(void);
 	bool registry_load(void);
@@ -77,12 +225,15 @@ public:
 	XCodecDiskCache *connect(const UUID&);
 	XCodecDiskCache *local(void);
 
-	void enter(XCodecDiskCache *, uint64_t, const BufferSegment *);
-	BufferSegment *lookup(XCodecDiskCache *, uint64_t);
+	void enter(XCodecDiskCache *, uint64_t, BufferSegment *);
+	BufferSegment *lookup(XCodecDiskCache *, uint64_t, bool = true);
 	void remove(XCodecDiskCache *, uint64_t);
-	void touch(XCodecDiskCache *, uint64_t, const BufferSegment *);
+	void touch(XCodecDiskCache *, uint64_t, BufferSegment *);
+
+	std::vector<Statistics> statistics(void) const;
 
-	static XCodecDisk *open(const std::string&, uint64_t);
+	static XCodecDisk *open(const std::string&, uint64_t, bool = false, uint64_t = 0, bool = false, XCodecMemoryStore * = NULL);
+	static XCodecDisk *open(const std::vector<std::string>&, uint64_t, bool = false, uint64_t = 0, bool = false, XCodecMemoryStore * = NULL);
 };
 
 /*
@@ -147,6 +298,11 @@ public:
 		return (disk_->lookup(this, hash));
 	}
 
+	BufferSegment *peek(const uint64_t& hash)
+	{
+		return (disk_->lookup(this, hash, false));
+	}
+
 	void touch(const uint64_t& hash, BufferSegment *seg)
 	{
 		disk_->touch(this, hash, seg);
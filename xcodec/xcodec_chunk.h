@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	XCODEC_XCODEC_CHUNK_H
+#define	XCODEC_XCODEC_CHUNK_H
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <common/endian.h>
+
+#include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_hash.h>
+
+/*
+ * A variable-size chunk is kept as ordinary segments, each named by its own
+ * hash, so that caches, the disk format and <ASK>/<LEARN> need know nothing
+ * of chunks.
+ *
+ * The chunk's index segment begins with its length.  A chunk of no more than
+ * XCODEC_CHUNK_INLINE bytes follows in the index itself; a longer one is cut
+ * into pieces of XCODEC_SEGMENT_LENGTH bytes, the last padded with zeroes,
+ * and the index holds the names of the pieces.  The index is padded with
+ * zeroes too, and the chunk is named by the hash of its index, and so by the
+ * hash of its data and its length together.
+ *
+ * Pieces are always named with generation zero; only the index has its
+ * generation sent on the wire.
+ */
+#define	XCODEC_CHUNK_INLINE	(XCODEC_SEGMENT_LENGTH - sizeof (uint16_t))
+#define	XCODEC_CHUNK_PIECES(length)					\
+	(((length) + XCODEC_SEGMENT_LENGTH - 1) / XCODEC_SEGMENT_LENGTH)
+
+class XCodecChunk {
+	struct Piece {
+		uint64_t name_;
+		BufferSegment *seg_;
+	};
+
+	size_t length_;
+	BufferSegment *index_;
+	std::vector<Piece> pieces_;
+public:
+	XCodecChunk(void)
+	: length_(0),
+	  index_(NULL),
+	  pieces_()
+	{ }
+
+	~XCodecChunk()
+	{
+		clear();
+	}
+
+	size_t length(void) const
+	{
+		return (length_);
+	}
+
+	BufferSegment *index(void) const
+	{
+		return (index_);
+	}
+
+	/*
+	 * The hash of the index, by which the chunk is named.
+	 */
+	uint64_t hash(void) const
+	{
+		return (XCodecHash::hash(index_->data()));
+	}
+
+	/*
+	 * Build the index and pieces of a chunk from its data.
+	 */
+	void make(const uint8_t *data, size_t length)
+	{
+		ASSERT("/xcodec/chunk", length >= XCODEC_CHUNK_MIN && length <= XCODEC_CHUNK_MAX);
+
+		clear();
+		length_ = length;
+
+		uint8_t index[XCODEC_SEGMENT_LENGTH];
+		memset(index, 0, sizeof index);
+		uint16_t belength = BigEndian::encode((uint16_t)length);
+		memcpy(index, &belength, sizeof belength);
+
+		if (length <= XCODEC_CHUNK_INLINE) {
+			memcpy(index + sizeof belength, data, length);
+		} else {
+			unsigned i;
+			for (i = 0; i < XCODEC_CHUNK_PIECES(length); i++) {
+				uint8_t piece[XCODEC_SEGMENT_LENGTH];
+				size_t n = std::min(length - i * XCODEC_SEGMENT_LENGTH, (size_t)XCODEC_SEGMENT_LENGTH);
+				memcpy(piece, data + i * XCODEC_SEGMENT_LENGTH, n);
+				if (n != sizeof piece)
+					memset(piece + n, 0, sizeof piece - n);
+
+				Piece p;
+				p.name_ = XCodecHash::hash(piece);
+				p.seg_ = BufferSegment::create(piece, sizeof piece);
+				pieces_.push_back(p);
+
+				uint64_t bename = BigEndian::encode(p.name_);
+				memcpy(index + sizeof belength + i * sizeof bename, &bename, sizeof bename);
+			}
+		}
+
+		index_ = BufferSegment::create(index, sizeof index);
+	}
+
+	/*
+	 * Take the index of a chunk from the cache, without its pieces, which
+	 * lookup() finds.  The index must be for a chunk of the given length.
+	 */
+	bool parse(BufferSegment *index, size_t length)
+	{
+		clear();
+
+		uint16_t belength;
+		memcpy(&belength, index->data(), sizeof belength);
+		if (BigEndian::decode(belength) != length ||
+		    length < XCODEC_CHUNK_MIN || length > XCODEC_CHUNK_MAX)
+			return (false);
+
+		index->ref();
+		index_ = index;
+		length_ = length;
+
+		if (length <= XCODEC_CHUNK_INLINE)
+			return (true);
+
+		unsigned i;
+		for (i = 0; i < XCODEC_CHUNK_PIECES(length); i++) {
+			uint64_t bename;
+			memcpy(&bename, index->data() + sizeof belength + i * sizeof bename, sizeof bename);
+
+			Piece p;
+			p.name_ = BigEndian::decode(bename);
+			p.seg_ = NULL;
+			pieces_.push_back(p);
+		}
+		return (true);
+	}
+
+	/*
+	 * Find the pieces of a parsed chunk in the cache, noting the names of
+	 * any which are missing.
+	 */
+	bool lookup(XCodecCache *cache, std::vector<uint64_t> *missing)
+	{
+		bool found = true;
+
+		std::vector<Piece>::iterator it;
+		for (it = pieces_.begin(); it != pieces_.end(); ++it) {
+			if (it->seg_ != NULL)
+				continue;
+			it->seg_ = cache->lookup(it->name_);
+			if (it->seg_ != NULL)
+				continue;
+			if (missing != NULL)
+				missing->push_back(it->name_);
+			found = false;
+		}
+		return (found);
+	}
+
+	/*
+	 * Whether the cache has each of the pieces of a chunk made from its
+	 * data, and whether it has other data by the name of any of them.
+	 */
+	bool cached(XCodecCache *cache, bool *collisionp) const
+	{
+		bool found = true;
+
+		std::vector<Piece>::const_iterator it;
+		for (it = pieces_.begin(); it != pieces_.end(); ++it) {
+			BufferSegment *oseg = cache->lookup(it->name_);
+			if (oseg == NULL) {
+				found = false;
+				continue;
+			}
+			if (!oseg->equal(it->seg_)) {
+				*collisionp = true;
+				found = false;
+			}
+			oseg->unref();
+		}
+		return (found);
+	}
+
+	/*
+	 * Enter the index of a chunk made from its data under the given
+	 * name, and its pieces under theirs, replacing anything else there.
+	 */
+	void enter(XCodecCache *cache, uint64_t name) const
+	{
+		std::vector<Piece>::const_iterator it;
+		for (it = pieces_.begin(); it != pieces_.end(); ++it)
+			enter(cache, it->name_, it->seg_);
+		enter(cache, name, index_);
+	}
+
+	/*
+	 * The data of a chunk whose pieces have all been found.
+	 */
+	void data(Buffer *buf) const
+	{
+		if (length_ <= XCODEC_CHUNK_INLINE) {
+			buf->append(index_->data() + sizeof (uint16_t), length_);
+			return;
+		}
+
+		size_t resid = length_;
+		std::vector<Piece>::const_iterator it;
+		for (it = pieces_.begin(); it != pieces_.end(); ++it) {
+			ASSERT_NON_NULL("/xcodec/chunk", it->seg_);
+			size_t n = std::min(resid, (size_t)XCODEC_SEGMENT_LENGTH);
+			if (n == XCODEC_SEGMENT_LENGTH)
+				buf->append(it->seg_);
+			else
+				buf->append(it->seg_->data(), n);
+			resid -= n;
+		}
+	}
+
+	/*
+	 * The segments of a chunk, by name.
+	 */
+	void segments(std::vector<std::pair<uint64_t, BufferSegment *> > *segs, uint64_t name) const
+	{
+		segs->push_back(std::pair<uint64_t, BufferSegment *>(name, index_));
+		std::vector<Piece>::const_iterator it;
+		for (it = pieces_.begin(); it != pieces_.end(); ++it) {
+			ASSERT_NON_NULL("/xcodec/chunk", it->seg_);
+			segs->push_back(std::pair<uint64_t, BufferSegment *>(it->name_, it->seg_));
+		}
+	}
+
+private:
+	void clear(void)
+	{
+		if (index_ != NULL) {
+			index_->unref();
+			index_ = NULL;
+		}
+
+		std::vector<Piece>::iterator it;
+		for (it = pieces_.begin(); it != pieces_.end(); ++it) {
+			if (it->seg_ != NULL)
+				it->seg_->unref();
+		}
+		pieces_.clear();
+		length_ = 0;
+	}
+
+	static void enter(XCodecCache *cache, uint64_t name, BufferSegment *seg)
+	{
+		BufferSegment *oseg = cache->lookup(name);
+		if (oseg == NULL) {
+			cache->enter(name, seg);
+			return;
+		}
+		if (!oseg->equal(seg))
+			cache->replace(name, seg);
+		oseg->unref();
+	}
+};
+
+#endif /* !XCODEC_XCODEC_CHUNK_H */
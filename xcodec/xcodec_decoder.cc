@@ -23,19 +23,33 @@
  * SUCH DAMAGE.
  */
 
+#include <string.h>
+
+#include <algorithm>
+
 #include <common/buffer.h>
 #include <common/endian.h>
 
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_chunk.h>
 #include <xcodec/xcodec_decoder.h>
 #include <xcodec/xcodec_encoder.h>
 #include <xcodec/xcodec_hash.h>
 
-XCodecDecoder::XCodecDecoder(XCodecCache *cache)
+XCodecDecoder::XCodecDecoder(XCodecCache *cache, unsigned window)
 : log_("/xcodec/decoder"),
   cache_(cache),
-  window_()
+  local_cache_(NULL),
+  window_(window),
+  history_(),
+  legacy_(false),
+  reorder_(false),
+  holes_(),
+  holes_input_(0),
+  skimming_(false),
+  skim_(),
+  skim_defined_()
 { }
 
 XCodecDecoder::~XCodecDecoder()
@@ -64,17 +78,33 @@ XCodecDecoder::~XCodecDecoder()
  * share an originator.
  */
 bool
-XCodecDecoder::decode(Buffer *output, Buffer *input, std::set<uint64_t>& unknown_hashes)
+XCodecDecoder::decode(Buffer *output, Buffer *input, std::set<XCodecReference>& unknown_hashes)
 {
+	size_t output_start = output->length();
+	size_t input_start = input->length();
+	bool skimmed = skimming_;
+
+	skimming_ = false;
+
+	if (!holes_.empty() && !hole_fill(output, unknown_hashes))
+		return (false);
+
+	/*
+	 * Input consumed since mark goes with the last hole, if any.
+	 */
+	size_t mark = input->length();
+
 	while (!input->empty()) {
+		Buffer *out = holes_.empty() ? output : &holes_.back().data_;
+
 		size_t off;
 		if (!input->find(XCODEC_MAGIC, &off)) {
-			input->moveout(output);
+			input->moveout(out);
 			break;
 		}
 
 		if (off != 0) {
-			output->append(input, off);
+			out->append(input, off);
 			input->skip(off);
 		}
 		ASSERT(log_, !input->empty());
@@ -90,20 +120,54 @@ XCodecDecoder::decode(Buffer *output, Buffer *input, std::set<uint64_t>& unknown
 
 		switch (op) {
 		case XCODEC_OP_ESCAPE:
-			output->append(XCODEC_MAGIC);
+			out->append(XCODEC_MAGIC);
 			input->skip(sizeof XCODEC_MAGIC + sizeof op);
 			break;
 		case XCODEC_OP_EXTRACT:
-			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + XCODEC_SEGMENT_LENGTH)
+		case XCODEC_OP_EXTRACT_GENERATION:
+			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + (op == XCODEC_OP_EXTRACT_GENERATION ? sizeof (uint8_t) : 0) + XCODEC_SEGMENT_LENGTH)
 				goto done;
 			else {
-				input->skip(sizeof XCODEC_MAGIC + sizeof op);
+				/*
+				 * If this declares a name we are waiting to
+				 * learn, the data it brings may not be what the
+				 * earlier reference meant, so wait for that to
+				 * be learned first.
+				 */
+				if (!holes_.empty()) {
+					uint8_t data[XCODEC_SEGMENT_LENGTH];
+					uint8_t generation = 0;
+					size_t header = sizeof XCODEC_MAGIC + sizeof op;
+					if (op == XCODEC_OP_EXTRACT_GENERATION) {
+						input->extract(&generation, header);
+						header += sizeof generation;
+					}
+					input->copyout(data, header, sizeof data);
+					if (hole_find(XCODEC_NAME(XCodecHash::hash(data), generation)) != NULL) {
+						decode_stop(input, skimmed && input->length() == input_start, unknown_hashes);
+						DEBUG(log_) << "Waiting for <LEARN> before <EXTRACT>.";
+						goto done;
+					}
+				}
+
+				uint8_t generation = 0;
+				if (op == XCODEC_OP_EXTRACT_GENERATION) {
+					input->moveout(&generation, sizeof XCODEC_MAGIC + sizeof op, sizeof generation);
+				} else {
+					input->skip(sizeof XCODEC_MAGIC + sizeof op);
+				}
 
 				BufferSegment *seg;
 				input->copyout(&seg, XCODEC_SEGMENT_LENGTH);
 				input->skip(XCODEC_SEGMENT_LENGTH);
 
-				uint64_t hash = XCodecHash::hash(seg->data());
+				/*
+				 * Anything the peer had with an earlier generation
+				 * of this hash is no longer to be referenced.
+				 */
+				uint64_t hash = XCODEC_NAME(XCodecHash::hash(seg->data()), generation);
+				cache_->rename(hash);
+
 				BufferSegment *oseg = cache_->lookup(hash);
 				if (oseg != NULL) {
 					if (oseg->equal(seg)) {
@@ -126,6 +190,10 @@ XCodecDecoder::decode(Buffer *output, Buffer *input, std::set<uint64_t>& unknown
 						 * framing so that it can verify decoded
 						 * data, and refetch data from the peer if
 						 * the decoded data is incorrect.
+						 *
+						 * Since names carry a generation, this only
+						 * happens once a peer has forgotten or run
+						 * out of generations for a hash.
 						 */
 						INFO(log_) << "Name reuse in <EXTRACT>.";
 						oseg->unref();
@@ -136,7 +204,7 @@ XCodecDecoder::decode(Buffer *output, Buffer *input, std::set<uint64_t>& unknown
 				}
 
 				window_.declare(hash, seg);
-				output->append(seg);
+				out->append(seg);
 				seg->unref();
 			}
 			break;
@@ -146,45 +214,398 @@ XCodecDecoder::decode(Buffer *output, Buffer *input, std::set<uint64_t>& unknown
 			else {
 				uint64_t behash;
 				input->extract(&behash, sizeof XCODEC_MAGIC + sizeof op);
-				uint64_t hash = BigEndian::decode(behash);
+				uint64_t hash = local_name(BigEndian::decode(behash));
 
 				BufferSegment *oseg = cache_->lookup(hash);
 				if (oseg == NULL) {
-					decode_skim(input, unknown_hashes);
-					DEBUG(log_) << "Sending <ASK>, waiting for <LEARN>.";
-					return (true);
+					XCodecReference ref(XCodecNamespaceEncoder, BigEndian::decode(behash));
+					if (reorder_) {
+						hold(mark - input->length());
+						mark = input->length();
+						unknown_hashes.insert(ref);
+						hole(ref, hash);
+						input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof behash);
+						window_.declare(hash, NULL);
+						DEBUG(log_) << "Holding output for <LEARN>.";
+						break;
+					}
+					decode_stop(input, skimmed && input->length() == input_start, unknown_hashes);
+					DEBUG(log_) << "Waiting for <LEARN>.";
+					goto done;
+				}
+
+				input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof behash);
+
+				window_.declare(hash, oseg);
+				out->append(oseg);
+				oseg->unref();
+			}
+			break;
+		case XCODEC_OP_REF_PEER:
+			if (local_cache_ == NULL) {
+				ERROR(log_) << "Got <REF_PEER> without a cache of our own.";
+				return (false);
+			}
+			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint64_t))
+				goto done;
+			else {
+				uint64_t behash;
+				input->extract(&behash, sizeof XCODEC_MAGIC + sizeof op);
+				uint64_t hash = local_name(BigEndian::decode(behash));
+
+				BufferSegment *oseg = lookup_peer(hash);
+				if (oseg == NULL) {
+					XCodecReference ref(XCodecNamespaceDecoder, BigEndian::decode(behash));
+					if (reorder_) {
+						hold(mark - input->length());
+						mark = input->length();
+						unknown_hashes.insert(ref);
+						hole(ref, hash);
+						input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof behash);
+						window_.declare(hash, NULL);
+						DEBUG(log_) << "Holding output for <LEARN> for <REF_PEER>.";
+						break;
+					}
+					decode_stop(input, skimmed && input->length() == input_start, unknown_hashes);
+					DEBUG(log_) << "Waiting for <LEARN> for <REF_PEER>.";
+					goto done;
 				}
 
 				input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof behash);
 
 				window_.declare(hash, oseg);
-				output->append(oseg);
+				out->append(oseg);
 				oseg->unref();
 			}
 			break;
+		case XCODEC_OP_EXTRACT_CHUNK:
+			if (legacy_) {
+				ERROR(log_) << "Got <EXTRACT_CHUNK> from a peer which does not take generations.";
+				return (false);
+			}
+			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t) + sizeof (uint16_t))
+				goto done;
+			else {
+				uint8_t generation;
+				input->extract(&generation, sizeof XCODEC_MAGIC + sizeof op);
+				uint16_t belength;
+				input->extract(&belength, sizeof XCODEC_MAGIC + sizeof op + sizeof generation);
+				size_t length = BigEndian::decode(belength);
+				if (length < XCODEC_CHUNK_MIN || length > XCODEC_CHUNK_MAX) {
+					ERROR(log_) << "Invalid <EXTRACT_CHUNK> of " << length << " bytes.";
+					return (false);
+				}
+
+				size_t header = sizeof XCODEC_MAGIC + sizeof op + sizeof generation + sizeof belength;
+				if (input->length() < header + length)
+					goto done;
+
+				uint8_t data[XCODEC_CHUNK_MAX];
+				input->copyout(data, header, length);
+
+				XCodecChunk chunk;
+				chunk.make(data, length);
+				uint64_t name = XCODEC_NAME(chunk.hash(), generation);
+
+				/*
+				 * As with <EXTRACT>, wait for an earlier reference
+				 * to this name to be learned first.
+				 */
+				if (hole_find(name) != NULL) {
+					decode_stop(input, skimmed && input->length() == input_start, unknown_hashes);
+					DEBUG(log_) << "Waiting for <LEARN> before <EXTRACT_CHUNK>.";
+					goto done;
+				}
+				input->skip(header + length);
+
+				cache_->rename(name);
+				chunk.enter(cache_, name);
+				out->append(data, length);
+			}
+			break;
+		case XCODEC_OP_REF_CHUNK:
+			if (legacy_) {
+				ERROR(log_) << "Got <REF_CHUNK> from a peer which does not take generations.";
+				return (false);
+			}
+			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint64_t) + sizeof (uint16_t))
+				goto done;
+			else {
+				uint64_t bename;
+				input->extract(&bename, sizeof XCODEC_MAGIC + sizeof op);
+				uint64_t name = BigEndian::decode(bename);
+				uint16_t belength;
+				input->extract(&belength, sizeof XCODEC_MAGIC + sizeof op + sizeof bename);
+				size_t length = BigEndian::decode(belength);
+				if (length < XCODEC_CHUNK_MIN || length > XCODEC_CHUNK_MAX) {
+					ERROR(log_) << "Invalid <REF_CHUNK> of " << length << " bytes.";
+					return (false);
+				}
+
+				/*
+				 * We may have to <ASK> first for the index and
+				 * then for the pieces it names.
+				 */
+				Buffer data;
+				bool found;
+				if (!lookup_chunk(name, length, &data, unknown_hashes, &found)) {
+					ERROR(log_) << "Index for <REF_CHUNK> is not for a chunk of " << length << " bytes.";
+					return (false);
+				}
+				if (!found) {
+					if (reorder_) {
+						hold(mark - input->length());
+						mark = input->length();
+						hole(XCodecReference(XCodecNamespaceEncoder, name), name, length);
+						input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof bename + sizeof belength);
+						DEBUG(log_) << "Holding output for <LEARN> for <REF_CHUNK>.";
+						break;
+					}
+					decode_stop(input, skimmed && input->length() == input_start, unknown_hashes);
+					DEBUG(log_) << "Waiting for <LEARN> for <REF_CHUNK>.";
+					goto done;
+				}
+
+				input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof bename + sizeof belength);
+				out->append(data);
+			}
+			break;
 		case XCODEC_OP_BACKREF:
 			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t))
 				goto done;
 			else {
 				uint8_t idx;
-				input->moveout(&idx, sizeof XCODEC_MAGIC + sizeof op, sizeof idx);
+				input->extract(&idx, sizeof XCODEC_MAGIC + sizeof op);
 
-				BufferSegment *oseg = window_.dereference(idx);
+				BufferSegment *oseg = window_.dereference(idx, XCODEC_WINDOW_COUNT);
 				if (oseg == NULL) {
-					ERROR(log_) << "Index not present in <BACKREF> window: " << (unsigned)idx;
-					return (false);
+					const Hole *h = hole_find(window_.name(idx, XCODEC_WINDOW_COUNT));
+					if (h == NULL) {
+						ERROR(log_) << "Index not present in <BACKREF> window: " << (unsigned)idx;
+						return (false);
+					}
+					hold(mark - input->length());
+					mark = input->length();
+					hole(h->reference_, h->hash_);
+					input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof idx);
+					break;
 				}
+				input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof idx);
 
-				output->append(oseg);
+				out->append(oseg);
 				oseg->unref();
 			}
 			break;
+		case XCODEC_OP_BACKREF16:
+			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t))
+				goto done;
+			else {
+				uint16_t beidx;
+				input->extract(&beidx, sizeof XCODEC_MAGIC + sizeof op);
+				uint16_t idx = BigEndian::decode(beidx);
+
+				BufferSegment *oseg = window_.dereference(idx, XCODEC_WIDE_WINDOW_COUNT);
+				if (oseg == NULL) {
+					const Hole *h = hole_find(window_.name(idx, XCODEC_WIDE_WINDOW_COUNT));
+					if (h == NULL) {
+						ERROR(log_) << "Index not present in <BACKREF16> window: " << idx;
+						return (false);
+					}
+					hold(mark - input->length());
+					mark = input->length();
+					hole(h->reference_, h->hash_);
+					input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof beidx);
+					break;
+				}
+				input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof beidx);
+
+				out->append(oseg);
+				oseg->unref();
+			}
+			break;
+		case XCODEC_OP_RUN:
+			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t) + sizeof (uint16_t))
+				goto done;
+			else {
+				uint8_t ch;
+				input->extract(&ch, sizeof XCODEC_MAGIC + sizeof op);
+				uint16_t berun;
+				input->extract(&berun, sizeof XCODEC_MAGIC + sizeof op + sizeof ch);
+				unsigned run = BigEndian::decode(berun);
+				if (run == 0) {
+					ERROR(log_) << "Empty <RUN>.";
+					return (false);
+				}
+				input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof ch + sizeof berun);
+
+				uint8_t data[XCODEC_SEGMENT_LENGTH];
+				memset(data, ch, std::min(run, (unsigned)sizeof data));
+				while (run != 0) {
+					unsigned n = std::min(run, (unsigned)sizeof data);
+					out->append(data, n);
+					run -= n;
+				}
+			}
+			break;
+		case XCODEC_OP_REPEAT:
+			if (input->length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t) + sizeof (uint16_t))
+				goto done;
+			else {
+				uint16_t bedistance;
+				input->extract(&bedistance, sizeof XCODEC_MAGIC + sizeof op);
+				unsigned distance = BigEndian::decode(bedistance);
+				uint16_t berepeat;
+				input->extract(&berepeat, sizeof XCODEC_MAGIC + sizeof op + sizeof bedistance);
+				unsigned repeat = BigEndian::decode(berepeat);
+
+				/*
+				 * The data to be repeated may be partly in what
+				 * we have output so far, and partly in what we
+				 * had output before.  Behind a hole, only what
+				 * follows it is known, and anything further back
+				 * has to wait until the hole is filled.
+				 */
+				size_t produced, history;
+				if (holes_.empty()) {
+					produced = output->length() - output_start;
+					history = history_.length();
+				} else {
+					produced = out->length();
+					history = 0;
+					if (distance > produced && distance <= XCODEC_HISTORY_LENGTH) {
+						decode_stop(input, skimmed && input->length() == input_start, unknown_hashes);
+						DEBUG(log_) << "Waiting for <LEARN> before <REPEAT>.";
+						goto done;
+					}
+				}
+				if (distance == 0 || distance > XCODEC_HISTORY_LENGTH ||
+				    distance > produced + history || repeat == 0) {
+					ERROR(log_) << "Invalid <REPEAT> of " << repeat << " bytes from " << distance << " bytes back.";
+					return (false);
+				}
+				input->skip(sizeof XCODEC_MAGIC + sizeof op + sizeof bedistance + sizeof berepeat);
+
+				uint8_t data[XCODEC_HISTORY_LENGTH];
+				if (distance <= produced) {
+					out->copyout(data, out->length() - distance, distance);
+				} else {
+					size_t older = distance - produced;
+					history_.copyout(data, history_.length() - older, older);
+					if (produced != 0)
+						output->copyout(data + older, output_start, produced);
+				}
+
+				while (repeat != 0) {
+					unsigned n = std::min(repeat, distance);
+					out->append(data, n);
+					repeat -= n;
+				}
+			}
+			break;
 		default:
 			ERROR(log_) << "Unsupported XCodec opcode " << (unsigned)op << ".";
 			return (false);
 		}
 	}
-done:	return (true);
+done:
+	hold(mark - input->length());
+
+	/*
+	 * Keep the last XCODEC_HISTORY_LENGTH bytes of the stream for any
+	 * <REPEAT> to come.  Output held behind a hole is added once it is
+	 * produced.
+	 */
+	size_t produced = output->length() - output_start;
+	if (produced != 0) {
+		size_t keep = std::min(produced, (size_t)XCODEC_HISTORY_LENGTH);
+		Buffer tail(*output);
+		if (tail.length() != keep)
+			tail.skip(tail.length() - keep);
+		history_.append(tail);
+		if (history_.length() > XCODEC_HISTORY_LENGTH)
+			history_.skip(history_.length() - XCODEC_HISTORY_LENGTH);
+	}
+	return (true);
+}
+
+/*
+ * Hold the output which follows a reference to data we must <ASK> for.
+ */
+void
+XCodecDecoder::hole(const XCodecReference& ref, uint64_t hash, size_t length)
+{
+	holes_.push_back(Hole(ref, hash, length));
+}
+
+/*
+ * The last hole for the given hash which is still waiting to be filled.
+ */
+const XCodecDecoder::Hole *
+XCodecDecoder::hole_find(uint64_t hash) const
+{
+	std::deque<Hole>::const_reverse_iterator it;
+	for (it = holes_.rbegin(); it != holes_.rend(); ++it) {
+		if (it->hash_ == hash && !it->filled_)
+			return (&*it);
+	}
+	return (NULL);
+}
+
+/*
+ * Fill in each hole whose data has been learned, and output everything
+ * which is no longer held behind one that has not.  Learning the index of
+ * a chunk may show that there are pieces of it to <ASK> for too.
+ */
+bool
+XCodecDecoder::hole_fill(Buffer *output, std::set<XCodecReference>& unknown_hashes)
+{
+	std::deque<Hole>::iterator it;
+	for (it = holes_.begin(); it != holes_.end(); ++it) {
+		if (it->filled_)
+			continue;
+		if (it->length_ != 0) {
+			if (!lookup_chunk(it->hash_, it->length_, &it->fill_, unknown_hashes, &it->filled_)) {
+				ERROR(log_) << "Learned index is not for a chunk of " << it->length_ << " bytes.";
+				return (false);
+			}
+			continue;
+		}
+
+		BufferSegment *seg;
+		if (it->reference_.namespace_ == XCodecNamespaceDecoder)
+			seg = lookup_peer(it->hash_);
+		else
+			seg = cache_->lookup(it->hash_);
+		if (seg == NULL)
+			continue;
+		window_.define(it->hash_, seg);
+		it->fill_.append(seg);
+		it->filled_ = true;
+		seg->unref();
+	}
+
+	while (!holes_.empty()) {
+		Hole& h = holes_.front();
+		if (!h.filled_)
+			break;
+		output->append(h.fill_);
+		output->append(h.data_);
+		holes_input_ -= h.input_;
+		holes_.pop_front();
+	}
+	return (true);
+}
+
+/*
+ * Charge input consumed to the last hole.
+ */
+void
+XCodecDecoder::hold(size_t consumed)
+{
+	if (holes_.empty())
+		return;
+	holes_.back().input_ += consumed;
+	holes_input_ += consumed;
 }
 
 /*
@@ -192,18 +613,40 @@ done:	return (true);
  * stream and identify any other unresolvable references, so that we
  * can properly interrogate the peer for as many as possible at once
  * rather than having to go one-by-one and slowly.
+ *
+ * If we stopped here last time too and have consumed nothing since, all
+ * of the input has already been skimmed, either then or as it arrived.
  */
 void
-XCodecDecoder::decode_skim(const Buffer *resid, std::set<uint64_t>& unknown_hashes)
+XCodecDecoder::decode_stop(const Buffer *input, bool skimmed, std::set<XCodecReference>& unknown_hashes)
 {
-	std::set<uint64_t> defined_hashes;
+	skimming_ = true;
+	if (skimmed)
+		return;
 
-	Buffer input;
+	skim_.clear();
+	skim_defined_.clear();
+	decode_skim(input, unknown_hashes);
+}
+
+/*
+ * Skim input which follows that at which decoding is stopped.  Only an
+ * incomplete operation at the end of what has been skimmed so far is kept
+ * until more input arrives.
+ */
+void
+XCodecDecoder::decode_skim(const Buffer *resid, std::set<XCodecReference>& unknown_hashes)
+{
+	ASSERT(log_, skimming_);
+
+	Buffer& input = skim_;
 	input.append(resid);
 	while (!input.empty()) {
 		size_t off;
-		if (!input.find(XCODEC_MAGIC, &off))
+		if (!input.find(XCODEC_MAGIC, &off)) {
+			input.clear();
 			break;
+		}
 
 		if (off != 0)
 			input.skip(off);
@@ -223,18 +666,23 @@ XCodecDecoder::decode_skim(const Buffer *resid, std::set<uint64_t>& unknown_hash
 			input.skip(sizeof XCODEC_MAGIC + sizeof op);
 			break;
 		case XCODEC_OP_EXTRACT:
-			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + XCODEC_SEGMENT_LENGTH)
+		case XCODEC_OP_EXTRACT_GENERATION:
+			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + (op == XCODEC_OP_EXTRACT_GENERATION ? sizeof (uint8_t) : 0) + XCODEC_SEGMENT_LENGTH)
 				return;
 			else {
-				input.skip(sizeof XCODEC_MAGIC + sizeof op);
+				uint8_t generation = 0;
+				if (op == XCODEC_OP_EXTRACT_GENERATION) {
+					input.moveout(&generation, sizeof XCODEC_MAGIC + sizeof op, sizeof generation);
+				} else {
+					input.skip(sizeof XCODEC_MAGIC + sizeof op);
+				}
 
 				BufferSegment *seg;
 				input.copyout(&seg, XCODEC_SEGMENT_LENGTH);
 				input.skip(XCODEC_SEGMENT_LENGTH);
 
-				uint64_t hash = XCodecHash::hash(seg->data());
-				if (defined_hashes.find(hash) == defined_hashes.end())
-					defined_hashes.insert(hash);
+				uint64_t hash = XCODEC_NAME(XCodecHash::hash(seg->data()), generation);
+				skim_defined_.insert(hash);
 				seg->unref();
 			}
 			break;
@@ -244,13 +692,13 @@ XCodecDecoder::decode_skim(const Buffer *resid, std::set<uint64_t>& unknown_hash
 			else {
 				uint64_t behash;
 				input.extract(&behash, sizeof XCODEC_MAGIC + sizeof op);
-				uint64_t hash = BigEndian::decode(behash);
+				uint64_t pname = BigEndian::decode(behash);
+				uint64_t hash = local_name(pname);
 
 				BufferSegment *oseg = cache_->lookup(hash);
 				if (oseg == NULL) {
-					if (defined_hashes.find(hash) == defined_hashes.end() &&
-					    unknown_hashes.find(hash) == unknown_hashes.end())
-						unknown_hashes.insert(hash);
+					if (skim_defined_.find(hash) == skim_defined_.end())
+						unknown_hashes.insert(XCodecReference(XCodecNamespaceEncoder, pname));
 				} else {
 					oseg->unref();
 				}
@@ -258,15 +706,166 @@ XCodecDecoder::decode_skim(const Buffer *resid, std::set<uint64_t>& unknown_hash
 				input.skip(sizeof XCODEC_MAGIC + sizeof op + sizeof behash);
 			}
 			break;
+		case XCODEC_OP_REF_PEER:
+			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint64_t))
+				return;
+			else {
+				uint64_t behash;
+				input.extract(&behash, sizeof XCODEC_MAGIC + sizeof op);
+				uint64_t pname = BigEndian::decode(behash);
+				uint64_t hash = local_name(pname);
+
+				/*
+				 * Nothing declared in the stream is in our own
+				 * namespace, so everything not in our cache is
+				 * to be asked for.
+				 */
+				BufferSegment *oseg = lookup_peer(hash);
+				if (oseg == NULL) {
+					unknown_hashes.insert(XCodecReference(XCodecNamespaceDecoder, pname));
+				} else {
+					oseg->unref();
+				}
+
+				input.skip(sizeof XCODEC_MAGIC + sizeof op + sizeof behash);
+			}
+			break;
+		case XCODEC_OP_EXTRACT_CHUNK:
+			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t) + sizeof (uint16_t))
+				return;
+			else {
+				uint8_t generation;
+				input.extract(&generation, sizeof XCODEC_MAGIC + sizeof op);
+				uint16_t belength;
+				input.extract(&belength, sizeof XCODEC_MAGIC + sizeof op + sizeof generation);
+				size_t length = BigEndian::decode(belength);
+				if (length < XCODEC_CHUNK_MIN || length > XCODEC_CHUNK_MAX) {
+					ERROR(log_) << "Invalid <EXTRACT_CHUNK> when skimming.";
+					return;
+				}
+
+				size_t header = sizeof XCODEC_MAGIC + sizeof op + sizeof generation + sizeof belength;
+				if (input.length() < header + length)
+					return;
+
+				uint8_t data[XCODEC_CHUNK_MAX];
+				input.copyout(data, header, length);
+				input.skip(header + length);
+
+				XCodecChunk chunk;
+				chunk.make(data, length);
+				skim_defined_.insert(XCODEC_NAME(chunk.hash(), generation));
+			}
+			break;
+		case XCODEC_OP_REF_CHUNK:
+			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint64_t) + sizeof (uint16_t))
+				return;
+			else {
+				uint64_t bename;
+				input.extract(&bename, sizeof XCODEC_MAGIC + sizeof op);
+				uint64_t name = BigEndian::decode(bename);
+				uint16_t belength;
+				input.extract(&belength, sizeof XCODEC_MAGIC + sizeof op + sizeof bename);
+				size_t length = BigEndian::decode(belength);
+
+				/*
+				 * An index which is not for a chunk of this
+				 * length is an error for decoding to find.
+				 */
+				if (skim_defined_.find(name) == skim_defined_.end()) {
+					Buffer data;
+					bool found;
+					(void)lookup_chunk(name, length, &data, unknown_hashes, &found);
+				}
+
+				input.skip(sizeof XCODEC_MAGIC + sizeof op + sizeof bename + sizeof belength);
+			}
+			break;
 		case XCODEC_OP_BACKREF:
 			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t))
 				return;
 			else
 				input.skip(sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t));
 			break;
+		case XCODEC_OP_BACKREF16:
+			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t))
+				return;
+			else
+				input.skip(sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t));
+			break;
+		case XCODEC_OP_RUN:
+			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t) + sizeof (uint16_t))
+				return;
+			else
+				input.skip(sizeof XCODEC_MAGIC + sizeof op + sizeof (uint8_t) + sizeof (uint16_t));
+			break;
+		case XCODEC_OP_REPEAT:
+			if (input.length() < sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t) + sizeof (uint16_t))
+				return;
+			else
+				input.skip(sizeof XCODEC_MAGIC + sizeof op + sizeof (uint16_t) + sizeof (uint16_t));
+			break;
 		default:
 			ERROR(log_) << "Unsupported XCodec opcode when skimming " << (unsigned)op << ".";
 			return;
 		}
 	}
 }
+
+/*
+ * The name by which we know data that the peer has named.
+ */
+uint64_t
+XCodecDecoder::local_name(uint64_t name) const
+{
+	if (legacy_)
+		return (XCodecHash::fold(name));
+	return (name);
+}
+
+/*
+ * Data named by a <REF_PEER> is in our own cache, and if we had to <ASK> for
+ * it, the <LEARN> put it back there.
+ */
+BufferSegment *
+XCodecDecoder::lookup_peer(uint64_t hash)
+{
+	if (local_cache_ == NULL)
+		return (NULL);
+	return (local_cache_->lookup(hash));
+}
+
+/*
+ * Find the data of a chunk by the name of its index, noting the names of
+ * whatever of it we have yet to learn.  Returns false if the index we have
+ * is not for a chunk of the given length.
+ */
+bool
+XCodecDecoder::lookup_chunk(uint64_t name, size_t length, Buffer *buf, std::set<XCodecReference>& unknown_hashes, bool *foundp)
+{
+	*foundp = false;
+
+	BufferSegment *index = cache_->lookup(name);
+	if (index == NULL) {
+		unknown_hashes.insert(XCodecReference(XCodecNamespaceEncoder, name));
+		return (true);
+	}
+
+	XCodecChunk chunk;
+	bool parsed = chunk.parse(index, length);
+	index->unref();
+	if (!parsed)
+		return (false);
+
+	std::vector<uint64_t> missing;
+	if (!chunk.lookup(cache_, &missing)) {
+		std::vector<uint64_t>::const_iterator it;
+		for (it = missing.begin(); it != missing.end(); ++it)
+			unknown_hashes.insert(XCodecReference(XCodecNamespaceEncoder, *it));
+		return (true);
+	}
+
+	chunk.data(buf);
+	*foundp = true;
+	return (true);
+}
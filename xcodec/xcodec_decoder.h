@@ -26,6 +26,7 @@
 #ifndef	XCODEC_XCODEC_DECODER_H
 #define	XCODEC_XCODEC_DECODER_H
 
+#include <deque>
 #include <set>
 
 #include <xcodec/xcodec_window.h>
@@ -33,16 +34,115 @@
 class XCodecCache;
 
 class XCodecDecoder {
+	/*
+	 * A reference whose data we have had to <ASK> for, and the output
+	 * which follows it in the stream, up to the next such reference, along
+	 * with how much input that took.  A reference to a chunk has its
+	 * length, and a reference to a segment has none.
+	 */
+	struct Hole {
+		XCodecReference reference_;
+		uint64_t hash_;
+		size_t length_;
+		bool filled_;
+		Buffer fill_;
+		Buffer data_;
+		size_t input_;
+
+		Hole(const XCodecReference& reference, uint64_t hash, size_t length = 0)
+		: reference_(reference),
+		  hash_(hash),
+		  length_(length),
+		  filled_(false),
+		  fill_(),
+		  data_(),
+		  input_(0)
+		{ }
+	};
+
 	LogHandle log_;
 	XCodecCache *cache_;
+	XCodecCache *local_cache_;
 	XCodecWindow window_;
+	Buffer history_;
+	bool legacy_;
+
+	bool reorder_;
+	std::deque<Hole> holes_;
+	size_t holes_input_;
+
+	bool skimming_;
+	Buffer skim_;
+	std::set<uint64_t> skim_defined_;
 
 public:
-	XCodecDecoder(XCodecCache *);
+	XCodecDecoder(XCodecCache *, unsigned = XCODEC_WINDOW_COUNT);
 	~XCodecDecoder();
 
-	bool decode(Buffer *, Buffer *, std::set<uint64_t>&);
-	void decode_skim(const Buffer *, std::set<uint64_t>&);
+	/*
+	 * Our own cache, in which <REF_PEER>s are looked up.
+	 */
+	void set_local_cache(XCodecCache *cache)
+	{
+		local_cache_ = cache;
+	}
+
+	/*
+	 * Whether the peer names data by its legacy hash, as it does unless we
+	 * both take generations.  Either way, we know data by the name that
+	 * has a generation.
+	 */
+	void set_legacy(bool legacy)
+	{
+		legacy_ = legacy;
+	}
+
+	/*
+	 * Keep decoding past references whose data we must <ASK> for, holding
+	 * what follows each until its data is learned.  Input is consumed as
+	 * it is decoded, but the output is only produced in order.
+	 */
+	void set_reorder(bool reorder)
+	{
+		reorder_ = reorder;
+	}
+
+	/*
+	 * The input which has been consumed, but whose output is held behind
+	 * a reference we are waiting to learn.
+	 */
+	size_t held(void) const
+	{
+		return (holes_input_);
+	}
+
+	bool holding(void) const
+	{
+		return (!holes_.empty());
+	}
+
+	/*
+	 * While decoding is stopped at an unknown hash, any further input
+	 * should be passed to decode_skim as it arrives, so that unknown
+	 * hashes in it can be asked for before decoding reaches them.
+	 */
+	bool skimming(void) const
+	{
+		return (skimming_);
+	}
+
+	bool decode(Buffer *, Buffer *, std::set<XCodecReference>&);
+	void decode_skim(const Buffer *, std::set<XCodecReference>&);
+
+private:
+	void hole(const XCodecReference&, uint64_t, size_t = 0);
+	const Hole *hole_find(uint64_t) const;
+	bool hole_fill(Buffer *, std::set<XCodecReference>&);
+	void hold(size_t);
+	void decode_stop(const Buffer *, bool, std::set<XCodecReference>&);
+	uint64_t local_name(uint64_t) const;
+	BufferSegment *lookup_peer(uint64_t);
+	bool lookup_chunk(uint64_t, size_t, Buffer *, std::set<XCodecReference>&, bool *);
 };
 
 #endif /* !XCODEC_XCODEC_DECODER_H */
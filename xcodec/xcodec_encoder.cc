@@ -23,29 +23,183 @@
  * SUCH DAMAGE.
  */
 
+#include <string.h>
+
+#include <algorithm>
+
 #include <common/buffer.h>
 #include <common/endian.h>
 
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_chunk.h>
 #include <xcodec/xcodec_encoder.h>
+#include <xcodec/xcodec_eviction_log.h>
 #include <xcodec/xcodec_hash.h>
 
+/*
+ * Literal data is searched for runs of a single byte and for repeats of
+ * data which came shortly before it, which are sent as <RUN> and <REPEAT>
+ * if they are at least this long.
+ */
+#define	XCODEC_RUN_MIN			(8)
+#define	XCODEC_REPEAT_MIN		(8)
+
+#define	XCODEC_REPEAT_TABLE_BITS	(12)
+#define	XCODEC_REPEAT_TABLE_SIZE	(1 << XCODEC_REPEAT_TABLE_BITS)
+
+/*
+ * With content-defined chunking, segments are only considered if they end
+ * at an anchor, which is where the top XCODEC_ANCHOR_BITS bits of a gear
+ * hash of the last 64 bytes are all zero, and so, on average, every
+ * 2^XCODEC_ANCHOR_BITS bytes.
+ */
+#define	XCODEC_ANCHOR_BITS		(6)
+
+/*
+ * Variable-size chunks end where the top bits of a gear hash of the last 64
+ * bytes are all zero, with XCODEC_CHUNK_SMALL_BITS of them checked before
+ * XCODEC_CHUNK_AVERAGE bytes and XCODEC_CHUNK_LARGE_BITS after, so that
+ * chunk lengths cluster around the average, as with FastCDC's normalized
+ * chunking.
+ */
+#define	XCODEC_CHUNK_SMALL_BITS		(12)
+#define	XCODEC_CHUNK_LARGE_BITS		(10)
+
+static struct XCodecGear {
+	uint64_t table_[256];
+
+	XCodecGear(void)
+	{
+		uint64_t x = 0;
+		unsigned i;
+
+		/*
+		 * The table must be the same everywhere and for all time so
+		 * that data gets cut in the same places, so it is generated
+		 * from a fixed seed with SplitMix64.
+		 */
+		for (i = 0; i < 256; i++) {
+			uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			table_[i] = z ^ (z >> 31);
+		}
+	}
+
+	uint64_t roll(uint64_t gear, uint8_t ch) const
+	{
+		return ((gear << 1) + table_[ch]);
+	}
+
+	static bool anchor(uint64_t gear)
+	{
+		return ((gear >> (64 - XCODEC_ANCHOR_BITS)) == 0);
+	}
+} xcodec_gear;
+
+/*
+ * The length of the chunk at the start of the given data.
+ */
+static size_t
+xcodec_chunk_length(const uint8_t *data, size_t length)
+{
+	if (length <= XCODEC_CHUNK_MIN)
+		return (length);
+
+	size_t end = std::min(length, (size_t)XCODEC_CHUNK_MAX);
+	uint64_t gear = 0;
+	size_t i;
+
+	/*
+	 * Only the last 64 bytes matter to the gear hash, so start just
+	 * before the shortest chunk would end.
+	 */
+	for (i = XCODEC_CHUNK_MIN - 64; i < XCODEC_CHUNK_MIN; i++)
+		gear = xcodec_gear.roll(gear, data[i]);
+	for (; i < end; i++) {
+		gear = xcodec_gear.roll(gear, data[i]);
+		unsigned bits = i < XCODEC_CHUNK_AVERAGE ? XCODEC_CHUNK_SMALL_BITS : XCODEC_CHUNK_LARGE_BITS;
+		if ((gear >> (64 - bits)) == 0)
+			return (i + 1);
+	}
+	return (end);
+}
+
+/*
+ * The encoder pool splits data into regions of at least this much to be
+ * scanned by different threads.  Each thread must first go over the
+ * XCODEC_SEGMENT_LENGTH bytes before its region, so smaller regions would
+ * mostly be repeated work.
+ */
+#define	XCODEC_SCAN_REGION_LENGTH	(16 * 1024)
+
 struct candidate_symbol {
 	bool set_;
 	unsigned offset_;
 	uint64_t symbol_;
 };
 
-XCodecEncoder::XCodecEncoder(XCodecCache *cache)
+/*
+ * Fill in the hashes and anchors of the segments ending at offsets from
+ * begin up to end.
+ */
+void
+XCodecScan::scan(const uint8_t *data, size_t begin, size_t end)
+{
+	XCodecHash xcodec_hash;
+	uint64_t gear = 0;
+	unsigned o = 0;
+	size_t i;
+
+	ASSERT("/xcodec/scan", end <= hashes_.size());
+
+	i = begin < XCODEC_SEGMENT_LENGTH ? 0 : begin - (XCODEC_SEGMENT_LENGTH - 1);
+	for (; i < end; i++) {
+		gear = xcodec_gear.roll(gear, data[i]);
+		if (o < XCODEC_SEGMENT_LENGTH) {
+			xcodec_hash.add(data[i]);
+			if (++o != XCODEC_SEGMENT_LENGTH)
+				continue;
+		} else {
+			xcodec_hash.roll(data[i]);
+		}
+		if (i < begin)
+			continue;
+		hashes_[i] = xcodec_hash.mix();
+		anchors_[i] = XCodecGear::anchor(gear);
+	}
+}
+
+XCodecEncoder::XCodecEncoder(XCodecCache *cache, unsigned window, XCodecChunking chunking)
 : log_("/xcodec/encoder"),
   cache_(cache),
-  window_(),
-  stream_(!cache_->out_of_band())
+  window_(window),
+  peer_window_(XCODEC_WINDOW_COUNT),
+  peer_hello_(false),
+  peer_capabilities_(0),
+  chunking_(chunking),
+  pool_(NULL),
+  peer_cache_(NULL),
+  eviction_log_(NULL),
+  stream_(!cache_->out_of_band()),
+  history_(),
+  position_(0),
+  repeat_table_(XCODEC_REPEAT_TABLE_SIZE, 0)
 { }
 
 XCodecEncoder::~XCodecEncoder()
-{ }
+{
+	if (eviction_log_ == NULL)
+		return;
+
+	unsigned n;
+	for (n = 0; n < window_.count(); n++) {
+		uint64_t name = window_.expiring(n);
+		if (name != 0)
+			eviction_log_->evicted(name);
+	}
+}
 
 /*
 seg * This takes a view of a data stream and turns it into a series of references
@@ -72,7 +226,43 @@ seg * This takes a view of a data stream and turns it into a series of reference
  * trying to decode which requests a hash, rather than just one frame.
  */
 void
-XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSegment *> *refmap)
+XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<XCodecReference, BufferSegment *> *refmap)
+{
+	/*
+	 * Variable-size chunks are only sent in-band, to a peer which takes
+	 * them.
+	 */
+	if (chunking_ == XCodecChunkingVariable && stream_ && peer_hello_ &&
+	    (peer_capabilities_ & XCODEC_CAPABILITY_CHUNK) != 0) {
+		encode_chunks(output, input, refmap);
+		return;
+	}
+
+#ifdef THREADS
+	/*
+	 * Only bother the pool if there is enough data to split up.
+	 */
+	if (pool_ != NULL && input->length() >= 2 * XCODEC_SCAN_REGION_LENGTH) {
+		size_t length = input->length();
+		std::vector<uint8_t> data(length);
+		input->copyout(&data[0], length);
+
+		XCodecScan scan(length);
+		pool_->scan(&scan, &data[0], length);
+
+		encode(output, input, refmap, &scan);
+		return;
+	}
+#endif
+	encode(output, input, refmap, NULL);
+}
+
+/*
+ * If the hashes have already been worked out, they are taken from the scan
+ * rather than rolled here.  The encoding is the same either way.
+ */
+void
+XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<XCodecReference, BufferSegment *> *refmap, const XCodecScan *scan)
 {
 	if (input->empty())
 		return;
@@ -83,9 +273,11 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 	}
 
 	XCodecHash xcodec_hash;
+	uint64_t gear = 0;
 	candidate_symbol candidate;
 	Buffer outq;
 	unsigned o = 0;
+	size_t pos = 0;
 
 	candidate.set_ = false;
 
@@ -128,19 +320,27 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 				 * Hash all of the bytes from it and continue.
 				 */
 				o += resid;
-				while (p < q)
+				if (scan != NULL)
+					break;
+				while (p < q) {
+					gear = xcodec_gear.roll(gear, *p);
 					xcodec_hash.add(*p++);
+				}
 				break;
 			}
 
 			/*
 			 * If we don't have a complete hash.
 			 */
-			if (o < XCODEC_SEGMENT_LENGTH) {
+			if (o < XCODEC_SEGMENT_LENGTH && scan != NULL) {
+				p += XCODEC_SEGMENT_LENGTH - o - 1;
+				o = XCODEC_SEGMENT_LENGTH;
+			} else if (o < XCODEC_SEGMENT_LENGTH) {
 				for (;;) {
 					/*
 					 * Add bytes to the hash.
 					 */
+					gear = xcodec_gear.roll(gear, *p);
 					xcodec_hash.add(*p);
 
 					/*
@@ -159,7 +359,10 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 				/*
 				 * Roll it into the rolling hash.
 				 */
-				xcodec_hash.roll(*p);
+				if (scan == NULL) {
+					gear = xcodec_gear.roll(gear, *p);
+					xcodec_hash.roll(*p);
+				}
 				o++;
 			}
 
@@ -173,7 +376,16 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 			 * data in the XCodecCache.
 			 */
 			unsigned start = o - XCODEC_SEGMENT_LENGTH;
-			uint64_t hash = xcodec_hash.mix();
+			uint64_t hash;
+			bool anchor;
+			if (scan != NULL) {
+				size_t end = pos + (p - seg->data());
+				hash = scan->hashes_[end];
+				anchor = scan->anchors_[end];
+			} else {
+				hash = xcodec_hash.mix();
+				anchor = XCodecGear::anchor(gear);
+			}
 
 			/*
 			 * If there is a pending candidate hash that wouldn't
@@ -189,6 +401,13 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 				candidate.set_ = false;
 			}
 
+			/*
+			 * With content-defined chunking, skip segments which
+			 * do not end at an anchor.
+			 */
+			if (chunking_ != XCodecChunkingExhaustive && !anchor)
+				continue;
+
 			/*
 			 * Now attempt to encode this hash as a reference if it
 			 * has been defined before.
@@ -215,6 +434,22 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 			if (collision)
 				continue;
 
+			/*
+			 * The peer may have sent us this data.  Only look in
+			 * its namespace where we have an anchor, or where we
+			 * would otherwise declare the data, rather than at
+			 * every offset.
+			 */
+			if (peer_cache_ != NULL &&
+			    (peer_capabilities_ & XCODEC_CAPABILITY_REF_PEER) != 0 &&
+			    (chunking_ != XCodecChunkingExhaustive || !candidate.set_) &&
+			    find_peer_reference(output, &outq, start, hash, refmap)) {
+				o = 0;
+				xcodec_hash.reset();
+				candidate.set_ = false;
+				continue;
+			}
+
 			/*
 			 * Not defined before, it's a candidate for declaration
 			 * if we don't already have one.
@@ -242,6 +477,7 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 			candidate.set_ = true;
 		}
 
+		pos += seg->length();
 		seg->unref();
 	}
 
@@ -273,6 +509,112 @@ XCodecEncoder::encode(Buffer *output, Buffer *input, std::map<uint64_t, BufferSe
 	ASSERT(log_, input->empty());
 }
 
+/*
+ * Cut the input into variable-size chunks and send each as a reference if
+ * both we and the peer should have it, and otherwise as data.
+ */
+void
+XCodecEncoder::encode_chunks(Buffer *output, Buffer *input, std::map<XCodecReference, BufferSegment *> *refmap)
+{
+	while (!input->empty()) {
+		if (input->length() < XCODEC_CHUNK_MIN) {
+			encode_escape(output, input, input->length());
+			break;
+		}
+
+		uint8_t data[XCODEC_CHUNK_MAX];
+		size_t length = std::min(input->length(), sizeof data);
+		input->copyout(data, length);
+		length = xcodec_chunk_length(data, length);
+
+		encode_chunk(output, input, data, length, refmap);
+	}
+}
+
+void
+XCodecEncoder::encode_chunk(Buffer *output, Buffer *input, const uint8_t *data, size_t length, std::map<XCodecReference, BufferSegment *> *refmap)
+{
+	/*
+	 * A chunk of a single byte is better sent as a <RUN>.
+	 */
+	if ((peer_capabilities_ & XCODEC_CAPABILITY_RUN) != 0 &&
+	    memcmp(data, data + 1, length - 1) == 0) {
+		encode_escape(output, input, length);
+		return;
+	}
+
+	XCodecChunk chunk;
+	chunk.make(data, length);
+	uint64_t name = cache_->name(chunk.hash());
+
+	/*
+	 * If other data is known by the name of the chunk or of any of its
+	 * pieces, it cannot be declared, and is sent as literal data.
+	 */
+	bool collision = false;
+	bool cached = false;
+	BufferSegment *oseg = cache_->lookup(name);
+	if (oseg != NULL) {
+		if (oseg->equal(chunk.index()))
+			cached = true;
+		else
+			collision = true;
+		oseg->unref();
+	}
+	if (!chunk.cached(cache_, &collision))
+		cached = false;
+	if (collision) {
+		DEBUG(log_) << "Collision in chunk; sending literal data.";
+		encode_escape(output, input, length);
+		return;
+	}
+
+	Buffer buf;
+	input->moveout(&buf, length);
+
+	if (cached) {
+		output->append(XCODEC_MAGIC);
+		output->append(XCODEC_OP_REF_CHUNK);
+		uint64_t bename = BigEndian::encode(name);
+		output->append(&bename);
+		uint16_t belength = BigEndian::encode((uint16_t)length);
+		output->append(&belength);
+		history_append(buf);
+
+		/*
+		 * The peer may <ASK> for the index or for any piece.
+		 */
+		if (refmap != NULL) {
+			std::vector<std::pair<uint64_t, BufferSegment *> > segs;
+			chunk.segments(&segs, name);
+
+			std::vector<std::pair<uint64_t, BufferSegment *> >::const_iterator it;
+			for (it = segs.begin(); it != segs.end(); ++it) {
+				XCodecReference ref(XCodecNamespaceEncoder, it->first);
+				if (refmap->find(ref) != refmap->end())
+					continue;
+				it->second->ref();
+				refmap->insert(std::map<XCodecReference, BufferSegment *>::value_type(ref, it->second));
+			}
+		}
+		return;
+	}
+
+	/*
+	 * Either we have never seen the chunk or some of its pieces have been
+	 * evicted since, and either way the peer may not have it.
+	 */
+	chunk.enter(cache_, name);
+
+	output->append(XCODEC_MAGIC);
+	output->append(XCODEC_OP_EXTRACT_CHUNK);
+	output->append(XCODEC_NAME_GENERATION(name));
+	uint16_t belength = BigEndian::encode((uint16_t)length);
+	output->append(&belength);
+	output->append(buf);
+	history_append(buf);
+}
+
 void
 XCodecEncoder::encode_declaration(Buffer *output, Buffer *input, unsigned offset, uint64_t hash)
 {
@@ -280,28 +622,52 @@ XCodecEncoder::encode_declaration(Buffer *output, Buffer *input, unsigned offset
 		encode_escape(output, input, offset);
 	}
 
+	/*
+	 * A segment of a single byte is better sent as a <RUN>, and there is
+	 * no sense in filling the cache with it.
+	 */
+	if ((peer_capabilities_ & XCODEC_CAPABILITY_RUN) != 0) {
+		uint8_t data[XCODEC_SEGMENT_LENGTH];
+		input->copyout(data, sizeof data);
+		if (memcmp(data, data + 1, sizeof data - 1) == 0) {
+			encode_escape(output, input, sizeof data);
+			return;
+		}
+	}
+
 	BufferSegment *nseg;
 	input->copyout(&nseg, XCODEC_SEGMENT_LENGTH);
 
-	cache_->enter(hash, nseg);
+	uint64_t name = cache_->name(hash);
+	cache_->enter(name, nseg);
 
 	if (!stream_) {
 		/*
 		 * Declarations occur out-of-band.
 		 */
-		encode_reference(output, input, 0, hash, nseg, NULL);
+		encode_reference(output, input, 0, name, nseg, NULL, false);
 		nseg->unref();
 		return;
 	}
 
 	/*
-	 * Declarations are extracted in-band.
+	 * Declarations are extracted in-band, with the generation of their
+	 * name if that is not the first and the peer takes generations.
 	 */
 	output->append(XCODEC_MAGIC);
-	output->append(XCODEC_OP_EXTRACT);
+	uint8_t generation = 0;
+	if ((peer_capabilities_ & XCODEC_CAPABILITY_GENERATION) != 0)
+		generation = XCODEC_NAME_GENERATION(name);
+	if (generation == 0) {
+		output->append(XCODEC_OP_EXTRACT);
+	} else {
+		output->append(XCODEC_OP_EXTRACT_GENERATION);
+		output->append(generation);
+	}
 	output->append(nseg);
+	history_append(nseg);
 
-	bool collision = window_.declare(hash, nseg);
+	bool collision = declare(name, nseg);
 	if (collision)
 		DEBUG(log_) << "Collision in encoder window; cleared old entry.";
 	nseg->unref();
@@ -312,35 +678,157 @@ XCodecEncoder::encode_declaration(Buffer *output, Buffer *input, unsigned offset
 	input->skip(XCODEC_SEGMENT_LENGTH);
 }
 
+/*
+ * Encode literal data, looking for runs and for repeats within it and the
+ * XCODEC_HISTORY_LENGTH bytes before it.
+ *
+ * Only the starts of literal data which are not already covered by a <RUN>
+ * or a <REPEAT> are entered into the table, which keeps just the most
+ * recent position for each value of the hash of the first few bytes, and
+ * so we find some, but not all, repeats, much as with LZ77 with the least
+ * effort.
+ */
 void
 XCodecEncoder::encode_escape(Buffer *output, Buffer *input, unsigned length)
 {
 	ASSERT_NON_ZERO(log_, length);
 
-	do {
+	/*
+	 * A peer which does not offer <RUN> and <REPEAT> just gets escaped
+	 * literal data.  The history is still kept so that we are ready for
+	 * it when it does.
+	 */
+	if ((peer_capabilities_ & XCODEC_CAPABILITY_RUN) == 0) {
+		Buffer escaped;
+		input->moveout(&escaped, length);
+		history_append(escaped);
+		encode_literal(output, &escaped);
+		return;
+	}
+
+	size_t hlen = history_.length();
+	std::vector<uint8_t> data(hlen + length);
+	if (hlen != 0)
+		history_.copyout(&data[0], hlen);
+	input->copyout(&data[hlen], length);
+
+	uint64_t base = position_ - hlen;
+	size_t end = hlen + length;
+	size_t literal = hlen;
+	size_t i = hlen;
+
+	while (i < end) {
+		size_t run = 1;
+		while (i + run < end && run < 0xffff && data[i + run] == data[i])
+			run++;
+
+		if (run >= XCODEC_RUN_MIN) {
+			encode_literal(output, &data[literal], i - literal);
+
+			output->append(XCODEC_MAGIC);
+			output->append(XCODEC_OP_RUN);
+			output->append(data[i]);
+			uint16_t berun = BigEndian::encode((uint16_t)run);
+			output->append(&berun);
+
+			i += run;
+			literal = i;
+			continue;
+		}
+
+		if (end - i >= XCODEC_REPEAT_MIN) {
+			uint32_t word = (data[i] << 24) | (data[i + 1] << 16) | (data[i + 2] << 8) | data[i + 3];
+			unsigned slot = (word * 2654435761u) >> (32 - XCODEC_REPEAT_TABLE_BITS);
+			uint64_t candidate = repeat_table_[slot];
+			repeat_table_[slot] = base + i + 1;
+
+			if (candidate > base && base + i + 1 - candidate <= XCODEC_HISTORY_LENGTH) {
+				size_t c = candidate - 1 - base;
+				size_t repeat = 0;
+				while (i + repeat < end && repeat < 0xffff && data[c + repeat] == data[i + repeat])
+					repeat++;
+
+				if (repeat >= XCODEC_REPEAT_MIN) {
+					encode_literal(output, &data[literal], i - literal);
+
+					output->append(XCODEC_MAGIC);
+					output->append(XCODEC_OP_REPEAT);
+					uint16_t bedistance = BigEndian::encode((uint16_t)(i - c));
+					output->append(&bedistance);
+					uint16_t berepeat = BigEndian::encode((uint16_t)repeat);
+					output->append(&berepeat);
+
+					i += repeat;
+					literal = i;
+					continue;
+				}
+			}
+		}
+
+		i++;
+	}
+	encode_literal(output, &data[literal], end - literal);
+
+	Buffer escaped;
+	input->moveout(&escaped, length);
+	history_append(escaped);
+}
+
+/*
+ * Output literal data, escaping any XCODEC_MAGIC in it.
+ */
+void
+XCodecEncoder::encode_literal(Buffer *output, const uint8_t *data, size_t length)
+{
+	while (length != 0) {
+		const uint8_t *magic = (const uint8_t *)memchr(data, XCODEC_MAGIC, length);
+		if (magic == NULL) {
+			output->append(data, length);
+			return;
+		}
+
+		if (magic != data) {
+			output->append(data, magic - data);
+			length -= magic - data;
+			data = magic;
+		}
+
+		output->append(XCODEC_MAGIC);
+		output->append(XCODEC_OP_ESCAPE);
+
+		length -= sizeof XCODEC_MAGIC;
+		data += sizeof XCODEC_MAGIC;
+	}
+}
+
+/*
+ * Likewise for literal data in a Buffer, which is consumed.
+ */
+void
+XCodecEncoder::encode_literal(Buffer *output, Buffer *input)
+{
+	while (!input->empty()) {
 		size_t offset;
-		if (!input->find(XCODEC_MAGIC, &offset, length)) {
-			output->append(input, length);
-			input->skip(length);
+		if (!input->find(XCODEC_MAGIC, &offset)) {
+			output->append(input);
+			input->clear();
 			return;
 		}
 
 		if (offset != 0) {
 			output->append(input, offset);
-			length -= offset;
 			input->skip(offset);
 		}
 
 		output->append(XCODEC_MAGIC);
 		output->append(XCODEC_OP_ESCAPE);
 
-		length -= sizeof XCODEC_MAGIC;
 		input->skip(sizeof XCODEC_MAGIC);
-	} while (length != 0);
+	}
 }
 
 void
-XCodecEncoder::encode_reference(Buffer *output, Buffer *input, unsigned offset, uint64_t hash, BufferSegment *oseg, std::map<uint64_t, BufferSegment *> *refmap)
+XCodecEncoder::encode_reference(Buffer *output, Buffer *input, unsigned offset, uint64_t name, BufferSegment *oseg, std::map<XCodecReference, BufferSegment *> *refmap, bool peer)
 {
 	if (offset != 0) {
 		encode_escape(output, input, offset);
@@ -350,34 +838,109 @@ XCodecEncoder::encode_reference(Buffer *output, Buffer *input, unsigned offset,
 	 * Skip to the end.
 	 */
 	input->skip(XCODEC_SEGMENT_LENGTH);
+	history_append(oseg);
 
 	/*
-	 * And output a reference.
+	 * If the segment is still in the backref FIFO on both sides, then
+	 * output a back-reference to it.  This does not put it back into the
+	 * FIFO, so that the decoder's window stays in step with ours.
 	 */
+	uint64_t position;
+	if (window_.present(name, oseg->data(), &position)) {
+		uint64_t distance = window_.position() - position;
+		unsigned limit = std::min(window_.count(), peer_window_);
+
+		if (distance <= XCODEC_WINDOW_COUNT) {
+			output->append(XCODEC_MAGIC);
+			output->append(XCODEC_OP_BACKREF);
+			output->append((uint8_t)(position & XCODEC_WINDOW_MAX));
+			return;
+		}
+
+		if (distance <= limit) {
+			output->append(XCODEC_MAGIC);
+			output->append(XCODEC_OP_BACKREF16);
+			uint16_t beindex = BigEndian::encode((uint16_t)(position & XCODEC_WIDE_WINDOW_MAX));
+			output->append(&beindex);
+			return;
+		}
+	}
+
+	/*
+	 * Until we know how the peer names data, send the data itself, which
+	 * it will name as it does any other.
+	 */
+	if (!peer_hello_ && stream_) {
+		ASSERT(log_, !peer);
+		output->append(XCODEC_MAGIC);
+		output->append(XCODEC_OP_EXTRACT);
+		output->append(oseg);
+		declare(name, oseg);
+		return;
+	}
+
+	/*
+	 * And output a reference, to the peer's own data if that's where we
+	 * found it.
+	 */
+	uint64_t pname = peer_name(name, oseg);
 	output->append(XCODEC_MAGIC);
-	output->append(XCODEC_OP_REF);
-	uint64_t behash = BigEndian::encode(hash);
-	output->append(&behash);
+	output->append(peer ? XCODEC_OP_REF_PEER : XCODEC_OP_REF);
+	uint64_t bename = BigEndian::encode(pname);
+	output->append(&bename);
+
+	if (peer)
+		peer_cache_->use(name);
 
-	window_.declare(hash, oseg);
+	declare(name, oseg);
 
+	/*
+	 * The refmap is keyed by the name the peer will <ASK> for, and by
+	 * whose namespace it is in.
+	 */
 	if (refmap != NULL) {
-		std::map<uint64_t, BufferSegment *>::const_iterator it;
-		it = refmap->find(hash);
+		XCodecReference ref(peer ? XCodecNamespaceDecoder : XCodecNamespaceEncoder, pname);
+		std::map<XCodecReference, BufferSegment *>::const_iterator it;
+		it = refmap->find(ref);
 		if (it == refmap->end()) {
 			oseg->ref();
-			refmap->insert(std::map<uint64_t, BufferSegment *>::value_type(hash, oseg));
+			refmap->insert(std::map<XCodecReference, BufferSegment *>::value_type(ref, oseg));
 		}
 	}
 }
 
 bool
-XCodecEncoder::find_reference(Buffer *output, Buffer *input, unsigned offset, uint64_t hash, bool *collisionp, std::map<uint64_t, BufferSegment *> *refmap)
+XCodecEncoder::declare(uint64_t name, BufferSegment *seg)
+{
+	if (eviction_log_ != NULL) {
+		uint64_t expiring = window_.expiring();
+		if (expiring != 0)
+			eviction_log_->evicted(expiring);
+	}
+	return (window_.declare(name, seg));
+}
+
+/*
+ * The name by which the peer knows data, which is its legacy hash unless the
+ * peer takes generations.
+ */
+uint64_t
+XCodecEncoder::peer_name(uint64_t name, const BufferSegment *seg) const
+{
+	if ((peer_capabilities_ & XCODEC_CAPABILITY_GENERATION) == 0)
+		return (XCodecHash::legacy_hash(seg->data()));
+	return (name);
+}
+
+bool
+XCodecEncoder::find_reference(Buffer *output, Buffer *input, unsigned offset, uint64_t hash, bool *collisionp, std::map<XCodecReference, BufferSegment *> *refmap)
 {
 	/*
-	 * Now check in the cache proper.
+	 * Now check in the cache proper, under the name data with this hash
+	 * would be declared by now.
 	 */
-	BufferSegment *oseg = cache_->lookup(hash);
+	uint64_t name = cache_->name(hash);
+	BufferSegment *oseg = cache_->lookup(name);
 	if (oseg != NULL) {
 		uint8_t data[XCODEC_SEGMENT_LENGTH];
 		input->copyout(data, offset, sizeof data);
@@ -405,12 +968,171 @@ XCodecEncoder::find_reference(Buffer *output, Buffer *input, unsigned offset, ui
 			return (false);
 		}
 
-		encode_reference(output, input, offset, hash, oseg, refmap);
+		encode_reference(output, input, offset, name, oseg, refmap, false);
 		oseg->unref();
 		*collisionp = false;
 		return (true);
 	}
-
 	*collisionp = false;
 	return (false);
 }
+
+/*
+ * Data we have decoded from the peer, which it may now be getting back from
+ * us, can be referenced in its namespace.  If something else has that name
+ * there, it does not keep us from using the name in ours.
+ *
+ * Looking does not count as a use of the data; sending it does.
+ */
+bool
+XCodecEncoder::find_peer_reference(Buffer *output, Buffer *input, unsigned offset, uint64_t hash, std::map<XCodecReference, BufferSegment *> *refmap)
+{
+	ASSERT_NON_NULL(log_, peer_cache_);
+
+	uint64_t name = peer_cache_->name(hash);
+	BufferSegment *oseg = peer_cache_->peek(name);
+	if (oseg == NULL)
+		return (false);
+
+	uint8_t data[XCODEC_SEGMENT_LENGTH];
+	input->copyout(data, offset, sizeof data);
+	if (!oseg->equal(data, sizeof data)) {
+		oseg->unref();
+		return (false);
+	}
+
+	encode_reference(output, input, offset, name, oseg, refmap, true);
+	oseg->unref();
+	return (true);
+}
+
+/*
+ * Keep the last XCODEC_HISTORY_LENGTH bytes of the stream.
+ */
+void
+XCodecEncoder::history_append(const Buffer& buf)
+{
+	history_.append(buf);
+	position_ += buf.length();
+
+	if (history_.length() > XCODEC_HISTORY_LENGTH)
+		history_.skip(history_.length() - XCODEC_HISTORY_LENGTH);
+}
+
+void
+XCodecEncoder::history_append(BufferSegment *seg)
+{
+	Buffer buf;
+	buf.append(seg);
+	history_append(buf);
+}
+
+#ifdef THREADS
+class XCodecEncoderThread : public WorkerThread {
+	XCodecEncoderPool *pool_;
+public:
+	XCodecEncoderThread(XCodecEncoderPool *pool)
+	: WorkerThread("XCodecEncoderThread"),
+	  pool_(pool)
+	{ }
+
+	~XCodecEncoderThread()
+	{ }
+
+private:
+	void work(void)
+	{
+		while (pool_->run())
+			continue;
+	}
+};
+
+XCodecEncoderPool::XCodecEncoderPool(unsigned threads)
+: log_("/xcodec/encoder/pool"),
+  mtx_("XCodecEncoderPool"),
+  jobs_(),
+  threads_()
+{
+	while (threads_.size() < threads) {
+		XCodecEncoderThread *td = new XCodecEncoderThread(this);
+		td->start();
+		threads_.push_back(td);
+	}
+}
+
+XCodecEncoderPool::~XCodecEncoderPool()
+{
+	std::vector<XCodecEncoderThread *>::iterator it;
+
+	for (it = threads_.begin(); it != threads_.end(); ++it) {
+		XCodecEncoderThread *td = *it;
+		td->stop();
+		td->join();
+		delete td;
+	}
+	threads_.clear();
+
+	ASSERT(log_, jobs_.empty());
+}
+
+/*
+ * Split the data into a region for each thread, including the caller, and
+ * wait for them all to be scanned.
+ */
+void
+XCodecEncoderPool::scan(XCodecScan *scan, const uint8_t *data, size_t length)
+{
+	size_t region = std::max(length / (threads_.size() + 1), (size_t)XCODEC_SCAN_REGION_LENGTH);
+	Batch batch(&mtx_);
+	size_t begin;
+
+	mtx_.lock();
+	for (begin = XCODEC_SEGMENT_LENGTH - 1; begin < length; begin += region) {
+		Job job;
+		job.batch_ = &batch;
+		job.scan_ = scan;
+		job.data_ = data;
+		job.begin_ = begin;
+		job.end_ = std::min(begin + region, length);
+		jobs_.push_back(job);
+		batch.remaining_++;
+	}
+	mtx_.unlock();
+
+	std::vector<XCodecEncoderThread *>::iterator it;
+	for (it = threads_.begin(); it != threads_.end(); ++it)
+		(*it)->submit();
+
+	while (run())
+		continue;
+
+	mtx_.lock();
+	while (batch.remaining_ != 0)
+		batch.done_.wait();
+	mtx_.unlock();
+}
+
+/*
+ * Do one job, if there are any left.
+ */
+bool
+XCodecEncoderPool::run(void)
+{
+	mtx_.lock();
+	if (jobs_.empty()) {
+		mtx_.unlock();
+		return (false);
+	}
+	Job job = jobs_.front();
+	jobs_.pop_front();
+	mtx_.unlock();
+
+	job.scan_->scan(job.data_, job.begin_, job.end_);
+
+	mtx_.lock();
+	if (--job.batch_->remaining_ == 0)
+		job.batch_->done_.signal();
+	mtx_.unlock();
+	return (true);
+}
+#endif
@@ -26,26 +26,183 @@
 #ifndef	XCODEC_XCODEC_ENCODER_H
 #define	XCODEC_XCODEC_ENCODER_H
 
+#include <deque>
+#include <map>
+#include <vector>
+
+#ifdef THREADS
+#include <common/thread/thread.h>
+#endif
+
 #include <xcodec/xcodec_window.h>
 
 class XCodecCache;
+class XCodecEncoderPool;
+class XCodecEvictionLog;
+
+/*
+ * The hash of the segment ending at each offset of the data to be encoded,
+ * and whether that offset is an anchor.  Since these depend only on the
+ * data, they can be worked out for many parts of it at once before it is
+ * encoded.
+ */
+class XCodecScan {
+	friend class XCodecEncoder;
+
+	std::vector<uint64_t> hashes_;
+	std::vector<uint8_t> anchors_;
+public:
+	XCodecScan(size_t length)
+	: hashes_(length),
+	  anchors_(length)
+	{ }
+
+	~XCodecScan()
+	{ }
+
+	void scan(const uint8_t *, size_t, size_t);
+};
 
 class XCodecEncoder {
 	LogHandle log_;
 	XCodecCache *cache_;
 	XCodecWindow window_;
+	unsigned peer_window_;
+	bool peer_hello_;
+	uint32_t peer_capabilities_;
+	XCodecChunking chunking_;
+	XCodecEncoderPool *pool_;
+	XCodecCache *peer_cache_;
+	XCodecEvictionLog *eviction_log_;
 	bool stream_;
 
+	/*
+	 * The tail of the stream we have encoded, in which to look for
+	 * repeats of literal data, and a table of where in the stream
+	 * recent runs of literal data began, by their first few bytes.
+	 */
+	Buffer history_;
+	uint64_t position_;
+	std::vector<uint64_t> repeat_table_;
+
 public:
-	XCodecEncoder(XCodecCache *);
+	XCodecEncoder(XCodecCache *, unsigned = XCODEC_WINDOW_COUNT, XCodecChunking = XCodecChunkingExhaustive);
 	~XCodecEncoder();
 
-	void encode(Buffer *, Buffer *, std::map<uint64_t, BufferSegment *> * = NULL);
+	/*
+	 * The size of the window which the peer keeps, beyond which we must
+	 * not send back-references.  Until the peer tells us otherwise, it is
+	 * assumed to keep XCODEC_WINDOW_COUNT entries.
+	 */
+	void set_peer_window(unsigned window)
+	{
+		peer_window_ = window;
+	}
+
+	/*
+	 * The XCODEC_CAPABILITY_* bits for the extensions to the stream which
+	 * both we and the peer offer, once its <HELLO> tells us.  Until then,
+	 * none, and we do not know how it names data.
+	 */
+	void set_peer_capabilities(uint32_t capabilities)
+	{
+		peer_hello_ = true;
+		peer_capabilities_ = capabilities;
+	}
+
+	/*
+	 * Have hashes worked out by the threads in the given pool, leaving
+	 * only lookups and output to be done by the caller of encode().
+	 */
+	void set_pool(XCodecEncoderPool *pool)
+	{
+		pool_ = pool;
+	}
+
+	/*
+	 * Our cache of the peer's namespace, in which we may find data to
+	 * send back to it with <REF_PEER>.
+	 */
+	void set_peer_cache(XCodecCache *cache)
+	{
+		peer_cache_ = cache;
+	}
+
+	/*
+	 * Where to note the names of data which falls out of our window, or
+	 * is left in it when we are done.
+	 */
+	void set_eviction_log(XCodecEvictionLog *log)
+	{
+		eviction_log_ = log;
+	}
+
+	void encode(Buffer *, Buffer *, std::map<XCodecReference, BufferSegment *> * = NULL);
 private:
+	bool declare(uint64_t, BufferSegment *);
+	void encode(Buffer *, Buffer *, std::map<XCodecReference, BufferSegment *> *, const XCodecScan *);
+	void encode_chunks(Buffer *, Buffer *, std::map<XCodecReference, BufferSegment *> *);
+	void encode_chunk(Buffer *, Buffer *, const uint8_t *, size_t, std::map<XCodecReference, BufferSegment *> *);
 	void encode_declaration(Buffer *, Buffer *, unsigned, uint64_t);
 	void encode_escape(Buffer *, Buffer *, unsigned);
-	void encode_reference(Buffer *, Buffer *, unsigned, uint64_t, BufferSegment *, std::map<uint64_t, BufferSegment *> *);
-	bool find_reference(Buffer *, Buffer *, unsigned, uint64_t, bool *, std::map<uint64_t, BufferSegment *> *);
+	void encode_literal(Buffer *, const uint8_t *, size_t);
+	void encode_literal(Buffer *, Buffer *);
+	void encode_reference(Buffer *, Buffer *, unsigned, uint64_t, BufferSegment *, std::map<XCodecReference, BufferSegment *> *, bool);
+	bool find_reference(Buffer *, Buffer *, unsigned, uint64_t, bool *, std::map<XCodecReference, BufferSegment *> *);
+	bool find_peer_reference(Buffer *, Buffer *, unsigned, uint64_t, std::map<XCodecReference, BufferSegment *> *);
+	uint64_t peer_name(uint64_t, const BufferSegment *) const;
+
+	void history_append(const Buffer&);
+	void history_append(BufferSegment *);
+};
+
+#ifdef THREADS
+class XCodecEncoderThread;
+
+/*
+ * A pool of threads which scan parts of the data to be encoded in parallel,
+ * shared by all of the encoders of a codec.  The thread asking for a scan
+ * also takes part in it.
+ */
+class XCodecEncoderPool {
+	friend class XCodecEncoderThread;
+
+	struct Batch {
+		unsigned remaining_;
+		SleepQueue done_;
+
+		Batch(Mutex *mtx)
+		: remaining_(0),
+		  done_("XCodecEncoderPool", mtx)
+		{ }
+	};
+
+	struct Job {
+		Batch *batch_;
+		XCodecScan *scan_;
+		const uint8_t *data_;
+		size_t begin_;
+		size_t end_;
+	};
+
+	LogHandle log_;
+	Mutex mtx_;
+	std::deque<Job> jobs_;
+	std::vector<XCodecEncoderThread *> threads_;
+public:
+	XCodecEncoderPool(unsigned);
+	~XCodecEncoderPool();
+
+	unsigned threads(void) const
+	{
+		return (threads_.size());
+	}
+
+	void scan(XCodecScan *, const uint8_t *, size_t);
+
+private:
+	bool run(void);
 };
+#endif
 
 #endif /* !XCODEC_XCODEC_ENCODER_H */
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	XCODEC_XCODEC_EVICTION_LOG_H
+#define	XCODEC_XCODEC_EVICTION_LOG_H
+
+#include <deque>
+#include <map>
+
+/*
+ * The number of names kept in an eviction log.
+ */
+#define	XCODEC_EVICTION_LOG_LENGTH	(XCODEC_WINDOW_COUNT * 16)
+
+/*
+ * The names of data which the encoders of a codec have recently let fall out
+ * of their windows, or left in them when they were done.  Such data is sent
+ * by name rather than by <BACKREF> if it is seen again, and so the peer must
+ * find it in its cache.  A peer which has had to <ASK> for data, as it will
+ * after a restart, has likely lost what is logged here too, and so for a while
+ * any of it which is referenced may be pushed to the peer ahead of the frame
+ * which references it, rather than costing another round trip.
+ */
+class XCodecEvictionLog {
+	std::deque<std::pair<uint64_t, uint64_t> > names_;
+	std::map<uint64_t, uint64_t> serials_;
+	uint64_t serial_;
+public:
+	XCodecEvictionLog(void)
+	: names_(),
+	  serials_(),
+	  serial_(0)
+	{ }
+
+	~XCodecEvictionLog()
+	{ }
+
+	void evicted(uint64_t name)
+	{
+		serials_[name] = ++serial_;
+		names_.push_back(std::pair<uint64_t, uint64_t>(name, serial_));
+		if (names_.size() <= XCODEC_EVICTION_LOG_LENGTH)
+			return;
+
+		std::map<uint64_t, uint64_t>::iterator it;
+		it = serials_.find(names_.front().first);
+		if (it != serials_.end() && it->second == names_.front().second)
+			serials_.erase(it);
+		names_.pop_front();
+	}
+
+	/*
+	 * Whether data with the given name is in the log, in which case it is
+	 * taken out, so that it is pushed only once unless it is evicted
+	 * again.
+	 */
+	bool take(uint64_t name)
+	{
+		return (serials_.erase(name) != 0);
+	}
+};
+
+#endif /* !XCODEC_XCODEC_EVICTION_LOG_H */
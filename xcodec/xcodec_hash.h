@@ -152,7 +152,7 @@ public:
 	 * hocus pocus computer science.  Need to think more clearly and
 	 * fully about it.
 	 */
-	uint64_t mix(void) const
+	uint64_t legacy_mix(void) const
 	{
 #ifndef NDEBUG
 		ASSERT_EQUAL("/xcodec/hash", length_, XCODEC_SEGMENT_LENGTH);
@@ -163,14 +163,34 @@ public:
 		return ((bits_hash << 36) + bytes_hash);
 	}
 
+	uint64_t mix(void) const
+	{
+		return (fold(legacy_mix()));
+	}
+
+	/*
+	 * Leave room above a hash for a generation number.  Peers which do
+	 * not take generations know data by the whole of its legacy hash, and
+	 * fold() turns that into the hash we know it by.
+	 */
+	static uint64_t fold(uint64_t hash)
+	{
+		return ((hash ^ (hash >> XCODEC_NAME_HASH_BITS)) & XCODEC_NAME_HASH_MASK);
+	}
+
 	static uint64_t hash(const uint8_t *data)
+	{
+		return (fold(legacy_hash(data)));
+	}
+
+	static uint64_t legacy_hash(const uint8_t *data)
 	{
 		XCodecHash xchash;
 		unsigned i;
 
 		for (i = 0; i < XCODEC_SEGMENT_LENGTH; i++)
 			xchash.add(*data++);
-		return (xchash.mix());
+		return (xchash.legacy_mix());
 	}
 };
 
@@ -76,6 +76,13 @@ public:
 		return (counter);
 	}
 
+	Tk oldest(void) const
+	{
+		typename counter_key_map_t::const_iterator lit = counter_key_map_.begin();
+		ASSERT(log_, lit != counter_key_map_.end());
+		return (lit->second);
+	}
+
 	Tk evict(void)
 	{
 		typename counter_key_map_t::iterator lit = counter_key_map_.begin();
@@ -85,6 +92,14 @@ public:
 		return (okey);
 	}
 
+	void remove(Tk key, uint64_t counter)
+	{
+		typename counter_key_map_t::iterator lit = counter_key_map_.find(counter);
+		ASSERT(log_, lit != counter_key_map_.end());
+		ASSERT(log_, lit->second == key);
+		counter_key_map_.erase(lit);
+	}
+
 	uint64_t use(Tk key, uint64_t counter)
 	{
 		if (counter == lru_counter_)
@@ -23,10 +23,13 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+
 #include <common/buffer.h>
 #include <common/endian.h>
 
 #include <event/event_callback.h>
+#include <event/event_system.h>
 
 #include <io/pipe/pipe.h>
 #include <io/pipe/pipe_pair.h>
@@ -35,6 +38,7 @@
 #include <xcodec/xcodec_cache.h>
 #include <xcodec/xcodec_decoder.h>
 #include <xcodec/xcodec_encoder.h>
+#include <xcodec/xcodec_eviction_log.h>
 #include <xcodec/xcodec_hash.h>
 #include <xcodec/xcodec_pipe_pair.h>
 #include <xcodec/xcodec_pipe_protocol.h>
@@ -60,11 +64,40 @@
  */
 #define	XCODEC_PIPE_MAX_FRAME	(1024 * 1024)
 
+/*
+ * Frames encoded in two passes may be larger, since the first pass turns
+ * data it has seen before into a stream some two hundred times shorter, in
+ * which the second pass can find nothing until that is several segments.
+ */
+#define	XCODEC_PIPE_MAX_PASS_FRAME	(16 * 1024 * 1024)
+
+#define	XCODEC_PIPE_FRAME_LIMIT(pass)					\
+	((pass) ? XCODEC_PIPE_MAX_PASS_FRAME : XCODEC_PIPE_MAX_FRAME)
+
+/*
+ * How much data may be put in a frame; at worst each pass doubles it.
+ */
+#define	XCODEC_PIPE_FRAME_DATA(pass)					\
+	((pass) ? XCODEC_PIPE_MAX_PASS_FRAME / 4 : XCODEC_PIPE_MAX_FRAME / 2)
+
 /*
  * Allow up to 512 items per ASK/LEARN.
  */
 #define	XCODEC_PIPE_ASK_MAX	(512)
 
+/*
+ * After the peer asks for data of ours, push data which has recently fallen
+ * out of our window with the next this many frames that reference it.
+ */
+#define	XCODEC_PIPE_PUSH_FRAMES	(64)
+
+/*
+ * A flow whose writes average at least XCODEC_PIPE_BULK_LENGTH bytes is a
+ * bulk flow until they average less than XCODEC_PIPE_INTERACTIVE_LENGTH.
+ */
+#define	XCODEC_PIPE_BULK_LENGTH		(XCODEC_SEGMENT_LENGTH * 2)
+#define	XCODEC_PIPE_INTERACTIVE_LENGTH	(XCODEC_SEGMENT_LENGTH / 2)
+
 void
 XCodecPipePair::decoder_consume(Buffer *buf)
 {
@@ -72,7 +105,8 @@ XCodecPipePair::decoder_consume(Buffer *buf)
 	if (buf->empty()) {
 		if (!decoder_buffer_.empty())
 			ERROR(log_) << "Remote encoder closed connection with data outstanding.";
-		if (!decoder_frame_buffer_.empty())
+		if (!decoder_frame_buffer_.empty() || !decoder_pass_frames_.empty() ||
+		    (decoder_ != NULL && decoder_->holding()))
 			ERROR(log_) << "Remote encoder closed connection with frame data outstanding.";
 		if (!decoder_sent_eos_) {
 			DEBUG(log_) << "Decoder received, sent EOS.";
@@ -103,21 +137,28 @@ XCodecPipePair::decoder_consume(Buffer *buf)
 
 	/*
 	 * Decode any frames we extracted and process the data stream
-	 * state, unless we're still waiting for a <LEARN>.
+	 * state.  Output which follows a hash we're still waiting to
+	 * learn is held by the decoder until the <LEARN> comes in.
 	 */
-	if (decoder_unknown_hashes_.empty()) {
-		if (!decoder_decode_data()) {
-			decoder_error();
-			encoder_pipe_->uncork();
-			return;
-		}
+	if (!decoder_decode_data()) {
+		decoder_error();
+		encoder_pipe_->uncork();
+		return;
 	}
 
+	/*
+	 * Ask for any unknown hashes found in all of the frames above at
+	 * once, without waiting for answers to any <ASK>s outstanding.
+	 */
+	decoder_ask();
+
 	/*
 	 * If we have more data to decode, do not fall through to the EOS
 	 * checks that follow, but we're clearly waiting for more data.
 	 */
-	if (!decoder_buffer_.empty() || !decoder_frame_buffer_.empty()) {
+	if (!decoder_buffer_.empty() || !decoder_frame_buffer_.empty() ||
+	    !decoder_pass_frames_.empty() ||
+	    (decoder_ != NULL && decoder_->holding())) {
 		encoder_pipe_->uncork();
 		return;
 	}
@@ -135,7 +176,6 @@ XCodecPipePair::decoder_consume(Buffer *buf)
 			decoder_produce_eos();
 			decoder_sent_eos_ = true;
 		} else {
-			ASSERT(log_, !decoder_frame_buffer_.empty());
 			DEBUG(log_) << "Decoder finished, waiting to send <EOS> until <ASK>s are answered.";
 		}
 	}
@@ -186,7 +226,9 @@ XCodecPipePair::decoder_decode(void)
 				if (decoder_buffer_.length() < sizeof op + sizeof len + len)
 					return (true);
 
-				if (len != UUID_SIZE) {
+				if (len != UUID_SIZE &&
+				    len != UUID_SIZE + 2 * sizeof (uint32_t) &&
+				    len != UUID_SIZE + 2 * sizeof (uint32_t) + UUID_SIZE) {
 					ERROR(log_) << "Unsupported <HELLO> length: " << (unsigned)len;
 					return (false);
 				}
@@ -200,9 +242,85 @@ XCodecPipePair::decoder_decode(void)
 					return (false);
 				}
 
+				/*
+				 * A peer which sends only its UUID is an older
+				 * one, which keeps the smallest window, offers
+				 * nothing, and names data by its legacy hash.
+				 */
+				unsigned window = XCODEC_WINDOW_COUNT;
+				uint32_t capabilities = 0;
+				if (len != UUID_SIZE) {
+					uint32_t bewindow;
+					decoder_buffer_.moveout(&bewindow);
+					window = BigEndian::decode(bewindow);
+
+					if (window < XCODEC_WINDOW_COUNT ||
+					    window > XCODEC_WIDE_WINDOW_COUNT ||
+					    (window & (window - 1)) != 0) {
+						ERROR(log_) << "Unsupported window in <HELLO>: " << window;
+						return (false);
+					}
+
+					/*
+					 * Capabilities we do not know of are
+					 * those of a newer peer, which will not
+					 * use them with us, since we do not
+					 * offer them.
+					 */
+					uint32_t becapabilities;
+					decoder_buffer_.moveout(&becapabilities);
+					capabilities = BigEndian::decode(becapabilities);
+				}
+
+				/*
+				 * A second UUID names the cache of the second
+				 * pass with which the peer encodes.
+				 */
+				if (len == UUID_SIZE + 2 * sizeof (uint32_t) + UUID_SIZE) {
+					Buffer passbuf;
+					decoder_buffer_.moveout(&passbuf, UUID_SIZE);
+
+					UUID pass_uuid;
+					if (!pass_uuid.decode(&passbuf)) {
+						ERROR(log_) << "Invalid second pass UUID in <HELLO>.";
+						return (false);
+					}
+
+					XCodecCache *parent = codec_->pass_cache();
+					if (parent == NULL)
+						parent = codec_->cache();
+					decoder_pass_cache_ = XCodecCache::connect(pass_uuid, parent);
+					ASSERT_NULL(log_, decoder_pass_);
+					decoder_pass_ = new XCodecDecoder(decoder_pass_cache_, codec_->window());
+					decoder_pass_->set_legacy((capabilities & codec_->capabilities() & XCODEC_CAPABILITY_GENERATION) == 0);
+
+					DEBUG(log_) << "Peer encodes in two passes, second with UUID: " << pass_uuid.string_;
+				}
+
+				/*
+				 * Back-references may reach only as far as
+				 * the smaller of the two windows.
+				 */
+				peer_window_ = std::min(window, codec_->window());
+				peer_capabilities_ = capabilities & codec_->capabilities();
+				if (encoder_ != NULL) {
+					encoder_->set_peer_window(peer_window_);
+					encoder_->set_peer_capabilities(peer_capabilities_);
+				}
+				if (encoder_pass_ != NULL) {
+					encoder_pass_->set_peer_window(peer_window_);
+					encoder_pass_->set_peer_capabilities(peer_capabilities_);
+				}
+
 				decoder_cache_ = XCodecCache::connect(uuid, codec_->cache());
 				ASSERT_NULL(log_, decoder_);
-				decoder_ = new XCodecDecoder(decoder_cache_);
+				decoder_ = new XCodecDecoder(decoder_cache_, codec_->window());
+				decoder_->set_local_cache(codec_->cache());
+				decoder_->set_legacy((peer_capabilities_ & XCODEC_CAPABILITY_GENERATION) == 0);
+				decoder_->set_reorder(true);
+
+				if (encoder_ != NULL)
+					encoder_->set_peer_cache(decoder_cache_);
 
 				DEBUG(log_) << "Peer connected with UUID: " << uuid.string_;
 			}
@@ -223,8 +341,13 @@ XCodecPipePair::decoder_decode(void)
 					return (false);
 				}
 
+				/*
+				 * Each hash comes with the namespace it is in if
+				 * the peer may be sent <REF_PEER>s.
+				 */
 				uint64_t hash;
-				if (decoder_buffer_.length() < sizeof op + sizeof count + (sizeof hash * count))
+				size_t namespace_length = (peer_capabilities_ & XCODEC_CAPABILITY_REF_PEER) != 0 ? sizeof (uint8_t) : 0;
+				if (decoder_buffer_.length() < sizeof op + sizeof count + ((namespace_length + sizeof hash) * count))
 					return (true);
 
 				decoder_buffer_.skip(sizeof op + sizeof count);
@@ -233,9 +356,29 @@ XCodecPipePair::decoder_decode(void)
 				learn.append(XCODEC_PIPE_OP_LEARN);
 				learn.append(&becount);
 				while (count-- != 0) {
+					uint8_t ns = XCodecNamespaceEncoder;
+					if (namespace_length != 0) {
+						decoder_buffer_.moveout(&ns, sizeof ns);
+						if (ns != XCodecNamespaceEncoder &&
+						    ns != XCodecNamespaceDecoder) {
+							ERROR(log_) << "Got invalid namespace in <ASK>: " << (unsigned)ns;
+							return (false);
+						}
+					}
+
 					decoder_buffer_.moveout(&hash);
 					hash = BigEndian::decode(hash);
 
+					XCodecReference ref((XCodecNamespace)ns, hash);
+
+					/*
+					 * The peer has lost data of ours, and
+					 * likely much else that it has not yet
+					 * been sent a reference to.
+					 */
+					if (ref.namespace_ == XCodecNamespaceEncoder)
+						encoder_push_frames_ = XCODEC_PIPE_PUSH_FRAMES;
+
 					if (encoder_reference_frames_.empty()) {
 						ERROR(log_) << "Got <ASK> when all encoded frames have been processed.";
 						return (false);
@@ -249,16 +392,22 @@ XCodecPipePair::decoder_decode(void)
 					 * frames.  Mind, we process one frame at a time
 					 * these days.
 					 */
-					std::list<std::map<uint64_t, BufferSegment *> *>::const_iterator rmit;
+					std::list<std::map<XCodecReference, BufferSegment *> *>::const_iterator rmit;
 					for (rmit = encoder_reference_frames_.begin();
 					     rmit != encoder_reference_frames_.end(); ++rmit) {
-						std::map<uint64_t, BufferSegment *> *refmap = *rmit;
+						std::map<XCodecReference, BufferSegment *> *refmap = *rmit;
+						if (refmap == NULL)
+							continue;
 
-						std::map<uint64_t, BufferSegment *>::const_iterator it;
-						it = refmap->find(hash);
+						std::map<XCodecReference, BufferSegment *>::const_iterator it;
+						it = refmap->find(ref);
 						if (it == refmap->end())
 							continue;
 
+						if (namespace_length != 0)
+							learn.append(ns);
+						if ((peer_capabilities_ & XCODEC_CAPABILITY_GENERATION) != 0)
+							learn.append(XCODEC_NAME_GENERATION(hash));
 						learn.append(it->second);
 						break;
 					}
@@ -287,29 +436,78 @@ XCodecPipePair::decoder_decode(void)
 					return (false);
 				}
 
-				if (decoder_buffer_.length() < sizeof op + sizeof count + (XCODEC_SEGMENT_LENGTH * count))
+				/*
+				 * Each segment comes with the namespace it was
+				 * asked for in as in <ASK>, and with the
+				 * generation of its name if both sides use
+				 * generations, and is otherwise named by its
+				 * legacy hash.
+				 */
+				bool legacy = (peer_capabilities_ & XCODEC_CAPABILITY_GENERATION) == 0;
+				size_t namespace_length = (peer_capabilities_ & XCODEC_CAPABILITY_REF_PEER) != 0 ? sizeof (uint8_t) : 0;
+				size_t generation_length = legacy ? 0 : sizeof (uint8_t);
+				if (decoder_buffer_.length() < sizeof op + sizeof count + ((namespace_length + generation_length + XCODEC_SEGMENT_LENGTH) * count))
 					return (true);
 
 				decoder_buffer_.skip(sizeof op + sizeof count);
 
 				while (count-- != 0) {
+					uint8_t ns = XCodecNamespaceEncoder;
+					if (namespace_length != 0)
+						decoder_buffer_.moveout(&ns, sizeof ns);
+
+					uint8_t generation = 0;
+					if (generation_length != 0)
+						decoder_buffer_.moveout(&generation, sizeof generation);
+
 					BufferSegment *seg;
 					decoder_buffer_.copyout(&seg, XCODEC_SEGMENT_LENGTH);
 					decoder_buffer_.skip(XCODEC_SEGMENT_LENGTH);
 
-					uint64_t hash = XCodecHash::hash(seg->data());
-					if (decoder_unknown_hashes_.find(hash) == decoder_unknown_hashes_.end()) {
+					/*
+					 * We asked by the name the peer uses, but
+					 * keep the data under our own.
+					 */
+					uint64_t hash;
+					if (legacy)
+						hash = XCodecHash::legacy_hash(seg->data());
+					else
+						hash = XCODEC_NAME(XCodecHash::hash(seg->data()), generation);
+					XCodecReference ref((XCodecNamespace)ns, hash);
+					if (decoder_unknown_hashes_.find(ref) == decoder_unknown_hashes_.end()) {
 						/*
+						 * A peer may push its own data
+						 * before referencing it.
+						 *
 						 * XXX
-						 * This can happen if we send a duplicate <ASK>.
-						 * Have we weeded all such cases out?
+						 * Otherwise this can happen if we send a
+						 * duplicate <ASK>.  Have we weeded all such
+						 * cases out?
 						 */
-						ERROR(log_) << "Gratuitous <LEARN> without <ASK>.";
-						return (false);
+						if ((peer_capabilities_ & XCODEC_CAPABILITY_PUSH) == 0 ||
+						    ref.namespace_ != XCodecNamespaceEncoder) {
+							ERROR(log_) << "Gratuitous <LEARN> without <ASK>.";
+							return (false);
+						}
 					}
-					decoder_unknown_hashes_.erase(hash);
+					decoder_unknown_hashes_.erase(ref);
 
-					BufferSegment *oseg = decoder_cache_->lookup(hash);
+					/*
+					 * Data asked for by the second pass goes in
+					 * its own cache, and data named in our own
+					 * namespace by a <REF_PEER> goes back in ours.
+					 */
+					XCodecCache *cache = decoder_cache_;
+					if (decoder_pass_unknown_hashes_.erase(ref) != 0)
+						cache = decoder_pass_cache_;
+					else if (ref.namespace_ == XCodecNamespaceDecoder)
+						cache = codec_->cache();
+
+					uint64_t name = hash;
+					if (legacy)
+						name = XCodecHash::fold(hash);
+
+					BufferSegment *oseg = cache->lookup(name);
 					if (oseg != NULL) {
 						if (oseg->equal(seg)) {
 							oseg->unref();
@@ -321,10 +519,10 @@ XCodecPipePair::decoder_decode(void)
 							 */
 							INFO(log_) << "Name reuse in <LEARN>.";
 							oseg->unref();
-							decoder_cache_->replace(hash, seg);
+							cache->replace(name, seg);
 						}
 					} else {
-						decoder_cache_->enter(hash, seg);
+						cache->enter(name, seg);
 					}
 					seg->unref();
 				}
@@ -361,7 +559,7 @@ XCodecPipePair::decoder_decode(void)
 					return (true);
 				decoder_buffer_.extract(&len, sizeof op);
 				len = BigEndian::decode(len);
-				if (len == 0 || len > XCODEC_PIPE_MAX_FRAME) {
+				if (len == 0 || len > XCODEC_PIPE_FRAME_LIMIT(decoder_pass_ != NULL)) {
 					ERROR(log_) << "Invalid framed data length.";
 					return (false);
 				}
@@ -377,8 +575,33 @@ XCodecPipePair::decoder_decode(void)
 				 * a time while waiting for a <LEARN> whereas right now a
 				 * single <LEARN> will delay all production from the
 				 * decoder.
+				 *
+				 * While it does, skim each frame as it arrives so
+				 * that we can <ASK> for anything else we are going
+				 * to need without waiting for that <LEARN> first.
 				 */
-				decoder_buffer_.moveout(&decoder_frame_buffer_, sizeof op + sizeof len, len);
+				if (decoder_pass_ != NULL) {
+					/*
+					 * Frames encoded in two passes are kept
+					 * apart until the second pass has been
+					 * undone for the whole of each.
+					 */
+					Buffer frame;
+					decoder_buffer_.moveout(&frame, sizeof op + sizeof len, len);
+					if (decoder_pass_->skimming())
+						decoder_pass_->decode_skim(&frame, decoder_pass_ask_hashes_);
+					decoder_pass_frames_.push_back(frame);
+					break;
+				}
+
+				if (decoder_->skimming()) {
+					Buffer frame;
+					decoder_buffer_.moveout(&frame, sizeof op + sizeof len, len);
+					decoder_->decode_skim(&frame, decoder_ask_hashes_);
+					frame.moveout(&decoder_frame_buffer_);
+				} else {
+					decoder_buffer_.moveout(&decoder_frame_buffer_, sizeof op + sizeof len, len);
+				}
 
 				/*
 				 * Track the length of each frame in a vector so
@@ -408,6 +631,13 @@ XCodecPipePair::decoder_decode(void)
 					encoder_reference_frame_advance();
 					count--;
 				}
+
+				/*
+				 * Take more input if that has given us
+				 * credit to send it.
+				 */
+				if (!encoder_credit_exhausted())
+					encoder_pipe_->input_release();
 			}
 			break;
 		default:
@@ -426,10 +656,15 @@ bool
 XCodecPipePair::decoder_decode_data(void)
 {
 	ASSERT_LOCK_OWNED(log_, &mtx_);
-	ASSERT(log_, decoder_unknown_hashes_.empty());
 
-	if (decoder_frame_buffer_.empty()) {
-		if (decoder_received_eos_ && !encoder_sent_eos_ack_) {
+	if (decoder_pass_ != NULL && !decoder_decode_pass())
+		return (false);
+
+	if (decoder_frame_buffer_.empty() &&
+	    (decoder_ == NULL || !decoder_->holding())) {
+		if (decoder_received_eos_ && !encoder_sent_eos_ack_ &&
+		    decoder_pass_frames_.empty() &&
+		    decoder_unknown_hashes_.empty()) {
 			DEBUG(log_) << "Decoder finished, got <EOS>, sending <EOS_ACK>.";
 
 			Buffer eos_ack;
@@ -441,14 +676,19 @@ XCodecPipePair::decoder_decode_data(void)
 		return (true);
 	}
 
-	size_t frame_buffer_consumed = decoder_frame_buffer_.length();
+	/*
+	 * Frames are only advanced once their output has been produced, so
+	 * that the peer still has the data for any reference we have yet to
+	 * <ASK> for, or to learn, behind which output is held.
+	 */
+	size_t frame_buffer_consumed = decoder_frame_buffer_.length() + decoder_->held();
 	Buffer output;
-	if (!decoder_->decode(&output, &decoder_frame_buffer_, decoder_unknown_hashes_)) {
+	if (!decoder_->decode(&output, &decoder_frame_buffer_, decoder_ask_hashes_)) {
 		ERROR(log_) << "Decoder exiting with error.";
 		return (false);
 	}
 
-	frame_buffer_consumed -= decoder_frame_buffer_.length();
+	frame_buffer_consumed -= decoder_frame_buffer_.length() + decoder_->held();
 	if (frame_buffer_consumed != 0) {
 		uint32_t frame_buffer_advance = 0;
 		for (;;) {
@@ -492,25 +732,86 @@ XCodecPipePair::decoder_decode_data(void)
 		 * simplify length checking within the decoder
 		 * considerably.)
 		 */
-		ASSERT(log_, !decoder_frame_buffer_.empty() || !decoder_unknown_hashes_.empty());
+		ASSERT(log_, !decoder_frame_buffer_.empty() || !decoder_unknown_hashes_.empty() ||
+		       decoder_->holding());
 	}
 
-	/*
-	 * We've processed the data and are done.
-	 */
-	if (decoder_unknown_hashes_.empty())
-		return (true);
+	return (true);
+}
+
+/*
+ * Undo the second pass for as many whole frames as we can, passing what
+ * each decodes to on to the first pass as a frame of its own.
+ */
+bool
+XCodecPipePair::decoder_decode_pass(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+
+	while (!decoder_pass_frames_.empty()) {
+		Buffer& frame = decoder_pass_frames_.front();
+		if (!decoder_pass_->decode(&decoder_pass_output_, &frame, decoder_pass_ask_hashes_)) {
+			ERROR(log_) << "Second pass decoder exiting with error.";
+			return (false);
+		}
+		if (!frame.empty())
+			return (true);
+		decoder_pass_frames_.pop_front();
+
+		ASSERT(log_, !decoder_pass_output_.empty());
+		size_t len = decoder_pass_output_.length();
+		if (len > XCODEC_PIPE_MAX_PASS_FRAME / 2) {
+			ERROR(log_) << "Second pass decoded to an invalid frame length.";
+			return (false);
+		}
+
+		if (decoder_->skimming())
+			decoder_->decode_skim(&decoder_pass_output_, decoder_ask_hashes_);
+		decoder_pass_output_.moveout(&decoder_frame_buffer_);
+		decoder_frame_lengths_.push_back(len);
+	}
+	return (true);
+}
+
+/*
+ * Send <ASK>s for any unknown hashes not already asked for, in groups of
+ * XCODEC_PIPE_ASK_MAX.
+ */
+void
+XCodecPipePair::decoder_ask(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
 
 	/*
-	 * Send <ASK>s in groups of XCODEC_PIPE_ASK_MAX.
+	 * Remember which hashes the second pass asked for, so that we know
+	 * which cache to put their data in when it is learned.
 	 */
+	std::set<XCodecReference>::iterator uit;
+	for (uit = decoder_pass_ask_hashes_.begin(); uit != decoder_pass_ask_hashes_.end(); ++uit) {
+		if (decoder_unknown_hashes_.find(*uit) != decoder_unknown_hashes_.end())
+			continue;
+		decoder_pass_unknown_hashes_.insert(*uit);
+		decoder_ask_hashes_.insert(*uit);
+	}
+	decoder_pass_ask_hashes_.clear();
+
+	for (uit = decoder_ask_hashes_.begin(); uit != decoder_ask_hashes_.end(); ) {
+		if (decoder_unknown_hashes_.find(*uit) != decoder_unknown_hashes_.end()) {
+			decoder_ask_hashes_.erase(uit++);
+			continue;
+		}
+		decoder_unknown_hashes_.insert(*uit);
+		++uit;
+	}
+	if (decoder_ask_hashes_.empty())
+		return;
+
 	Buffer ask;
-	std::set<uint64_t>::const_iterator it;
-	unsigned hashcnt = decoder_unknown_hashes_.size();
+	std::set<XCodecReference>::const_iterator it;
+	unsigned hashcnt = decoder_ask_hashes_.size();
 	unsigned nhash = 0;
-	for (it = decoder_unknown_hashes_.begin(); it != decoder_unknown_hashes_.end(); ++it) {
-		uint64_t hash = *it;
-		hash = BigEndian::encode(hash);
+	for (it = decoder_ask_hashes_.begin(); it != decoder_ask_hashes_.end(); ++it) {
+		uint64_t hash = BigEndian::encode(it->name_);
 
 		if (nhash == 0) {
 			uint16_t count;
@@ -528,6 +829,12 @@ XCodecPipePair::decoder_decode_data(void)
 			ask.append(&count);
 		}
 		ASSERT(log_, !ask.empty());
+		if ((peer_capabilities_ & XCODEC_CAPABILITY_REF_PEER) != 0) {
+			uint8_t ns = it->namespace_;
+			ask.append(ns);
+		} else {
+			ASSERT(log_, it->namespace_ == XCodecNamespaceEncoder);
+		}
 		ask.append(&hash);
 		if (++nhash == XCODEC_PIPE_ASK_MAX) {
 			nhash = 0;
@@ -542,8 +849,7 @@ XCodecPipePair::decoder_decode_data(void)
 	} else {
 		ASSERT_ZERO(log_, nhash);
 	}
-
-	return (true);
+	decoder_ask_hashes_.clear();
 }
 
 void
@@ -562,81 +868,314 @@ XCodecPipePair::encoder_consume(Buffer *buf)
 			return;
 		}
 
+		ASSERT_EQUAL(log_, extra.length(), UUID_SIZE);
+
+		/*
+		 * An older peer takes nothing more than our UUID.
+		 */
+		if (!codec_->legacy()) {
+			uint32_t bewindow = BigEndian::encode((uint32_t)codec_->window());
+			extra.append(&bewindow);
+
+			uint32_t becapabilities = BigEndian::encode(codec_->capabilities());
+			extra.append(&becapabilities);
+		} else {
+			ASSERT_EQUAL(log_, codec_->window(), XCODEC_WINDOW_COUNT);
+			ASSERT_NULL(log_, codec_->pass_cache());
+		}
+
+		XCodecCache *pass_cache = codec_->pass_cache();
+
+		if (pass_cache != NULL && !pass_cache->uuid_encode(&extra)) {
+			ERROR(log_) << "Could not encode second pass UUID for <HELLO>.";
+			encoder_error();
+			return;
+		}
+
 		uint8_t len = extra.length();
-		ASSERT_EQUAL(log_, len, UUID_SIZE);
 
 		output.append(XCODEC_PIPE_OP_HELLO);
 		output.append(len);
 		output.append(extra);
 
-		ASSERT(log_, output.length() == 2 + UUID_SIZE);
+		/*
+		 * What the peer takes is only known once its <HELLO> is.
+		 */
+		encoder_ = new XCodecEncoder(codec_->cache(), codec_->window(), codec_->chunking());
+		if (decoder_cache_ != NULL) {
+			encoder_->set_peer_window(peer_window_);
+			encoder_->set_peer_capabilities(peer_capabilities_);
+		}
+		encoder_->set_pool(codec_->encoder_pool());
+		encoder_->set_peer_cache(decoder_cache_);
+		encoder_->set_eviction_log(codec_->eviction_log());
 
-		encoder_ = new XCodecEncoder(codec_->cache());
+		if (pass_cache != NULL) {
+			encoder_pass_ = new XCodecEncoder(pass_cache, codec_->window(), codec_->chunking());
+			if (decoder_cache_ != NULL) {
+				encoder_pass_->set_peer_window(peer_window_);
+				encoder_pass_->set_peer_capabilities(peer_capabilities_);
+			}
+			encoder_pass_->set_pool(codec_->encoder_pool());
+		}
 	}
 
 	if (!buf->empty()) {
+		encoder_classify(buf->length());
+
 		/*
-		 * We must encode XCODEC_PIPE_MAX_FRAME / 2 bytes at a time,
-		 * since at worst we double the size of data, and that way we
-		 * can ensure that each frame is self-contained!
-		 *
-		 * Here we should also be doing protocol-aware framing.  Have
-		 * a protocol subsystem which will taste if this is the first
-		 * few frames, until it works out what framing policy to use.
-		 * It could also decide to rewrite data in safe ways, rather
-		 * than just do framing.
-		 *
-		 * XXX
-		 * This needs to include a checksum of the decoded data, and
-		 * we need a way to negotiate the resulting ASK/LEARN work, or
-		 * even send the full decoded data in the raw in the case
-		 * where an error is encountered.  That wouldn't be very hard
-		 * to implement.
+		 * Bulk data is held back until there is a full frame of it,
+		 * or until the coalescing window closes.
 		 */
-		for (;;) {
-			uint32_t framelen;
-			if (buf->length() <= XCODEC_PIPE_MAX_FRAME / 2)
-				framelen = buf->length();
-			else
-				framelen = XCODEC_PIPE_MAX_FRAME / 2;
-
-			Buffer frame;
-			buf->moveout(&frame, framelen);
-
-			std::map<uint64_t, BufferSegment *> *refmap =
-				new std::map<uint64_t, BufferSegment *>;
-
-			Buffer encoded;
-			encoder_->encode(&encoded, &frame, refmap);
-			ASSERT(log_, !encoded.empty());
-
-			/*
-			 * Track all references associated with this frame, so
-			 * that we can guarantee we can answer any <ASK> for it
-			 * until the peer has said they're finished with it.
-			 */
-			encoder_reference_frames_.push_back(refmap);
-
-			/*
-			 * Now wrap the encoded data frame.
-			 */
-			ASSERT(log_, encoded.length() <= XCODEC_PIPE_MAX_FRAME);
-
-			framelen = encoded.length();
-			framelen = BigEndian::encode(framelen);
-
-			output.append(XCODEC_PIPE_OP_FRAME);
-			output.append(&framelen);
-			output.append(encoded);
-
-			if (buf->empty())
-				break;
+		if (encoder_statistics_.bulk_ && codec_->coalesce() != 0) {
+			buf->moveout(&encoder_pending_);
+			if (encoder_pending_.length() < XCODEC_PIPE_FRAME_DATA(encoder_pass_ != NULL)) {
+				if (encoder_coalesce_action_ == NULL)
+					encoder_coalesce_action_ = EventSystem::instance()->timeout(codec_->coalesce(), &encoder_coalesce_callback_);
+				if (!output.empty())
+					encoder_produce(&output);
+				return;
+			}
+			encoder_flush(&output);
+		} else {
+			encoder_flush(&output);
+			encoder_encode(&output, buf);
 		}
 	} else {
+		encoder_flush(&output);
+
 		ASSERT(log_, !encoder_sent_eos_);
 		output.append(XCODEC_PIPE_OP_EOS);
 		encoder_sent_eos_ = true;
 	}
 	ASSERT(log_, !output.empty());
 	encoder_produce(&output);
+
+	/*
+	 * If the peer has yet to finish with as many frames as we may have
+	 * outstanding, take no more input until its <ADVANCE> says it has.
+	 */
+	if (!encoder_sent_eos_ && encoder_credit_exhausted()) {
+		DEBUG(log_) << "Out of credit, holding input.";
+		encoder_pipe_->input_hold();
+	}
+}
+
+bool
+XCodecPipePair::encoder_credit_exhausted(void) const
+{
+	if (codec_->credit_frames() != 0 &&
+	    encoder_reference_frames_.size() >= codec_->credit_frames())
+		return (true);
+	if (codec_->credit_bytes() != 0 &&
+	    encoder_frame_bytes_ >= codec_->credit_bytes())
+		return (true);
+	return (false);
+}
+
+/*
+ * Running average of the last several writes, with hysteresis so that a
+ * flow does not flap between modes on every write.
+ */
+void
+XCodecPipePair::encoder_classify(size_t len)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+
+	encoder_write_average_ = (encoder_write_average_ * 7 + len) / 8;
+
+	bool bulk;
+	if (encoder_statistics_.bulk_)
+		bulk = encoder_write_average_ >= XCODEC_PIPE_INTERACTIVE_LENGTH;
+	else
+		bulk = encoder_write_average_ >= XCODEC_PIPE_BULK_LENGTH;
+	if (bulk == encoder_statistics_.bulk_)
+		return;
+
+	if (bulk)
+		DEBUG(log_) << "Switching to bulk framing.";
+	else
+		DEBUG(log_) << "Switching to interactive framing.";
+	encoder_statistics_.bulk_ = bulk;
+}
+
+void
+XCodecPipePair::encoder_coalesce_timeout(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	ASSERT(log_, !encoder_sent_eos_);
+
+	encoder_coalesce_action_->cancel();
+	encoder_coalesce_action_ = NULL;
+
+	Buffer output;
+	encoder_flush(&output);
+	if (!output.empty())
+		encoder_produce(&output);
+}
+
+void
+XCodecPipePair::encoder_encode(Buffer *output, Buffer *buf)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	ASSERT(log_, !buf->empty());
+
+	/*
+	 * We must encode XCODEC_PIPE_MAX_FRAME / 2 bytes at a time,
+	 * since at worst we double the size of data, and that way we
+	 * can ensure that each frame is self-contained!  With a second
+	 * pass, which may double it again, a quarter of the larger
+	 * XCODEC_PIPE_MAX_PASS_FRAME.
+	 *
+	 * Here we should also be doing protocol-aware framing.  Have
+	 * a protocol subsystem which will taste if this is the first
+	 * few frames, until it works out what framing policy to use.
+	 * It could also decide to rewrite data in safe ways, rather
+	 * than just do framing.
+	 *
+	 * XXX
+	 * This needs to include a checksum of the decoded data, and
+	 * we need a way to negotiate the resulting ASK/LEARN work, or
+	 * even send the full decoded data in the raw in the case
+	 * where an error is encountered.  That wouldn't be very hard
+	 * to implement.
+	 */
+	for (;;) {
+		uint32_t framelen;
+		if (buf->length() <= XCODEC_PIPE_FRAME_DATA(encoder_pass_ != NULL))
+			framelen = buf->length();
+		else
+			framelen = XCODEC_PIPE_FRAME_DATA(encoder_pass_ != NULL);
+
+		Buffer frame;
+		buf->moveout(&frame, framelen);
+
+		/*
+		 * Frames shorter than the shortest chunk are only ever
+		 * escaped, and so have no references to be kept track of.
+		 */
+		std::map<XCodecReference, BufferSegment *> *refmap = NULL;
+		if (framelen >= XCODEC_CHUNK_MIN)
+			refmap = new std::map<XCodecReference, BufferSegment *>;
+
+		Buffer encoded;
+		encoder_->encode(&encoded, &frame, refmap);
+		ASSERT(log_, !encoded.empty());
+
+		/*
+		 * Data of ours which the peer has likely lost goes ahead of
+		 * the frame which references it.  The second pass is not
+		 * pushed, since its references only name references.
+		 */
+		if (encoder_push_frames_ != 0) {
+			encoder_push_frames_--;
+			encoder_push(output, refmap);
+		}
+
+		/*
+		 * References made by the second pass go in the same map,
+		 * since an <ASK> does not say which pass it is for; what
+		 * the first pass produced may be long enough to have some
+		 * even if the frame was not.
+		 */
+		if (encoder_pass_ != NULL) {
+			if (refmap == NULL && encoded.length() >= XCODEC_SEGMENT_LENGTH)
+				refmap = new std::map<XCodecReference, BufferSegment *>;
+
+			Buffer pass;
+			encoder_pass_->encode(&pass, &encoded, refmap);
+			ASSERT(log_, !pass.empty());
+			pass.moveout(&encoded);
+		}
+
+		/*
+		 * Track all references associated with this frame, so
+		 * that we can guarantee we can answer any <ASK> for it
+		 * until the peer has said they're finished with it.
+		 */
+		encoder_reference_frames_.push_back(refmap);
+
+		/*
+		 * Now wrap the encoded data frame.
+		 */
+		ASSERT(log_, encoded.length() <= XCODEC_PIPE_FRAME_LIMIT(encoder_pass_ != NULL));
+
+		framelen = encoded.length();
+		encoder_frame_lengths_.push_back(framelen);
+		encoder_frame_bytes_ += framelen;
+		framelen = BigEndian::encode(framelen);
+
+		output->append(XCODEC_PIPE_OP_FRAME);
+		output->append(&framelen);
+		output->append(encoded);
+
+		codec_->pipe_frame(&encoder_statistics_);
+
+		if (buf->empty())
+			break;
+	}
+}
+
+/*
+ * Send a <LEARN> for any data of ours referenced by a frame which recently
+ * fell out of our window, and so has likely been lost by a peer which has
+ * had to ask for other such data.
+ */
+void
+XCodecPipePair::encoder_push(Buffer *output, const std::map<XCodecReference, BufferSegment *> *refmap)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+
+	XCodecEvictionLog *log = codec_->eviction_log();
+	if (log == NULL || refmap == NULL)
+		return;
+	if ((peer_capabilities_ & XCODEC_CAPABILITY_PUSH) == 0 ||
+	    (peer_capabilities_ & XCODEC_CAPABILITY_GENERATION) == 0)
+		return;
+
+	std::vector<std::map<XCodecReference, BufferSegment *>::const_iterator> pushes;
+	std::map<XCodecReference, BufferSegment *>::const_iterator it;
+	for (it = refmap->begin(); it != refmap->end(); ++it) {
+		if (it->first.namespace_ != XCodecNamespaceEncoder)
+			continue;
+		if (!log->take(it->first.name_))
+			continue;
+		pushes.push_back(it);
+	}
+
+	size_t i;
+	for (i = 0; i < pushes.size(); i += XCODEC_PIPE_ASK_MAX) {
+		uint16_t count = std::min(pushes.size() - i, (size_t)XCODEC_PIPE_ASK_MAX);
+		uint16_t becount = BigEndian::encode(count);
+
+		output->append(XCODEC_PIPE_OP_LEARN);
+		output->append(&becount);
+		while (count-- != 0) {
+			it = pushes[i + count];
+			if ((peer_capabilities_ & XCODEC_CAPABILITY_REF_PEER) != 0)
+				output->append((uint8_t)XCodecNamespaceEncoder);
+			output->append(XCODEC_NAME_GENERATION(it->first.name_));
+			output->append(it->second);
+		}
+	}
+	if (!pushes.empty())
+		DEBUG(log_) << "Pushed " << pushes.size() << " segments with <LEARN>.";
+}
+
+/*
+ * Send any data held back for coalescing.
+ */
+void
+XCodecPipePair::encoder_flush(Buffer *output)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+
+	if (encoder_coalesce_action_ != NULL) {
+		encoder_coalesce_action_->cancel();
+		encoder_coalesce_action_ = NULL;
+	}
+
+	if (encoder_pending_.empty())
+		return;
+	encoder_encode(output, &encoder_pending_);
 }
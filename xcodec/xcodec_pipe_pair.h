@@ -30,6 +30,9 @@
 
 #include <common/thread/mutex.h>
 
+#include <event/action.h>
+#include <event/callback.h>
+
 #include <io/pipe/pipe_producer.h>
 #include <io/pipe/pipe_producer_wrapper.h>
 
@@ -47,13 +50,26 @@ class XCodecPipePair : public PipePair {
 	XCodecPipePairType type_;
 
 	/*
+	 * If the peer encodes in two passes, each frame is decoded first by
+	 * decoder_pass_, which has its own cache, and once the whole of it
+	 * has been, what that produced is decoded by decoder_.  Likewise, if
+	 * we are to encode in two passes, what encoder_ produces for each
+	 * frame is encoded again by encoder_pass_.
+	 *
 	 * XXX
 	 * Have N encoders and decoders (and, critically, caches), one for each
-	 * ''level'', to do multi-level encoding.
+	 * ''level'', rather than stopping at two.
 	 */
 	XCodecDecoder *decoder_;
 	XCodecCache *decoder_cache_;
-	std::set<uint64_t> decoder_unknown_hashes_;
+	XCodecDecoder *decoder_pass_;
+	XCodecCache *decoder_pass_cache_;
+	std::set<XCodecReference> decoder_pass_unknown_hashes_;
+	std::set<XCodecReference> decoder_pass_ask_hashes_;
+	std::list<Buffer> decoder_pass_frames_;
+	Buffer decoder_pass_output_;
+	std::set<XCodecReference> decoder_unknown_hashes_;
+	std::set<XCodecReference> decoder_ask_hashes_;
 	bool decoder_received_eos_;
 	bool decoder_received_eos_ack_;
 	bool decoder_sent_eos_;
@@ -62,12 +78,30 @@ class XCodecPipePair : public PipePair {
 	std::list<uint32_t> decoder_frame_lengths_;
 	PipeProducerWrapper<XCodecPipePair> *decoder_pipe_;
 
+	unsigned peer_window_;
+	uint32_t peer_capabilities_;
+
 	XCodecEncoder *encoder_;
+	XCodecEncoder *encoder_pass_;
 	bool encoder_produced_eos_;
 	bool encoder_sent_eos_;
 	bool encoder_sent_eos_ack_;
-	std::list<std::map<uint64_t, BufferSegment *> *> encoder_reference_frames_;
+	std::list<std::map<XCodecReference, BufferSegment *> *> encoder_reference_frames_;
+	std::list<uint32_t> encoder_frame_lengths_;
+	size_t encoder_frame_bytes_;
+	unsigned encoder_push_frames_;
 	PipeProducerWrapper<XCodecPipePair> *encoder_pipe_;
+
+	/*
+	 * Framing policy: a running average of the size of writes tells us
+	 * whether this is an interactive or a bulk flow, and bulk data may
+	 * be held back briefly to be sent in larger frames.
+	 */
+	size_t encoder_write_average_;
+	XCodec::PipeStatistics encoder_statistics_;
+	Buffer encoder_pending_;
+	SimpleCallback::Method<XCodecPipePair> encoder_coalesce_callback_;
+	Action *encoder_coalesce_action_;
 public:
 	XCodecPipePair(const LogHandle& log, XCodec *codec, XCodecPipePairType type)
 	: log_(log + "/xcodec"),
@@ -76,7 +110,14 @@ public:
 	  type_(type),
 	  decoder_(NULL),
 	  decoder_cache_(NULL),
+	  decoder_pass_(NULL),
+	  decoder_pass_cache_(NULL),
+	  decoder_pass_unknown_hashes_(),
+	  decoder_pass_ask_hashes_(),
+	  decoder_pass_frames_(),
+	  decoder_pass_output_(),
 	  decoder_unknown_hashes_(),
+	  decoder_ask_hashes_(),
 	  decoder_received_eos_(false),
 	  decoder_received_eos_ack_(false),
 	  decoder_sent_eos_(false),
@@ -84,13 +125,26 @@ public:
 	  decoder_frame_buffer_(),
 	  decoder_frame_lengths_(),
 	  decoder_pipe_(NULL),
+	  peer_window_(XCODEC_WINDOW_COUNT),
+	  peer_capabilities_(0),
 	  encoder_(NULL),
+	  encoder_pass_(NULL),
 	  encoder_produced_eos_(false),
 	  encoder_sent_eos_(false),
 	  encoder_sent_eos_ack_(false),
 	  encoder_reference_frames_(),
-	  encoder_pipe_(NULL)
+	  encoder_frame_lengths_(),
+	  encoder_frame_bytes_(0),
+	  encoder_push_frames_(0),
+	  encoder_pipe_(NULL),
+	  encoder_write_average_(0),
+	  encoder_statistics_(),
+	  encoder_pending_(),
+	  encoder_coalesce_callback_(NULL, &mtx_, this, &XCodecPipePair::encoder_coalesce_timeout),
+	  encoder_coalesce_action_(NULL)
 	{
+		codec_->pipe_attach(&encoder_statistics_);
+
 		decoder_pipe_ = new PipeProducerWrapper<XCodecPipePair>(log_ + "/decoder", &mtx_, this, &XCodecPipePair::decoder_consume);
 		encoder_pipe_ = new PipeProducerWrapper<XCodecPipePair>(log_ + "/encoder", &mtx_, this, &XCodecPipePair::encoder_consume);
 	}
@@ -98,6 +152,13 @@ public:
 	~XCodecPipePair()
 	{
 		ScopedLock _(&mtx_);
+		if (encoder_coalesce_action_ != NULL) {
+			encoder_coalesce_action_->cancel();
+			encoder_coalesce_action_ = NULL;
+		}
+
+		codec_->pipe_detach(&encoder_statistics_);
+
 		while (!encoder_reference_frames_.empty())
 			encoder_reference_frame_advance();
 
@@ -106,6 +167,11 @@ public:
 			decoder_ = NULL;
 		}
 
+		if (decoder_pass_ != NULL) {
+			delete decoder_pass_;
+			decoder_pass_ = NULL;
+		}
+
 		if (decoder_pipe_ != NULL) {
 			delete decoder_pipe_;
 			decoder_pipe_ = NULL;
@@ -116,6 +182,11 @@ public:
 			encoder_ = NULL;
 		}
 
+		if (encoder_pass_ != NULL) {
+			delete encoder_pass_;
+			encoder_pass_ = NULL;
+		}
+
 		if (encoder_pipe_ != NULL) {
 			delete encoder_pipe_;
 			encoder_pipe_ = NULL;
@@ -126,6 +197,8 @@ private:
 	void decoder_consume(Buffer *);
 	bool decoder_decode(void);
 	bool decoder_decode_data(void);
+	bool decoder_decode_pass(void);
+	void decoder_ask(void);
 
 	void decoder_error(void)
 	{
@@ -148,6 +221,12 @@ private:
 	}
 
 	void encoder_consume(Buffer *);
+	bool encoder_credit_exhausted(void) const;
+	void encoder_classify(size_t);
+	void encoder_coalesce_timeout(void);
+	void encoder_encode(Buffer *, Buffer *);
+	void encoder_flush(Buffer *);
+	void encoder_push(Buffer *, const std::map<XCodecReference, BufferSegment *> *);
 
 	void encoder_error(void)
 	{
@@ -173,10 +252,20 @@ private:
 	{
 		ASSERT_LOCK_OWNED(log_, &mtx_);
 		ASSERT(log_, !encoder_reference_frames_.empty());
-		std::map<uint64_t, BufferSegment *> *refmap = encoder_reference_frames_.front();
+		std::map<XCodecReference, BufferSegment *> *refmap = encoder_reference_frames_.front();
 		encoder_reference_frames_.pop_front();
 
-		std::map<uint64_t, BufferSegment *>::iterator it;
+		ASSERT(log_, !encoder_frame_lengths_.empty());
+		encoder_frame_bytes_ -= encoder_frame_lengths_.front();
+		encoder_frame_lengths_.pop_front();
+
+		/*
+		 * Frames too short to contain references have no map.
+		 */
+		if (refmap == NULL)
+			return;
+
+		std::map<XCodecReference, BufferSegment *>::iterator it;
 		while ((it = refmap->begin()) != refmap->end()) {
 			it->second->unref();
 			refmap->erase(it);
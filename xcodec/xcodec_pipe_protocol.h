@@ -33,6 +33,16 @@
  * Effects:
  * 	Must appear at the start of and only at the start of an encoded	stream.
  *
+ * 	The `data' is the sender's UUID, followed by the number of entries in
+ * 	the sender's backref FIFO as a uint32_t, which permits <OP_BACKREF16>
+ * 	to be sent to it if more than XCODEC_WINDOW_COUNT, and then by the
+ * 	XCODEC_CAPABILITY_* bits for the extensions to the stream which the
+ * 	sender offers as a uint32_t.
+ *
+ * 	If the sender encodes in two passes, these are followed by the UUID
+ * 	naming the cache of the second pass, and each <OP_FRAME> holds the
+ * 	second pass's encoding of the first's.
+ *
  * Sife-effects:
  * 	Possibly many.
  */
@@ -40,10 +50,21 @@
 
 /*
  * Usage:
- * 	<OP_LEARN> count[uint16_t] data[[uint8_t x XCODEC_PIPE_SEGMENT_LENGTH] x count]
+ * 	<OP_LEARN> count[uint16_t] [namespace[uint8_t] generation[uint8_t] data[uint8_t x XCODEC_PIPE_SEGMENT_LENGTH]] x count
  *
  * Effects:
- * 	The each `data' is hashed, the hash is associated with the data if possible.
+ * 	The each `data' is hashed, the name made of the hash and `generation'
+ * 	is associated with the data if possible, in the namespace `namespace'
+ * 	as given in the <OP_ASK> it answers.
+ *
+ * 	The `namespace' is only present if both sides offer
+ * 	XCODEC_CAPABILITY_REF_PEER; otherwise it is taken to be that of the
+ * 	sender.  The `generation' is only present if both sides offer
+ * 	XCODEC_CAPABILITY_GENERATION; otherwise it is taken to be zero.
+ *
+ * 	If both sides offer XCODEC_CAPABILITY_PUSH, data in the namespace of
+ * 	the sender may also be sent without an <OP_ASK>, ahead of a frame
+ * 	which references it; otherwise, error will be indicated.
  *
  * Side-effects:
  * 	None.
@@ -52,12 +73,17 @@
 
 /*
  * Usage:
- * 	<OP_ASK> count[uint16_t] hash[uint64_t x count]
+ * 	<OP_ASK> count[uint16_t] [namespace[uint8_t] hash[uint64_t]] x count
  *
  * Effects:
  * 	An OP_LEARN will be sent in response with the data corresponding to the
  * 	requested hashes.
  *
+ * 	The `namespace' is XCodecNamespaceEncoder for a hash from an <OP_REF>
+ * 	from the receiver, which is in its namespace, and XCodecNamespaceDecoder
+ * 	for one from an <OP_REF_PEER>, which is in the sender's.  It is only
+ * 	present if both sides offer XCODEC_CAPABILITY_REF_PEER.
+ *
  * 	If any hash is unknown, error will be indicated.
  *
  * Side-effects:
@@ -99,7 +125,8 @@
  *
  * Side-effects:
  * 	The other party will send <OP_ADVANCE> when it has processed one or
- * 	more frames successfully in their entirety.
+ * 	more frames successfully in their entirety, including producing any
+ * 	output which it held while waiting for an <OP_LEARN>.
  */
 #define	XCODEC_PIPE_OP_FRAME	((uint8_t)0x02)
 
@@ -113,7 +140,8 @@
  * 	in case an ASK is generated by the encoder.
  *
  * Side-effects:
- * 	None.
+ * 	An encoder limited in how many frames it may have outstanding may
+ * 	take more input.
  */
 #define	XCODEC_PIPE_OP_ADVANCE	((uint8_t)0x01)
 
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	XCODEC_XCODEC_SKETCH_H
+#define	XCODEC_XCODEC_SKETCH_H
+
+#include <vector>
+
+/*
+ * A count-min sketch of 4-bit counters estimating how often each hash has
+ * been seen recently, as used by the TinyLFU admission policy.
+ *
+ * Each hash maps to one counter in each of four rows, and its frequency is
+ * the least of those counters.  Once a number of increments proportional
+ * to the capacity of the cache have been recorded, every counter is halved
+ * so that the sketch reflects recent history rather than all history.
+ *
+ * Segment hashes are not very well-mixed in their low bits, so they are
+ * scrambled before being used to pick counters.
+ */
+class XCodecSketch {
+	static const unsigned depth = 4;
+
+	LogHandle log_;
+	std::vector<uint64_t> table_;
+	uint64_t mask_;
+	uint64_t samples_;
+	uint64_t sample_limit_;
+public:
+	XCodecSketch(size_t capacity)
+	: log_("/xcodec/sketch"),
+	  table_(),
+	  mask_(0),
+	  samples_(0),
+	  sample_limit_(10 * (uint64_t)capacity)
+	{
+		/*
+		 * Each word holds sixteen counters, so this gives about
+		 * eight counters per entry in each row.
+		 */
+		size_t words = 8;
+		while (words < capacity / 2)
+			words <<= 1;
+		table_.resize(words, 0);
+		mask_ = words - 1;
+
+		if (sample_limit_ == 0)
+			sample_limit_ = 1;
+	}
+
+	~XCodecSketch()
+	{ }
+
+	unsigned frequency(uint64_t hash) const
+	{
+		unsigned frequency = 15;
+		unsigned i;
+
+		for (i = 0; i < depth; i++) {
+			uint64_t h = scramble(hash, i);
+			unsigned count = (table_[h & mask_] >> shift(h)) & 0xf;
+			if (count < frequency)
+				frequency = count;
+		}
+		return (frequency);
+	}
+
+	void increment(uint64_t hash)
+	{
+		bool incremented = false;
+		unsigned i;
+
+		for (i = 0; i < depth; i++) {
+			uint64_t h = scramble(hash, i);
+			uint64_t& word = table_[h & mask_];
+			unsigned s = shift(h);
+
+			if (((word >> s) & 0xf) == 0xf)
+				continue;
+			word += (uint64_t)1 << s;
+			incremented = true;
+		}
+
+		if (!incremented)
+			return;
+		if (++samples_ < sample_limit_)
+			return;
+
+		/*
+		 * Age the sketch by halving every counter.
+		 */
+		std::vector<uint64_t>::iterator it;
+		for (it = table_.begin(); it != table_.end(); ++it)
+			*it = (*it >> 1) & 0x7777777777777777ull;
+		samples_ /= 2;
+	}
+
+private:
+	static uint64_t scramble(uint64_t hash, unsigned row)
+	{
+		uint64_t h = hash + (row + 1) * 0x9e3779b97f4a7c15ull;
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+		return (h ^ (h >> 31));
+	}
+
+	static unsigned shift(uint64_t h)
+	{
+		return ((h >> 60) << 2);
+	}
+};
+
+#endif /* !XCODEC_XCODEC_SKETCH_H */
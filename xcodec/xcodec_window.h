@@ -26,102 +26,250 @@
 #ifndef	XCODEC_XCODEC_WINDOW_H
 #define	XCODEC_XCODEC_WINDOW_H
 
-#include <map>
-
-#define	XCODEC_WINDOW_MAX		(0xff)
-#define	XCODEC_WINDOW_COUNT		(XCODEC_WINDOW_MAX + 1)
+#include <vector>
 
 /*
+ * The backref FIFO is a flat array indexed by the position of each segment
+ * in the stream of declared and referenced segments, modulo the size of the
+ * window, with an open-addressed hash table (using linear probing) from
+ * hashes to their place in that array.
+ *
+ * Because positions are kept in full, a window of any size can interpret
+ * indices into any smaller one, so a peer which keeps a wide window can
+ * decode <BACKREF>s from one which does not.
+ *
  * XXX
  * Make more like an LRU and make present() bump up in the window.
  *
  * Maybe add an explicit use() mechanism?
+ *
+ * A decoder may declare a hash whose data it does not yet have, with no
+ * segment, and define it once the data is learned.
  */
 class XCodecWindow {
-	typedef	std::pair<unsigned, BufferSegment *> cursor_segment_t;
+	struct Entry {
+		uint64_t hash_;
+		uint64_t position_;
+		BufferSegment *seg_;
+	};
 
-	uint64_t window_[XCODEC_WINDOW_COUNT];
-	unsigned cursor_;
-	std::map<uint64_t, cursor_segment_t> present_;
+	std::vector<Entry> window_;
+	uint64_t mask_;
+	std::vector<unsigned> index_;
+	unsigned index_mask_;
+	unsigned index_shift_;
+	uint64_t position_;
 public:
-	XCodecWindow(void)
+	XCodecWindow(unsigned count = XCODEC_WINDOW_COUNT)
 	: window_(),
-	  cursor_(0),
-	  present_()
+	  mask_(count - 1),
+	  index_(),
+	  index_mask_(0),
+	  index_shift_(64),
+	  position_(0)
 	{
-		unsigned b;
+		ASSERT("/xcodec/window", count >= XCODEC_WINDOW_COUNT && count <= XCODEC_WIDE_WINDOW_COUNT);
+		ASSERT("/xcodec/window", (count & (count - 1)) == 0);
+
+		Entry empty;
+		empty.hash_ = 0;
+		empty.position_ = 0;
+		empty.seg_ = NULL;
+		window_.resize(count, empty);
 
-		for (b = 0; b < XCODEC_WINDOW_COUNT; b++) {
-			window_[b] = 0;
+		/*
+		 * Keep the hash table no more than half full.
+		 */
+		unsigned slots = count * 2;
+		index_.resize(slots, 0);
+		index_mask_ = slots - 1;
+		while (slots > 1) {
+			index_shift_--;
+			slots >>= 1;
 		}
 	}
 
 	~XCodecWindow()
 	{
-		std::map<uint64_t, cursor_segment_t>::iterator it;
+		std::vector<Entry>::iterator it;
+
+		for (it = window_.begin(); it != window_.end(); ++it) {
+			if (it->seg_ == NULL)
+				continue;
+			it->seg_->unref();
+			it->seg_ = NULL;
+		}
+	}
+
+	unsigned count(void) const
+	{
+		return (window_.size());
+	}
 
-		for (it = present_.begin(); it != present_.end(); ++it)
-			it->second.second->unref();
-		present_.clear();
+	/*
+	 * The position that the next segment declared will have.
+	 */
+	uint64_t position(void) const
+	{
+		return (position_);
+	}
+
+	/*
+	 * The hash of the segment which will be the nth to fall out of the
+	 * window as more are declared, or zero.
+	 */
+	uint64_t expiring(unsigned n = 0) const
+	{
+		return (window_[(position_ + n) & mask_].hash_);
 	}
 
 	bool declare(uint64_t hash, BufferSegment *seg)
 	{
-		std::map<uint64_t, cursor_segment_t>::iterator it;
 		bool collision;
+		unsigned i;
 
 		ASSERT_NON_ZERO("/xcodec/window", hash);
 
-		it = present_.find(hash);
-		collision = it != present_.end();
-		if (collision) {
-			it->second.second->unref();
-			window_[it->second.first] = 0;
-			present_.erase(it);
-		}
+		collision = find(hash, &i);
+		if (collision)
+			evict(i);
 
-		uint64_t old = window_[cursor_];
-		if (old != 0) {
-			it = present_.find(old);
-			ASSERT("/xcodec/window", it != present_.end());
-			ASSERT("/xcodec/window", it->second.first == cursor_);
-			BufferSegment *oseg = it->second.second;
-			oseg->unref();
-			present_.erase(it);
+		Entry& entry = window_[position_ & mask_];
+		if (entry.hash_ != 0) {
+			bool found = find(entry.hash_, &i);
+			ASSERT("/xcodec/window", found);
+			evict(i);
 		}
 
-		window_[cursor_] = hash;
-		seg->ref();
-		present_[hash] = cursor_segment_t(cursor_, seg);
-		cursor_ = (cursor_ + 1) % XCODEC_WINDOW_COUNT;
+		if (seg != NULL)
+			seg->ref();
+		entry.hash_ = hash;
+		entry.position_ = position_;
+		entry.seg_ = seg;
+
+		for (i = home(hash); index_[i] != 0; i = (i + 1) & index_mask_)
+			continue;
+		index_[i] = (position_ & mask_) + 1;
+
+		position_++;
 
 		return (collision);
 	}
 
-	BufferSegment *dereference(unsigned c) const
+	/*
+	 * Finds the most recent segment whose position is congruent to the
+	 * index modulo the given window size, if it is still present.
+	 */
+	BufferSegment *dereference(uint64_t index, uint64_t modulus) const
 	{
-		if (window_[c] == 0)
+		if (position_ == 0)
+			return (NULL);
+		uint64_t back = (position_ - 1 - index) & (modulus - 1);
+		if (back >= position_ || back > mask_)
 			return (NULL);
-		std::map<uint64_t, cursor_segment_t>::const_iterator it;
-		it = present_.find(window_[c]);
-		ASSERT("/xcodec/window", it != present_.end());
-		BufferSegment *seg = it->second.second;
+		uint64_t p = position_ - 1 - back;
+
+		const Entry& entry = window_[p & mask_];
+		if (entry.seg_ == NULL || entry.position_ != p)
+			return (NULL);
+		entry.seg_->ref();
+		return (entry.seg_);
+	}
+
+	/*
+	 * The hash of the segment which dereference() would find, even if it
+	 * was declared without one, or zero.
+	 */
+	uint64_t name(uint64_t index, uint64_t modulus) const
+	{
+		if (position_ == 0)
+			return (0);
+		uint64_t back = (position_ - 1 - index) & (modulus - 1);
+		if (back >= position_ || back > mask_)
+			return (0);
+		uint64_t p = position_ - 1 - back;
+
+		const Entry& entry = window_[p & mask_];
+		if (entry.position_ != p)
+			return (0);
+		return (entry.hash_);
+	}
+
+	/*
+	 * Supplies the segment for a hash declared without one, if it is still
+	 * in the window.
+	 */
+	void define(uint64_t hash, BufferSegment *seg)
+	{
+		unsigned i;
+
+		if (!find(hash, &i))
+			return;
+		Entry& entry = window_[index_[i] - 1];
+		if (entry.seg_ != NULL)
+			return;
 		seg->ref();
-		return (seg);
+		entry.seg_ = seg;
 	}
 
-	bool present(uint64_t hash, const uint8_t *data, uint8_t *c) const
+	bool present(uint64_t hash, const uint8_t *data, uint64_t *positionp) const
 	{
-		std::map<uint64_t, cursor_segment_t>::const_iterator it;
-		it = present_.find(hash);
-		if (it == present_.end())
+		unsigned i;
+
+		if (!find(hash, &i))
 			return (false);
-		if (data != NULL && !it->second.second->equal(data, XCODEC_SEGMENT_LENGTH))
+		const Entry& entry = window_[index_[i] - 1];
+		if (data != NULL && (entry.seg_ == NULL || !entry.seg_->equal(data, XCODEC_SEGMENT_LENGTH)))
 			return (false);
-		ASSERT("/xcodec/window", window_[it->second.first] == hash);
-		*c = it->second.first;
+		*positionp = entry.position_;
 		return (true);
 	}
+
+private:
+	unsigned home(uint64_t hash) const
+	{
+		return ((hash * 0x9e3779b97f4a7c15ull) >> index_shift_);
+	}
+
+	bool find(uint64_t hash, unsigned *ip) const
+	{
+		unsigned i;
+
+		for (i = home(hash); index_[i] != 0; i = (i + 1) & index_mask_) {
+			if (window_[index_[i] - 1].hash_ != hash)
+				continue;
+			*ip = i;
+			return (true);
+		}
+		return (false);
+	}
+
+	/*
+	 * Removes the entry at slot i of the hash table from the window, and
+	 * shifts back any entries after it which would no longer be found.
+	 */
+	void evict(unsigned i)
+	{
+		Entry& entry = window_[index_[i] - 1];
+		if (entry.seg_ != NULL) {
+			entry.seg_->unref();
+			entry.seg_ = NULL;
+		}
+		entry.hash_ = 0;
+
+		unsigned j = i;
+		for (;;) {
+			j = (j + 1) & index_mask_;
+			if (index_[j] == 0)
+				break;
+			unsigned k = home(window_[index_[j] - 1].hash_);
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			index_[i] = index_[j];
+			i = j;
+		}
+		index_[i] = 0;
+	}
 };
 
 #endif /* !XCODEC_XCODEC_WINDOW_H */
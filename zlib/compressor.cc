@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <common/buffer.h>
+#include <common/thread/mutex.h>
+
+#include <event/event_callback.h>
+
+#include <io/pipe/pipe.h>
+
+#include <zlib/compressor.h>
+#include <zlib/deflate_pipe.h>
+#include <zlib/inflate_pipe.h>
+#ifdef USE_LZ4
+#include <zlib/lz4_compress_pipe.h>
+#include <zlib/lz4_decompress_pipe.h>
+#endif
+#ifdef USE_ZSTD
+#include <zlib/zstd_compress_pipe.h>
+#include <zlib/zstd_decompress_pipe.h>
+#endif
+
+bool
+Compressor::available(CompressorType type)
+{
+	switch (type) {
+	case CompressorZlib:
+		return (true);
+	case CompressorLZ4:
+#ifdef USE_LZ4
+		return (true);
+#else
+		return (false);
+#endif
+	case CompressorZstd:
+#ifdef USE_ZSTD
+		return (true);
+#else
+		return (false);
+#endif
+	default:
+		NOTREACHED("/zlib/compressor");
+	}
+}
+
+const char *
+Compressor::name(CompressorType type)
+{
+	switch (type) {
+	case CompressorZlib:
+		return ("zlib");
+	case CompressorLZ4:
+		return ("lz4");
+	case CompressorZstd:
+		return ("zstd");
+	default:
+		NOTREACHED("/zlib/compressor");
+	}
+}
+
+int
+Compressor::level_min(CompressorType type)
+{
+	switch (type) {
+	case CompressorZlib:
+	case CompressorLZ4:
+		return (0);
+	case CompressorZstd:
+		return (1);
+	default:
+		NOTREACHED("/zlib/compressor");
+	}
+}
+
+int
+Compressor::level_max(CompressorType type)
+{
+	switch (type) {
+	case CompressorZlib:
+		return (9);
+	case CompressorLZ4:
+		return (12);
+	case CompressorZstd:
+		return (22);
+	default:
+		NOTREACHED("/zlib/compressor");
+	}
+}
+
+bool
+Compressor::dictionary(CompressorType type)
+{
+	return (type == CompressorZstd);
+}
+
+Pipe *
+Compressor::compress_pipe(CompressorType type, int level, const Buffer *dictionary, CompressorStatistics *statistics, unsigned flush_interval)
+{
+	ASSERT("/zlib/compressor", available(type));
+	ASSERT("/zlib/compressor", level >= level_min(type) && level <= level_max(type));
+	ASSERT("/zlib/compressor", dictionary == NULL || Compressor::dictionary(type));
+
+	switch (type) {
+	case CompressorZlib:
+		return (new DeflatePipe(level, statistics, flush_interval));
+#ifdef USE_LZ4
+	case CompressorLZ4:
+		return (new LZ4CompressPipe(level, statistics));
+#endif
+#ifdef USE_ZSTD
+	case CompressorZstd:
+		return (new ZstdCompressPipe(level, dictionary, statistics));
+#endif
+	default:
+		NOTREACHED("/zlib/compressor");
+	}
+}
+
+Pipe *
+Compressor::decompress_pipe(CompressorType type, const Buffer *dictionary)
+{
+	ASSERT("/zlib/compressor", available(type));
+	ASSERT("/zlib/compressor", dictionary == NULL || Compressor::dictionary(type));
+
+	switch (type) {
+	case CompressorZlib:
+		return (new InflatePipe());
+#ifdef USE_LZ4
+	case CompressorLZ4:
+		return (new LZ4DecompressPipe());
+#endif
+#ifdef USE_ZSTD
+	case CompressorZstd:
+		return (new ZstdDecompressPipe(dictionary));
+#endif
+	default:
+		NOTREACHED("/zlib/compressor");
+	}
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	ZLIB_COMPRESSOR_H
+#define	ZLIB_COMPRESSOR_H
+
+#include <event/flush_timer.h>
+
+class Buffer;
+class Pipe;
+
+/*
+ * The compressors a pipe may be built with.  All but zlib are optional, and
+ * only available if the library was built with USE_LZ4 or USE_ZSTD.
+ */
+enum CompressorType {
+	CompressorZlib,
+	CompressorLZ4,
+	CompressorZstd,
+};
+
+/*
+ * Counts of the bytes given to compress pipes, split between those which
+ * were compressed and those which were passed through stored, as they were,
+ * because they looked to be incompressible.
+ */
+struct CompressorStatistics {
+	uintmax_t compressed_bytes_;
+	uintmax_t bypassed_bytes_;
+
+	CompressorStatistics(void)
+	: compressed_bytes_(0),
+	  bypassed_bytes_(0)
+	{ }
+};
+
+class Compressor {
+	Compressor(void);
+	~Compressor();
+public:
+	static bool available(CompressorType);
+	static const char *name(CompressorType);
+
+	/*
+	 * The range of levels each compressor accepts; higher levels give
+	 * smaller output at the cost of speed.
+	 */
+	static int level_min(CompressorType);
+	static int level_max(CompressorType);
+
+	/*
+	 * Whether the compressor may be primed with a dictionary, which both
+	 * sides must share, so that small streams of data like it compress
+	 * well from their very first bytes.
+	 */
+	static bool dictionary(CompressorType);
+
+	/*
+	 * Only zlib holds back its output to flush several small inputs at
+	 * once, according to a FlushTimer with the given interval.
+	 */
+	static Pipe *compress_pipe(CompressorType, int, const Buffer * = NULL, CompressorStatistics * = NULL, unsigned = FLUSH_TIMER_INTERVAL);
+	static Pipe *decompress_pipe(CompressorType, const Buffer * = NULL);
+};
+
+#endif /* !ZLIB_COMPRESSOR_H */
@@ -23,20 +23,53 @@
  * SUCH DAMAGE.
  */
 
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <common/buffer.h>
 #include <common/thread/mutex.h>
 
 #include <event/event_callback.h>
 
 #include <io/pipe/pipe.h>
 
+#include <zlib/compressor.h>
 #include <zlib/deflate_pipe.h>
 
-#define	DEFLATE_CHUNK_SIZE	65536
+/*
+ * Inputs shorter than DEFLATE_PROBE_MIN are too short for their histogram
+ * to say much, and are compressed or not as the last larger input was.  At
+ * most DEFLATE_PROBE_LENGTH bytes are sampled.
+ */
+#define	DEFLATE_PROBE_MIN	2048
+#define	DEFLATE_PROBE_LENGTH	4096
 
-DeflatePipe::DeflatePipe(int level)
+/*
+ * Compressed or encrypted data has very nearly eight bits of entropy per
+ * byte even in a short sample, while anything deflate can do much with has
+ * far fewer.
+ */
+#define	DEFLATE_BYPASS_ENTROPY	(7.8)
+
+#define	DEFLATE_BYPASS_MAX	64
+
+#define	DEFLATE_FLUSH_BYTES	65536
+
+DeflatePipe::DeflatePipe(int level, CompressorStatistics *statistics, unsigned flush_interval)
 : PipeProducer("/zlib/deflate_pipe", &mtx_),
   mtx_("DeflatePipe"),
-  stream_()
+  stream_(),
+  outseg_(NULL),
+  level_(level),
+  statistics_(statistics),
+  bypass_(false),
+  bypass_blocks_(0),
+  bypass_failures_(0),
+  flush_pending_(0),
+  flush_callback_(NULL, &mtx_, this, &DeflatePipe::flush_timeout),
+  flush_timer_(&flush_callback_, flush_interval)
 {
 	stream_.zalloc = Z_NULL;
 	stream_.zfree = Z_NULL;
@@ -49,67 +82,243 @@ DeflatePipe::DeflatePipe(int level)
 
 DeflatePipe::~DeflatePipe()
 {
+	flush_timer_.cancel();
+
+	if (outseg_ != NULL) {
+		outseg_->unref();
+		outseg_ = NULL;
+	}
+
 	int error = deflateEnd(&stream_);
 	if (error != Z_OK)
 		ERROR(log_) << "Deflate stream did not end cleanly.";
 }
 
+/*
+ * Decide whether to deflate the input or send it stored, and switch the
+ * stream's level if need be.  Anything not yet flushed is deflated at the
+ * old level first.
+ */
+bool
+DeflatePipe::adapt(const Buffer *in, Buffer *out)
+{
+	bool bypass;
+
+	if (level_ == 0)
+		return (true);
+
+	if (in->length() < DEFLATE_PROBE_MIN) {
+		bypass = bypass_;
+	} else if (bypass_blocks_ != 0) {
+		bypass_blocks_--;
+		bypass = true;
+	} else if (incompressible(in)) {
+		if (bypass_failures_ < DEFLATE_BYPASS_MAX)
+			bypass_failures_ = bypass_failures_ == 0 ? 1 : bypass_failures_ * 2;
+		bypass_blocks_ = bypass_failures_ - 1;
+		bypass = true;
+	} else {
+		bypass_failures_ = 0;
+		bypass = false;
+	}
+
+	if (statistics_ != NULL) {
+		if (bypass)
+			statistics_->bypassed_bytes_ += in->length();
+		else
+			statistics_->compressed_bytes_ += in->length();
+	}
+
+	if (bypass == bypass_)
+		return (true);
+
+	stream_.avail_in = 0;
+	stream_.next_in = Z_NULL;
+
+	/*
+	 * If there is not room for what is pending, the level is left as
+	 * it was, and we must try again with more room.
+	 */
+	for (;;) {
+		output_prepare();
+		int error = deflateParams(&stream_, bypass ? 0 : level_, Z_DEFAULT_STRATEGY);
+		output_collect(out);
+		if (error == Z_BUF_ERROR)
+			continue;
+		if (error != Z_OK) {
+			ERROR(log_) << "deflateParams(): " << zError(error);
+			return (false);
+		}
+		break;
+	}
+	bypass_ = bypass;
+	return (true);
+}
+
+bool
+DeflatePipe::incompressible(const Buffer *in) const
+{
+	unsigned counts[256];
+	size_t sample = 0;
+
+	memset(counts, 0, sizeof counts);
+
+	Buffer::SegmentIterator iter = in->segments();
+	while (!iter.end() && sample < DEFLATE_PROBE_LENGTH) {
+		const BufferSegment *seg = *iter;
+		const uint8_t *p = seg->data();
+		size_t len = std::min(seg->length(), (size_t)DEFLATE_PROBE_LENGTH - sample);
+
+		for (size_t i = 0; i < len; i++)
+			counts[p[i]]++;
+		sample += len;
+
+		iter.next();
+	}
+
+	double entropy = 0.0;
+	for (unsigned i = 0; i < 256; i++) {
+		if (counts[i] == 0)
+			continue;
+		double p = (double)counts[i] / sample;
+		entropy -= p * log2(p);
+	}
+	return (entropy >= DEFLATE_BYPASS_ENTROPY);
+}
+
+/*
+ * Deflate whatever input the stream has with the given flush, straight into
+ * BufferSegments which are appended to out.
+ */
+bool
+DeflatePipe::deflate_run(int flush, Buffer *out)
+{
+	for (;;) {
+		output_prepare();
+		int error = deflate(&stream_, flush);
+		output_collect(out);
+		if (error == Z_STREAM_ERROR) {
+			ERROR(log_) << "deflate(): " << zError(error);
+			return (false);
+		}
+
+		/*
+		 * Having been left with room for more output, deflate has
+		 * consumed all input and done all the flush asked for.
+		 */
+		if (stream_.avail_out != 0) {
+			ASSERT(log_, stream_.avail_in == 0);
+			ASSERT(log_, flush != Z_FINISH || error == Z_STREAM_END);
+			return (true);
+		}
+	}
+}
+
+bool
+DeflatePipe::flush(Buffer *out)
+{
+	stream_.avail_in = 0;
+	stream_.next_in = Z_NULL;
+
+	if (!deflate_run(Z_SYNC_FLUSH, out))
+		return (false);
+	flush_pending_ = 0;
+
+	flush_timer_.flushed();
+	return (true);
+}
+
+void
+DeflatePipe::flush_timeout(void)
+{
+	ASSERT_LOCK_OWNED(log_, &mtx_);
+	flush_timer_.expire();
+
+	if (flush_pending_ == 0)
+		return;
+
+	Buffer out;
+	if (!flush(&out)) {
+		flush_timer_.cancel();
+		produce_error();
+		return;
+	}
+	if (!out.empty())
+		produce(&out);
+}
+
+void
+DeflatePipe::output_prepare(void)
+{
+	if (outseg_ == NULL)
+		outseg_ = BufferSegment::create();
+	stream_.next_out = outseg_->head();
+	stream_.avail_out = BUFFER_SEGMENT_SIZE;
+}
+
+void
+DeflatePipe::output_collect(Buffer *out)
+{
+	size_t outlen = BUFFER_SEGMENT_SIZE - stream_.avail_out;
+	if (outlen == 0)
+		return;
+
+	outseg_->set_length(outlen);
+	out->append(outseg_);
+	outseg_->unref();
+	outseg_ = NULL;
+}
+
 void
 DeflatePipe::consume(Buffer *in)
 {
 	Buffer out;
-	uint8_t outbuf[DEFLATE_CHUNK_SIZE];
-	bool first = true;
 
-	stream_.avail_out = sizeof outbuf;
-	stream_.next_out = outbuf;
+	if (in->empty()) {
+		flush_timer_.cancel();
 
-	for (;;) {
-		Buffer::SegmentIterator iter = in->segments();
-		const BufferSegment *seg;
-		int flush;
-
-		if (iter.end()) {
-			seg = NULL;
-			flush = first ? Z_FINISH : Z_SYNC_FLUSH;
-
-			stream_.avail_in = 0;
-			stream_.next_in = Z_NULL;
-		} else {
-			seg = *iter;
-			flush = Z_NO_FLUSH;
-			first = false;
-
-			stream_.avail_in = seg->length();
-			stream_.next_in = (Bytef *)(uintptr_t)seg->data();
+		stream_.avail_in = 0;
+		stream_.next_in = Z_NULL;
+
+		if (!deflate_run(Z_FINISH, &out)) {
+			produce_error();
+			return;
 		}
+		produce_eos(&out);
+		return;
+	}
+
+	if (!adapt(in, &out)) {
+		flush_timer_.cancel();
+		produce_error();
+		return;
+	}
+
+	while (!in->empty()) {
+		Buffer::SegmentIterator iter = in->segments();
+		const BufferSegment *seg = *iter;
 
-		for (;;) {
-			int error = deflate(&stream_, flush);
-			if (error == Z_OK && stream_.avail_out > 0 &&
-			    flush == Z_NO_FLUSH)
-				break;
-
-			out.append(outbuf, sizeof outbuf - stream_.avail_out);
-			stream_.avail_out = sizeof outbuf;
-			stream_.next_out = outbuf;
-
-			if (flush == Z_NO_FLUSH)
-				break;
-			if (flush == Z_SYNC_FLUSH && error == Z_OK) {
-				if (!out.empty())
-					produce(&out);
-				return;
-			}
-			if (flush == Z_FINISH && error == Z_STREAM_END) {
-				produce_eos(&out);
-				return;
-			}
-			/* More data to output.  */
+		stream_.avail_in = seg->length();
+		stream_.next_in = (Bytef *)(uintptr_t)seg->data();
+
+		if (!deflate_run(Z_NO_FLUSH, &out)) {
+			flush_timer_.cancel();
+			produce_error();
+			return;
 		}
 
-		if (seg != NULL)
-			in->skip(seg->length() - stream_.avail_in);
+		flush_pending_ += seg->length();
+		in->skip(seg->length());
 	}
-	NOTREACHED(log_);
+
+	if (!flush_timer_.hold() || flush_pending_ >= DEFLATE_FLUSH_BYTES) {
+		if (!flush(&out)) {
+			flush_timer_.cancel();
+			produce_error();
+			return;
+		}
+	}
+
+	if (!out.empty())
+		produce(&out);
 }
@@ -26,18 +26,51 @@
 #ifndef	ZLIB_DEFLATE_PIPE_H
 #define	ZLIB_DEFLATE_PIPE_H
 
+#include <event/flush_timer.h>
+
 #include <io/pipe/pipe_producer.h>
 
 #include <zlib.h>
 
+struct CompressorStatistics;
+
+/*
+ * Deflated data is written straight into BufferSegments, and is flushed to
+ * the peer as a FlushTimer says, or once DEFLATE_FLUSH_BYTES have built up,
+ * rather than after every input.
+ *
+ * Data which looks to be incompressible is sent in stored blocks rather
+ * than deflated.  Each time it is found to be so, we wait twice as long
+ * before looking again, up to DEFLATE_BYPASS_MAX blocks.
+ */
 class DeflatePipe : public PipeProducer {
 	Mutex mtx_;
 	z_stream stream_;
+	BufferSegment *outseg_;
+	int level_;
+	CompressorStatistics *statistics_;
+	bool bypass_;
+	unsigned bypass_blocks_;
+	unsigned bypass_failures_;
+	size_t flush_pending_;
+	SimpleCallback::Method<DeflatePipe> flush_callback_;
+	FlushTimer flush_timer_;
 public:
-	DeflatePipe(int = 0);
+	DeflatePipe(int = 0, CompressorStatistics * = NULL, unsigned = FLUSH_TIMER_INTERVAL);
 	~DeflatePipe();
 
 private:
+	bool adapt(const Buffer *, Buffer *);
+	bool incompressible(const Buffer *) const;
+
+	bool deflate_run(int, Buffer *);
+
+	bool flush(Buffer *);
+	void flush_timeout(void);
+
+	void output_prepare(void);
+	void output_collect(Buffer *);
+
 	void consume(Buffer *);
 };
 
@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <common/buffer.h>
+#include <common/thread/mutex.h>
+#include <common/timer/timer.h>
+
+#include <event/event_callback.h>
+#include <event/event_main.h>
+#include <event/event_system.h>
+
+#include <io/pipe/pipe.h>
+
+#include <zlib/compressor.h>
+
+/*
+ * Compresses and decompresses a corpus with each compressor we were built
+ * with, at a few of its levels, through the same pipes that WANProxy uses,
+ * and reports the ratio and throughput of each.
+ */
+
+#define	BENCH_INPUT_SIZE	65536
+
+struct Trial {
+	CompressorType type_;
+	int level_;
+};
+
+static const Trial trials[] = {
+	{ CompressorZlib,	1 },
+	{ CompressorZlib,	6 },
+	{ CompressorZlib,	9 },
+	{ CompressorLZ4,	0 },
+	{ CompressorLZ4,	9 },
+	{ CompressorZstd,	1 },
+	{ CompressorZstd,	3 },
+	{ CompressorZstd,	19 },
+};
+
+class CompressorBench {
+	LogHandle log_;
+	Mutex mtx_;
+	const Buffer *corpus_;
+	const Buffer *dictionary_;
+	size_t input_size_;
+	unsigned trial_;
+	bool decompressing_;
+	Pipe *pipe_;
+	Buffer source_;
+	Buffer compressed_;
+	Buffer sink_;
+	Timer compress_timer_;
+	Timer decompress_timer_;
+	CompressorStatistics statistics_;
+	EventCallback::Method<CompressorBench> input_complete_;
+	Action *input_action_;
+	bool input_eos_;
+	BufferEventCallback::Method<CompressorBench> output_complete_;
+	Action *output_action_;
+	bool output_eos_;
+public:
+	CompressorBench(const Buffer *corpus, const Buffer *dictionary, size_t input_size)
+	: log_("/zlib/example/compressor/bench1"),
+	  mtx_("CompressorBench"),
+	  corpus_(corpus),
+	  dictionary_(dictionary),
+	  input_size_(input_size),
+	  trial_(0),
+	  decompressing_(false),
+	  pipe_(NULL),
+	  source_(),
+	  compressed_(),
+	  sink_(),
+	  compress_timer_(),
+	  decompress_timer_(),
+	  statistics_(),
+	  input_complete_(NULL, &mtx_, this, &CompressorBench::input_complete),
+	  input_action_(NULL),
+	  input_eos_(false),
+	  output_complete_(NULL, &mtx_, this, &CompressorBench::output_complete),
+	  output_action_(NULL),
+	  output_eos_(false)
+	{
+		ScopedLock _(&mtx_);
+		trial_start();
+	}
+
+	~CompressorBench()
+	{
+		ASSERT_NULL(log_, pipe_);
+		ASSERT_NULL(log_, input_action_);
+		ASSERT_NULL(log_, output_action_);
+	}
+
+private:
+	void trial_start(void)
+	{
+		ASSERT_LOCK_OWNED(log_, &mtx_);
+
+		while (trial_ != sizeof trials / sizeof trials[0]) {
+			const Trial& trial = trials[trial_];
+			if (Compressor::available(trial.type_) &&
+			    (dictionary_ == NULL || Compressor::dictionary(trial.type_)))
+				break;
+			trial_++;
+		}
+		if (trial_ == sizeof trials / sizeof trials[0]) {
+			EventSystem::instance()->stop();
+			return;
+		}
+
+		const Trial& trial = trials[trial_];
+		decompressing_ = false;
+		compressed_.clear();
+		compress_timer_.reset();
+		decompress_timer_.reset();
+		statistics_ = CompressorStatistics();
+
+		stage_start(Compressor::compress_pipe(trial.type_, trial.level_, dictionary_, &statistics_), corpus_);
+	}
+
+	void trial_finish(void)
+	{
+		ASSERT_LOCK_OWNED(log_, &mtx_);
+
+		const Trial& trial = trials[trial_];
+		if (!sink_.equal(corpus_))
+			HALT(log_) << Compressor::name(trial.type_) << " level " << trial.level_ << ": data did not survive the round trip.";
+
+		double ratio = (double)corpus_->length() / compressed_.length();
+		double compress_rate = (double)corpus_->length() / compress_timer_.sample();
+		double decompress_rate = (double)corpus_->length() / decompress_timer_.sample();
+
+		INFO(log_) << Compressor::name(trial.type_) << " level " << trial.level_ << ": " << compressed_.length() << " bytes, ratio " << ratio << ":1, compress " << compress_rate << " MB/s, decompress " << decompress_rate << " MB/s, " << statistics_.bypassed_bytes_ << " bytes sent uncompressed.";
+
+		trial_++;
+		trial_start();
+	}
+
+	void stage_start(Pipe *pipe, const Buffer *source)
+	{
+		ASSERT_LOCK_OWNED(log_, &mtx_);
+		ASSERT_NULL(log_, pipe_);
+
+		pipe_ = pipe;
+		source_ = *source;
+		sink_.clear();
+		input_eos_ = false;
+		output_eos_ = false;
+
+		(decompressing_ ? decompress_timer_ : compress_timer_).start();
+
+		output_action_ = pipe_->output(&output_complete_);
+		input_next();
+	}
+
+	void stage_finish(void)
+	{
+		ASSERT_LOCK_OWNED(log_, &mtx_);
+
+		if (!input_eos_ || !output_eos_ || input_action_ != NULL)
+			return;
+
+		delete pipe_;
+		pipe_ = NULL;
+
+		if (decompressing_) {
+			trial_finish();
+			return;
+		}
+
+		const Trial& trial = trials[trial_];
+		decompressing_ = true;
+		compressed_ = sink_;
+		stage_start(Compressor::decompress_pipe(trial.type_, dictionary_), &compressed_);
+	}
+
+	void input_next(void)
+	{
+		ASSERT_LOCK_OWNED(log_, &mtx_);
+		ASSERT_NULL(log_, input_action_);
+
+		Buffer buf;
+		if (source_.empty()) {
+			input_eos_ = true;
+		} else {
+			size_t len = source_.length();
+			if (len > input_size_)
+				len = input_size_;
+			source_.moveout(&buf, len);
+		}
+		input_action_ = pipe_->input(&buf, &input_complete_);
+	}
+
+	void input_complete(Event e)
+	{
+		ASSERT_LOCK_OWNED(log_, &mtx_);
+		input_action_->cancel();
+		input_action_ = NULL;
+
+		switch (e.type_) {
+		case Event::Done:
+			break;
+		default:
+			HALT(log_) << "Unexpected event: " << e;
+			return;
+		}
+
+		if (input_eos_) {
+			stage_finish();
+			return;
+		}
+		input_next();
+	}
+
+	void output_complete(Event e, Buffer buf)
+	{
+		ASSERT_LOCK_OWNED(log_, &mtx_);
+		output_action_->cancel();
+		output_action_ = NULL;
+
+		switch (e.type_) {
+		case Event::Done:
+		case Event::EOS:
+			break;
+		default:
+			HALT(log_) << "Unexpected event: " << e;
+			return;
+		}
+
+		sink_.append(buf);
+		if (e.type_ == Event::EOS) {
+			(decompressing_ ? decompress_timer_ : compress_timer_).stop();
+			output_eos_ = true;
+			stage_finish();
+			return;
+		}
+		output_action_ = pipe_->output(&output_complete_);
+	}
+};
+
+static bool read_file(const char *, Buffer *);
+static void usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	Buffer corpus, dictionary;
+	bool use_dictionary;
+	size_t input_size;
+	int ch;
+
+	use_dictionary = false;
+	input_size = BENCH_INPUT_SIZE;
+
+	while ((ch = getopt(argc, argv, "?b:D:")) != -1) {
+		switch (ch) {
+		case 'b':
+			input_size = strtoul(optarg, NULL, 0);
+			if (input_size == 0)
+				usage();
+			break;
+		case 'D':
+			if (!read_file(optarg, &dictionary))
+				return (1);
+			use_dictionary = true;
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0)
+		usage();
+
+	while (argc--) {
+		if (!read_file(*argv++, &corpus))
+			return (1);
+	}
+
+	if (corpus.empty()) {
+		ERROR("/zlib/example/compressor/bench1") << "Corpus is empty.";
+		return (1);
+	}
+
+	CompressorBench *bench = new CompressorBench(&corpus, use_dictionary ? &dictionary : NULL, input_size);
+
+	event_main();
+
+	delete bench;
+}
+
+static bool
+read_file(const char *path, Buffer *buf)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		ERROR("/zlib/example/compressor/bench1") << "Could not open file: " << path;
+		return (false);
+	}
+
+	for (;;) {
+		uint8_t data[65536];
+		size_t len = fread(data, 1, sizeof data, file);
+		if (len == 0)
+			break;
+		buf->append(data, len);
+	}
+
+	if (ferror(file)) {
+		ERROR("/zlib/example/compressor/bench1") << "Could not read file: " << path;
+		fclose(file);
+		return (false);
+	}
+	fclose(file);
+
+	return (true);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: compressor-bench1 [-b input-size] [-D dictionary] file ...\n");
+	exit(1);
+}
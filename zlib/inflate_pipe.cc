@@ -23,6 +23,7 @@
  * SUCH DAMAGE.
  */
 
+#include <common/buffer.h>
 #include <common/thread/mutex.h>
 
 #include <event/event_callback.h>
@@ -31,12 +32,11 @@
 
 #include <zlib/inflate_pipe.h>
 
-#define	INFLATE_CHUNK_SIZE	65536
-
 InflatePipe::InflatePipe(void)
 : PipeProducer("/zlib/inflate_pipe", &mtx_),
   mtx_("InflatePipe"),
-  stream_()
+  stream_(),
+  outseg_(NULL)
 {
 	stream_.zalloc = Z_NULL;
 	stream_.zfree = Z_NULL;
@@ -52,88 +52,103 @@ InflatePipe::InflatePipe(void)
 
 InflatePipe::~InflatePipe()
 {
+	if (outseg_ != NULL) {
+		outseg_->unref();
+		outseg_ = NULL;
+	}
+
 	int error = inflateEnd(&stream_);
 	if (error != Z_OK)
 		ERROR(log_) << "Inflate stream did not end cleanly.";
 }
 
+/*
+ * Inflate whatever input the stream has, straight into BufferSegments which
+ * are appended to out.  Returns Z_OK once all input is consumed, or the first
+ * other result from inflate.
+ */
+int
+InflatePipe::inflate_run(int flush, Buffer *out)
+{
+	for (;;) {
+		if (outseg_ == NULL)
+			outseg_ = BufferSegment::create();
+		stream_.next_out = outseg_->head();
+		stream_.avail_out = BUFFER_SEGMENT_SIZE;
+
+		int error = inflate(&stream_, flush);
+
+		size_t outlen = BUFFER_SEGMENT_SIZE - stream_.avail_out;
+		if (outlen != 0) {
+			outseg_->set_length(outlen);
+			out->append(outseg_);
+			outseg_->unref();
+			outseg_ = NULL;
+		}
+
+		switch (error) {
+		case Z_OK:
+		case Z_BUF_ERROR:
+			/*
+			 * Having been left with room for more output, inflate
+			 * has consumed all the input it can.
+			 */
+			if (stream_.avail_out != 0)
+				return (Z_OK);
+			break;
+		default:
+			return (error);
+		}
+	}
+}
+
 void
 InflatePipe::consume(Buffer *in)
 {
 	Buffer out;
-	uint8_t outbuf[INFLATE_CHUNK_SIZE];
-	bool first = true;
+	int error;
 
-	stream_.avail_out = sizeof outbuf;
-	stream_.next_out = outbuf;
+	if (in->empty()) {
+		stream_.avail_in = 0;
+		stream_.next_in = Z_NULL;
 
-	for (;;) {
+		error = inflate_run(Z_FINISH, &out);
+		if (error != Z_STREAM_END) {
+			if (error == Z_OK)
+				ERROR(log_) << "Stream ended before the end of the deflate stream.";
+			else
+				ERROR(log_) << "inflate(): " << zError(error);
+			produce_error();
+			return;
+		}
+		produce_eos(&out);
+		return;
+	}
+
+	while (!in->empty()) {
 		Buffer::SegmentIterator iter = in->segments();
-		const BufferSegment *seg;
-		int flush;
-
-		if (iter.end()) {
-			seg = NULL;
-			flush = first ? Z_FINISH : Z_SYNC_FLUSH;
-
-			stream_.avail_in = 0;
-			stream_.next_in = Z_NULL;
-		} else {
-			seg = *iter;
-			flush = Z_NO_FLUSH;
-			first = false;
-
-			stream_.avail_in = seg->length();
-			stream_.next_in = (Bytef *)(uintptr_t)seg->data();
+		const BufferSegment *seg = *iter;
+
+		stream_.avail_in = seg->length();
+		stream_.next_in = (Bytef *)(uintptr_t)seg->data();
+
+		error = inflate_run(Z_NO_FLUSH, &out);
+		if (error != Z_OK && error != Z_STREAM_END) {
+			ERROR(log_) << "inflate(): " << zError(error);
+			produce_error();
+			return;
 		}
 
-		for (;;) {
-			int error = inflate(&stream_, flush);
-			if (error == Z_OK && stream_.avail_out > 0 &&
-			    flush == Z_NO_FLUSH)
-				break;
-			if (error == Z_NEED_DICT || error == Z_DATA_ERROR ||
-			    error == Z_MEM_ERROR) {
-				ERROR(log_) << "inflate(): " << zError(error);
-				produce_error();
-				return;
-			}
-
-			if (flush != Z_NO_FLUSH && error == Z_BUF_ERROR &&
-			    stream_.avail_out == sizeof outbuf)
-				error = Z_OK;
-
-			if (stream_.avail_out != sizeof outbuf)
-				out.append(outbuf, sizeof outbuf - stream_.avail_out);
-			stream_.avail_out = sizeof outbuf;
-			stream_.next_out = outbuf;
-
-			if (flush == Z_NO_FLUSH)
-				break;
-			if (error == Z_OK || error == Z_STREAM_END) {
-				if (flush == Z_FINISH && error == Z_STREAM_END) {
-					produce_eos(&out);
-				} else {
-					/*
-					 * XXX
-					 * How can it happen that we get nothing
-					 * here?
-					 */
-					if (!out.empty())
-						produce(&out);
-				}
-
-				if (!in->empty()) {
-					ERROR(log_) << "Stream ended but more data follows.";
-					produce_error();
-				}
-				return;
-			}
-			/* More data to output.  */
+		if (error == Z_STREAM_END &&
+		    (stream_.avail_in != 0 || in->length() != seg->length())) {
+			ERROR(log_) << "Stream ended but more data follows.";
+			produce_error();
+			return;
 		}
 
-		if (seg != NULL)
-			in->skip(seg->length() - stream_.avail_in);
+		in->skip(seg->length());
 	}
-	NOTREACHED(log_);
+
+	if (!out.empty())
+		produce(&out);
 }
@@ -30,14 +30,20 @@
 
 #include <zlib.h>
 
+/*
+ * Inflated data is written straight into BufferSegments.
+ */
 class InflatePipe : public PipeProducer {
 	Mutex mtx_;
 	z_stream stream_;
+	BufferSegment *outseg_;
 public:
 	InflatePipe(void);
 	~InflatePipe();
 
 private:
+	int inflate_run(int, Buffer *);
+
 	void consume(Buffer *);
 };
 
@@ -1,6 +1,33 @@
 VPATH+=	${TOPDIR}/zlib
 
+SRCS+=	compressor.cc
 SRCS+=	deflate_pipe.cc
 SRCS+=	inflate_pipe.cc
 
 LDADD+=	-lz
+
+ifndef USE_LZ4
+USE_LZ4=	no
+endif
+
+ifeq "${USE_LZ4}" "yes"
+SRCS+=	lz4_compress_pipe.cc
+SRCS+=	lz4_decompress_pipe.cc
+
+CFLAGS+=-DUSE_LZ4
+
+LDADD+=	-llz4
+endif
+
+ifndef USE_ZSTD
+USE_ZSTD=	no
+endif
+
+ifeq "${USE_ZSTD}" "yes"
+SRCS+=	zstd_compress_pipe.cc
+SRCS+=	zstd_decompress_pipe.cc
+
+CFLAGS+=-DUSE_ZSTD
+
+LDADD+=	-lzstd
+endif
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <common/thread/mutex.h>
+
+#include <event/event_callback.h>
+
+#include <io/pipe/pipe.h>
+
+#include <zlib/compressor.h>
+#include <zlib/lz4_compress_pipe.h>
+
+/*
+ * Data is compressed a segment at a time, with the output of each call
+ * to consume flushed, so the output buffer need only be large enough for
+ * the compressed form of a single segment, or for what a flush or the end
+ * of the frame may produce.
+ */
+LZ4CompressPipe::LZ4CompressPipe(int level, CompressorStatistics *statistics)
+: PipeProducer("/zlib/lz4_compress_pipe", &mtx_),
+  mtx_("LZ4CompressPipe"),
+  context_(NULL),
+  preferences_(),
+  begun_(false),
+  outbuf_(NULL),
+  outbuf_size_(0),
+  statistics_(statistics)
+{
+	preferences_.compressionLevel = level;
+
+	size_t rv = LZ4F_createCompressionContext(&context_, LZ4F_VERSION);
+	if (LZ4F_isError(rv))
+		HALT(log_) << "Could not initialize LZ4 compression context.";
+
+	outbuf_size_ = LZ4F_compressBound(BUFFER_SEGMENT_SIZE, &preferences_);
+	if (outbuf_size_ < LZ4F_HEADER_SIZE_MAX)
+		outbuf_size_ = LZ4F_HEADER_SIZE_MAX;
+	outbuf_ = new uint8_t[outbuf_size_];
+}
+
+LZ4CompressPipe::~LZ4CompressPipe()
+{
+	delete[] outbuf_;
+	outbuf_ = NULL;
+
+	size_t rv = LZ4F_freeCompressionContext(context_);
+	if (LZ4F_isError(rv))
+		ERROR(log_) << "LZ4 compression context did not end cleanly.";
+	context_ = NULL;
+}
+
+void
+LZ4CompressPipe::consume(Buffer *in)
+{
+	Buffer out;
+	size_t rv;
+
+	if (!begun_) {
+		rv = LZ4F_compressBegin(context_, outbuf_, outbuf_size_, &preferences_);
+		if (LZ4F_isError(rv)) {
+			ERROR(log_) << "LZ4F_compressBegin(): " << LZ4F_getErrorName(rv);
+			produce_error();
+			return;
+		}
+		out.append(outbuf_, rv);
+		begun_ = true;
+	}
+
+	if (in->empty()) {
+		rv = LZ4F_compressEnd(context_, outbuf_, outbuf_size_, NULL);
+		if (LZ4F_isError(rv)) {
+			ERROR(log_) << "LZ4F_compressEnd(): " << LZ4F_getErrorName(rv);
+			produce_error();
+			return;
+		}
+		if (rv != 0)
+			out.append(outbuf_, rv);
+		produce_eos(&out);
+		return;
+	}
+
+	while (!in->empty()) {
+		Buffer::SegmentIterator iter = in->segments();
+		const BufferSegment *seg = *iter;
+
+		rv = LZ4F_compressUpdate(context_, outbuf_, outbuf_size_,
+					 seg->data(), seg->length(), NULL);
+		if (LZ4F_isError(rv)) {
+			ERROR(log_) << "LZ4F_compressUpdate(): " << LZ4F_getErrorName(rv);
+			produce_error();
+			return;
+		}
+		if (rv != 0)
+			out.append(outbuf_, rv);
+
+		if (statistics_ != NULL)
+			statistics_->compressed_bytes_ += seg->length();
+		in->skip(seg->length());
+	}
+
+	rv = LZ4F_flush(context_, outbuf_, outbuf_size_, NULL);
+	if (LZ4F_isError(rv)) {
+		ERROR(log_) << "LZ4F_flush(): " << LZ4F_getErrorName(rv);
+		produce_error();
+		return;
+	}
+	if (rv != 0)
+		out.append(outbuf_, rv);
+
+	if (!out.empty())
+		produce(&out);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	ZLIB_LZ4_COMPRESS_PIPE_H
+#define	ZLIB_LZ4_COMPRESS_PIPE_H
+
+#include <io/pipe/pipe_producer.h>
+
+#include <lz4frame.h>
+
+struct CompressorStatistics;
+
+class LZ4CompressPipe : public PipeProducer {
+	Mutex mtx_;
+	LZ4F_compressionContext_t context_;
+	LZ4F_preferences_t preferences_;
+	bool begun_;
+	uint8_t *outbuf_;
+	size_t outbuf_size_;
+	CompressorStatistics *statistics_;
+public:
+	LZ4CompressPipe(int = 0, CompressorStatistics * = NULL);
+	~LZ4CompressPipe();
+
+private:
+	void consume(Buffer *);
+};
+
+#endif /* !ZLIB_LZ4_COMPRESS_PIPE_H */
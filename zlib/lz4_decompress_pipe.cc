@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <common/thread/mutex.h>
+
+#include <event/event_callback.h>
+
+#include <io/pipe/pipe.h>
+
+#include <zlib/lz4_decompress_pipe.h>
+
+#define	LZ4_DECOMPRESS_CHUNK_SIZE	65536
+
+LZ4DecompressPipe::LZ4DecompressPipe(void)
+: PipeProducer("/zlib/lz4_decompress_pipe", &mtx_),
+  mtx_("LZ4DecompressPipe"),
+  context_(NULL),
+  frame_open_(false)
+{
+	size_t rv = LZ4F_createDecompressionContext(&context_, LZ4F_VERSION);
+	if (LZ4F_isError(rv))
+		HALT(log_) << "Could not initialize LZ4 decompression context.";
+}
+
+LZ4DecompressPipe::~LZ4DecompressPipe()
+{
+	size_t rv = LZ4F_freeDecompressionContext(context_);
+	if (LZ4F_isError(rv))
+		ERROR(log_) << "LZ4 decompression context did not end cleanly.";
+	context_ = NULL;
+}
+
+void
+LZ4DecompressPipe::consume(Buffer *in)
+{
+	Buffer out;
+	uint8_t outbuf[LZ4_DECOMPRESS_CHUNK_SIZE];
+
+	if (in->empty()) {
+		if (frame_open_) {
+			ERROR(log_) << "Stream ended within a frame.";
+			produce_error();
+			return;
+		}
+		produce_eos();
+		return;
+	}
+
+	while (!in->empty()) {
+		Buffer::SegmentIterator iter = in->segments();
+		const BufferSegment *seg = *iter;
+		const uint8_t *src = seg->data();
+		size_t srclen = seg->length();
+		size_t outlen;
+
+		/*
+		 * Keep going while there is input left, or while we filled
+		 * the output buffer and so there may be more output to come.
+		 */
+		do {
+			size_t inlen = srclen;
+
+			outlen = sizeof outbuf;
+			size_t rv = LZ4F_decompress(context_, outbuf, &outlen,
+						    src, &inlen, NULL);
+			if (LZ4F_isError(rv)) {
+				ERROR(log_) << "LZ4F_decompress(): " << LZ4F_getErrorName(rv);
+				produce_error();
+				return;
+			}
+			if (outlen != 0)
+				out.append(outbuf, outlen);
+			src += inlen;
+			srclen -= inlen;
+
+			frame_open_ = rv != 0;
+		} while (srclen != 0 || outlen == sizeof outbuf);
+
+		in->skip(seg->length());
+	}
+
+	if (!out.empty())
+		produce(&out);
+}
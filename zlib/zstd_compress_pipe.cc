@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <common/thread/mutex.h>
+
+#include <event/event_callback.h>
+
+#include <io/pipe/pipe.h>
+
+#include <zlib/compressor.h>
+#include <zlib/zstd_compress_pipe.h>
+
+#define	ZSTD_COMPRESS_CHUNK_SIZE	65536
+
+/*
+ * A level of zero selects Zstandard's default.  A dictionary, if any, must
+ * also be given to the ZstdDecompressPipe at the other end.
+ */
+ZstdCompressPipe::ZstdCompressPipe(int level, const Buffer *dictionary, CompressorStatistics *statistics)
+: PipeProducer("/zlib/zstd_compress_pipe", &mtx_),
+  mtx_("ZstdCompressPipe"),
+  context_(NULL),
+  statistics_(statistics)
+{
+	context_ = ZSTD_createCCtx();
+	if (context_ == NULL)
+		HALT(log_) << "Could not initialize Zstandard compression context.";
+
+	size_t rv = ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, level);
+	if (ZSTD_isError(rv))
+		HALT(log_) << "Could not set Zstandard compression level: " << ZSTD_getErrorName(rv);
+
+	if (dictionary != NULL && !dictionary->empty()) {
+		uint8_t *data = new uint8_t[dictionary->length()];
+		dictionary->copyout(data, dictionary->length());
+		rv = ZSTD_CCtx_loadDictionary(context_, data, dictionary->length());
+		delete[] data;
+
+		if (ZSTD_isError(rv))
+			HALT(log_) << "Could not load Zstandard dictionary: " << ZSTD_getErrorName(rv);
+	}
+}
+
+ZstdCompressPipe::~ZstdCompressPipe()
+{
+	ZSTD_freeCCtx(context_);
+	context_ = NULL;
+}
+
+void
+ZstdCompressPipe::consume(Buffer *in)
+{
+	Buffer out;
+	uint8_t outbuf[ZSTD_COMPRESS_CHUNK_SIZE];
+	ZSTD_outBuffer output;
+	size_t rv;
+
+	/*
+	 * An empty input ends the frame; anything else is compressed and
+	 * flushed, so that the peer may decompress it all as soon as it
+	 * arrives.
+	 */
+	ZSTD_EndDirective directive = in->empty() ? ZSTD_e_end : ZSTD_e_flush;
+
+	while (!in->empty()) {
+		Buffer::SegmentIterator iter = in->segments();
+		const BufferSegment *seg = *iter;
+		ZSTD_inBuffer input = { seg->data(), seg->length(), 0 };
+
+		while (input.pos != input.size) {
+			output.dst = outbuf;
+			output.size = sizeof outbuf;
+			output.pos = 0;
+
+			rv = ZSTD_compressStream2(context_, &output, &input, ZSTD_e_continue);
+			if (ZSTD_isError(rv)) {
+				ERROR(log_) << "ZSTD_compressStream2(): " << ZSTD_getErrorName(rv);
+				produce_error();
+				return;
+			}
+			if (output.pos != 0)
+				out.append(outbuf, output.pos);
+		}
+
+		if (statistics_ != NULL)
+			statistics_->compressed_bytes_ += seg->length();
+		in->skip(seg->length());
+	}
+
+	ZSTD_inBuffer input = { NULL, 0, 0 };
+	do {
+		output.dst = outbuf;
+		output.size = sizeof outbuf;
+		output.pos = 0;
+
+		rv = ZSTD_compressStream2(context_, &output, &input, directive);
+		if (ZSTD_isError(rv)) {
+			ERROR(log_) << "ZSTD_compressStream2(): " << ZSTD_getErrorName(rv);
+			produce_error();
+			return;
+		}
+		if (output.pos != 0)
+			out.append(outbuf, output.pos);
+	} while (rv != 0);
+
+	if (directive == ZSTD_e_end) {
+		produce_eos(&out);
+		return;
+	}
+
+	if (!out.empty())
+		produce(&out);
+}
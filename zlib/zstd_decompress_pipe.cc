@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015 Juli Mallett. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <common/thread/mutex.h>
+
+#include <event/event_callback.h>
+
+#include <io/pipe/pipe.h>
+
+#include <zlib/zstd_decompress_pipe.h>
+
+#define	ZSTD_DECOMPRESS_CHUNK_SIZE	65536
+
+ZstdDecompressPipe::ZstdDecompressPipe(const Buffer *dictionary)
+: PipeProducer("/zlib/zstd_decompress_pipe", &mtx_),
+  mtx_("ZstdDecompressPipe"),
+  context_(NULL),
+  frame_open_(false)
+{
+	context_ = ZSTD_createDCtx();
+	if (context_ == NULL)
+		HALT(log_) << "Could not initialize Zstandard decompression context.";
+
+	if (dictionary != NULL && !dictionary->empty()) {
+		uint8_t *data = new uint8_t[dictionary->length()];
+		dictionary->copyout(data, dictionary->length());
+		size_t rv = ZSTD_DCtx_loadDictionary(context_, data, dictionary->length());
+		delete[] data;
+
+		if (ZSTD_isError(rv))
+			HALT(log_) << "Could not load Zstandard dictionary: " << ZSTD_getErrorName(rv);
+	}
+}
+
+ZstdDecompressPipe::~ZstdDecompressPipe()
+{
+	ZSTD_freeDCtx(context_);
+	context_ = NULL;
+}
+
+void
+ZstdDecompressPipe::consume(Buffer *in)
+{
+	Buffer out;
+	uint8_t outbuf[ZSTD_DECOMPRESS_CHUNK_SIZE];
+
+	if (in->empty()) {
+		if (frame_open_) {
+			ERROR(log_) << "Stream ended within a frame.";
+			produce_error();
+			return;
+		}
+		produce_eos();
+		return;
+	}
+
+	while (!in->empty()) {
+		Buffer::SegmentIterator iter = in->segments();
+		const BufferSegment *seg = *iter;
+		ZSTD_inBuffer input = { seg->data(), seg->length(), 0 };
+		ZSTD_outBuffer output;
+
+		/*
+		 * Keep going while there is input left, or while we filled
+		 * the output buffer and so there may be more output to come.
+		 */
+		do {
+			output.dst = outbuf;
+			output.size = sizeof outbuf;
+			output.pos = 0;
+
+			size_t rv = ZSTD_decompressStream(context_, &output, &input);
+			if (ZSTD_isError(rv)) {
+				ERROR(log_) << "ZSTD_decompressStream(): " << ZSTD_getErrorName(rv);
+				produce_error();
+				return;
+			}
+			if (output.pos != 0)
+				out.append(outbuf, output.pos);
+
+			frame_open_ = rv != 0;
+		} while (input.pos != input.size || output.pos == output.size);
+
+		in->skip(seg->length());
+	}
+
+	if (!out.empty())
+		produce(&out);
+}